@@ -0,0 +1,534 @@
+#include "FanoutSink.h"
+#include "OptionsFromParams.h"
+#include "Params.h"
+#include "PixelConverter.h"
+#include "WebcamCapture.h"
+
+extern "C"
+{
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+}
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+// Headless throughput benchmark: runs the WebcamCapture pipeline on a lavfi
+// testsrc/sine source or a media file and prints the result as one JSON object.
+//
+//   WebcamBench.exe -size=1280x720 -rate=30 -duration=10 -vcodec=libx264 -vpreset=veryfast
+//   WebcamBench.exe -i=sample.mp4 -re=1 -json=result.json
+//   WebcamBench.exe -kernels=1 -size=1920x1080 -iterations=500
+//   WebcamBench.exe -check=1
+//
+// All WebcamCapture options (-vcodec, -copy, -vf, -queue_size ...) work here too.
+// -kernels=1 times the pixel format kernels against swscale instead, after
+// checking that every ISA level gives the C kernels' pictures; -check=1 runs
+// the self-checks and exits with the number of failures.
+
+struct ProcessUsage
+{
+  double  cpu_seconds;
+  int64_t peak_rss_kb;
+};
+
+static ProcessUsage GetProcessUsage()
+{
+  ProcessUsage usage = { 0, 0 };
+#ifdef _WIN32
+  FILETIME creation, exit, kernel, user;
+  if (GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+  {
+    ULARGE_INTEGER k, u;
+    k.LowPart = kernel.dwLowDateTime;
+    k.HighPart = kernel.dwHighDateTime;
+    u.LowPart = user.dwLowDateTime;
+    u.HighPart = user.dwHighDateTime;
+    usage.cpu_seconds = (k.QuadPart + u.QuadPart) / 1e7;
+  }
+  PROCESS_MEMORY_COUNTERS memory;
+  if (GetProcessMemoryInfo(GetCurrentProcess(), &memory, sizeof(memory)))
+  {
+    usage.peak_rss_kb = memory.PeakWorkingSetSize / 1024;
+  }
+#else
+  struct rusage self;
+  if (getrusage(RUSAGE_SELF, &self) == 0)
+  {
+    usage.cpu_seconds = self.ru_utime.tv_sec + self.ru_stime.tv_sec +
+      (self.ru_utime.tv_usec + self.ru_stime.tv_usec) / 1e6;
+    usage.peak_rss_kb = self.ru_maxrss;
+  }
+#endif
+  return usage;
+}
+
+// value of -key=value, or default_value
+static std::string BenchArg(int argc, const char **argv, const char *key, const char *default_value)
+{
+  size_t key_length = strlen(key);
+  for (int i = 1; i < argc; i++)
+  {
+    if (strncmp(argv[i], key, key_length) == 0 && argv[i][key_length] == '=')
+    {
+      return argv[i] + key_length + 1;
+    }
+  }
+  return default_value;
+}
+
+static std::string JsonString(const std::string &value)
+{
+  std::string quoted = "\"";
+  for (size_t i = 0; i < value.size(); i++)
+  {
+    if (value[i] == '"' || value[i] == '\\')
+    {
+      quoted += '\\';
+    }
+    quoted += value[i];
+  }
+  return quoted + "\"";
+}
+
+static void FillPlanes(AVFrame *frame)
+{
+  for (int i = 0; i < AV_NUM_DATA_POINTERS && frame->buf[i]; i++)
+  {
+    for (int j = 0; j < frame->buf[i]->size; j++)
+    {
+      frame->buf[i]->data[j] = (uint8_t)rand();
+    }
+  }
+}
+
+static const AVPixelFormat KERNEL_CONVERSIONS[][2] =
+{
+  { AV_PIX_FMT_YUYV422, AV_PIX_FMT_YUV420P },
+  { AV_PIX_FMT_YUYV422, AV_PIX_FMT_NV12 },
+  { AV_PIX_FMT_NV12, AV_PIX_FMT_YUV420P }
+};
+static const int KERNEL_CONVERSION_COUNT = sizeof(KERNEL_CONVERSIONS) / sizeof(KERNEL_CONVERSIONS[0]);
+
+static std::string ConversionName(int conversion)
+{
+  return std::string(av_get_pix_fmt_name(KERNEL_CONVERSIONS[conversion][0])) + ">" +
+    av_get_pix_fmt_name(KERNEL_CONVERSIONS[conversion][1]);
+}
+
+// first plane and row where the visible pixels differ, -1 when they are the same
+static int FirstDifference(const AVFrame *a, const AVFrame *b, int *row)
+{
+  AVPixelFormat format = (AVPixelFormat)a->format;
+  const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+  for (int plane = 0; plane < av_pix_fmt_count_planes(format); plane++)
+  {
+    int bytes = av_image_get_linesize(format, a->width, plane);
+    int shift = plane ? desc->log2_chroma_h : 0;
+    int rows = (a->height + (1 << shift) - 1) >> shift;
+    for (int y = 0; y < rows; y++)
+    {
+      if (memcmp(a->data[plane] + y * a->linesize[plane], b->data[plane] + y * b->linesize[plane], bytes) != 0)
+      {
+        *row = y;
+        return plane;
+      }
+    }
+  }
+  return -1;
+}
+
+// every ISA level this CPU has against the C kernels, on the benchmark size,
+// odd sizes and widths that leave the SIMD loops a row tail; one line per mismatch
+static std::vector<std::string> KernelMismatches(int width, int height)
+{
+  const int sizes[][2] = { { width, height }, { 33, 17 }, { 1000, 6 }, { 641, 3 }, { 1, 1 } };
+  std::vector<std::string> mismatches;
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+  {
+    for (int c = 0; c < KERNEL_CONVERSION_COUNT; c++)
+    {
+      std::ostringstream where;
+      where << ConversionName(c) << " at " << sizes[s][0] << "x" << sizes[s][1];
+      AVFrame *src = av_frame_alloc();
+      AVFrame *reference = av_frame_alloc();
+      AVFrame *dst = av_frame_alloc();
+      src->format = KERNEL_CONVERSIONS[c][0];
+      src->width = sizes[s][0];
+      src->height = sizes[s][1];
+      PixelConverter c_converter(KERNEL_CONVERSIONS[c][0], KERNEL_CONVERSIONS[c][1], PixelConverter::C);
+      int ret = av_frame_get_buffer(src, 32);
+      if (ret >= 0)
+      {
+        FillPlanes(src);
+        ret = c_converter.Convert(src, reference);
+      }
+      if (ret < 0)
+      {
+        mismatches.push_back(where.str() + ": C kernel failed");
+      }
+      else
+      {
+        for (int level = PixelConverter::C + 1; level <= PixelConverter::BestIsa(); level++)
+        {
+          PixelConverter converter(KERNEL_CONVERSIONS[c][0], KERNEL_CONVERSIONS[c][1], (PixelConverter::isa)level);
+          int row = 0;
+          int plane = -1;
+          if (converter.Convert(src, dst) < 0)
+          {
+            mismatches.push_back(where.str() + ": " + PixelConverter::IsaName(converter.Isa()) + " kernel failed");
+          }
+          else if ((plane = FirstDifference(reference, dst, &row)) >= 0)
+          {
+            std::ostringstream mismatch;
+            mismatch << where.str() << ": " << PixelConverter::IsaName(converter.Isa()) << " differs from C in plane " <<
+              plane << " row " << row;
+            mismatches.push_back(mismatch.str());
+          }
+          av_frame_unref(dst);
+        }
+      }
+      av_frame_free(&src);
+      av_frame_free(&reference);
+      av_frame_free(&dst);
+    }
+  }
+  return mismatches;
+}
+
+// ms per frame of each kernel level this CPU has, and of swscale as the
+// buffersink's auto-inserted scale filter runs it
+static std::string KernelBench(const std::string &size, int iterations)
+{
+  int width = 1280;
+  int height = 720;
+  sscanf(size.c_str(), "%dx%d", &width, &height);
+  iterations = FFMAX(iterations, 1);
+
+  std::ostringstream result;
+  result << "{\"size\":" << JsonString(size)
+         << ",\"iterations\":" << iterations
+         << ",\"best_isa\":" << JsonString(PixelConverter::IsaName(PixelConverter::BestIsa()))
+         << ",\"kernels\":[";
+  for (int c = 0; c < KERNEL_CONVERSION_COUNT; c++)
+  {
+    AVPixelFormat src_format = KERNEL_CONVERSIONS[c][0];
+    AVPixelFormat dst_format = KERNEL_CONVERSIONS[c][1];
+    std::string name = ConversionName(c);
+    AVFrame *src = av_frame_alloc();
+    AVFrame *dst = av_frame_alloc();
+    src->format = src_format;
+    src->width = width;
+    src->height = height;
+    dst->format = dst_format;
+    dst->width = width;
+    dst->height = height;
+    SwsContext *sws = sws_getContext(width, height, src_format, width, height, dst_format, SWS_BILINEAR, NULL, NULL, NULL);
+    if (!sws || av_frame_get_buffer(src, 32) < 0 || av_frame_get_buffer(dst, 32) < 0)
+    {
+      sws_freeContext(sws);
+      av_frame_free(&src);
+      av_frame_free(&dst);
+      continue;
+    }
+    FillPlanes(src);
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++)
+    {
+      sws_scale(sws, src->data, src->linesize, 0, height, dst->data, dst->linesize);
+    }
+    double sws_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / iterations;
+    sws_freeContext(sws);
+    av_frame_unref(dst);
+    result << (c ? "," : "") << "{\"conversion\":" << JsonString(name) << ",\"impl\":\"swscale\",\"ms\":" << sws_ms << "}";
+
+    for (int level = PixelConverter::C; level <= PixelConverter::BestIsa(); level++)
+    {
+      PixelConverter converter(src_format, dst_format, (PixelConverter::isa)level);
+      start = std::chrono::steady_clock::now();
+      for (int i = 0; i < iterations; i++)
+      {
+        converter.Convert(src, dst);
+        av_frame_unref(dst);
+      }
+      double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / iterations;
+      result << ",{\"conversion\":" << JsonString(name)
+             << ",\"impl\":" << JsonString(PixelConverter::IsaName(converter.Isa()))
+             << ",\"ms\":" << ms
+             << ",\"speedup\":" << (ms > 0 ? sws_ms / ms : 0) << "}";
+    }
+    av_frame_free(&src);
+    av_frame_free(&dst);
+  }
+  result << "]}";
+  return result.str();
+}
+
+// one line per check, 1 when it failed
+static int Expect(bool ok, const std::string &what)
+{
+  std::cout << (ok ? "ok   " : "FAIL ") << what << std::endl;
+  return ok ? 0 : 1;
+}
+
+// keeps the last packet the fanout hands to the main output
+class LastPacketSink : public PacketSink
+{
+public:
+  explicit LastPacketSink(AVPacket *last) : last_(last) {}
+  int WritePacket(AVPacket *packet)
+  {
+    av_packet_unref(last_);
+    av_packet_move_ref(last_, packet);
+    return 0;
+  }
+  int Close() { return 0; }
+
+private:
+  AVPacket *last_;
+};
+
+// the encoders get global headers for an MP4 extra output; a main container
+// without them must still see the parameter sets in front of every keyframe
+static int CheckInbandHeaders(const char *main_format, bool expect_headers)
+{
+  static const uint8_t headers[] = { 0, 0, 0, 1, 0x67, 0x42, 0xc0, 0x1e, 0, 0, 0, 1, 0x68, 0xce, 0x3c, 0x80 };
+  static const uint8_t picture[] = { 0, 0, 0, 1, 0x65, 0x88, 0x84, 0x00 };
+  int failed = 0;
+  AVFormatContext *layout = NULL;
+  if (avformat_alloc_output_context2(&layout, NULL, main_format, NULL) < 0)
+  {
+    return Expect(false, std::string("in-band headers: no ") + main_format + " muxer");
+  }
+  AVStream *stream = avformat_new_stream(layout, NULL);
+  stream->codec->codec_type = AVMEDIA_TYPE_VIDEO;
+  stream->codec->codec_id = AV_CODEC_ID_H264;
+  stream->codec->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+  stream->codec->extradata = (uint8_t*)av_mallocz(sizeof(headers) + AV_INPUT_BUFFER_PADDING_SIZE);
+  memcpy(stream->codec->extradata, headers, sizeof(headers));
+  stream->codec->extradata_size = sizeof(headers);
+
+  FanoutOptions options;
+  OutputTarget target;
+  target.url = "check.mp4";
+  options.targets.push_back(target);
+  failed += Expect(FanoutSink::NeedsGlobalHeader(options), "in-band headers: an mp4 target needs global headers");
+
+  AVPacket *last = av_packet_alloc();
+  {
+    /* not started, the extra output is never opened */
+    FanoutSink fanout(layout, new LastPacketSink(last), options);
+    for (int key = 1; key >= 0; key--)
+    {
+      AVPacket packet;
+      av_new_packet(&packet, sizeof(picture));
+      memcpy(packet.data, picture, sizeof(picture));
+      packet.flags = key ? AV_PKT_FLAG_KEY : 0;
+      fanout.WritePacket(&packet);
+      bool with_headers = last->size == (int)(sizeof(headers) + sizeof(picture)) &&
+        memcmp(last->data, headers, sizeof(headers)) == 0 &&
+        memcmp(last->data + sizeof(headers), picture, sizeof(picture)) == 0;
+      bool unchanged = last->size == (int)sizeof(picture) && memcmp(last->data, picture, sizeof(picture)) == 0;
+      failed += Expect(key && expect_headers ? with_headers : unchanged, std::string("in-band headers: main ") +
+        main_format + (key ? " keyframe " : " other frame ") + (key && expect_headers ? "has them" : "is left alone"));
+    }
+  }
+  av_packet_free(&last);
+  avformat_free_context(layout);
+  return failed;
+}
+
+// -sessions entries whose devices or outputs have colons of their own
+static int CheckSessions()
+{
+  static const char *cases[][4] =
+  {
+    /* entry, video, audio, output */
+    { "0+1:cam0.mp4", "0", "1", "cam0.mp4" },
+    { "hw:1,0:cam.mkv", "hw:1,0", "", "cam.mkv" },
+    { "video=USB Cam+hw:2,0:C:\\rec\\cam.mp4", "video=USB Cam", "hw:2,0", "C:\\rec\\cam.mp4" },
+    { "C:\\rec\\cam.spool:C:\\out\\a.mp4", "C:\\rec\\cam.spool", "", "C:\\out\\a.mp4" },
+    { "D:/rec/cam.spool:out.mp4", "D:/rec/cam.spool", "", "out.mp4" },
+    { "0:pipe:1", "0", "", "pipe:1" },
+    { "0:file:C:\\out\\a.ts", "0", "", "file:C:\\out\\a.ts" },
+    { "hw:1,0:udp://127.0.0.1:1234?pkt_size=1316", "hw:1,0", "", "udp://127.0.0.1:1234?pkt_size=1316" },
+    { "rtsp://cam:554/live:D:\\out\\cam.mp4", "rtsp://cam:554/live", "", "D:\\out\\cam.mp4" },
+    { "testsrc=size=640x480:rate=30:out.mkv", "testsrc=size=640x480:rate=30", "", "out.mkv" }
+  };
+  int failed = 0;
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+  {
+    std::vector<SessionSpec> sessions;
+    bool ok = ParseSessions(cases[i][0], &sessions) && sessions.size() == 1 &&
+      sessions[0].video == cases[i][1] && sessions[0].audio == cases[i][2] && sessions[0].output == cases[i][3];
+    failed += Expect(ok, std::string("sessions: ") + cases[i][0]);
+  }
+  std::vector<SessionSpec> sessions;
+  failed += Expect(ParseSessions("0:a.mp4|hw:1,0:C:\\b.mp4", &sessions) && sessions.size() == 2 &&
+    sessions[1].video == "hw:1,0" && sessions[1].output == "C:\\b.mp4", "sessions: two entries");
+  failed += Expect(!ParseSessions("cam.mp4", &sessions) && !ParseSessions("0:", &sessions) &&
+    !ParseSessions(":out.mp4", &sessions), "sessions: an entry without devices or output is refused");
+  return failed;
+}
+
+static int RunChecks()
+{
+  int failed = 0;
+  failed += CheckSessions();
+  std::vector<std::string> mismatches = KernelMismatches(1280, 720);
+  for (size_t i = 0; i < mismatches.size(); i++)
+  {
+    std::cout << "     " << mismatches[i] << std::endl;
+  }
+  failed += Expect(mismatches.empty(), std::string("kernels: up to ") +
+    PixelConverter::IsaName(PixelConverter::BestIsa()) + " match C on odd and unaligned sizes");
+  failed += CheckInbandHeaders("mpegts", true);
+  failed += CheckInbandHeaders("mp4", false);
+  if (failed)
+  {
+    std::cout << failed << " checks failed" << std::endl;
+  }
+  else
+  {
+    std::cout << "all checks passed" << std::endl;
+  }
+  return failed;
+}
+
+static void WriteResult(const std::string &json, const std::string &result)
+{
+  if (json.empty())
+  {
+    std::cout << result << std::endl;
+  }
+  else
+  {
+    std::ofstream file(json.c_str());
+    file << result << std::endl;
+  }
+}
+
+int main(int argc, const char ** argv)
+{
+  std::string size     = BenchArg(argc, argv, "-size", "1280x720");
+  std::string rate     = BenchArg(argc, argv, "-rate", "30");
+  std::string duration = BenchArg(argc, argv, "-duration", "10");
+  std::string audio    = BenchArg(argc, argv, "-audio", "1");
+  std::string json     = BenchArg(argc, argv, "-json", "");
+  std::string input    = BenchArg(argc, argv, "-i", "");
+
+  if (BenchArg(argc, argv, "-kernels", "0") != "0")
+  {
+    /* a fast kernel that computes something else is no result */
+    int width = 1280;
+    int height = 720;
+    sscanf(size.c_str(), "%dx%d", &width, &height);
+    std::vector<std::string> mismatches = KernelMismatches(width, height);
+    for (size_t i = 0; i < mismatches.size(); i++)
+    {
+      std::cerr << "Kernel mismatch: " << mismatches[i] << std::endl;
+    }
+    if (!mismatches.empty())
+    {
+      return 1;
+    }
+    WriteResult(json, KernelBench(size, atoi(BenchArg(argc, argv, "-iterations", "200").c_str())));
+    return 0;
+  }
+  if (BenchArg(argc, argv, "-check", "0") != "0")
+  {
+    av_register_all();
+    return RunChecks();
+  }
+
+  /* defaults first, the command line overrides them */
+  std::vector<std::string> defaults;
+  defaults.push_back("-f=bench_output.mkv");
+  defaults.push_back("-d=0");
+  std::string source = input;
+  if (input.empty())
+  {
+    std::string graph = "testsrc=size=" + size + ":rate=" + rate + ":duration=" + duration + "[out0]";
+    if (audio != "0")
+    {
+      graph += ";sine=frequency=1000:sample_rate=48000:duration=" + duration + "[out1]";
+    }
+    defaults.push_back("-input_format=lavfi");
+    defaults.push_back("-i=" + graph);
+    source = "lavfi:" + graph;
+  }
+  std::vector<const char*> args;
+  args.push_back(argv[0]);
+  for (size_t i = 0; i < defaults.size(); i++)
+  {
+    args.push_back(defaults[i].c_str());
+  }
+  for (int i = 1; i < argc; i++)
+  {
+    args.push_back(argv[i]);
+  }
+
+  Params params((int)args.size(), &args[0]);
+  if (params.GetStatus() == Params::INVALID_PARAM)
+  {
+    params.PrintInfo();
+    return -1;
+  }
+  CaptureOptions options = MakeOptions(params);
+  av_log_set_level(AV_LOG_WARNING);
+
+  WebcamCapture capture(params.GetInt(Params::CAPTURE_DURATION_SEC), params.GetString(Params::FILE_DESTINATION),
+    std::string(), std::string(), options);
+
+  std::ostringstream result;
+  result << "{\"source\":" << JsonString(source)
+         << ",\"output\":" << JsonString(params.GetString(Params::FILE_DESTINATION))
+         << ",\"realtime\":" << (options.pace_input ? "true" : "false");
+
+  int ret = -1;
+  if (capture.Status() == WebcamCapture::SUCCESS)
+  {
+    /* setup is not part of the measurement */
+    ProcessUsage before = GetProcessUsage();
+    auto start = std::chrono::steady_clock::now();
+    ret = capture.Work();
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    ProcessUsage after = GetProcessUsage();
+
+    WebcamCapture::OutputStats output = capture.GetOutputStats();
+    CaptureQueue::Stats queue = capture.QueueStats();
+    double cpu = after.cpu_seconds - before.cpu_seconds;
+    double media = output.duration_us / 1e6;
+    result << ",\"wall_s\":" << wall
+           << ",\"frames\":" << output.video_frames
+           << ",\"audio_frames\":" << output.audio_frames
+           << ",\"fps\":" << (wall > 0 ? output.video_frames / wall : 0)
+           << ",\"cpu_s\":" << cpu
+           << ",\"cpu_ms_per_frame\":" << (output.video_frames ? cpu * 1000 / output.video_frames : 0)
+           << ",\"peak_rss_kb\":" << after.peak_rss_kb
+           << ",\"output_bytes\":" << output.bytes
+           << ",\"media_s\":" << media
+           << ",\"bitrate_kbps\":" << (media > 0 ? output.bytes * 8 / media / 1000 : 0)
+           << ",\"queue_dropped\":" << queue.dropped;
+  }
+  result << ",\"status\":" << JsonString(ret < 0 ? "failed" : "ok") << "}";
+
+  WriteResult(json, result.str());
+  return ret < 0 ? 1 : 0;
+}
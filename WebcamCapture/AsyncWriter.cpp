@@ -0,0 +1,426 @@
+#include "AsyncWriter.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#include <malloc.h>
+#else
+#include <unistd.h>
+#endif
+
+/* O_DIRECT wants buffers, sizes and offsets aligned to the logical block size */
+static const size_t ALIGNMENT = 4096;
+static const int AVIO_BUFFER_SIZE = 32768;
+
+void WriterStats::PrintStats(int level) const
+{
+  av_log(NULL, level, "Writer: %llu bytes, pending %lld (max %lld), %llu stalls for %.1f ms, "
+    "block write p50 %.2f ms, p99 %.2f ms, max %.2f ms, %llu errors\n",
+    (unsigned long long)written_bytes.load(), (long long)pending_bytes.load(), (long long)max_pending_bytes.load(),
+    (unsigned long long)stalls.load(), stall_us.load() / 1000.0,
+    write_latency.Percentile(0.5) / 1000.0, write_latency.Percentile(0.99) / 1000.0, write_latency.Max() / 1000.0,
+    (unsigned long long)errors.load());
+}
+
+AsyncWriter::AsyncWriter(const WriterOptions &options, WriterStats *stats)
+  : options_(options)
+  , stats_(stats ? stats : &own_stats_)
+  , avio_(NULL)
+  , fd_(-1)
+  , direct_fd_(-1)
+  , pos_(0)
+  , size_(0)
+  , current_limit_(0)
+  , pending_(0)
+  , stopping_(false)
+  , thread_(NULL)
+  , error_(0)
+  , reserved_(0)
+{
+  options_.block_size = FFMAX(options_.block_size, (size_t)16 * ALIGNMENT);
+  options_.block_size = (options_.block_size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+  if (options_.max_pending < (int64_t)options_.block_size)
+  {
+    options_.max_pending = options_.block_size;
+  }
+  current_.data = NULL;
+  current_.size = 0;
+  current_.offset = 0;
+}
+
+AsyncWriter::~AsyncWriter()
+{
+  Close();
+}
+
+bool AsyncWriter::Supports(const std::string &filename)
+{
+  /* "file:" or no protocol at all, as libavformat sees it: C:\ is a file, pipe:1 is not */
+  const char *protocol = avio_find_protocol_name(filename.c_str());
+  return protocol && strcmp(protocol, "file") == 0;
+}
+
+int AsyncWriter::Open(const std::string &filename)
+{
+  filename_ = filename.compare(0, 5, "file:") == 0 ? filename.substr(5) : filename;
+
+#ifdef _WIN32
+  fd_ = _open(filename_.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+  fd_ = open(filename_.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+#endif
+  if (fd_ < 0)
+  {
+    int ret = AVERROR(errno);
+    av_log(NULL, AV_LOG_ERROR, "Cannot create '%s': %s\n", filename_.c_str(), strerror(errno));
+    return ret;
+  }
+  if (options_.direct_io)
+  {
+#ifdef O_DIRECT
+    /* a second descriptor: blocks that are not aligned still go through the page cache */
+    direct_fd_ = open(filename_.c_str(), O_WRONLY | O_DIRECT);
+    if (direct_fd_ < 0)
+    {
+      av_log(NULL, AV_LOG_WARNING, "O_DIRECT is not available for '%s', writing through the page cache\n", filename_.c_str());
+    }
+#else
+    av_log(NULL, AV_LOG_WARNING, "Direct I/O is not supported on this platform\n");
+#endif
+  }
+
+  uint8_t *buffer = (uint8_t*)av_malloc(AVIO_BUFFER_SIZE);
+  avio_ = buffer ? avio_alloc_context(buffer, AVIO_BUFFER_SIZE, 1, this, NULL, write_packet, seek) : NULL;
+  if (!avio_)
+  {
+    av_free(buffer);
+    close_files();
+    return AVERROR(ENOMEM);
+  }
+
+  current_ = take_block(0);
+  if (!current_.data)
+  {
+    Close();
+    return AVERROR(ENOMEM);
+  }
+  thread_ = new std::thread(&AsyncWriter::write_loop, this);
+  return 0;
+}
+
+int AsyncWriter::Close()
+{
+  if (!avio_)
+  {
+    return 0;
+  }
+  avio_flush(avio_);
+  if (current_.data && current_.size)
+  {
+    submit_block();
+  }
+  else if (current_.data)
+  {
+    free_aligned(current_.data);
+  }
+  current_.data = NULL;
+
+  if (thread_)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    cond_.notify_all();
+    thread_->join();
+    delete thread_;
+    thread_ = NULL;
+  }
+  close_files();
+
+  for (size_t i = 0; i < free_.size(); i++)
+  {
+    free_aligned(free_[i]);
+  }
+  free_.clear();
+  av_freep(&avio_->buffer);
+  av_freep(&avio_);
+  return error_;
+}
+
+int AsyncWriter::write_packet(void *opaque, uint8_t *buf, int buf_size)
+{
+  return static_cast<AsyncWriter*>(opaque)->write(buf, buf_size);
+}
+
+int64_t AsyncWriter::seek(void *opaque, int64_t offset, int whence)
+{
+  AsyncWriter *writer = static_cast<AsyncWriter*>(opaque);
+  switch (whence & ~AVSEEK_FORCE)
+  {
+  case AVSEEK_SIZE:
+    return FFMAX(writer->size_, writer->pos_);
+  case SEEK_SET:
+    writer->pos_ = offset;
+    break;
+  case SEEK_CUR:
+    writer->pos_ += offset;
+    break;
+  case SEEK_END:
+    writer->pos_ = FFMAX(writer->size_, writer->pos_) + offset;
+    break;
+  default:
+    return AVERROR(EINVAL);
+  }
+  return writer->pos_;
+}
+
+int AsyncWriter::write(const uint8_t *buf, size_t size)
+{
+  if (error_ < 0)
+  {
+    return error_;
+  }
+  if (pos_ != current_.offset + (int64_t)current_.size)
+  {
+    /* the muxer went back to patch a header: what was collected so far goes as is */
+    if (current_.size)
+    {
+      submit_block();
+      current_ = take_block(pos_);
+    }
+    else
+    {
+      current_.offset = pos_;
+      current_limit_ = options_.block_size - (size_t)(pos_ % ALIGNMENT);
+    }
+  }
+
+  while (size > 0 && current_.data)
+  {
+    size_t chunk = FFMIN(size, current_limit_ - current_.size);
+    memcpy(current_.data + current_.size, buf, chunk);
+    current_.size += chunk;
+    buf += chunk;
+    size -= chunk;
+    pos_ += chunk;
+    if (current_.size == current_limit_)
+    {
+      submit_block();
+      current_ = take_block(pos_);
+    }
+  }
+  size_ = FFMAX(size_, pos_);
+  if (!current_.data)
+  {
+    return AVERROR(ENOMEM);
+  }
+  return error_;
+}
+
+void AsyncWriter::submit_block()
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  int64_t size = current_.size;
+  if (pending_ + size > options_.max_pending && !queue_.empty())
+  {
+    /* backpressure: the mux thread waits, the queues in front of it absorb the rest */
+    ++stats_->stalls;
+    int64_t stall_start = LatencyMetrics::Now();
+    while (pending_ + size > options_.max_pending && !queue_.empty() && error_ >= 0)
+    {
+      cond_.wait(lock);
+    }
+    stats_->stall_us += LatencyMetrics::Now() - stall_start;
+  }
+  queue_.push_back(current_);
+  pending_ += size;
+  int64_t pending = (stats_->pending_bytes += size);
+  int64_t max_pending = stats_->max_pending_bytes;
+  while (pending > max_pending && !stats_->max_pending_bytes.compare_exchange_weak(max_pending, pending))
+  {
+  }
+  current_.data = NULL;
+  current_.size = 0;
+  cond_.notify_all();
+}
+
+AsyncWriter::Block AsyncWriter::take_block(int64_t offset)
+{
+  Block block;
+  block.data = NULL;
+  block.size = 0;
+  block.offset = offset;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!free_.empty())
+    {
+      block.data = free_.back();
+      free_.pop_back();
+    }
+  }
+  if (!block.data)
+  {
+    block.data = alloc_aligned(options_.block_size);
+  }
+  /* the first block after a seek ends on a boundary so the following ones are aligned */
+  current_limit_ = options_.block_size - (size_t)(offset % ALIGNMENT);
+  return block;
+}
+
+void AsyncWriter::write_loop()
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (1)
+  {
+    while (!stopping_ && queue_.empty())
+    {
+      cond_.wait(lock);
+    }
+    if (queue_.empty())
+    {
+      break;
+    }
+    Block block = queue_.front();
+    queue_.pop_front();
+    lock.unlock();
+
+    int ret = error_ < 0 ? (int)error_ : write_block(block);
+
+    lock.lock();
+    if (ret < 0 && error_ >= 0)
+    {
+      error_ = ret;
+      ++stats_->errors;
+      av_log(NULL, AV_LOG_ERROR, "Writing '%s' failed at offset %lld\n", filename_.c_str(), (long long)block.offset);
+    }
+    pending_ -= block.size;
+    stats_->pending_bytes -= block.size;
+    free_.push_back(block.data);
+    cond_.notify_all();
+  }
+}
+
+int AsyncWriter::write_block(const Block &block)
+{
+  reserve(block.offset + block.size);
+
+  int64_t start = LatencyMetrics::Now();
+  const uint8_t *data = block.data;
+  size_t left = block.size;
+  int64_t offset = block.offset;
+  int fd = (direct_fd_ >= 0 && offset % ALIGNMENT == 0 && left % ALIGNMENT == 0) ? direct_fd_ : fd_;
+
+  while (left > 0)
+  {
+#ifdef _WIN32
+    /* only this thread moves the file pointer */
+    int written = -1;
+    if (_lseeki64(fd, offset, SEEK_SET) >= 0)
+    {
+      written = _write(fd, data, (unsigned int)FFMIN(left, (size_t)1 << 30));
+    }
+#else
+    ssize_t written = pwrite(fd, data, left, offset);
+#endif
+    if (written < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      if (fd == direct_fd_ && errno == EINVAL)
+      {
+        /* the filesystem wants a larger alignment, give up on direct I/O */
+        fd = fd_;
+        continue;
+      }
+      return AVERROR(errno);
+    }
+    data += written;
+    left -= written;
+    offset += written;
+  }
+
+  stats_->write_latency.Record(LatencyMetrics::Now() - start);
+  stats_->written_bytes += block.size;
+  return 0;
+}
+
+void AsyncWriter::reserve(int64_t end)
+{
+  if (options_.preallocate <= 0 || end <= reserved_)
+  {
+    return;
+  }
+  int64_t target = end + options_.preallocate;
+  bool done = false;
+#if defined(__linux__)
+  /* KEEP_SIZE: the file does not grow, only its blocks are allocated */
+  done = fallocate(fd_, FALLOC_FL_KEEP_SIZE, reserved_, target - reserved_) == 0;
+#elif defined(_WIN32)
+  FILE_ALLOCATION_INFO info;
+  info.AllocationSize.QuadPart = target;
+  done = SetFileInformationByHandle((HANDLE)_get_osfhandle(fd_), FileAllocationInfo, &info, sizeof(info)) != 0;
+#endif
+  if (done)
+  {
+    reserved_ = target;
+  }
+  else
+  {
+    av_log(NULL, AV_LOG_VERBOSE, "Cannot preallocate '%s', writing without\n", filename_.c_str());
+    options_.preallocate = 0;
+  }
+}
+
+void AsyncWriter::close_files()
+{
+  if (fd_ >= 0)
+  {
+#ifdef _WIN32
+    _close(fd_);
+#else
+    if (reserved_ > size_ && ftruncate(fd_, size_) != 0)
+    {
+      /* the file is fine, the reservation beyond its end just stays allocated */
+      av_log(NULL, AV_LOG_VERBOSE, "Cannot release the space reserved for '%s'\n", filename_.c_str());
+    }
+    close(fd_);
+#endif
+    fd_ = -1;
+  }
+  if (direct_fd_ >= 0)
+  {
+#ifndef _WIN32
+    close(direct_fd_);
+#endif
+    direct_fd_ = -1;
+  }
+}
+
+uint8_t *AsyncWriter::alloc_aligned(size_t size)
+{
+#ifdef _WIN32
+  return (uint8_t*)_aligned_malloc(size, ALIGNMENT);
+#else
+  void *data = NULL;
+  return posix_memalign(&data, ALIGNMENT, size) == 0 ? (uint8_t*)data : NULL;
+#endif
+}
+
+void AsyncWriter::free_aligned(uint8_t *data)
+{
+#ifdef _WIN32
+  _aligned_free(data);
+#else
+  free(data);
+#endif
+}
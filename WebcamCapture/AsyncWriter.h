@@ -0,0 +1,130 @@
+#pragma once
+
+extern "C"
+{
+  #define __STDC_CONSTANT_MACROS
+  #include <libavformat/avio.h>
+}
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "LatencyMetrics.h"
+#include "Noncopyable.h"
+
+struct WriterOptions
+{
+  WriterOptions()
+    : async(false)
+    , block_size(1 << 20)
+    , max_pending(64 << 20)
+    , preallocate(0)
+    , direct_io(false)
+  {
+  }
+
+  bool    async;        // write local files from a background thread instead of avio_open
+  size_t  block_size;   // bytes handed to the writer thread at once, rounded to 4 KiB
+  int64_t max_pending;  // bytes queued before the muxer has to wait
+  int64_t preallocate;  // reserve the file this many bytes at a time, 0 = never
+  bool    direct_io;    // O_DIRECT for the aligned blocks, bypassing the page cache (Linux)
+};
+
+// Shared by all writers of a capture so segments and events add up; any
+// thread may read it.
+struct WriterStats
+{
+  WriterStats()
+    : pending_bytes(0)
+    , max_pending_bytes(0)
+    , written_bytes(0)
+    , stalls(0)
+    , stall_us(0)
+    , errors(0)
+  {
+  }
+
+  std::atomic<int64_t>  pending_bytes;     // queued, not yet on disk
+  std::atomic<int64_t>  max_pending_bytes;
+  std::atomic<uint64_t> written_bytes;
+  std::atomic<uint64_t> stalls;            // times the muxer waited for the disk
+  std::atomic<int64_t>  stall_us;
+  std::atomic<uint64_t> errors;
+  LatencyHistogram      write_latency;     // one block write
+
+  void PrintStats(int level) const;
+};
+
+// An AVIOContext whose writes are collected into large aligned blocks and
+// written by a thread of its own, so a slow disk or network mount costs the
+// mux thread nothing until max_pending bytes are queued. Seeks (header and
+// index rewrites) are supported; blocks carry their file offset. Disk space
+// is reserved ahead with fallocate(FALLOC_FL_KEEP_SIZE) or its Windows
+// equivalent and the unused rest released on Close().
+class AsyncWriter : Noncopyable
+{
+public:
+  AsyncWriter(const WriterOptions &options, WriterStats *stats);
+  ~AsyncWriter();
+
+  int Open(const std::string &filename);
+  // the context to put into AVFormatContext.pb, owned by the writer
+  AVIOContext *Context() const { return avio_; }
+  // waits for every queued block; returns the first write error
+  int Close();
+
+  // plain files only, other protocols keep using avio_open
+  static bool Supports(const std::string &filename);
+
+private:
+  struct Block
+  {
+    uint8_t *data;
+    size_t   size;
+    int64_t  offset;
+  };
+
+  static int write_packet(void *opaque, uint8_t *buf, int buf_size);
+  static int64_t seek(void *opaque, int64_t offset, int whence);
+  int write(const uint8_t *buf, size_t size);
+  void submit_block();
+  Block take_block(int64_t offset);
+  void write_loop();
+  int write_block(const Block &block);
+  void reserve(int64_t end);
+  void close_files();
+
+  static uint8_t *alloc_aligned(size_t size);
+  static void free_aligned(uint8_t *data);
+
+private:
+  WriterOptions options_;
+  WriterStats own_stats_;    /* when nobody collects them */
+  WriterStats *stats_;
+  std::string filename_;
+  AVIOContext *avio_;
+  int fd_;
+  int direct_fd_;            /* -1 without direct_io */
+
+  /* mux thread */
+  int64_t pos_;              /* where the muxer writes next */
+  int64_t size_;             /* file size as the muxer sees it */
+  Block current_;            /* filling, current_.size bytes used */
+  size_t current_limit_;     /* block ends on an alignment boundary */
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::deque<Block> queue_;
+  std::vector<uint8_t*> free_;
+  int64_t pending_;
+  bool stopping_;
+  std::thread *thread_;
+  std::atomic<int> error_;
+
+  /* writer thread */
+  int64_t reserved_;
+};
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "CaptureQueue.h"
+#include "DegradationController.h"
+#include "EventRecorder.h"
+#include "FanoutSink.h"
+#include "LatencyMetrics.h"
+#include "MotionGate.h"
+#include "RenditionLadder.h"
+#include "SegmentWriter.h"
+#include "SnapshotWriter.h"
+#include "SpoolFile.h"
+#include "TimestampEngine.h"
+#include "WorkerPool.h"
+
+#include <string>
+
+// Encoder choice for one stream type. Empty strings leave the choice to
+// WebcamCapture, which picks a fast lossy codec; every value is passed to
+// avcodec_open2() as an AVOption, so "2500k", "auto" or "slice" work as in ffmpeg.
+struct EncoderOptions
+{
+  std::string codec;        // encoder name, e.g. libx264, mpeg4, aac
+  std::string preset;       // encoder private option, e.g. veryfast
+  std::string tune;         // encoder private option, e.g. zerolatency
+  std::string crf;          // constant rate factor, for encoders that have one
+  std::string bitrate;      // "b"
+  std::string gop;          // "g"
+  std::string threads;      // thread_count, a number or auto
+  std::string thread_type;  // frame or slice
+  std::string pix_fmt;      // video only, defaults to the encoder's preferred format
+  std::string extra;        // any other options as key=value:key=value
+};
+
+// Decoder threading of the input streams, passed to avcodec_open2() like the
+// encoder options. Intra-only video that libavcodec cannot thread itself
+// (MJPEG) is decoded by a ParallelDecoder with as many threads instead.
+struct DecoderOptions
+{
+  std::string threads;      // thread_count, a number or auto; empty = auto, with -sessions the cores shared out
+  std::string thread_type;  // frame or slice; empty lets the decoder choose, slice in low-latency mode
+};
+
+// Tuning knobs of the capture pipeline. Defaults reproduce the plain
+// "record the device for N seconds" behaviour.
+struct CaptureOptions
+{
+  CaptureOptions()
+    : queue_size(512)
+    , queue_policy(CaptureQueue::BLOCK)
+    , frame_queue_size(8)
+    , packet_queue_size(256)
+    , copy_video(false)
+    , copy_audio(false)
+    , filter_threads(0)
+    , pace_input(false)
+    , low_latency(false)
+    , latency_target_ms(0)
+    , fragment_sec(0)
+    , worker_pool(NULL)
+  {
+  }
+
+  size_t                         queue_size;    // packets buffered between reader and processing threads
+  CaptureQueue::overflow_policy  queue_policy;  // what the reader does when the queue is full
+  size_t                         frame_queue_size;   // filtered frames buffered per encoder thread
+  size_t                         packet_queue_size;  // encoded packets buffered per stream for the mux thread
+  bool                           copy_video;    // remux the camera's bitstream (MJPEG, H.264) instead of re-encoding
+  bool                           copy_audio;
+  DecoderOptions                 decoder;
+  EncoderOptions                 video_encoder;
+  EncoderOptions                 audio_encoder;
+  std::string                    video_filter;  // libavfilter chain, e.g. scale=1280:720,fps=15; empty skips the graph when possible
+  std::string                    audio_filter;
+  int                            filter_threads;  // nb_threads of every filter graph, 0 = automatic
+  SegmentOptions                 segment;       // rolling output files, disabled by default
+  EventOptions                   event;         // DVR mode, replaces the continuous output when enabled
+  TimestampOptions               timestamps;    // frame rate policy and A/V drift correction
+  std::string                    input_backend; // dshow, v4l2, file, lavfi or spool, see InputBackend::DefaultName()
+  std::string                    input_url;     // a file or lavfi graph to read instead of the camera
+  std::string                    input_format;  // its demuxer, e.g. lavfi; empty probes the file
+  std::string                    input_options; // demuxer/device options as key=value:key=value
+  bool                           pace_input;    // read input_url at its own speed instead of as fast as possible
+  std::string                    probe_cache;   // file of the stream parameters probed per device, skips the probe next time; empty = off
+  MetricsOptions                 metrics;       // per-stage latency export, disabled by default
+  bool                           low_latency;   // zero-delay encoders and unbuffered muxing, for live monitoring
+  int                            latency_target_ms;  // capture-to-write latency to warn above, 0 = none
+  WriterOptions                  writer;        // background file writes, off by default
+  double                         fragment_sec;  // fragmented MP4/Matroska flushed this often, readable after a crash; 0 = off
+  FanoutOptions                  fanout;        // more outputs of the same encoded packets
+  LadderOptions                  ladder;        // scaled renditions of the video from the same decode
+  WorkerPool                    *worker_pool;   // encoders run on these shared threads instead of their own, not owned
+  MotionOptions                  motion;        // skip the video frames of a static scene, off by default
+  DegradeOptions                 degrade;       // cheaper encoding while the host cannot keep up, off by default
+  SnapshotOptions                snapshot;      // still images of the video on a side thread, off by default
+  SpoolOptions                   spool;         // write the raw packets to spool files and transcode later, off by default
+};
@@ -0,0 +1,179 @@
+#include "CaptureQueue.h"
+
+CaptureQueue::CaptureQueue(size_t capacity, overflow_policy policy, MediaPool *pool)
+  : queue_(capacity)
+  , policy_(policy)
+  , pool_(pool)
+  , high_water_(0)
+  , pushed_(0)
+  , dropped_(0)
+{
+}
+
+CaptureQueue::~CaptureQueue()
+{
+  AVPacket *packet = NULL;
+  while (queue_.TryPop(packet))
+  {
+    Drop(packet);
+  }
+}
+
+bool CaptureQueue::Push(AVPacket *packet)
+{
+  size_t stream_index = packet->stream_index;
+  bool keyframe = (packet->flags & AV_PKT_FLAG_KEY) != 0;
+
+  if (stream_index >= wait_keyframe_.size())
+  {
+    wait_keyframe_.resize(stream_index + 1, false);
+  }
+
+  if (policy_ == DROP_NON_KEYFRAMES && wait_keyframe_[stream_index])
+  {
+    /* the reference chain is broken, skip until the stream can be decoded again */
+    if (!keyframe)
+    {
+      Drop(packet);
+      return false;
+    }
+    wait_keyframe_[stream_index] = false;
+  }
+
+  if (!queue_.TryPush(packet))
+  {
+    switch (policy_)
+    {
+    case DROP_OLDEST:
+      while (!queue_.TryPush(packet))
+      {
+        EvictOldest();
+      }
+      break;
+    case DROP_NON_KEYFRAMES:
+      if (!keyframe)
+      {
+        wait_keyframe_[stream_index] = true;
+        Drop(packet);
+        return false;
+      }
+      /* keyframes are never dropped */
+      if (!queue_.Push(packet))
+      {
+        Drop(packet);
+        return false;
+      }
+      break;
+    case BLOCK:
+    default:
+      if (!queue_.Push(packet))
+      {
+        Drop(packet);
+        return false;
+      }
+      break;
+    }
+  }
+
+  ++pushed_;
+  size_t depth = queue_.Size();
+  size_t high_water = high_water_.load(std::memory_order_relaxed);
+  while (depth > high_water && !high_water_.compare_exchange_weak(high_water, depth))
+  {
+  }
+  return true;
+}
+
+AVPacket *CaptureQueue::Pop()
+{
+  AVPacket *packet = NULL;
+  if (!queue_.Pop(packet))
+  {
+    return NULL;
+  }
+  return packet;
+}
+
+void CaptureQueue::Close()
+{
+  queue_.Close();
+}
+
+CaptureQueue::Stats CaptureQueue::GetStats() const
+{
+  Stats stats;
+  stats.depth      = queue_.Size();
+  stats.high_water = high_water_.load();
+  stats.capacity   = queue_.Capacity();
+  stats.pushed     = pushed_.load();
+  stats.dropped    = dropped_.load();
+  return stats;
+}
+
+void CaptureQueue::PrintStats(int level) const
+{
+  Stats stats = GetStats();
+  av_log(NULL, level, "Capture queue (%s): depth %u/%u, high-water %u, pushed %llu, dropped %llu\n",
+    PolicyName(policy_),
+    (unsigned)stats.depth, (unsigned)stats.capacity, (unsigned)stats.high_water,
+    (unsigned long long)stats.pushed, (unsigned long long)stats.dropped);
+}
+
+bool CaptureQueue::ParsePolicy(const std::string &name, overflow_policy *policy)
+{
+  if (name == "block")
+  {
+    *policy = BLOCK;
+  }
+  else if (name == "drop_oldest")
+  {
+    *policy = DROP_OLDEST;
+  }
+  else if (name == "drop_nonkey")
+  {
+    *policy = DROP_NON_KEYFRAMES;
+  }
+  else
+  {
+    return false;
+  }
+  return true;
+}
+
+const char *CaptureQueue::PolicyName(overflow_policy policy)
+{
+  switch (policy)
+  {
+  case DROP_OLDEST:
+    return "drop_oldest";
+  case DROP_NON_KEYFRAMES:
+    return "drop_nonkey";
+  case BLOCK:
+  default:
+    return "block";
+  }
+}
+
+void CaptureQueue::Drop(AVPacket *packet)
+{
+  if (pool_)
+  {
+    pool_->ReleasePacket(&packet);
+  }
+  else
+  {
+    av_packet_free(&packet);
+  }
+  ++dropped_;
+}
+
+bool CaptureQueue::EvictOldest()
+{
+  AVPacket *packet = NULL;
+  if (!queue_.TryPop(packet))
+  {
+    return false;
+  }
+  Drop(packet);
+  return true;
+}
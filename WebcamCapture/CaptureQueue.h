@@ -0,0 +1,65 @@
+#pragma once
+
+extern "C"
+{
+  #define __STDC_CONSTANT_MACROS
+  #include <libavcodec/avcodec.h>
+}
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include "MediaPool.h"
+#include "Noncopyable.h"
+#include "SpscRing.h"
+
+// Bounded hand-off of demuxed packets from the device reader thread to the
+// processing thread. The queue owns every packet pushed into it.
+class CaptureQueue : Noncopyable
+{
+public:
+  enum overflow_policy
+  {
+    BLOCK,              // reader waits for free space
+    DROP_OLDEST,        // oldest queued packet is discarded
+    DROP_NON_KEYFRAMES  // incoming non-key packets are discarded until the next keyframe
+  };
+
+  struct Stats
+  {
+    size_t   depth;
+    size_t   high_water;
+    size_t   capacity;
+    uint64_t pushed;
+    uint64_t dropped;
+  };
+
+  // dropped packets go back to the pool when one is given
+  CaptureQueue(size_t capacity, overflow_policy policy, MediaPool *pool = NULL);
+  ~CaptureQueue();
+
+  // reader thread; returns false if the packet was dropped (and freed)
+  bool Push(AVPacket *packet);
+  // processing thread; returns NULL once the queue is closed and drained
+  AVPacket *Pop();
+  void Close();
+
+  Stats GetStats() const;
+  void PrintStats(int level) const;
+
+  static bool ParsePolicy(const std::string &name, overflow_policy *policy);
+  static const char *PolicyName(overflow_policy policy);
+
+private:
+  void Drop(AVPacket *packet);
+  bool EvictOldest();
+
+private:
+  SpscQueue<AVPacket*> queue_;
+  overflow_policy policy_;
+  MediaPool *pool_;
+  std::vector<bool> wait_keyframe_;
+  std::atomic<size_t> high_water_;
+  std::atomic<uint64_t> pushed_;
+  std::atomic<uint64_t> dropped_;
+};
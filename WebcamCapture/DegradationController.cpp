@@ -0,0 +1,229 @@
+#include "DegradationController.h"
+
+#include <sstream>
+
+static const char *step_names[] = { "bframes", "preset", "fps", "scale" };
+
+/* smoothing of the measurements: one eighth of each new sample */
+static int64_t smooth(int64_t average, int64_t sample)
+{
+  return average + (sample - average) / 8;
+}
+
+bool DegradeOptions::ParseSteps(const std::string &spec, std::vector<step> *steps)
+{
+  if (spec == "1")
+  {
+    steps->push_back(BFRAMES);
+    steps->push_back(PRESET);
+    steps->push_back(FPS);
+    steps->push_back(SCALE);
+    return true;
+  }
+
+  size_t start = 0;
+  while (start < spec.size())
+  {
+    size_t end = spec.find(',', start);
+    if (end == std::string::npos)
+    {
+      end = spec.size();
+    }
+    std::string name = spec.substr(start, end - start);
+    start = end + 1;
+
+    int found = -1;
+    for (int i = 0; i < (int)(sizeof(step_names) / sizeof(step_names[0])); i++)
+    {
+      if (name == step_names[i])
+      {
+        found = i;
+      }
+    }
+    if (found < 0)
+    {
+      return false;
+    }
+    steps->push_back((step)found);
+  }
+  return !steps->empty();
+}
+
+const char *DegradeOptions::StepName(step s)
+{
+  return step_names[s];
+}
+
+DegradationController::DegradationController(const DegradeOptions &options)
+  : options_(options)
+  , last_frame_us_(AV_NOPTS_VALUE)
+  , interval_us_(0)
+  , last_change_us_(AV_NOPTS_VALUE)
+  , last_recovery_us_(AV_NOPTS_VALUE)
+  , calm_since_us_(AV_NOPTS_VALUE)
+  , backoff_(1)
+  , level_(0)
+  , degrades_(0)
+  , recoveries_(0)
+  , degraded_us_(0)
+  , lag_us_(0)
+  , queue_fill_x1000_(0)
+  , encode_load_x1000_(0)
+  , encode_us_(0)
+{
+}
+
+bool DegradationController::Update(int64_t frame_us, const Sample &sample)
+{
+  if (frame_us == AV_NOPTS_VALUE)
+  {
+    return false;
+  }
+  if (last_frame_us_ != AV_NOPTS_VALUE && frame_us > last_frame_us_)
+  {
+    int64_t interval = frame_us - last_frame_us_;
+    interval_us_ = interval_us_ ? smooth(interval_us_, interval) : interval;
+    if (level_ > 0)
+    {
+      degraded_us_ += interval;
+    }
+  }
+  last_frame_us_ = frame_us;
+  if (last_change_us_ == AV_NOPTS_VALUE)
+  {
+    last_change_us_ = frame_us;
+  }
+
+  int64_t lag = smooth(lag_us_, sample.lag_us);
+  lag_us_ = lag;
+  queue_fill_x1000_ = (int)(sample.queue_fill * 1000);
+
+  /* the encoder only sees every fps_divisor-th frame */
+  Profile profile = GetProfile();
+  double encode_load = interval_us_ ? (double)encode_us_ / (interval_us_ * profile.fps_divisor) : 0;
+  encode_load_x1000_ = (int)(encode_load * 1000);
+
+  bool overloaded = lag > options_.lag_high_ms * (int64_t)1000 || sample.queue_fill >= options_.queue_high ||
+    encode_load > options_.encode_high;
+  bool calm = lag < options_.lag_low_ms * (int64_t)1000 && sample.queue_fill < options_.queue_high / 2 &&
+    encode_load < options_.encode_high * 0.7;
+
+  if (overloaded)
+  {
+    calm_since_us_ = AV_NOPTS_VALUE;
+    if (profile.level < (int)options_.steps.size() &&
+      frame_us - last_change_us_ >= (int64_t)(options_.settle_sec * AV_TIME_BASE))
+    {
+      /* the last recovery came too early: wait longer before the next one */
+      bool relapse = last_recovery_us_ != AV_NOPTS_VALUE &&
+        frame_us - last_recovery_us_ < (int64_t)(options_.recover_sec * backoff_ * AV_TIME_BASE);
+      backoff_ = relapse ? FFMIN(backoff_ * 2, 8) : 1;
+
+      std::ostringstream reason;
+      reason.precision(0);
+      reason << std::fixed << "lag " << lag / 1000 << " ms, queue " << sample.queue_fill * 100 <<
+        "%, encode " << encode_load * 100 << "%";
+      change_level(frame_us, 1, reason.str().c_str());
+      return true;
+    }
+    return false;
+  }
+
+  if (!calm)
+  {
+    calm_since_us_ = AV_NOPTS_VALUE;
+    return false;
+  }
+  if (calm_since_us_ == AV_NOPTS_VALUE)
+  {
+    calm_since_us_ = frame_us;
+  }
+  if (profile.level > 0 && frame_us - calm_since_us_ >= (int64_t)(options_.recover_sec * backoff_ * AV_TIME_BASE))
+  {
+    change_level(frame_us, -1, "load subsided");
+    last_recovery_us_ = frame_us;
+    /* the next step up needs a calm period of its own */
+    calm_since_us_ = frame_us;
+    return true;
+  }
+  return false;
+}
+
+void DegradationController::AddEncodeTime(int64_t us)
+{
+  encode_us_ = encode_us_ ? smooth(encode_us_, us) : us;
+}
+
+DegradationController::Profile DegradationController::GetProfile() const
+{
+  Profile profile;
+  profile.level = level_;
+  profile.no_bframes = false;
+  profile.fast_preset = false;
+  profile.fps_divisor = 1;
+  profile.scale_steps = 0;
+  for (int i = 0; i < profile.level; i++)
+  {
+    switch (options_.steps[i])
+    {
+    case DegradeOptions::BFRAMES: profile.no_bframes = true;  break;
+    case DegradeOptions::PRESET:  profile.fast_preset = true; break;
+    case DegradeOptions::FPS:     profile.fps_divisor *= 2;   break;
+    case DegradeOptions::SCALE:   profile.scale_steps++;      break;
+    }
+  }
+  return profile;
+}
+
+DegradationController::Stats DegradationController::GetStats() const
+{
+  Stats stats;
+  stats.level       = level_;
+  stats.degrades    = degrades_;
+  stats.recoveries  = recoveries_;
+  stats.degraded_us = degraded_us_;
+  stats.lag_ms      = lag_us_ / 1000.0;
+  stats.queue_fill  = queue_fill_x1000_ / 1000.0;
+  stats.encode_load = encode_load_x1000_ / 1000.0;
+  return stats;
+}
+
+void DegradationController::PrintStats(int level) const
+{
+  Stats stats = GetStats();
+  av_log(NULL, level, "Degradation: level %d of %u at the end, %llu steps down, %llu back up, %.1f s degraded\n",
+    stats.level, (unsigned int)options_.steps.size(), (unsigned long long)stats.degrades,
+    (unsigned long long)stats.recoveries, stats.degraded_us / 1000000.0);
+}
+
+void DegradationController::change_level(int64_t frame_us, int step, const char *reason)
+{
+  int level = level_ + step;
+  level_ = level;
+  last_change_us_ = frame_us;
+  if (step > 0)
+  {
+    degrades_++;
+    av_log(NULL, AV_LOG_WARNING, "Overloaded (%s): degrading to level %d, %s\n", reason, level, describe(level).c_str());
+  }
+  else
+  {
+    recoveries_++;
+    av_log(NULL, AV_LOG_INFO, "Recovering (%s): level %d, %s\n", reason, level, describe(level).c_str());
+  }
+}
+
+std::string DegradationController::describe(int level) const
+{
+  if (level == 0)
+  {
+    return "full quality";
+  }
+  std::string steps;
+  for (int i = 0; i < level; i++)
+  {
+    steps += (i ? "+" : "");
+    steps += DegradeOptions::StepName(options_.steps[i]);
+  }
+  return steps;
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+extern "C"
+{
+  #define __STDC_CONSTANT_MACROS
+  #include <libavutil/avutil.h>
+}
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include "Noncopyable.h"
+
+struct DegradeOptions
+{
+  enum step
+  {
+    BFRAMES,  // reopen the encoder without B-frames
+    PRESET,   // reopen the encoder two presets faster
+    FPS,      // halve the frame rate again
+    SCALE     // two thirds of the picture size again
+  };
+
+  DegradeOptions()
+    : lag_high_ms(500)
+    , lag_low_ms(100)
+    , queue_high(0.5)
+    , encode_high(0.9)
+    , settle_sec(3)
+    , recover_sec(15)
+  {
+  }
+
+  bool Enabled() const { return !steps.empty(); }
+
+  std::vector<step> steps;  // taken in order under load, undone in reverse
+  int    lag_high_ms;       // capture-to-processing lag that counts as overloaded
+  int    lag_low_ms;        // and the lag below which load has subsided
+  double queue_high;        // fill level (0-1) of the capture or encoder queue that counts as overloaded
+  double encode_high;       // encode time per frame over the frame interval that counts as overloaded
+  double settle_sec;        // at least this long between two steps down, so the last one can take effect
+  double recover_sec;       // calm this long before a step back up, doubled each time recovery fails
+
+  // bframes,preset,fps,scale; fps and scale may be repeated, 1 takes that ladder
+  static bool ParseSteps(const std::string &spec, std::vector<step> *steps);
+  static const char *StepName(step s);
+};
+
+// Sheds encoding work while the host cannot keep up, instead of letting the
+// device buffer grow until memory runs out or the recording drifts. Every
+// video frame reports how far processing lags behind its capture time and how
+// full the queues are; the encoder thread reports how long frames take. When
+// any of them stays above its limit the controller takes the next step of the
+// ladder, once they are all calm again long enough it undoes the last one.
+//
+// Update() runs on the processing thread, AddEncodeTime() on the encoder's;
+// the profile and the statistics can be read from any thread.
+class DegradationController : Noncopyable
+{
+public:
+  struct Sample
+  {
+    int64_t lag_us;      // now on the capture clock minus the frame's capture time
+    double  queue_fill;  // fullest queue on the way to the encoder, 0-1
+  };
+
+  // what the current level asks of the pipeline
+  struct Profile
+  {
+    int  level;         // steps taken, 0 is the configured quality
+    bool no_bframes;
+    bool fast_preset;
+    int  fps_divisor;   // keep one frame of this many
+    int  scale_steps;   // times the picture is scaled to two thirds
+  };
+
+  struct Stats
+  {
+    int      level;
+    uint64_t degrades;     // steps down
+    uint64_t recoveries;   // steps back up
+    int64_t  degraded_us;  // media time spent above level 0
+    double   lag_ms;       // smoothed
+    double   queue_fill;
+    double   encode_load;  // smoothed encode time over frame interval
+  };
+
+  explicit DegradationController(const DegradeOptions &options);
+
+  // frame pts in microseconds; true if the level changed
+  bool Update(int64_t frame_us, const Sample &sample);
+  // one video frame took this long to encode
+  void AddEncodeTime(int64_t us);
+
+  Profile GetProfile() const;
+  Stats GetStats() const;
+  void PrintStats(int level) const;
+
+private:
+  void change_level(int64_t frame_us, int step, const char *reason);
+  std::string describe(int level) const;
+
+private:
+  DegradeOptions options_;
+  int64_t last_frame_us_;     /* processing thread only, like the others up to level_ */
+  int64_t interval_us_;       /* smoothed input frame interval */
+  int64_t last_change_us_;
+  int64_t last_recovery_us_;
+  int64_t calm_since_us_;
+  int     backoff_;           /* recover_sec multiplier */
+
+  std::atomic<int> level_;
+  std::atomic<uint64_t> degrades_;
+  std::atomic<uint64_t> recoveries_;
+  std::atomic<int64_t> degraded_us_;
+  std::atomic<int64_t> lag_us_;
+  std::atomic<int> queue_fill_x1000_;
+  std::atomic<int> encode_load_x1000_;   /* as of the last Update() */
+  std::atomic<int64_t> encode_us_;   /* smoothed, written by the encoder thread */
+};
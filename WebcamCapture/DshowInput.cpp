@@ -0,0 +1,71 @@
+#include "DshowInput.h"
+
+#ifdef _WIN32
+#include "WinDevices.h"
+#endif
+
+InputCapabilities DshowInput::Capabilities() const
+{
+  InputCapabilities caps;
+  caps.live = true;
+#ifdef _WIN32
+  caps.enumerable = true;
+#endif
+  caps.video = true;
+  caps.audio = true;
+  return caps;
+}
+
+std::vector<InputDevice> DshowInput::ListDevices()
+{
+  std::vector<InputDevice> devices;
+#ifdef _WIN32
+  /* this FFmpeg's dshow cannot list devices through libavdevice, ask COM */
+  WinDevices win_devices;
+  for (int i = 0; i < win_devices.Count(); i++)
+  {
+    InputDevice device;
+    device.name = win_devices.DeviceName(i);
+    device.audio = i >= win_devices.FirstAudioDevice();
+    devices.push_back(device);
+  }
+#endif
+  return devices;
+}
+
+int DshowInput::BuildInput(const InputRequest &request, AVInputFormat **format, std::string *url, AVDictionary **options)
+{
+  int ret = find_format("dshow", format);
+  if (ret < 0)
+  {
+    return ret;
+  }
+  if (request.video_device.empty() && request.audio_device.empty())
+  {
+    av_log(NULL, AV_LOG_ERROR, "No dshow device given\n");
+    return AVERROR(EINVAL);
+  }
+  /* the default real-time buffer overflows while the encoders warm up */
+  av_dict_set(options, "rtbufsize", "1000000000", 0);
+  *url = make_url(request);
+  return 0;
+}
+
+int DshowInput::PrintCapabilities(const InputRequest &request)
+{
+  return print_device_options("dshow", make_url(request), "list_options", "true");
+}
+
+std::string DshowInput::make_url(const InputRequest &request)
+{
+  std::string url;
+  if (!request.video_device.empty())
+  {
+    url = "video=" + request.video_device;
+  }
+  if (!request.audio_device.empty())
+  {
+    url += (url.empty() ? "audio=" : ":audio=") + request.audio_device;
+  }
+  return url;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "InputBackend.h"
+
+// DirectShow capture devices, Windows only. Devices are enumerated through
+// COM; video and audio go into one "video=...:audio=..." url.
+class DshowInput : public InputBackend
+{
+public:
+  const char *Name() const { return "dshow"; }
+  InputCapabilities Capabilities() const;
+  std::vector<InputDevice> ListDevices();
+  int BuildInput(const InputRequest &request, AVInputFormat **format, std::string *url, AVDictionary **options);
+  int PrintCapabilities(const InputRequest &request);
+
+private:
+  static std::string make_url(const InputRequest &request);
+};
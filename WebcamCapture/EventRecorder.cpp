@@ -0,0 +1,344 @@
+#include "EventRecorder.h"
+
+static int64_t packet_time_us(const AVPacket *packet, AVRational time_base)
+{
+  int64_t ts = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+  return ts == AV_NOPTS_VALUE ? AV_NOPTS_VALUE : av_rescale_q(ts, time_base, AV_TIME_BASE_Q);
+}
+
+EventRecorder::EventRecorder(AVFormatContext *layout, const std::string &filename, const EventOptions &options,
+  const MuxerOptions &muxer_options)
+  : layout_(layout)
+  , filename_(filename)
+  , options_(options)
+  , reference_stream_(0)
+  , trigger_(false)
+  , events_(0)
+  , buffered_bytes_(0)
+  , event_active_(false)
+  , event_end_us_(AV_NOPTS_VALUE)
+  , dropping_(false)
+  , dropped_packets_(0)
+  , queued_bytes_(0)
+  , closing_(false)
+  , writer_thread_(NULL)
+  , muxer_(layout, muxer_options)
+  , wait_keyframe_(true)
+  , event_start_us_(AV_NOPTS_VALUE)
+{
+  for (unsigned int i = 0; i < layout_->nb_streams; i++)
+  {
+    if (layout_->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO)
+    {
+      reference_stream_ = i;
+      break;
+    }
+  }
+  if (options_.name_template.empty())
+  {
+    options_.name_template = OutputMuxer::DerivedTemplate(filename_, "_event_%Y%m%d-%H%M%S");
+  }
+}
+
+EventRecorder::~EventRecorder()
+{
+  Close();
+}
+
+int EventRecorder::Start()
+{
+  if (writer_thread_)
+  {
+    return 0;
+  }
+  closing_ = false;
+  writer_thread_ = new std::thread(&EventRecorder::write_events, this);
+  av_log(NULL, AV_LOG_INFO, "DVR mode: keeping %d s (at most %lld bytes) in memory, %d s after a trigger\n",
+    options_.pre_sec, (long long)options_.max_memory, options_.post_sec);
+  return 0;
+}
+
+int EventRecorder::WritePacket(AVPacket *packet)
+{
+  int64_t ts_us = packet_time_us(packet, layout_->streams[packet->stream_index]->time_base);
+
+  if (trigger_.exchange(false) && ts_us != AV_NOPTS_VALUE)
+  {
+    if (!event_active_)
+    {
+      start_event();
+    }
+    event_end_us_ = ts_us + (int64_t)options_.post_sec * AV_TIME_BASE;
+  }
+  if (event_active_ && ts_us != AV_NOPTS_VALUE && ts_us >= event_end_us_)
+  {
+    stop_event();
+  }
+
+  if (event_active_)
+  {
+    std::vector<Job> jobs(1);
+    jobs[0].kind = WRITE_PACKET;
+    jobs[0].packet = av_packet_clone(packet);
+    if (jobs[0].packet)
+    {
+      post_jobs(jobs);
+    }
+  }
+
+  buffer_packet(packet, ts_us);
+  return 0;
+}
+
+int EventRecorder::Close()
+{
+  if (event_active_)
+  {
+    stop_event();
+  }
+  if (writer_thread_)
+  {
+    {
+      std::lock_guard<std::mutex> lock(jobs_mutex_);
+      closing_ = true;
+    }
+    jobs_cond_.notify_one();
+    /* finishes the queued events first */
+    writer_thread_->join();
+    delete writer_thread_;
+    writer_thread_ = NULL;
+  }
+  while (!buffer_.empty())
+  {
+    drop_oldest_gop();
+  }
+  return 0;
+}
+
+bool EventRecorder::is_keyframe(const AVPacket *packet) const
+{
+  return packet->stream_index == reference_stream_ && (packet->flags & AV_PKT_FLAG_KEY);
+}
+
+void EventRecorder::start_event()
+{
+  event_active_ = true;
+  int number = ++events_;
+
+  /* references only, the packet data is shared with the buffer */
+  std::vector<Job> jobs(1);
+  jobs[0].kind = OPEN_FILE;
+  jobs[0].packet = NULL;
+  jobs[0].filename = OutputMuxer::ExpandTemplate(options_.name_template, number);
+  for (size_t i = 0; i < buffer_.size(); i++)
+  {
+    Job job;
+    job.kind = WRITE_PACKET;
+    job.packet = av_packet_clone(buffer_[i].packet);
+    if (job.packet)
+    {
+      jobs.push_back(job);
+    }
+  }
+
+  int64_t span_ms = buffer_.empty() ? 0 : (buffer_.back().ts_us - buffer_.front().ts_us) / 1000;
+  av_log(NULL, AV_LOG_INFO, "Event %d triggered, saving %lld ms (%lld bytes) of pre-event video to '%s'\n",
+    number, (long long)span_ms, (long long)buffered_bytes_, jobs[0].filename.c_str());
+  post_jobs(jobs);
+}
+
+void EventRecorder::stop_event()
+{
+  event_active_ = false;
+  std::vector<Job> jobs(1);
+  jobs[0].kind = CLOSE_FILE;
+  jobs[0].packet = NULL;
+  post_jobs(jobs);
+}
+
+void EventRecorder::buffer_packet(AVPacket *packet, int64_t ts_us)
+{
+  bool keyframe = is_keyframe(packet);
+
+  /* the buffer always starts at a keyframe */
+  if (buffer_.empty() && !keyframe)
+  {
+    av_packet_unref(packet);
+    return;
+  }
+
+  Buffered entry;
+  entry.packet = av_packet_alloc();
+  if (!entry.packet)
+  {
+    av_packet_unref(packet);
+    return;
+  }
+  av_packet_move_ref(entry.packet, packet);
+  if (ts_us == AV_NOPTS_VALUE)
+  {
+    ts_us = buffer_.empty() ? 0 : buffer_.back().ts_us;
+  }
+  entry.ts_us = ts_us;
+  buffer_.push_back(entry);
+  buffered_bytes_ += entry.packet->size;
+  if (keyframe)
+  {
+    keyframes_us_.push_back(ts_us);
+  }
+
+  /* drop whole GOPs while the rest still covers pre_sec, and whatever it takes to fit in memory */
+  while (keyframes_us_.size() > 1 && ts_us - keyframes_us_[1] >= (int64_t)options_.pre_sec * AV_TIME_BASE)
+  {
+    drop_oldest_gop();
+  }
+  while (!buffer_.empty() && options_.max_memory > 0 && buffered_bytes_ > options_.max_memory)
+  {
+    drop_oldest_gop();
+  }
+}
+
+void EventRecorder::drop_oldest_gop()
+{
+  do
+  {
+    buffered_bytes_ -= buffer_.front().packet->size;
+    av_packet_free(&buffer_.front().packet);
+    buffer_.pop_front();
+  }
+  while (!buffer_.empty() && !is_keyframe(buffer_.front().packet));
+
+  if (!keyframes_us_.empty())
+  {
+    keyframes_us_.pop_front();
+  }
+}
+
+void EventRecorder::post_jobs(std::vector<Job> &jobs)
+{
+  {
+    std::lock_guard<std::mutex> lock(jobs_mutex_);
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+      Job &job = jobs[i];
+      if (job.kind == WRITE_PACKET && options_.max_memory > 0)
+      {
+        /* a slow disk must not hold the whole event in memory: skip to a keyframe that fits */
+        bool fits = queued_bytes_ + job.packet->size <= options_.max_memory;
+        if (dropping_ && fits && is_keyframe(job.packet))
+        {
+          av_log(NULL, AV_LOG_WARNING, "Event writer caught up, %lld packets dropped\n", (long long)dropped_packets_);
+          dropping_ = false;
+        }
+        else if (!dropping_ && !fits)
+        {
+          av_log(NULL, AV_LOG_WARNING, "Event writer is %lld bytes behind, dropping packets up to the next keyframe\n",
+            (long long)queued_bytes_);
+          dropping_ = true;
+          dropped_packets_ = 0;
+        }
+        if (dropping_)
+        {
+          dropped_packets_++;
+          av_packet_free(&job.packet);
+          continue;
+        }
+        queued_bytes_ += job.packet->size;
+      }
+      jobs_.push_back(job);
+    }
+  }
+  jobs_cond_.notify_one();
+}
+
+void EventRecorder::write_events()
+{
+  while (1)
+  {
+    Job job;
+    {
+      std::unique_lock<std::mutex> lock(jobs_mutex_);
+      while (jobs_.empty() && !closing_)
+      {
+        jobs_cond_.wait(lock);
+      }
+      if (jobs_.empty())
+      {
+        break;
+      }
+      job = jobs_.front();
+      jobs_.pop_front();
+      if (job.kind == WRITE_PACKET)
+      {
+        queued_bytes_ -= job.packet->size;
+      }
+    }
+    write_job(job);
+  }
+  if (muxer_.IsOpen())
+  {
+    muxer_.Close();
+  }
+}
+
+void EventRecorder::write_job(Job &job)
+{
+  switch (job.kind)
+  {
+  case OPEN_FILE:
+    if (muxer_.IsOpen())
+    {
+      muxer_.Close();
+    }
+    if (muxer_.Open(job.filename) < 0)
+    {
+      av_log(NULL, AV_LOG_ERROR, "Event '%s' is lost\n", job.filename.c_str());
+    }
+    wait_keyframe_ = true;
+    event_start_us_ = AV_NOPTS_VALUE;
+    break;
+
+  case WRITE_PACKET:
+    if (muxer_.IsOpen() && !(wait_keyframe_ && !is_keyframe(job.packet)))
+    {
+      AVRational time_base = layout_->streams[job.packet->stream_index]->time_base;
+      wait_keyframe_ = false;
+      if (event_start_us_ == AV_NOPTS_VALUE)
+      {
+        event_start_us_ = packet_time_us(job.packet, time_base);
+      }
+      /* every event file starts at zero */
+      if (event_start_us_ != AV_NOPTS_VALUE)
+      {
+        int64_t offset = av_rescale_q(event_start_us_, AV_TIME_BASE_Q, time_base);
+        if (job.packet->pts != AV_NOPTS_VALUE)
+        {
+          job.packet->pts -= offset;
+        }
+        if (job.packet->dts != AV_NOPTS_VALUE)
+        {
+          job.packet->dts -= offset;
+        }
+      }
+      if (muxer_.WritePacket(job.packet) < 0)
+      {
+        av_log(NULL, AV_LOG_ERROR, "Writing event '%s' failed\n", muxer_.Filename().c_str());
+        muxer_.Close();
+      }
+    }
+    av_packet_free(&job.packet);
+    break;
+
+  case CLOSE_FILE:
+    if (muxer_.IsOpen())
+    {
+      std::string filename = muxer_.Filename();
+      int64_t size = muxer_.BytesWritten();
+      if (muxer_.Close() >= 0)
+      {
+        av_log(NULL, AV_LOG_INFO, "Event saved to '%s', %lld bytes\n", filename.c_str(), (long long)size);
+      }
+    }
+    break;
+  }
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "OutputMuxer.h"
+#include "PacketSink.h"
+
+struct EventOptions
+{
+  EventOptions()
+    : pre_sec(0)
+    , post_sec(10)
+    , max_memory(64 << 20)
+  {
+  }
+
+  bool Enabled() const { return pre_sec > 0; }
+
+  int         pre_sec;        // seconds kept in memory before a trigger, > 0 enables DVR mode
+  int         post_sec;       // seconds recorded after the last trigger
+  int64_t     max_memory;     // hard cap of the buffered packet data in bytes, and of the data queued for the writer
+  std::string name_template;  // strftime fields plus %d for the event number
+};
+
+// DVR mode: keeps the last pre_sec seconds of encoded packets in memory,
+// always starting at a keyframe, and writes nothing until Trigger(). The
+// buffer plus the next post_sec seconds then go to a new file on a writer
+// thread; the mux thread only hands over packet references. A writer that
+// falls more than max_memory behind loses packets up to the next keyframe.
+class EventRecorder : public PacketSink
+{
+public:
+  EventRecorder(AVFormatContext *layout, const std::string &filename, const EventOptions &options,
+    const MuxerOptions &muxer_options = MuxerOptions());
+  ~EventRecorder();
+
+  int Start();
+  int WritePacket(AVPacket *packet);
+  int Close();
+
+  // safe from any thread or a signal handler; a trigger during an event extends it
+  void Trigger() { trigger_ = true; }
+  int Events() const { return events_; }
+
+private:
+  enum job_kind
+  {
+    OPEN_FILE,
+    WRITE_PACKET,
+    CLOSE_FILE
+  };
+  struct Job
+  {
+    job_kind    kind;
+    AVPacket   *packet;
+    std::string filename;
+  };
+  struct Buffered
+  {
+    AVPacket *packet;
+    int64_t   ts_us;
+  };
+
+  bool is_keyframe(const AVPacket *packet) const;
+  void start_event();
+  void stop_event();
+  void buffer_packet(AVPacket *packet, int64_t ts_us);
+  void drop_oldest_gop();
+  void post_jobs(std::vector<Job> &jobs);
+  void write_events();
+  void write_job(Job &job);
+
+private:
+  AVFormatContext *layout_;
+  std::string filename_;
+  EventOptions options_;
+  int reference_stream_;
+  std::atomic<bool> trigger_;
+  std::atomic<int> events_;
+
+  // mux thread
+  std::deque<Buffered> buffer_;
+  std::deque<int64_t> keyframes_us_;   // timestamps of the reference keyframes in buffer_
+  int64_t buffered_bytes_;
+  bool event_active_;
+  int64_t event_end_us_;
+  bool dropping_;                      // writer over budget, skipping to the next keyframe
+  int64_t dropped_packets_;
+
+  // writer thread
+  std::mutex jobs_mutex_;
+  std::condition_variable jobs_cond_;
+  std::deque<Job> jobs_;
+  int64_t queued_bytes_;               // packet data in jobs_
+  bool closing_;
+  std::thread *writer_thread_;
+  OutputMuxer muxer_;
+  bool wait_keyframe_;
+  int64_t event_start_us_;
+};
@@ -0,0 +1,311 @@
+#include "FanoutSink.h"
+#include "LatencyMetrics.h"
+
+#include <string.h>
+
+/* how long a stalled network output may hold up Close() */
+static const int64_t CLOSE_TIMEOUT_US = 5000000;
+
+bool FanoutOptions::Parse(const std::string &spec, std::vector<OutputTarget> *targets)
+{
+  size_t start = 0;
+  while (start < spec.size())
+  {
+    size_t end = spec.find('|', start);
+    if (end == std::string::npos)
+    {
+      end = spec.size();
+    }
+    std::string entry = spec.substr(start, end - start);
+    start = end + 1;
+    if (entry.empty())
+    {
+      continue;
+    }
+
+    OutputTarget target;
+    if (entry[0] == '[')
+    {
+      size_t close = entry.find(']');
+      if (close == std::string::npos)
+      {
+        return false;
+      }
+      /* [f=mpegts], more options may follow separated by ':' */
+      std::string options = entry.substr(1, close - 1);
+      size_t pos = 0;
+      while (pos < options.size())
+      {
+        size_t next = options.find(':', pos);
+        if (next == std::string::npos)
+        {
+          next = options.size();
+        }
+        std::string option = options.substr(pos, next - pos);
+        if (option.compare(0, 2, "f=") != 0)
+        {
+          return false;
+        }
+        target.format = option.substr(2);
+        pos = next + 1;
+      }
+      entry = entry.substr(close + 1);
+    }
+    if (entry.empty())
+    {
+      return false;
+    }
+    target.url = entry;
+    targets->push_back(target);
+  }
+  return true;
+}
+
+FanoutSink::FanoutSink(AVFormatContext *layout, PacketSink *primary, const FanoutOptions &options,
+  const MuxerOptions &muxer_options)
+  : layout_(layout)
+  , primary_(primary)
+  , primary_inband_headers_(!(layout->oformat->flags & AVFMT_GLOBALHEADER))
+  , options_(options)
+  , muxer_options_(muxer_options)
+  , reference_stream_(-1)
+  , close_deadline_(0)
+{
+  muxer_options_.interrupt.callback = interrupt;
+  muxer_options_.interrupt.opaque = this;
+  for (unsigned int i = 0; i < layout_->nb_streams; i++)
+  {
+    if (layout_->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO)
+    {
+      reference_stream_ = i;
+      break;
+    }
+  }
+}
+
+FanoutSink::~FanoutSink()
+{
+  Close();
+  for (size_t i = 0; i < outputs_.size(); i++)
+  {
+    delete outputs_[i]->muxer;
+    delete outputs_[i]->queue;
+    delete outputs_[i];
+  }
+  delete primary_;
+}
+
+int FanoutSink::Start()
+{
+  for (size_t i = 0; i < options_.targets.size(); i++)
+  {
+    const OutputTarget &target = options_.targets[i];
+    AVOutputFormat *format = target_format(target);
+    if (!format)
+    {
+      av_log(NULL, AV_LOG_ERROR, "Cannot find a muxer for output '%s', give one as [f=<format>]%s\n",
+        target.url.c_str(), target.url.c_str());
+      return AVERROR_MUXER_NOT_FOUND;
+    }
+
+    Output *output = new Output();
+    output->target = target;
+    MuxerOptions muxer_options = muxer_options_;
+    muxer_options.format = format->name;
+    output->muxer = new OutputMuxer(layout_, muxer_options);
+    output->queue = new SpscQueue<AVPacket*>(FFMAX(options_.queue_size, 2));
+    const char *protocol = avio_find_protocol_name(target.url.c_str());
+    output->retry = !protocol || strcmp(protocol, "file") != 0;
+    output->inband_headers = !(format->flags & AVFMT_GLOBALHEADER);
+    output->resync = false;
+    output->failed = false;
+    output->written = 0;
+    output->dropped = 0;
+    output->failures = 0;
+    /* opened lazily on its own thread, connecting to a slow consumer must not delay the capture */
+    output->thread = new std::thread(&FanoutSink::write_output, this, output);
+    outputs_.push_back(output);
+  }
+  return 0;
+}
+
+int FanoutSink::WritePacket(AVPacket *packet)
+{
+  for (size_t i = 0; i < outputs_.size(); i++)
+  {
+    Output *output = outputs_[i];
+    if (output->failed)
+    {
+      continue;
+    }
+    if (output->resync && !is_keyframe(packet))
+    {
+      ++output->dropped;
+      continue;
+    }
+    /* a new reference to the same data, the encoder's buffer is not copied */
+    AVPacket *copy = av_packet_clone(packet);
+    if (!copy || !output->queue->TryPush(copy))
+    {
+      av_packet_free(&copy);
+      ++output->dropped;
+      output->resync = true;
+      continue;
+    }
+    output->resync = false;
+  }
+  if (primary_inband_headers_)
+  {
+    /* the extra outputs have their own reference, the data is replaced, not changed */
+    int ret = prepend_headers(packet);
+    if (ret < 0)
+    {
+      av_packet_unref(packet);
+      return ret;
+    }
+  }
+  return primary_->WritePacket(packet);
+}
+
+int FanoutSink::Close()
+{
+  int ret = primary_->Close();
+  close_deadline_ = LatencyMetrics::Now() + CLOSE_TIMEOUT_US;
+  for (size_t i = 0; i < outputs_.size(); i++)
+  {
+    Output *output = outputs_[i];
+    if (!output->thread)
+    {
+      continue;
+    }
+    /* the thread writes what is queued and closes its file */
+    output->queue->Close();
+    output->thread->join();
+    delete output->thread;
+    output->thread = NULL;
+  }
+  return ret;
+}
+
+void FanoutSink::PrintStats(int level) const
+{
+  for (size_t i = 0; i < outputs_.size(); i++)
+  {
+    const Output *output = outputs_[i];
+    av_log(NULL, level, "Output '%s': %llu packets written, %llu dropped, %llu failures%s\n",
+      output->target.url.c_str(), (unsigned long long)output->written.load(),
+      (unsigned long long)output->dropped.load(), (unsigned long long)output->failures.load(),
+      output->failed ? ", gave up" : "");
+  }
+}
+
+bool FanoutSink::NeedsGlobalHeader(const FanoutOptions &options)
+{
+  for (size_t i = 0; i < options.targets.size(); i++)
+  {
+    AVOutputFormat *format = target_format(options.targets[i]);
+    if (format && (format->flags & AVFMT_GLOBALHEADER))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+AVOutputFormat *FanoutSink::target_format(const OutputTarget &target)
+{
+  if (!target.format.empty())
+  {
+    return av_guess_format(target.format.c_str(), NULL, NULL);
+  }
+  return av_guess_format(NULL, target.url.c_str(), NULL);
+}
+
+int FanoutSink::interrupt(void *opaque)
+{
+  FanoutSink *sink = static_cast<FanoutSink*>(opaque);
+  int64_t deadline = sink->close_deadline_;
+  return deadline && LatencyMetrics::Now() > deadline;
+}
+
+bool FanoutSink::is_keyframe(const AVPacket *packet) const
+{
+  if (reference_stream_ < 0)
+  {
+    return true;
+  }
+  return packet->stream_index == reference_stream_ && (packet->flags & AV_PKT_FLAG_KEY);
+}
+
+void FanoutSink::write_output(Output *output)
+{
+  int64_t retry_us = 0;
+  AVPacket *packet = NULL;
+
+  while (output->queue->Pop(packet))
+  {
+    if (output->failed)
+    {
+      av_packet_free(&packet);
+      continue;
+    }
+    if (!output->muxer->IsOpen())
+    {
+      /* start (again) on a keyframe so the consumer can decode from the first packet */
+      if (LatencyMetrics::Now() < retry_us || !is_keyframe(packet))
+      {
+        av_packet_free(&packet);
+        continue;
+      }
+      if (output->muxer->Open(output->target.url) < 0)
+      {
+        ++output->failures;
+        if (!output->retry || options_.retry_sec <= 0)
+        {
+          av_log(NULL, AV_LOG_ERROR, "Output '%s' is disabled\n", output->target.url.c_str());
+          output->failed = true;
+        }
+        retry_us = LatencyMetrics::Now() + options_.retry_sec * (int64_t)1000000;
+        av_packet_free(&packet);
+        continue;
+      }
+      av_log(NULL, AV_LOG_INFO, "Output '%s' opened\n", output->target.url.c_str());
+    }
+
+    int ret = output->inband_headers ? prepend_headers(packet) : 0;
+    if (ret >= 0)
+    {
+      ret = output->muxer->WritePacket(packet);
+    }
+    av_packet_free(&packet);
+    if (ret >= 0)
+    {
+      ++output->written;
+      continue;
+    }
+
+    /* only this output is affected: close it and try again later */
+    ++output->failures;
+    char buf[AV_ERROR_MAX_STRING_SIZE];
+    av_strerror(ret, buf, sizeof(buf));
+    av_log(NULL, AV_LOG_WARNING, "Output '%s' failed with '%s'%s\n", output->target.url.c_str(), buf,
+      output->retry && options_.retry_sec > 0 ? ", reopening it later" : "");
+    output->muxer->Close();
+    if (!output->retry || options_.retry_sec <= 0)
+    {
+      output->failed = true;
+    }
+    retry_us = LatencyMetrics::Now() + options_.retry_sec * (int64_t)1000000;
+  }
+
+  if (output->muxer->IsOpen() && output->muxer->Close() < 0)
+  {
+    ++output->failures;
+  }
+}
+
+int FanoutSink::prepend_headers(AVPacket *packet) const
+{
+  /* the encoders were opened for a container with global headers */
+  return OutputMuxer::PrependHeaders(packet, layout_->streams[packet->stream_index]->codec);
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include "OutputMuxer.h"
+#include "PacketSink.h"
+#include "SpscRing.h"
+
+struct OutputTarget
+{
+  std::string url;     // file, pipe:1, udp://127.0.0.1:1234?pkt_size=1316, ...
+  std::string format;  // muxer name, empty guesses it from the url
+};
+
+struct FanoutOptions
+{
+  FanoutOptions()
+    : queue_size(256)
+    , retry_sec(2)
+  {
+  }
+
+  bool Enabled() const { return !targets.empty(); }
+
+  std::vector<OutputTarget> targets;  // outputs besides the main one, each on a thread of its own
+  int queue_size;                     // packets buffered per output before it starts dropping
+  int retry_sec;                      // reopen a failed stream output after this many seconds, 0 = never
+
+  // the tee muxer's syntax: [f=mpegts]udp://127.0.0.1:1234|copy.mkv
+  static bool Parse(const std::string &spec, std::vector<OutputTarget> *targets);
+};
+
+// Encode once, mux many times: the main sink keeps running on the mux thread
+// while every extra output gets a reference to each packet (av_packet_clone,
+// the data is shared) through a queue of its own and muxes it on its own
+// thread. An output that cannot keep up loses packets until the next
+// keyframe, one that fails is closed and, unless it is a plain file, reopened
+// later; neither ever blocks the main output or the pipeline. When a target
+// needs global headers the encoders are opened with them, and every output
+// whose container has none, the main one included, gets them in band.
+class FanoutSink : public PacketSink
+{
+public:
+  // takes over primary
+  FanoutSink(AVFormatContext *layout, PacketSink *primary, const FanoutOptions &options,
+    const MuxerOptions &muxer_options = MuxerOptions());
+  ~FanoutSink();
+
+  int Start();
+  int WritePacket(AVPacket *packet);
+  // closes the main sink first; returns its result, failed extra outputs are only logged
+  int Close();
+
+  size_t Outputs() const { return outputs_.size(); }
+  const std::string &Url(size_t index) const { return outputs_[index]->target.url; }
+  size_t QueueDepth(size_t index) const { return outputs_[index]->queue->Size(); }
+  size_t QueueCapacity(size_t index) const { return outputs_[index]->queue->Capacity(); }
+  void PrintStats(int level) const;
+
+  // some target's container needs the codec headers out of band
+  static bool NeedsGlobalHeader(const FanoutOptions &options);
+
+private:
+  struct Output
+  {
+    OutputTarget           target;
+    OutputMuxer           *muxer;
+    SpscQueue<AVPacket*>  *queue;
+    std::thread           *thread;
+    bool                   retry;         /* not a plain file, may be reopened */
+    bool                   inband_headers; /* the codec headers go in front of keyframes */
+    bool                   resync;        /* mux thread: dropped, wait for a keyframe */
+    std::atomic<bool>      failed;        /* gave up, the mux thread stops feeding it */
+    std::atomic<uint64_t>  written;
+    std::atomic<uint64_t>  dropped;
+    std::atomic<uint64_t>  failures;
+  };
+
+  static AVOutputFormat *target_format(const OutputTarget &target);
+  static int interrupt(void *opaque);
+  bool is_keyframe(const AVPacket *packet) const;
+  void write_output(Output *output);
+  int prepend_headers(AVPacket *packet) const;
+
+private:
+  AVFormatContext *layout_;
+  PacketSink *primary_;
+  bool primary_inband_headers_;   /* the main container has no global headers */
+  FanoutOptions options_;
+  MuxerOptions muxer_options_;
+  int reference_stream_;          /* first video stream, -1 for audio only */
+  std::vector<Output*> outputs_;
+  std::atomic<int64_t> close_deadline_;  /* 0 until Close(), then stalled outputs are aborted after it */
+};
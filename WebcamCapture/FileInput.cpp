@@ -0,0 +1,22 @@
+#include "FileInput.h"
+
+InputCapabilities FileInput::Capabilities() const
+{
+  InputCapabilities caps;
+  caps.video = true;
+  caps.audio = true;
+  return caps;
+}
+
+int FileInput::BuildInput(const InputRequest &request, AVInputFormat **format, std::string *url, AVDictionary **options)
+{
+  if (request.url.empty())
+  {
+    av_log(NULL, AV_LOG_ERROR, "No input file given\n");
+    return AVERROR(EINVAL);
+  }
+  *url = request.url;
+  *format = NULL;
+  /* the format is only forced when asked for, probing handles the rest */
+  return request.format.empty() ? 0 : find_format(request.format.c_str(), format);
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "InputBackend.h"
+
+// A local file or any url the demuxers understand. Not live: the reader
+// runs as fast as it can unless -re paces it.
+class FileInput : public InputBackend
+{
+public:
+  const char *Name() const { return "file"; }
+  InputCapabilities Capabilities() const;
+  int BuildInput(const InputRequest &request, AVInputFormat **format, std::string *url, AVDictionary **options);
+};
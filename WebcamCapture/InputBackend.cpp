@@ -0,0 +1,203 @@
+#include "InputBackend.h"
+
+extern "C"
+{
+  #define __STDC_CONSTANT_MACROS
+  #include <libavfilter/avfilter.h>
+}
+
+#include "DshowInput.h"
+#include "FileInput.h"
+#include "LavfiInput.h"
+#include "SpoolInput.h"
+#include "V4l2Input.h"
+
+#include <iostream>
+
+int InputBackend::PrintCapabilities(const InputRequest &request)
+{
+  /* nothing to ask a file or a graph, probing it tells the most */
+  AVFormatContext *ctx = NULL;
+  int ret = Open(request, &ctx);
+  if (ret < 0)
+  {
+    return ret;
+  }
+  if ((ret = avformat_find_stream_info(ctx, NULL)) >= 0)
+  {
+    av_dump_format(ctx, 0, ctx->filename, 0);
+  }
+  avformat_close_input(&ctx);
+  return ret;
+}
+
+int InputBackend::Open(const InputRequest &request, AVFormatContext **ctx)
+{
+  AVInputFormat *format = NULL;
+  AVDictionary *options = NULL;
+  std::string url;
+
+  int ret = BuildInput(request, &format, &url, &options);
+  if (ret < 0)
+  {
+    av_dict_free(&options);
+    return ret;
+  }
+  /* user options last so they override the backend's defaults */
+  if (!request.options.empty() && (ret = av_dict_parse_string(&options, request.options.c_str(), "=", ":", 0)) < 0)
+  {
+    av_log(NULL, AV_LOG_ERROR, "Cannot parse input options '%s'\n", request.options.c_str());
+    av_dict_free(&options);
+    return ret;
+  }
+
+  if ((ret = avformat_open_input(ctx, url.c_str(), format, &options)) < 0)
+  {
+    char buf[AV_ERROR_MAX_STRING_SIZE];
+    av_strerror(ret, buf, sizeof(buf));
+    av_log(NULL, AV_LOG_ERROR, "Cannot open %s input '%s' with error '%s'\n", Name(), url.c_str(), buf);
+  }
+  else
+  {
+    AVDictionaryEntry *unused = NULL;
+    while ((unused = av_dict_get(options, "", unused, AV_DICT_IGNORE_SUFFIX)))
+    {
+      av_log(NULL, AV_LOG_WARNING, "Input option '%s' was not used\n", unused->key);
+    }
+  }
+  av_dict_free(&options);
+  return ret;
+}
+
+std::string InputBackend::DeviceName(int index)
+{
+  std::vector<InputDevice> devices = ListDevices();
+  if (index < 0 || index >= (int)devices.size())
+  {
+    return std::string();
+  }
+  return devices[index].name;
+}
+
+void InputBackend::PrintDevices()
+{
+  if (!Capabilities().enumerable)
+  {
+    return;
+  }
+  std::vector<InputDevice> devices = ListDevices();
+  std::cout << "======== Device list: =========" << std::endl;
+  for (size_t i = 0; i < devices.size(); i++)
+  {
+    std::cout << "id: " << i << (devices[i].audio ? " audio" : " video") << " name: " << devices[i].name;
+    if (!devices[i].description.empty() && devices[i].description != devices[i].name)
+    {
+      std::cout << " (" << devices[i].description << ")";
+    }
+    std::cout << std::endl;
+  }
+  std::cout << std::endl;
+}
+
+InputBackend *InputBackend::Create(const std::string &name)
+{
+  /* device listing may run before any capture registered the demuxers */
+  av_register_all();
+  avfilter_register_all();
+  avdevice_register_all();
+
+  if (name == "dshow")
+  {
+    return new DshowInput();
+  }
+  if (name == "v4l2")
+  {
+    return new V4l2Input();
+  }
+  if (name == "file")
+  {
+    return new FileInput();
+  }
+  if (name == "lavfi")
+  {
+    return new LavfiInput();
+  }
+  if (name == "spool")
+  {
+    return new SpoolInput();
+  }
+  return NULL;
+}
+
+std::string InputBackend::DefaultName(const std::string &url, const std::string &format)
+{
+  if (format == "lavfi")
+  {
+    return "lavfi";
+  }
+  if (url.size() > 6 && url.compare(url.size() - 6, 6, ".spool") == 0)
+  {
+    return "spool";
+  }
+  if (!url.empty())
+  {
+    return "file";
+  }
+#ifdef _WIN32
+  return "dshow";
+#else
+  return "v4l2";
+#endif
+}
+
+int InputBackend::find_format(const char *name, AVInputFormat **format)
+{
+  *format = av_find_input_format(name);
+  if (!*format)
+  {
+    av_log(NULL, AV_LOG_ERROR, "Input format '%s' is not available in this FFmpeg build\n", name);
+    return AVERROR_DEMUXER_NOT_FOUND;
+  }
+  return 0;
+}
+
+void InputBackend::list_sources(const char *format_name, bool audio, std::vector<InputDevice> *devices)
+{
+  AVInputFormat *format = av_find_input_format(format_name);
+  AVDeviceInfoList *list = NULL;
+  if (!format || avdevice_list_input_sources(format, NULL, NULL, &list) < 0)
+  {
+    return;
+  }
+  for (int i = 0; i < list->nb_devices; i++)
+  {
+    InputDevice device;
+    device.name = list->devices[i]->device_name ? list->devices[i]->device_name : "";
+    device.description = list->devices[i]->device_description ? list->devices[i]->device_description : "";
+    device.audio = audio;
+    devices->push_back(device);
+  }
+  avdevice_free_list_devices(&list);
+}
+
+int InputBackend::print_device_options(const char *format_name, const std::string &url, const char *key, const char *value)
+{
+  AVInputFormat *format = NULL;
+  int ret = find_format(format_name, &format);
+  if (ret < 0)
+  {
+    return ret;
+  }
+
+  AVFormatContext *ctx = NULL;
+  AVDictionary *options = NULL;
+  av_dict_set(&options, key, value, 0);
+  /* the device logs its formats and refuses to open, which is expected */
+  ret = avformat_open_input(&ctx, url.c_str(), format, &options);
+  av_dict_free(&options);
+  if (ret >= 0)
+  {
+    avformat_close_input(&ctx);
+  }
+  return ret == AVERROR_EXIT ? 0 : ret;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+extern "C"
+{
+  #define __STDC_CONSTANT_MACROS
+  #include <libavdevice/avdevice.h>
+  #include <libavformat/avformat.h>
+}
+
+#include <string>
+#include <vector>
+#include "Noncopyable.h"
+
+struct InputDevice
+{
+  InputDevice()
+    : audio(false)
+  {
+  }
+
+  std::string name;         // what goes into the input url, e.g. /dev/video0 or a dshow friendly name
+  std::string description;  // human readable, may be empty
+  bool        audio;
+};
+
+struct InputCapabilities
+{
+  InputCapabilities()
+    : live(false)
+    , recorded(false)
+    , enumerable(false)
+    , video(false)
+    , audio(false)
+  {
+  }
+
+  bool live;        // runs in real time, arrival times can be trusted
+  bool recorded;    // packets carry the arrival time of an earlier capture in pos
+  bool enumerable;  // ListDevices() returns something
+  bool video;       // can deliver a video stream
+  bool audio;       // can deliver an audio stream
+};
+
+// What the user asked to capture. Device backends use the device names,
+// file and lavfi backends the url.
+struct InputRequest
+{
+  std::string video_device;
+  std::string audio_device;
+  std::string url;
+  std::string format;   // forced demuxer, e.g. matroska, empty probes
+  std::string options;  // demuxer/device options as key=value:key=value
+};
+
+// One kind of input: a capture API, local files or synthetic lavfi sources.
+// Backends enumerate their devices and turn an InputRequest into the demuxer,
+// url and options given to avformat_open_input().
+class InputBackend : Noncopyable
+{
+public:
+  virtual ~InputBackend() {}
+
+  virtual const char *Name() const = 0;
+  virtual InputCapabilities Capabilities() const = 0;
+  // video devices first, then audio ones; -v and -a index this list
+  virtual std::vector<InputDevice> ListDevices() { return std::vector<InputDevice>(); }
+  virtual int BuildInput(const InputRequest &request, AVInputFormat **format, std::string *url, AVDictionary **options) = 0;
+  // logs the pixel formats, frame sizes and rates the requested devices offer
+  virtual int PrintCapabilities(const InputRequest &request);
+
+  // opens *ctx (allocated or NULL) with the backend's input plus request.options
+  int Open(const InputRequest &request, AVFormatContext **ctx);
+  std::string DeviceName(int index);
+  void PrintDevices();
+
+  // dshow, v4l2, file, lavfi or spool; NULL for an unknown name
+  static InputBackend *Create(const std::string &name);
+  // spool, file or lavfi when an url is given, the platform's capture API otherwise
+  static std::string DefaultName(const std::string &url, const std::string &format);
+
+protected:
+  static int find_format(const char *name, AVInputFormat **format);
+  // appends the sources libavdevice reports for one device demuxer
+  static void list_sources(const char *format_name, bool audio, std::vector<InputDevice> *devices);
+  // opens a device with an option that makes it log what it offers and bail out
+  static int print_device_options(const char *format_name, const std::string &url, const char *key, const char *value);
+};
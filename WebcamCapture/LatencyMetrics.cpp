@@ -0,0 +1,471 @@
+#include "LatencyMetrics.h"
+#include "OutputMuxer.h"
+
+#include <stdio.h>
+#include <chrono>
+#include <iomanip>
+#include <sstream>
+
+LatencyHistogram::LatencyHistogram()
+  : count_(0)
+  , sum_(0)
+  , max_(0)
+{
+  for (int i = 0; i < BUCKETS; i++)
+  {
+    buckets_[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+void LatencyHistogram::Record(int64_t us)
+{
+  if (us < 0)
+  {
+    us = 0;
+  }
+  buckets_[bucket(us)].fetch_add(1, std::memory_order_relaxed);
+  count_.fetch_add(1, std::memory_order_relaxed);
+  sum_.fetch_add(us, std::memory_order_relaxed);
+  int64_t max = max_.load(std::memory_order_relaxed);
+  while (us > max && !max_.compare_exchange_weak(max, us, std::memory_order_relaxed))
+  {
+  }
+}
+
+int64_t LatencyHistogram::Percentile(double q) const
+{
+  uint64_t count = Count();
+  if (!count)
+  {
+    return 0;
+  }
+  uint64_t target = (uint64_t)(q * count + 0.999999);
+  uint64_t seen = 0;
+  for (int i = 0; i < BUCKETS; i++)
+  {
+    seen += buckets_[i].load(std::memory_order_relaxed);
+    if (seen >= target)
+    {
+      return FFMIN(upper_bound(i), Max());
+    }
+  }
+  return Max();
+}
+
+int LatencyHistogram::bucket(int64_t us)
+{
+  if (us < 4)
+  {
+    return (int)us;
+  }
+  /* 4 + 4 * (octave - 2) + the two bits below the leading one */
+  int octave = 2;
+  while (octave < 62 && (us >> (octave + 1)))
+  {
+    octave++;
+  }
+  int index = 4 + 4 * (octave - 2) + (int)((us >> (octave - 2)) & 3);
+  return FFMIN(index, BUCKETS - 1);
+}
+
+int64_t LatencyHistogram::upper_bound(int index)
+{
+  if (index < 4)
+  {
+    return index;
+  }
+  int octave = 2 + (index - 4) / 4;
+  int64_t sub = (index - 4) % 4;
+  return ((4 + sub + 1) << (octave - 2)) - 1;
+}
+
+LatencyMetrics::LatencyMetrics(unsigned int nb_streams, const MetricsOptions &options)
+  : options_(options)
+  , nb_streams_(nb_streams)
+  , types_(nb_streams, AVMEDIA_TYPE_UNKNOWN)
+  , encoder_tags_(nb_streams)
+  , start_us_(Now())
+  , last_counts_(nb_streams * STAGE_MAX, 0)
+  , last_export_us_(start_us_)
+  , exporter_(NULL)
+  , stopping_(false)
+{
+  for (unsigned int i = 0; i < nb_streams * STAGE_MAX; i++)
+  {
+    StageCounters *counters = new StageCounters;
+    counters->bytes.store(0, std::memory_order_relaxed);
+    stages_.push_back(counters);
+  }
+  if (options_.interval_ms <= 0)
+  {
+    options_.interval_ms = 1000;
+  }
+}
+
+LatencyMetrics::~LatencyMetrics()
+{
+  Stop();
+  for (size_t i = 0; i < stages_.size(); i++)
+  {
+    delete stages_[i];
+  }
+}
+
+void LatencyMetrics::SetStreamType(unsigned int stream_index, AVMediaType type)
+{
+  if (stream_index < nb_streams_)
+  {
+    types_[stream_index] = type;
+  }
+}
+
+void LatencyMetrics::Record(stage s, unsigned int stream_index, int64_t us, int64_t bytes)
+{
+  if (stream_index >= nb_streams_)
+  {
+    return;
+  }
+  StageCounters *counters = stages_[stream_index * STAGE_MAX + s];
+  counters->latency.Record(us);
+  if (bytes > 0)
+  {
+    counters->bytes.fetch_add(bytes, std::memory_order_relaxed);
+  }
+}
+
+void LatencyMetrics::TagEncoderInput(unsigned int stream_index, int64_t pts, int64_t arrival)
+{
+  if (stream_index >= nb_streams_ || pts == AV_NOPTS_VALUE || arrival <= 0)
+  {
+    return;
+  }
+  std::deque<EncoderTag> &tags = encoder_tags_[stream_index];
+  EncoderTag tag = { pts, arrival };
+  tags.push_back(tag);
+  /* frames an encoder dropped must not pile up */
+  if (tags.size() > 512)
+  {
+    tags.pop_front();
+  }
+}
+
+int64_t LatencyMetrics::TakeEncoderTag(unsigned int stream_index, int64_t pts)
+{
+  if (stream_index >= nb_streams_ || pts == AV_NOPTS_VALUE)
+  {
+    return -1;
+  }
+  std::deque<EncoderTag> &tags = encoder_tags_[stream_index];
+  /* reordered video comes back with the pts it went in with */
+  for (std::deque<EncoderTag>::iterator it = tags.begin(); it != tags.end(); ++it)
+  {
+    if (it->pts == pts)
+    {
+      int64_t arrival = it->arrival;
+      tags.erase(it);
+      return arrival;
+    }
+  }
+  /* audio encoders shift pts by their priming delay: take the newest frame not after the packet */
+  int64_t arrival = -1;
+  while (!tags.empty() && tags.front().pts <= pts)
+  {
+    arrival = tags.front().arrival;
+    tags.pop_front();
+  }
+  return arrival;
+}
+
+void LatencyMetrics::SetQueueDepth(const std::string &name, size_t depth, size_t capacity)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (size_t i = 0; i < queues_.size(); i++)
+  {
+    if (queues_[i].name == name)
+    {
+      queues_[i].depth = depth;
+      queues_[i].capacity = capacity;
+      return;
+    }
+  }
+  QueueDepth queue;
+  queue.name = name;
+  queue.depth = depth;
+  queue.capacity = capacity;
+  queues_.push_back(queue);
+}
+
+void LatencyMetrics::SetGauge(const std::string &name, double value)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (size_t i = 0; i < gauges_.size(); i++)
+  {
+    if (gauges_[i].first == name)
+    {
+      gauges_[i].second = value;
+      return;
+    }
+  }
+  gauges_.push_back(std::make_pair(name, value));
+}
+
+void LatencyMetrics::Start(const sampler_type &sampler)
+{
+  if (exporter_ || !options_.Enabled())
+  {
+    return;
+  }
+  sampler_ = sampler;
+  stopping_ = false;
+  exporter_ = new std::thread(&LatencyMetrics::export_loop, this);
+}
+
+void LatencyMetrics::Stop()
+{
+  if (!exporter_)
+  {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  cond_.notify_all();
+  exporter_->join();
+  delete exporter_;
+  exporter_ = NULL;
+  /* the sampler looks at queues that are about to go away */
+  sampler_ = sampler_type();
+}
+
+void LatencyMetrics::export_loop()
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stopping_)
+  {
+    cond_.wait_for(lock, std::chrono::milliseconds(options_.interval_ms));
+    if (stopping_)
+    {
+      break;
+    }
+    lock.unlock();
+    if (sampler_)
+    {
+      sampler_(this);
+    }
+    Export();
+    lock.lock();
+  }
+}
+
+int LatencyMetrics::Export()
+{
+  if (!options_.Enabled())
+  {
+    return 0;
+  }
+  int64_t now = Now();
+  double elapsed_sec = (now - last_export_us_) / 1000000.0;
+  last_export_us_ = now;
+  std::string text = options_.format == MetricsOptions::JSON ? json_text(elapsed_sec) : prometheus_text();
+
+  if (OutputMuxer::WriteFileAtomically(options_.path, text) < 0)
+  {
+    av_log(NULL, AV_LOG_WARNING, "Cannot write metrics to '%s'\n", options_.path.c_str());
+    return AVERROR(EIO);
+  }
+  return 0;
+}
+
+std::string LatencyMetrics::prometheus_text() const
+{
+  static const double quantiles[] = { 0.5, 0.99 };
+  std::ostringstream out;
+  out << std::setprecision(9);
+
+  out << "# HELP webcam_stage_latency_seconds Time spent in one pipeline stage per packet or frame.\n"
+         "# TYPE webcam_stage_latency_seconds summary\n";
+  for (unsigned int i = 0; i < nb_streams_; i++)
+  {
+    for (int s = 0; s < STAGE_MAX; s++)
+    {
+      const LatencyHistogram &latency = stages_[i * STAGE_MAX + s]->latency;
+      if (!latency.Count())
+      {
+        continue;
+      }
+      std::ostringstream labels;
+      labels << "stage=\"" << StageName((stage)s) << "\",stream=\"" << i << "\",type=\"" << stream_type(i) << "\"";
+      for (int q = 0; q < 2; q++)
+      {
+        out << "webcam_stage_latency_seconds{" << labels.str() << ",quantile=\"" << quantiles[q] << "\"} "
+            << latency.Percentile(quantiles[q]) / 1000000.0 << "\n";
+      }
+      out << "webcam_stage_latency_seconds_sum{" << labels.str() << "} " << latency.Sum() / 1000000.0 << "\n";
+      out << "webcam_stage_latency_seconds_count{" << labels.str() << "} " << latency.Count() << "\n";
+    }
+  }
+
+  out << "# HELP webcam_stage_latency_max_seconds Slowest packet or frame of a stage since the start.\n"
+         "# TYPE webcam_stage_latency_max_seconds gauge\n";
+  for (unsigned int i = 0; i < nb_streams_; i++)
+  {
+    for (int s = 0; s < STAGE_MAX; s++)
+    {
+      const LatencyHistogram &latency = stages_[i * STAGE_MAX + s]->latency;
+      if (latency.Count())
+      {
+        out << "webcam_stage_latency_max_seconds{stage=\"" << StageName((stage)s) << "\",stream=\"" << i
+            << "\",type=\"" << stream_type(i) << "\"} " << latency.Max() / 1000000.0 << "\n";
+      }
+    }
+  }
+
+  out << "# HELP webcam_stage_bytes_total Payload bytes through a stage.\n"
+         "# TYPE webcam_stage_bytes_total counter\n";
+  for (unsigned int i = 0; i < nb_streams_; i++)
+  {
+    for (int s = 0; s < STAGE_MAX; s++)
+    {
+      uint64_t bytes = stages_[i * STAGE_MAX + s]->bytes.load(std::memory_order_relaxed);
+      if (bytes)
+      {
+        out << "webcam_stage_bytes_total{stage=\"" << StageName((stage)s) << "\",stream=\"" << i
+            << "\",type=\"" << stream_type(i) << "\"} " << bytes << "\n";
+      }
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    out << "# HELP webcam_queue_depth Items waiting in a pipeline queue.\n"
+           "# TYPE webcam_queue_depth gauge\n";
+    for (size_t i = 0; i < queues_.size(); i++)
+    {
+      out << "webcam_queue_depth{queue=\"" << queues_[i].name << "\"} " << queues_[i].depth << "\n";
+    }
+    out << "# HELP webcam_queue_capacity Size of a pipeline queue.\n"
+           "# TYPE webcam_queue_capacity gauge\n";
+    for (size_t i = 0; i < queues_.size(); i++)
+    {
+      out << "webcam_queue_capacity{queue=\"" << queues_[i].name << "\"} " << queues_[i].capacity << "\n";
+    }
+    for (size_t i = 0; i < gauges_.size(); i++)
+    {
+      out << "# TYPE webcam_" << gauges_[i].first << " gauge\n"
+          << "webcam_" << gauges_[i].first << " " << gauges_[i].second << "\n";
+    }
+  }
+
+  out << "# HELP webcam_uptime_seconds Time since the pipeline started.\n"
+         "# TYPE webcam_uptime_seconds gauge\n"
+         "webcam_uptime_seconds " << (Now() - start_us_) / 1000000.0 << "\n";
+  return out.str();
+}
+
+std::string LatencyMetrics::json_text(double elapsed_sec)
+{
+  std::ostringstream out;
+  out << std::fixed << std::setprecision(3);
+  out << "{\n  \"uptime_sec\": " << (Now() - start_us_) / 1000000.0 << ",\n  \"stages\": [";
+
+  bool first = true;
+  for (unsigned int i = 0; i < nb_streams_; i++)
+  {
+    for (int s = 0; s < STAGE_MAX; s++)
+    {
+      const StageCounters *counters = stages_[i * STAGE_MAX + s];
+      uint64_t count = counters->latency.Count();
+      if (!count)
+      {
+        continue;
+      }
+      uint64_t &last = last_counts_[i * STAGE_MAX + s];
+      double per_sec = elapsed_sec > 0 ? (count - last) / elapsed_sec : 0;
+      last = count;
+
+      out << (first ? "\n" : ",\n") << "    { \"stage\": \"" << StageName((stage)s) << "\", \"stream\": " << i
+          << ", \"type\": \"" << stream_type(i) << "\", \"count\": " << count
+          << ", \"per_sec\": " << per_sec
+          << ", \"bytes\": " << counters->bytes.load(std::memory_order_relaxed)
+          << ", \"mean_ms\": " << counters->latency.Sum() / 1000.0 / count
+          << ", \"p50_ms\": " << counters->latency.Percentile(0.5) / 1000.0
+          << ", \"p99_ms\": " << counters->latency.Percentile(0.99) / 1000.0
+          << ", \"max_ms\": " << counters->latency.Max() / 1000.0 << " }";
+      first = false;
+    }
+  }
+
+  out << "\n  ],\n  \"queues\": [";
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i < queues_.size(); i++)
+    {
+      out << (i ? ",\n" : "\n") << "    { \"name\": \"" << queues_[i].name << "\", \"depth\": " << queues_[i].depth
+          << ", \"capacity\": " << queues_[i].capacity << " }";
+    }
+    out << "\n  ],\n  \"gauges\": {";
+    for (size_t i = 0; i < gauges_.size(); i++)
+    {
+      out << (i ? ",\n" : "\n") << "    \"" << gauges_[i].first << "\": " << gauges_[i].second;
+    }
+  }
+  out << "\n  }\n}\n";
+  return out.str();
+}
+
+void LatencyMetrics::PrintStats(int level) const
+{
+  for (unsigned int i = 0; i < nb_streams_; i++)
+  {
+    for (int s = 0; s < STAGE_MAX; s++)
+    {
+      const LatencyHistogram &latency = stages_[i * STAGE_MAX + s]->latency;
+      if (!latency.Count())
+      {
+        continue;
+      }
+      av_log(NULL, level, "Latency #%u %-10s %8llu items, p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+        i, StageName((stage)s), (unsigned long long)latency.Count(),
+        latency.Percentile(0.5) / 1000.0, latency.Percentile(0.99) / 1000.0, latency.Max() / 1000.0);
+    }
+  }
+}
+
+bool LatencyMetrics::ParseFormat(const std::string &name, MetricsOptions::file_format *format)
+{
+  if (name == "prometheus")
+  {
+    *format = MetricsOptions::PROMETHEUS;
+  }
+  else if (name == "json")
+  {
+    *format = MetricsOptions::JSON;
+  }
+  else
+  {
+    return false;
+  }
+  return true;
+}
+
+const char *LatencyMetrics::StageName(stage s)
+{
+  switch (s)
+  {
+  case READ:       return "read";
+  case QUEUE:      return "queue";
+  case DECODE:     return "decode";
+  case FILTER:     return "filter";
+  case ENCODE:     return "encode";
+  case MUX:        return "mux";
+  case END_TO_END: return "end_to_end";
+  default:         return "unknown";
+  }
+}
+
+const char *LatencyMetrics::stream_type(unsigned int stream_index) const
+{
+  const char *name = av_get_media_type_string(types_[stream_index]);
+  return name ? name : "unknown";
+}
@@ -0,0 +1,160 @@
+#pragma once
+
+extern "C"
+{
+  #define __STDC_CONSTANT_MACROS
+  #include <libavutil/avutil.h>
+  #include <libavutil/time.h>
+}
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "Noncopyable.h"
+
+struct MetricsOptions
+{
+  enum file_format
+  {
+    PROMETHEUS,  // text exposition format, e.g. for the node exporter textfile collector
+    JSON
+  };
+
+  MetricsOptions()
+    : interval_ms(1000)
+    , format(PROMETHEUS)
+  {
+  }
+
+  bool Enabled() const { return !path.empty(); }
+
+  std::string path;         // rewritten atomically every interval, empty writes no file
+  int         interval_ms;
+  file_format format;
+};
+
+// Lock-free latency histogram: four buckets per power of two of microseconds,
+// so percentiles are within 25% and recording is one atomic increment.
+class LatencyHistogram : Noncopyable
+{
+public:
+  enum { BUCKETS = 144 };
+
+  LatencyHistogram();
+
+  void Record(int64_t us);
+  uint64_t Count() const { return count_.load(std::memory_order_relaxed); }
+  int64_t Sum() const { return sum_.load(std::memory_order_relaxed); }
+  int64_t Max() const { return max_.load(std::memory_order_relaxed); }
+  // upper bound of the bucket holding the q-th sample, 0 < q <= 1
+  int64_t Percentile(double q) const;
+
+private:
+  static int bucket(int64_t us);
+  static int64_t upper_bound(int index);
+
+private:
+  std::atomic<uint64_t> buckets_[BUCKETS];
+  std::atomic<uint64_t> count_;
+  std::atomic<int64_t>  sum_;
+  std::atomic<int64_t>  max_;
+};
+
+// Per-stage, per-stream latency histograms and throughput counters of the
+// capture pipeline, plus queue depths sampled when exporting. Each pipeline
+// thread records its own stages; an exporter thread rewrites the metrics file.
+//
+// Packets carry their arrival time (Now() after av_read_frame) in
+// AVPacket.pos and decoded frames in pkt_pos, so the end-to-end latency of a
+// muxed packet is known without side tables. When the instrumentation is
+// disabled WebcamCapture has no LatencyMetrics and pays one NULL check per stage.
+class LatencyMetrics : Noncopyable
+{
+public:
+  enum stage
+  {
+    READ,         // av_read_frame
+    QUEUE,        // arrival until the processing thread picks the packet up
+    DECODE,
+    FILTER,       // buffersrc add plus buffersink gets for one decoded frame
+    ENCODE,
+    MUX,          // writing one packet to the output
+    END_TO_END,   // arrival until the packet is written
+    STAGE_MAX
+  };
+
+  typedef std::function<void(LatencyMetrics *metrics)> sampler_type;
+
+  LatencyMetrics(unsigned int nb_streams, const MetricsOptions &options);
+  ~LatencyMetrics();
+
+  static int64_t Now() { return av_gettime_relative(); }
+
+  void SetStreamType(unsigned int stream_index, AVMediaType type);
+  void Record(stage s, unsigned int stream_index, int64_t us, int64_t bytes = 0);
+  const LatencyHistogram &Histogram(stage s, unsigned int stream_index) const { return stages_[stream_index * STAGE_MAX + s]->latency; }
+  // encoder threads: remember the arrival of a frame by pts, and find it again for an encoded packet
+  void TagEncoderInput(unsigned int stream_index, int64_t pts, int64_t arrival);
+  int64_t TakeEncoderTag(unsigned int stream_index, int64_t pts);
+  // called by the sampler
+  void SetQueueDepth(const std::string &name, size_t depth, size_t capacity);
+  // any other sampled value, exported as webcam_<name>
+  void SetGauge(const std::string &name, double value);
+
+  // exports every interval_ms on a thread of its own until Stop(); no-ops without a path
+  void Start(const sampler_type &sampler);
+  void Stop();
+  int Export();
+  void PrintStats(int level) const;
+
+  static bool ParseFormat(const std::string &name, MetricsOptions::file_format *format);
+  static const char *StageName(stage s);
+
+private:
+  void export_loop();
+  std::string prometheus_text() const;
+  std::string json_text(double elapsed_sec);
+  const char *stream_type(unsigned int stream_index) const;
+
+private:
+  struct StageCounters
+  {
+    LatencyHistogram      latency;
+    std::atomic<uint64_t> bytes;
+  };
+  struct QueueDepth
+  {
+    std::string name;
+    size_t      depth;
+    size_t      capacity;
+  };
+  struct EncoderTag
+  {
+    int64_t pts;
+    int64_t arrival;
+  };
+
+  MetricsOptions options_;
+  unsigned int nb_streams_;
+  std::vector<StageCounters*> stages_;        /* STAGE_MAX per stream */
+  std::vector<AVMediaType> types_;
+  std::vector<std::deque<EncoderTag> > encoder_tags_;  /* each touched by one encoder thread only */
+  int64_t start_us_;
+
+  mutable std::mutex mutex_;
+  std::vector<QueueDepth> queues_;
+  std::vector<std::pair<std::string, double> > gauges_;
+  std::vector<uint64_t> last_counts_;         /* exporter thread, for the per second rates */
+  int64_t last_export_us_;
+
+  sampler_type sampler_;
+  std::thread *exporter_;
+  std::condition_variable cond_;
+  bool stopping_;
+};
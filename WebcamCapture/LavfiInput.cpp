@@ -0,0 +1,17 @@
+#include "LavfiInput.h"
+
+static const char *DEFAULT_GRAPH = "testsrc=size=640x480:rate=30[out0];sine=frequency=1000:sample_rate=48000[out1]";
+
+InputCapabilities LavfiInput::Capabilities() const
+{
+  InputCapabilities caps;
+  caps.video = true;
+  caps.audio = true;
+  return caps;
+}
+
+int LavfiInput::BuildInput(const InputRequest &request, AVInputFormat **format, std::string *url, AVDictionary **options)
+{
+  *url = request.url.empty() ? DEFAULT_GRAPH : request.url;
+  return find_format("lavfi", format);
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "InputBackend.h"
+
+// Synthetic sources from a libavfilter graph, e.g. testsrc and sine, for
+// testing and benchmarking without a camera. Outputs are named out0, out1...
+class LavfiInput : public InputBackend
+{
+public:
+  const char *Name() const { return "lavfi"; }
+  InputCapabilities Capabilities() const;
+  int BuildInput(const InputRequest &request, AVInputFormat **format, std::string *url, AVDictionary **options);
+};
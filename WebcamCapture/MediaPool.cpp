@@ -0,0 +1,279 @@
+#include "MediaPool.h"
+
+extern "C"
+{
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+}
+
+/* decoders may read and write past the aligned picture, see get_buffer2 docs */
+static const int BUFFER_PADDING = 16 + 64 - 1;
+
+/* AVBufferPool in this FFmpeg version has no opaque for its allocator,
+ * so misses are counted process-wide */
+std::atomic<uint64_t> MediaPool::buffer_misses_(0);
+
+MediaPool::MediaPool(size_t max_cached)
+  : max_cached_(max_cached)
+  , buffer_format_(-1)
+  , buffer_width_(0)
+  , buffer_height_(0)
+  , frame_hits_(0)
+  , frame_misses_(0)
+  , packet_hits_(0)
+  , packet_misses_(0)
+  , buffer_gets_(0)
+  , last_misses_(0)
+  , last_report_(std::chrono::steady_clock::now())
+{
+  frames_.reserve(max_cached_);
+  packets_.reserve(max_cached_);
+  for (int i = 0; i < 4; i++)
+  {
+    buffer_pools_[i] = NULL;
+    buffer_linesize_[i] = 0;
+  }
+}
+
+MediaPool::~MediaPool()
+{
+  for (size_t i = 0; i < frames_.size(); i++)
+  {
+    av_frame_free(&frames_[i]);
+  }
+  for (size_t i = 0; i < packets_.size(); i++)
+  {
+    av_packet_free(&packets_[i]);
+  }
+  /* buffers still referenced elsewhere keep their pool alive until released */
+  for (int i = 0; i < 4; i++)
+  {
+    av_buffer_pool_uninit(&buffer_pools_[i]);
+  }
+}
+
+AVFrame *MediaPool::AcquireFrame()
+{
+  {
+    std::lock_guard<std::mutex> lock(frame_mutex_);
+    if (!frames_.empty())
+    {
+      AVFrame *frame = frames_.back();
+      frames_.pop_back();
+      ++frame_hits_;
+      return frame;
+    }
+  }
+  ++frame_misses_;
+  return av_frame_alloc();
+}
+
+AVPacket *MediaPool::AcquirePacket()
+{
+  {
+    std::lock_guard<std::mutex> lock(packet_mutex_);
+    if (!packets_.empty())
+    {
+      AVPacket *packet = packets_.back();
+      packets_.pop_back();
+      ++packet_hits_;
+      return packet;
+    }
+  }
+  ++packet_misses_;
+  return av_packet_alloc();
+}
+
+void MediaPool::ReleaseFrame(AVFrame **frame)
+{
+  if (!frame || !*frame)
+  {
+    return;
+  }
+  av_frame_unref(*frame);
+  {
+    std::lock_guard<std::mutex> lock(frame_mutex_);
+    if (frames_.size() < max_cached_)
+    {
+      frames_.push_back(*frame);
+      *frame = NULL;
+      return;
+    }
+  }
+  av_frame_free(frame);
+}
+
+void MediaPool::ReleasePacket(AVPacket **packet)
+{
+  if (!packet || !*packet)
+  {
+    return;
+  }
+  av_packet_unref(*packet);
+  {
+    std::lock_guard<std::mutex> lock(packet_mutex_);
+    if (packets_.size() < max_cached_)
+    {
+      packets_.push_back(*packet);
+      *packet = NULL;
+      return;
+    }
+  }
+  av_packet_free(packet);
+}
+
+void MediaPool::AttachDecoder(AVCodecContext *dec_ctx)
+{
+  if (dec_ctx->codec_type != AVMEDIA_TYPE_VIDEO)
+  {
+    return;
+  }
+  dec_ctx->opaque = this;
+  dec_ctx->get_buffer2 = get_buffer2;
+  /* safe from any thread, frame threads need not wait for the decoding thread to allocate */
+  dec_ctx->thread_safe_callbacks = 1;
+}
+
+MediaPool::Stats MediaPool::GetStats() const
+{
+  Stats stats;
+  stats.frame_hits    = frame_hits_.load();
+  stats.frame_misses  = frame_misses_.load();
+  stats.packet_hits   = packet_hits_.load();
+  stats.packet_misses = packet_misses_.load();
+  stats.buffer_misses = buffer_misses_.load();
+  uint64_t gets = buffer_gets_.load();
+  stats.buffer_hits   = gets > stats.buffer_misses ? gets - stats.buffer_misses : 0;
+  return stats;
+}
+
+void MediaPool::PrintStats(int level)
+{
+  Stats stats = GetStats();
+  uint64_t misses = stats.frame_misses + stats.packet_misses + stats.buffer_misses;
+  auto now = std::chrono::steady_clock::now();
+  double seconds = std::chrono::duration_cast<std::chrono::duration<double> >(now - last_report_).count();
+  double rate = seconds > 0 ? (misses - last_misses_) / seconds : 0;
+  last_misses_ = misses;
+  last_report_ = now;
+
+  av_log(NULL, level, "Media pool: frames %llu hit/%llu miss, packets %llu hit/%llu miss, "
+    "buffers %llu hit/%llu miss, %.1f allocations/s\n",
+    (unsigned long long)stats.frame_hits, (unsigned long long)stats.frame_misses,
+    (unsigned long long)stats.packet_hits, (unsigned long long)stats.packet_misses,
+    (unsigned long long)stats.buffer_hits, (unsigned long long)stats.buffer_misses,
+    rate);
+}
+
+int MediaPool::get_buffer2(AVCodecContext *ctx, AVFrame *frame, int flags)
+{
+  MediaPool *pool = static_cast<MediaPool*>(ctx->opaque);
+  const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+
+  /* paletted and hardware formats keep the default allocator */
+  if (!pool || !desc || !(ctx->codec->capabilities & AV_CODEC_CAP_DR1) ||
+    (desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_PSEUDOPAL | AV_PIX_FMT_FLAG_HWACCEL)))
+  {
+    return avcodec_default_get_buffer2(ctx, frame, flags);
+  }
+  return pool->get_video_buffer(ctx, frame);
+}
+
+AVBufferRef *MediaPool::alloc_buffer(int size)
+{
+  ++buffer_misses_;
+  return av_buffer_allocz(size);
+}
+
+int MediaPool::get_video_buffer(AVCodecContext *ctx, AVFrame *frame)
+{
+  std::lock_guard<std::mutex> lock(buffer_mutex_);
+  int ret = 0;
+
+  if (frame->format != buffer_format_ || frame->width != buffer_width_ || frame->height != buffer_height_)
+  {
+    if ((ret = reset_buffer_pools(ctx, frame)) < 0)
+    {
+      return ret;
+    }
+  }
+
+  for (int i = 0; i < 4 && buffer_pools_[i]; i++)
+  {
+    frame->buf[i] = av_buffer_pool_get(buffer_pools_[i]);
+    if (!frame->buf[i])
+    {
+      av_frame_unref(frame);
+      return AVERROR(ENOMEM);
+    }
+    ++buffer_gets_;
+    frame->data[i] = frame->buf[i]->data;
+    frame->linesize[i] = buffer_linesize_[i];
+  }
+  frame->extended_data = frame->data;
+  return 0;
+}
+
+int MediaPool::reset_buffer_pools(AVCodecContext *ctx, AVFrame *frame)
+{
+  AVPixelFormat format = (AVPixelFormat)frame->format;
+  int w = frame->width;
+  int h = frame->height;
+  int linesize_align[AV_NUM_DATA_POINTERS];
+  int linesize[4];
+  uint8_t *data[4];
+  int plane_size[4] = { 0 };
+  int unaligned;
+  int ret;
+  int i;
+
+  for (i = 0; i < 4; i++)
+  {
+    av_buffer_pool_uninit(&buffer_pools_[i]);
+    buffer_linesize_[i] = 0;
+  }
+  buffer_format_ = -1;
+
+  /* same layout rules as avcodec_default_get_buffer2() */
+  avcodec_align_dimensions2(ctx, &w, &h, linesize_align);
+  do
+  {
+    if ((ret = av_image_fill_linesizes(linesize, format, w)) < 0)
+    {
+      return ret;
+    }
+    /* increase alignment of w for next try (rhs gives the lowest bit set in w) */
+    w += w & ~(w - 1);
+    unaligned = 0;
+    for (i = 0; i < 4; i++)
+    {
+      unaligned |= linesize[i] % linesize_align[i];
+    }
+  } while (unaligned);
+
+  int size = av_image_fill_pointers(data, format, h, NULL, linesize);
+  if (size < 0)
+  {
+    return size;
+  }
+  for (i = 0; i < 3 && data[i + 1]; i++)
+  {
+    plane_size[i] = (int)(data[i + 1] - data[i]);
+  }
+  plane_size[i] = (int)(size - (data[i] - data[0]));
+
+  for (i = 0; i < 4 && plane_size[i]; i++)
+  {
+    buffer_pools_[i] = av_buffer_pool_init(plane_size[i] + BUFFER_PADDING, alloc_buffer);
+    if (!buffer_pools_[i])
+    {
+      return AVERROR(ENOMEM);
+    }
+    buffer_linesize_[i] = linesize[i];
+  }
+
+  buffer_format_ = frame->format;
+  buffer_width_  = frame->width;
+  buffer_height_ = frame->height;
+  return 0;
+}
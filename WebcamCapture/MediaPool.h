@@ -0,0 +1,79 @@
+#pragma once
+
+extern "C"
+{
+  #define __STDC_CONSTANT_MACROS
+  #include <libavcodec/avcodec.h>
+  #include <libavutil/buffer.h>
+}
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include "Noncopyable.h"
+
+// Recycles AVFrame/AVPacket shells between the pipeline threads and serves
+// decoder picture buffers from AVBufferPools, so the steady-state capture loop
+// does not touch the heap. Safe to use from any thread.
+class MediaPool : Noncopyable
+{
+public:
+  struct Stats
+  {
+    uint64_t frame_hits;
+    uint64_t frame_misses;
+    uint64_t packet_hits;
+    uint64_t packet_misses;
+    uint64_t buffer_hits;
+    uint64_t buffer_misses;
+  };
+
+  explicit MediaPool(size_t max_cached = 256);
+  ~MediaPool();
+
+  // unreferenced, ready-to-use objects
+  AVFrame *AcquireFrame();
+  AVPacket *AcquirePacket();
+  // drop the references and keep the shell; NULL is ignored, *object is reset like av_*_free()
+  void ReleaseFrame(AVFrame **frame);
+  void ReleasePacket(AVPacket **packet);
+
+  // route the video decoder's get_buffer2 through the pool
+  void AttachDecoder(AVCodecContext *dec_ctx);
+
+  Stats GetStats() const;
+  // cumulative counters plus heap allocations per second since the previous call
+  void PrintStats(int level);
+
+private:
+  static int get_buffer2(AVCodecContext *ctx, AVFrame *frame, int flags);
+  static AVBufferRef *alloc_buffer(int size);
+  int get_video_buffer(AVCodecContext *ctx, AVFrame *frame);
+  int reset_buffer_pools(AVCodecContext *ctx, AVFrame *frame);
+
+private:
+  static std::atomic<uint64_t> buffer_misses_;
+
+  size_t max_cached_;
+  std::mutex frame_mutex_;
+  std::vector<AVFrame*> frames_;
+  std::mutex packet_mutex_;
+  std::vector<AVPacket*> packets_;
+
+  std::mutex buffer_mutex_;
+  AVBufferPool *buffer_pools_[4];
+  int buffer_linesize_[4];
+  int buffer_format_;
+  int buffer_width_;
+  int buffer_height_;
+
+  std::atomic<uint64_t> frame_hits_;
+  std::atomic<uint64_t> frame_misses_;
+  std::atomic<uint64_t> packet_hits_;
+  std::atomic<uint64_t> packet_misses_;
+  std::atomic<uint64_t> buffer_gets_;
+
+  uint64_t last_misses_;
+  std::chrono::steady_clock::time_point last_report_;
+};
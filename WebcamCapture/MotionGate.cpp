@@ -0,0 +1,382 @@
+#include "MotionGate.h"
+#include "LatencyMetrics.h"
+
+extern "C"
+{
+  #include <libavutil/cpu.h>
+}
+
+#include <cstdio>
+#include <cstdlib>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define MOTION_GATE_X86 1
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__)
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#else
+#define TARGET_SSE2
+#endif
+
+static const int BLOCK = 8;
+
+bool MotionOptions::ParseMasks(const std::string &spec, std::vector<MotionRegion> *masks)
+{
+  size_t start = 0;
+  while (start < spec.size())
+  {
+    size_t end = spec.find('|', start);
+    if (end == std::string::npos)
+    {
+      end = spec.size();
+    }
+    std::string entry = spec.substr(start, end - start);
+    start = end + 1;
+    if (entry.empty())
+    {
+      continue;
+    }
+
+    MotionRegion region;
+    if (sscanf(entry.c_str(), "%lf,%lf,%lf,%lf", &region.x, &region.y, &region.w, &region.h) != 4 ||
+      region.w <= 0 || region.h <= 0)
+    {
+      return false;
+    }
+    masks->push_back(region);
+  }
+  return true;
+}
+
+/* where the luma samples of one row are: every step-th byte from offset */
+static void luma_layout(int format, int *step, int *offset)
+{
+  *step = 1;
+  *offset = 0;
+  if (format == AV_PIX_FMT_YUYV422)
+  {
+    *step = 2;
+  }
+  else if (format == AV_PIX_FMT_UYVY422)
+  {
+    *step = 2;
+    *offset = 1;
+  }
+}
+
+static int count_bits(unsigned int value)
+{
+  int bits = 0;
+  for (; value; value &= value - 1)
+  {
+    bits++;
+  }
+  return bits;
+}
+
+/* mean of each 8x8 block of one row of blocks, rows[] are the block's 8 source rows */
+static void block_means_c(const uint8_t *const rows[BLOCK], int step, int offset, uint8_t *out, int first, int blocks)
+{
+  for (int b = first; b < blocks; b++)
+  {
+    int sum = 0;
+    for (int r = 0; r < BLOCK; r++)
+    {
+      const uint8_t *p = rows[r] + b * BLOCK * step + offset;
+      for (int c = 0; c < BLOCK; c++)
+      {
+        sum += p[c * step];
+      }
+    }
+    out[b] = (uint8_t)((sum + 32) >> 6);
+  }
+}
+
+#ifdef MOTION_GATE_X86
+
+/* psadbw against zero sums 8 bytes at a time: two blocks per load for
+ * planar luma, one for packed 4:2:2 once the chroma bytes are masked off */
+TARGET_SSE2 static void block_means_sse2(const uint8_t *const rows[BLOCK], int step, int offset, uint8_t *out, int blocks)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i low = _mm_set1_epi16(0x00ff);
+  int b = 0;
+  if (step == 1)
+  {
+    for (; b + 2 <= blocks; b += 2)
+    {
+      __m128i sum = zero;
+      for (int r = 0; r < BLOCK; r++)
+      {
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(rows[r] + b * BLOCK)), zero));
+      }
+      out[b]     = (uint8_t)((_mm_cvtsi128_si32(sum) + 32) >> 6);
+      out[b + 1] = (uint8_t)((_mm_cvtsi128_si32(_mm_srli_si128(sum, 8)) + 32) >> 6);
+    }
+  }
+  else
+  {
+    for (; b < blocks; b++)
+    {
+      __m128i sum = zero;
+      for (int r = 0; r < BLOCK; r++)
+      {
+        __m128i pixels = _mm_loadu_si128((const __m128i*)(rows[r] + b * BLOCK * 2));
+        pixels = offset ? _mm_srli_epi16(pixels, 8) : _mm_and_si128(pixels, low);
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(pixels, zero));
+      }
+      out[b] = (uint8_t)((_mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8)) + 32) >> 6);
+    }
+  }
+  block_means_c(rows, step, offset, out, b, blocks);
+}
+
+/* 16 blocks per step: masked absolute differences, their sum and how many exceed the threshold */
+TARGET_SSE2 static int64_t compare_sse2(const uint8_t *current, const uint8_t *reference, const uint8_t *mask,
+  int size, int threshold, int *changed)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i limit = _mm_set1_epi8((char)threshold);
+  __m128i sad = zero;
+  int unchanged = 0;
+  for (int i = 0; i < size; i += 16)
+  {
+    __m128i a = _mm_loadu_si128((const __m128i*)(current + i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(reference + i));
+    __m128i diff = _mm_and_si128(_mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a)),
+      _mm_loadu_si128((const __m128i*)(mask + i)));
+    sad = _mm_add_epi64(sad, _mm_sad_epu8(diff, zero));
+    unchanged += count_bits(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_subs_epu8(diff, limit), zero)));
+  }
+  *changed = size - unchanged;
+  return _mm_cvtsi128_si32(sad) + _mm_cvtsi128_si32(_mm_srli_si128(sad, 8));
+}
+
+#endif
+
+static int64_t compare_c(const uint8_t *current, const uint8_t *reference, const uint8_t *mask,
+  int size, int threshold, int *changed)
+{
+  int64_t sad = 0;
+  *changed = 0;
+  for (int i = 0; i < size; i++)
+  {
+    int diff = mask[i] ? abs(current[i] - reference[i]) : 0;
+    sad += diff;
+    *changed += diff > threshold;
+  }
+  return sad;
+}
+
+MotionGate::MotionGate(const MotionOptions &options)
+  : options_(options)
+  , sse2_(false)
+  , width_(0)
+  , height_(0)
+  , format_(AV_PIX_FMT_NONE)
+  , grid_width_(0)
+  , grid_height_(0)
+  , grid_size_(0)
+  , active_blocks_(0)
+  , have_reference_(false)
+  , last_motion_us_(AV_NOPTS_VALUE)
+  , last_pass_us_(AV_NOPTS_VALUE)
+  , analysed_(0)
+  , passed_(0)
+  , skipped_(0)
+  , moving_(0)
+  , analysis_us_(0)
+  , encode_us_(0)
+  , encoded_(0)
+  , level_x100_(0)
+{
+#ifdef MOTION_GATE_X86
+  sse2_ = (av_get_cpu_flags() & AV_CPU_FLAG_SSE2) != 0;
+#endif
+  options_.threshold = av_clip(options_.threshold, 0, 255);
+}
+
+bool MotionGate::Supports(int format)
+{
+  switch (format)
+  {
+  case AV_PIX_FMT_YUV420P:
+  case AV_PIX_FMT_YUVJ420P:
+  case AV_PIX_FMT_YUV422P:
+  case AV_PIX_FMT_YUVJ422P:
+  case AV_PIX_FMT_YUV444P:
+  case AV_PIX_FMT_YUVJ444P:
+  case AV_PIX_FMT_NV12:
+  case AV_PIX_FMT_NV21:
+  case AV_PIX_FMT_GRAY8:
+  case AV_PIX_FMT_YUYV422:
+  case AV_PIX_FMT_UYVY422:
+    return true;
+  default:
+    return false;
+  }
+}
+
+void MotionGate::reset(const AVFrame *frame)
+{
+  width_ = frame->width;
+  height_ = frame->height;
+  format_ = frame->format;
+  grid_width_ = width_ / BLOCK;
+  grid_height_ = height_ / BLOCK;
+  grid_size_ = FFALIGN(grid_width_ * grid_height_, 16);
+  current_.assign(grid_size_, 0);
+  reference_.assign(grid_size_, 0);
+  mask_.assign(grid_size_, 0);
+  have_reference_ = false;
+
+  /* a block counts unless its centre lies in a masked region */
+  active_blocks_ = 0;
+  for (int y = 0; y < grid_height_; y++)
+  {
+    for (int x = 0; x < grid_width_; x++)
+    {
+      double cx = (x + 0.5) * 100.0 / grid_width_;
+      double cy = (y + 0.5) * 100.0 / grid_height_;
+      bool masked = false;
+      for (size_t i = 0; i < options_.masks.size() && !masked; i++)
+      {
+        const MotionRegion &region = options_.masks[i];
+        masked = cx >= region.x && cx < region.x + region.w && cy >= region.y && cy < region.y + region.h;
+      }
+      if (!masked)
+      {
+        mask_[y * grid_width_ + x] = 0xff;
+        active_blocks_++;
+      }
+    }
+  }
+  if (!active_blocks_)
+  {
+    av_log(NULL, AV_LOG_WARNING, "The motion masks cover the whole frame, every frame is kept\n");
+  }
+}
+
+void MotionGate::downscale(const AVFrame *frame)
+{
+  int step, offset;
+  luma_layout(frame->format, &step, &offset);
+  for (int y = 0; y < grid_height_; y++)
+  {
+    const uint8_t *rows[BLOCK];
+    for (int r = 0; r < BLOCK; r++)
+    {
+      rows[r] = frame->data[0] + (y * BLOCK + r) * frame->linesize[0];
+    }
+    uint8_t *out = &current_[y * grid_width_];
+#ifdef MOTION_GATE_X86
+    if (sse2_)
+    {
+      block_means_sse2(rows, step, offset, out, grid_width_);
+      continue;
+    }
+#endif
+    block_means_c(rows, step, offset, out, 0, grid_width_);
+  }
+}
+
+bool MotionGate::compare(double *level)
+{
+  int changed = 0;
+  int64_t sad;
+#ifdef MOTION_GATE_X86
+  if (sse2_)
+  {
+    sad = compare_sse2(&current_[0], &reference_[0], &mask_[0], grid_size_, options_.threshold, &changed);
+  }
+  else
+#endif
+  {
+    sad = compare_c(&current_[0], &reference_[0], &mask_[0], grid_size_, options_.threshold, &changed);
+  }
+  *level = (double)sad / active_blocks_;
+  return changed * 100.0 >= options_.min_area * active_blocks_ && changed > 0;
+}
+
+bool MotionGate::Pass(const AVFrame *frame)
+{
+  if (!Supports(frame->format) || frame->width < 2 * BLOCK || frame->height < 2 * BLOCK || frame->pts == AV_NOPTS_VALUE)
+  {
+    return true;
+  }
+  int64_t start = LatencyMetrics::Now();
+  if (frame->width != width_ || frame->height != height_ || frame->format != format_)
+  {
+    reset(frame);
+  }
+  if (!active_blocks_)
+  {
+    return true;
+  }
+
+  downscale(frame);
+  bool motion = true;
+  if (have_reference_)
+  {
+    double level = 0;
+    motion = compare(&level);
+    level_x100_ = (int)(level * 100);
+  }
+  if (motion)
+  {
+    last_motion_us_ = frame->pts;
+    moving_++;
+  }
+
+  int64_t pts = frame->pts;
+  bool pass = motion || pts - last_motion_us_ < (int64_t)(options_.hold_sec * AV_TIME_BASE) ||
+    (options_.keepalive_fps > 0 && pts - last_pass_us_ >= (int64_t)(AV_TIME_BASE / options_.keepalive_fps));
+  if (pass)
+  {
+    /* later frames are measured against what was encoded last, so slow changes add up */
+    current_.swap(reference_);
+    have_reference_ = true;
+    last_pass_us_ = pts;
+    passed_++;
+  }
+  else
+  {
+    skipped_++;
+  }
+  analysed_++;
+  analysis_us_ += LatencyMetrics::Now() - start;
+  return pass;
+}
+
+void MotionGate::AddEncodeTime(int64_t us)
+{
+  encode_us_ += us;
+  encoded_++;
+}
+
+MotionGate::Stats MotionGate::GetStats() const
+{
+  Stats stats;
+  stats.analysed = analysed_;
+  stats.passed = passed_;
+  stats.skipped = skipped_;
+  stats.moving = moving_;
+  stats.analysis_us = analysis_us_;
+  uint64_t encoded = encoded_;
+  int64_t encode_us = encode_us_;
+  stats.saved_us = (encoded ? (int64_t)(stats.skipped * (double)encode_us / encoded) : 0) - stats.analysis_us;
+  stats.level = level_x100_ / 100.0;
+  return stats;
+}
+
+void MotionGate::PrintStats(int level) const
+{
+  Stats stats = GetStats();
+  av_log(NULL, level, "Motion gate (%s): %llu frames, %llu with motion, %llu encoded, %llu skipped; "
+    "analysis %.1f ms per frame, about %.1f s of CPU saved\n", sse2_ ? "sse2" : "c",
+    (unsigned long long)stats.analysed, (unsigned long long)stats.moving, (unsigned long long)stats.passed,
+    (unsigned long long)stats.skipped, stats.analysed ? stats.analysis_us / 1000.0 / stats.analysed : 0.0,
+    stats.saved_us / 1000000.0);
+}
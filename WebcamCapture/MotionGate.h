@@ -0,0 +1,113 @@
+#pragma once
+
+extern "C"
+{
+  #define __STDC_CONSTANT_MACROS
+  #include <libavutil/frame.h>
+  #include <libavutil/pixfmt.h>
+}
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include "Noncopyable.h"
+
+struct MotionRegion
+{
+  double x;  // percent of the frame width/height
+  double y;
+  double w;
+  double h;
+};
+
+struct MotionOptions
+{
+  MotionOptions()
+    : enabled(false)
+    , threshold(12)
+    , min_area(0.5)
+    , keepalive_fps(1)
+    , hold_sec(2)
+  {
+  }
+
+  bool Enabled() const { return enabled; }
+
+  bool   enabled;
+  int    threshold;      // change of an 8x8 block's mean luma (0-255) that counts as moving
+  double min_area;       // percent of the unmasked blocks that must move
+  double keepalive_fps;  // frames kept per second of a static scene, 0 keeps none
+  double hold_sec;       // full frame rate this long after the last motion
+  std::vector<MotionRegion> masks;  // areas that never count, e.g. a clock or a window
+
+  // x,y,w,h in percent: 0,0,100,8|75,0,25,40
+  static bool ParseMasks(const std::string &spec, std::vector<MotionRegion> *masks);
+};
+
+// Decides before the filters and the encoder whether a video frame is worth
+// encoding. Frames are reduced to the mean luma of each 8x8 block (SSE2
+// psadbw against zero), and the blocks are compared with the last frame that
+// was let through: the sum of absolute differences gives the motion level,
+// and the scene moves when enough unmasked blocks change by more than the
+// threshold. A static scene is thinned out to the keep-alive rate.
+//
+// Pass() runs on the processing thread, AddEncodeTime() on the encoder's;
+// statistics can be read from any thread.
+class MotionGate : Noncopyable
+{
+public:
+  struct Stats
+  {
+    uint64_t analysed;
+    uint64_t passed;
+    uint64_t skipped;
+    uint64_t moving;       // frames with motion
+    int64_t  analysis_us;  // time spent in Pass()
+    int64_t  saved_us;     // skipped frames times the mean encode time, minus analysis_us
+    double   level;        // mean block difference of the last frame
+  };
+
+  explicit MotionGate(const MotionOptions &options);
+
+  // planar or NV12 luma, or YUYV/UYVY
+  static bool Supports(int format);
+
+  // frame pts in microseconds; true if it should be encoded
+  bool Pass(const AVFrame *frame);
+  // one video frame took this long to encode
+  void AddEncodeTime(int64_t us);
+
+  Stats GetStats() const;
+  void PrintStats(int level) const;
+
+private:
+  void reset(const AVFrame *frame);
+  void downscale(const AVFrame *frame);
+  bool compare(double *level);
+
+private:
+  MotionOptions options_;
+  bool sse2_;
+  int width_;
+  int height_;
+  int format_;
+  int grid_width_;
+  int grid_height_;
+  int grid_size_;                 /* padded to 16 blocks */
+  int active_blocks_;
+  std::vector<uint8_t> current_;
+  std::vector<uint8_t> reference_;
+  std::vector<uint8_t> mask_;     /* 0xff where blocks count */
+  bool have_reference_;
+  int64_t last_motion_us_;
+  int64_t last_pass_us_;
+
+  std::atomic<uint64_t> analysed_;
+  std::atomic<uint64_t> passed_;
+  std::atomic<uint64_t> skipped_;
+  std::atomic<uint64_t> moving_;
+  std::atomic<int64_t> analysis_us_;
+  std::atomic<int64_t> encode_us_;
+  std::atomic<uint64_t> encoded_;
+  std::atomic<int> level_x100_;
+};
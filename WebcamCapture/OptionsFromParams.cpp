@@ -0,0 +1,319 @@
+#include "OptionsFromParams.h"
+#include "InputBackend.h"
+
+#include <ctype.h>
+#include <cstdlib>
+#include <iostream>
+
+#ifndef _MSC_VER
+#define _strtoi64 strtoll
+#endif
+
+int64_t ParseSize(const std::string &value)
+{
+  char *end = NULL;
+  int64_t size = _strtoi64(value.c_str(), &end, 10);
+  switch (end ? *end : 0)
+  {
+  case 'k': case 'K': return size << 10;
+  case 'm': case 'M': return size << 20;
+  case 'g': case 'G': return size << 30;
+  default:            return size;
+  }
+}
+
+CaptureOptions MakeOptions(Params &params)
+{
+  CaptureOptions options;
+  if (params.GetInt(Params::QUEUE_SIZE) > 0)
+  {
+    options.queue_size = params.GetInt(Params::QUEUE_SIZE);
+  }
+  else
+  {
+    std::cout << "Invalid queue size '" << params.GetString(Params::QUEUE_SIZE) << "', using " << options.queue_size << std::endl;
+  }
+  if (!CaptureQueue::ParsePolicy(params.GetString(Params::QUEUE_POLICY), &options.queue_policy))
+  {
+    std::cout << "Unknown queue policy '" << params.GetString(Params::QUEUE_POLICY) << "', using block" << std::endl;
+  }
+
+  const std::string &copy = params.GetString(Params::STREAM_COPY);
+  options.copy_video = (copy == "video" || copy == "all");
+  options.copy_audio = (copy == "audio" || copy == "all");
+
+  options.video_encoder.codec       = params.GetString(Params::VIDEO_CODEC);
+  options.video_encoder.preset      = params.GetString(Params::VIDEO_PRESET);
+  options.video_encoder.tune        = params.GetString(Params::VIDEO_TUNE);
+  options.video_encoder.crf         = params.GetString(Params::VIDEO_CRF);
+  options.video_encoder.bitrate     = params.GetString(Params::VIDEO_BITRATE);
+  options.video_encoder.gop         = params.GetString(Params::VIDEO_GOP);
+  options.video_encoder.threads     = params.GetString(Params::VIDEO_THREADS);
+  options.video_encoder.thread_type = params.GetString(Params::VIDEO_THREAD_TYPE);
+  options.video_encoder.pix_fmt     = params.GetString(Params::VIDEO_PIX_FMT);
+  options.video_encoder.extra       = params.GetString(Params::VIDEO_CODEC_OPTIONS);
+  options.audio_encoder.codec       = params.GetString(Params::AUDIO_CODEC);
+  options.audio_encoder.bitrate     = params.GetString(Params::AUDIO_BITRATE);
+  options.audio_encoder.extra       = params.GetString(Params::AUDIO_CODEC_OPTIONS);
+  options.decoder.threads           = params.GetString(Params::DECODER_THREADS);
+  options.decoder.thread_type       = params.GetString(Params::DECODER_THREAD_TYPE);
+
+  options.video_filter = params.GetString(Params::VIDEO_FILTER);
+  options.audio_filter = params.GetString(Params::AUDIO_FILTER);
+  if (params.GetInt(Params::FILTER_THREADS) > 0)
+  {
+    options.filter_threads = params.GetInt(Params::FILTER_THREADS);
+  }
+
+  if (params.GetInt(Params::SEGMENT_TIME) > 0)
+  {
+    options.segment.duration_sec = params.GetInt(Params::SEGMENT_TIME);
+  }
+  options.segment.max_size       = ParseSize(params.GetString(Params::SEGMENT_SIZE));
+  options.segment.name_template  = params.GetString(Params::SEGMENT_TEMPLATE);
+  if (params.GetInt(Params::SEGMENT_COUNT) > 0)
+  {
+    options.segment.max_count = params.GetInt(Params::SEGMENT_COUNT);
+  }
+  options.segment.max_total_size = ParseSize(params.GetString(Params::SEGMENT_MAX_BYTES));
+
+  if (params.GetInt(Params::EVENT_PRE) > 0)
+  {
+    options.event.pre_sec = params.GetInt(Params::EVENT_PRE);
+  }
+  if (params.GetInt(Params::EVENT_POST) >= 0)
+  {
+    options.event.post_sec = params.GetInt(Params::EVENT_POST);
+  }
+  if (ParseSize(params.GetString(Params::EVENT_MEMORY)) > 0)
+  {
+    options.event.max_memory = ParseSize(params.GetString(Params::EVENT_MEMORY));
+  }
+  options.event.name_template = params.GetString(Params::EVENT_TEMPLATE);
+
+  const std::string &sync = params.GetString(Params::VIDEO_SYNC);
+  if (!sync.empty() && !TimestampEngine::ParseSync(sync, &options.timestamps.sync))
+  {
+    std::cout << "Unknown video sync '" << sync << "', using cfr" << std::endl;
+  }
+  if (params.GetInt(Params::DRIFT_CORRECTION) == 0)
+  {
+    options.timestamps.drift_correction = false;
+  }
+
+  options.input_url    = params.GetString(Params::INPUT_URL);
+  options.input_format = params.GetString(Params::INPUT_FORMAT);
+  options.input_options = params.GetString(Params::INPUT_OPTIONS);
+  options.input_backend = params.GetString(Params::INPUT_BACKEND);
+  if (options.input_backend.empty())
+  {
+    options.input_backend = InputBackend::DefaultName(options.input_url, options.input_format);
+  }
+  if (params.GetInt(Params::PACE_INPUT) > 0)
+  {
+    options.pace_input = true;
+  }
+  options.probe_cache = params.GetString(Params::PROBE_CACHE);
+
+  options.metrics.path = params.GetString(Params::METRICS_FILE);
+  if (params.GetInt(Params::METRICS_INTERVAL) > 0)
+  {
+    options.metrics.interval_ms = params.GetInt(Params::METRICS_INTERVAL);
+  }
+  std::string metrics_format = params.GetString(Params::METRICS_FORMAT);
+  const std::string &path = options.metrics.path;
+  if (metrics_format.empty() && path.size() > 5 && path.compare(path.size() - 5, 5, ".json") == 0)
+  {
+    metrics_format = "json";
+  }
+  if (!metrics_format.empty() && !LatencyMetrics::ParseFormat(metrics_format, &options.metrics.format))
+  {
+    std::cout << "Unknown metrics format '" << metrics_format << "', using prometheus" << std::endl;
+  }
+
+  if (params.GetInt(Params::LOW_LATENCY) > 0)
+  {
+    options.low_latency = true;
+  }
+  if (params.GetInt(Params::LATENCY_TARGET) > 0)
+  {
+    options.latency_target_ms = params.GetInt(Params::LATENCY_TARGET);
+  }
+
+  if (params.GetInt(Params::ASYNC_WRITE) > 0)
+  {
+    options.writer.async = true;
+  }
+  if (ParseSize(params.GetString(Params::WRITE_BLOCK)) > 0)
+  {
+    options.writer.block_size = (size_t)ParseSize(params.GetString(Params::WRITE_BLOCK));
+  }
+  if (ParseSize(params.GetString(Params::WRITE_MAX_PENDING)) > 0)
+  {
+    options.writer.max_pending = ParseSize(params.GetString(Params::WRITE_MAX_PENDING));
+  }
+  options.writer.preallocate = ParseSize(params.GetString(Params::PREALLOCATE));
+  if (params.GetInt(Params::DIRECT_IO) > 0)
+  {
+    options.writer.direct_io = true;
+  }
+
+  if (!FanoutOptions::Parse(params.GetString(Params::OUTPUTS), &options.fanout.targets))
+  {
+    std::cout << "Cannot parse outputs '" << params.GetString(Params::OUTPUTS) << "', ignoring them" << std::endl;
+    options.fanout.targets.clear();
+  }
+  if (params.GetInt(Params::OUTPUT_QUEUE) > 0)
+  {
+    options.fanout.queue_size = params.GetInt(Params::OUTPUT_QUEUE);
+  }
+  if (params.GetInt(Params::OUTPUT_RETRY) >= 0)
+  {
+    options.fanout.retry_sec = params.GetInt(Params::OUTPUT_RETRY);
+  }
+
+  if (!LadderOptions::Parse(params.GetString(Params::RENDITIONS), &options.ladder.renditions))
+  {
+    std::cout << "Cannot parse renditions '" << params.GetString(Params::RENDITIONS) << "', ignoring them" << std::endl;
+    options.ladder.renditions.clear();
+  }
+
+  if (params.GetInt(Params::MOTION) > 0)
+  {
+    options.motion.enabled = true;
+    if (params.GetInt(Params::MOTION_THRESHOLD) >= 0)
+    {
+      options.motion.threshold = params.GetInt(Params::MOTION_THRESHOLD);
+    }
+    if (!params.GetString(Params::MOTION_AREA).empty())
+    {
+      options.motion.min_area = atof(params.GetString(Params::MOTION_AREA).c_str());
+    }
+    if (!params.GetString(Params::MOTION_KEEPALIVE).empty())
+    {
+      options.motion.keepalive_fps = atof(params.GetString(Params::MOTION_KEEPALIVE).c_str());
+    }
+    if (!params.GetString(Params::MOTION_HOLD).empty())
+    {
+      options.motion.hold_sec = atof(params.GetString(Params::MOTION_HOLD).c_str());
+    }
+    if (!MotionOptions::ParseMasks(params.GetString(Params::MOTION_MASK), &options.motion.masks))
+    {
+      std::cout << "Cannot parse motion masks '" << params.GetString(Params::MOTION_MASK) << "', ignoring them" << std::endl;
+      options.motion.masks.clear();
+    }
+    if (options.timestamps.sync == TimestampOptions::CFR)
+    {
+      /* CFR would fill the skipped slots with copies of the last frame */
+      if (!params.GetString(Params::VIDEO_SYNC).empty())
+      {
+        std::cout << "Motion gating needs -vsync=vfr, using it" << std::endl;
+      }
+      options.timestamps.sync = TimestampOptions::VFR;
+    }
+  }
+
+  if (!params.GetString(Params::DEGRADE).empty() && params.GetString(Params::DEGRADE) != "0")
+  {
+    if (!DegradeOptions::ParseSteps(params.GetString(Params::DEGRADE), &options.degrade.steps))
+    {
+      std::cout << "Cannot parse degradation steps '" << params.GetString(Params::DEGRADE) << "', ignoring them" << std::endl;
+      options.degrade.steps.clear();
+    }
+    if (params.GetInt(Params::DEGRADE_LAG) > 0)
+    {
+      options.degrade.lag_high_ms = params.GetInt(Params::DEGRADE_LAG);
+      options.degrade.lag_low_ms = options.degrade.lag_high_ms / 5;
+    }
+    if (!params.GetString(Params::DEGRADE_RECOVER).empty())
+    {
+      options.degrade.recover_sec = atof(params.GetString(Params::DEGRADE_RECOVER).c_str());
+    }
+  }
+
+  options.snapshot.path = params.GetString(Params::SNAPSHOT);
+  if (!params.GetString(Params::SNAPSHOT_INTERVAL).empty())
+  {
+    options.snapshot.interval_sec = atof(params.GetString(Params::SNAPSHOT_INTERVAL).c_str());
+  }
+  if (params.GetInt(Params::SNAPSHOT_WIDTH) >= 0)
+  {
+    options.snapshot.width = params.GetInt(Params::SNAPSHOT_WIDTH);
+  }
+
+  options.spool.size = ParseSize(params.GetString(Params::SPOOL));
+
+  if (!params.GetString(Params::FRAGMENT).empty())
+  {
+    options.fragment_sec = atof(params.GetString(Params::FRAGMENT).c_str());
+  }
+
+  return options;
+}
+
+/* the ':' before the output: the last one that does not belong to the output's
+ * own drive letter (C:\), protocol (pipe:1) or url (udp://host:port), so device
+ * names like hw:1,0 and input urls keep theirs */
+static size_t session_separator(const std::string &entry)
+{
+  size_t colon = entry.rfind(':');
+  while (colon != std::string::npos && colon > 0)
+  {
+    size_t previous = entry.rfind(':', colon - 1);
+    size_t token_start = previous == std::string::npos ? 0 : previous + 1;
+    std::string token = entry.substr(token_start, colon - token_start);
+    size_t url = entry.rfind("://", colon);
+    bool inside_output_url = url != std::string::npos && url != colon && url > 0 &&
+      entry.rfind(':', url - 1) != std::string::npos;
+    bool scheme = entry.compare(colon + 1, 2, "//") == 0;
+    bool drive = token.size() == 1 && isalpha((unsigned char)token[0]) && previous != std::string::npos &&
+      colon + 1 < entry.size() && (entry[colon + 1] == '\\' || entry[colon + 1] == '/');
+    bool protocol = (token == "pipe" || token == "file") && previous != std::string::npos;
+    if (!inside_output_url && !scheme && !drive && !protocol)
+    {
+      return colon;
+    }
+    colon = previous;
+  }
+  return std::string::npos;
+}
+
+bool ParseSessions(const std::string &spec, std::vector<SessionSpec> *sessions)
+{
+  size_t start = 0;
+  while (start < spec.size())
+  {
+    size_t end = spec.find('|', start);
+    if (end == std::string::npos)
+    {
+      end = spec.size();
+    }
+    std::string entry = spec.substr(start, end - start);
+    start = end + 1;
+    if (entry.empty())
+    {
+      continue;
+    }
+
+    size_t colon = session_separator(entry);
+    if (colon == std::string::npos || colon == 0 || colon + 1 == entry.size())
+    {
+      return false;
+    }
+    SessionSpec session;
+    std::string devices = entry.substr(0, colon);
+    size_t plus = devices.find('+');
+    session.video = devices.substr(0, plus);
+    if (plus != std::string::npos)
+    {
+      session.audio = devices.substr(plus + 1);
+    }
+    session.output = entry.substr(colon + 1);
+    if (session.video.empty())
+    {
+      return false;
+    }
+    sessions->push_back(session);
+  }
+  return true;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "CaptureOptions.h"
+#include "Params.h"
+
+// "500M" -> 524288000, K/M/G suffixes
+int64_t ParseSize(const std::string &value);
+// pipeline options from the command line, shared by the capture tool and the benchmark
+CaptureOptions MakeOptions(Params &params);
+
+// one camera of -sessions
+struct SessionSpec
+{
+  std::string video;   // device index or name; the url for the file and lavfi backends
+  std::string audio;   // device index or name, may be empty
+  std::string output;
+};
+// 0+1:cam0.mp4|2:cam2.mp4; the output follows the last ':' that is not part of
+// its own drive letter, pipe:/file: prefix or url, so hw:1,0:a.mp4 and
+// C:\rec\cam.spool:C:\out\a.mp4 split where they should
+bool ParseSessions(const std::string &spec, std::vector<SessionSpec> *sessions);
@@ -0,0 +1,359 @@
+#include "OutputMuxer.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#endif
+
+OutputMuxer::OutputMuxer(AVFormatContext *layout, const MuxerOptions &options)
+  : layout_(layout)
+  , options_(options)
+  , ctx_(NULL)
+  , writer_(NULL)
+  , bytes_written_(0)
+  , fragment_stream_(-1)
+  , next_fragment_us_(AV_NOPTS_VALUE)
+{
+}
+
+OutputMuxer::~OutputMuxer()
+{
+  if (ctx_)
+  {
+    Close();
+  }
+}
+
+int OutputMuxer::Open(const std::string &filename)
+{
+  int ret;
+
+  filename_ = filename;
+  bytes_written_ = 0;
+  AVOutputFormat *format = layout_->oformat;
+  if (!options_.format.empty() && !(format = av_guess_format(options_.format.c_str(), NULL, NULL)))
+  {
+    av_log(NULL, AV_LOG_ERROR, "Unknown output format '%s'\n", options_.format.c_str());
+    return AVERROR_MUXER_NOT_FOUND;
+  }
+  avformat_alloc_output_context2(&ctx_, format, NULL, filename.c_str());
+  if (!ctx_)
+  {
+    av_log(NULL, AV_LOG_ERROR, "Could not create output context for '%s'\n", filename.c_str());
+    return AVERROR_UNKNOWN;
+  }
+
+  ctx_->interrupt_callback = options_.interrupt;
+
+  for (unsigned int i = 0; i < layout_->nb_streams; i++)
+  {
+    AVStream *in_stream = layout_->streams[i];
+    AVStream *out_stream = avformat_new_stream(ctx_, NULL);
+    if (!out_stream)
+    {
+      av_log(NULL, AV_LOG_ERROR, "Failed allocating output stream\n");
+      Free();
+      return AVERROR_UNKNOWN;
+    }
+    if ((ret = avcodec_copy_context(out_stream->codec, in_stream->codec)) < 0)
+    {
+      av_log(NULL, AV_LOG_ERROR, "Copying parameters for stream #%u failed\n", i);
+      Free();
+      return ret;
+    }
+    out_stream->time_base = in_stream->time_base;
+  }
+
+  if (!(ctx_->oformat->flags & AVFMT_NOFILE) && options_.writer.async && AsyncWriter::Supports(filename))
+  {
+    writer_ = new AsyncWriter(options_.writer, options_.writer_stats);
+    if ((ret = writer_->Open(filename)) < 0)
+    {
+      Free();
+      return ret;
+    }
+    ctx_->pb = writer_->Context();
+  }
+  else if (!(ctx_->oformat->flags & AVFMT_NOFILE))
+  {
+    ret = avio_open2(&ctx_->pb, filename.c_str(), AVIO_FLAG_WRITE, &options_.interrupt, NULL);
+    if (ret < 0)
+    {
+      av_log(NULL, AV_LOG_ERROR, "Could not open output file '%s'\n", filename.c_str());
+      Free();
+      return ret;
+    }
+  }
+
+  AVDictionary *format_options = NULL;
+  if (options_.low_latency)
+  {
+    /* every packet reaches the file (or socket) as soon as it is written */
+    av_dict_set(&format_options, "flush_packets", "1", 0);
+  }
+  fragment_stream_ = -1;
+  next_fragment_us_ = AV_NOPTS_VALUE;
+  if (options_.fragment_sec > 0 && CanFragment(ctx_->oformat))
+  {
+    /* the moov goes out empty up front: no rewrite at the end, and a killed capture keeps every flushed fragment */
+    if (strcmp(ctx_->oformat->name, "matroska") != 0 && strcmp(ctx_->oformat->name, "webm") != 0)
+    {
+      av_dict_set(&format_options, "movflags", "frag_custom+empty_moov+default_base_moof", 0);
+    }
+    /* fragments start at the video's keyframes, any packet will do for audio only */
+    fragment_stream_ = 0;
+    for (unsigned int i = 0; i < ctx_->nb_streams; i++)
+    {
+      if (ctx_->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO)
+      {
+        fragment_stream_ = i;
+        break;
+      }
+    }
+  }
+
+  /* init muxer, write output file header */
+  ret = avformat_write_header(ctx_, &format_options);
+  av_dict_free(&format_options);
+  if (ret < 0)
+  {
+    av_log(NULL, AV_LOG_ERROR, "Error occurred when opening output file '%s'\n", filename.c_str());
+    Free();
+    return ret;
+  }
+  return 0;
+}
+
+int OutputMuxer::WritePacket(AVPacket *packet)
+{
+  int stream_index = packet->stream_index;
+  int64_t packet_ts = (packet->dts != AV_NOPTS_VALUE) ? packet->dts : packet->pts;
+  if (stream_index == fragment_stream_ && (packet->flags & AV_PKT_FLAG_KEY) && packet_ts != AV_NOPTS_VALUE)
+  {
+    int64_t packet_us = av_rescale_q(packet_ts, layout_->streams[stream_index]->time_base, AV_TIME_BASE_Q);
+    if (next_fragment_us_ != AV_NOPTS_VALUE && packet_us >= next_fragment_us_)
+    {
+      int ret = flush_fragment();
+      if (ret < 0)
+      {
+        av_packet_unref(packet);
+        return ret;
+      }
+    }
+    if (next_fragment_us_ == AV_NOPTS_VALUE || packet_us >= next_fragment_us_)
+    {
+      next_fragment_us_ = packet_us + (int64_t)(options_.fragment_sec * AV_TIME_BASE);
+    }
+  }
+  av_packet_rescale_ts(packet,
+    layout_->streams[stream_index]->time_base,
+    ctx_->streams[stream_index]->time_base);
+  bytes_written_ += packet->size;
+  if (!options_.low_latency)
+  {
+    return av_interleaved_write_frame(ctx_, packet);
+  }
+  /* the mux thread already orders by dts, skip the muxer's own interleaving queue */
+  int ret = av_write_frame(ctx_, packet);
+  av_packet_unref(packet);
+  return ret;
+}
+
+int OutputMuxer::Close()
+{
+  if (!ctx_)
+  {
+    return 0;
+  }
+  int ret = av_write_trailer(ctx_);
+  if (ret < 0)
+  {
+    av_log(NULL, AV_LOG_ERROR, "Cannot finalize '%s'\n", filename_.c_str());
+  }
+  if (writer_)
+  {
+    /* the trailer may still be queued, a failed block write shows up only here */
+    int write_ret = writer_->Close();
+    if (ret >= 0 && write_ret < 0)
+    {
+      av_log(NULL, AV_LOG_ERROR, "Cannot write '%s'\n", filename_.c_str());
+      ret = write_ret;
+    }
+  }
+  Free();
+  return ret;
+}
+
+int OutputMuxer::flush_fragment()
+{
+  int ret = 0;
+  /* what the interleaving queue holds belongs to the fragment that ends here */
+  if (!options_.low_latency && (ret = av_interleaved_write_frame(ctx_, NULL)) < 0)
+  {
+    return ret;
+  }
+  /* moof+mdat, or the Matroska cluster, complete in the file */
+  if ((ret = av_write_frame(ctx_, NULL)) < 0)
+  {
+    av_log(NULL, AV_LOG_ERROR, "Cannot write a fragment of '%s'\n", filename_.c_str());
+    return ret;
+  }
+  avio_flush(ctx_->pb);
+  return 0;
+}
+
+void OutputMuxer::Free()
+{
+  if (writer_)
+  {
+    /* the context belongs to the writer */
+    writer_->Close();
+    delete writer_;
+    writer_ = NULL;
+    if (ctx_)
+    {
+      ctx_->pb = NULL;
+    }
+  }
+  else if (ctx_ && !(ctx_->oformat->flags & AVFMT_NOFILE))
+  {
+    avio_closep(&ctx_->pb);
+  }
+  avformat_free_context(ctx_);
+  ctx_ = NULL;
+}
+
+bool OutputMuxer::CanFragment(const AVOutputFormat *format)
+{
+  static const char *names[] = { "mp4", "mov", "ipod", "ismv", "matroska", "webm" };
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+  {
+    if (strcmp(format->name, names[i]) == 0)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+std::string OutputMuxer::ExpandTemplate(const std::string &pattern, int number)
+{
+  time_t now = time(NULL);
+  struct tm local;
+#ifdef _WIN32
+  localtime_s(&local, &now);
+#else
+  localtime_r(&now, &local);
+#endif
+
+  std::ostringstream result;
+  for (size_t i = 0; i < pattern.size(); i++)
+  {
+    if (pattern[i] != '%' || i + 1 == pattern.size())
+    {
+      result << pattern[i];
+      continue;
+    }
+    size_t j = i + 1;
+    while (j < pattern.size() && isdigit((unsigned char)pattern[j]))
+    {
+      j++;
+    }
+    if (j < pattern.size() && pattern[j] == 'd')
+    {
+      /* file number, %d or %05d */
+      std::string width = pattern.substr(i + 1, j - i - 1);
+      result << std::setfill(width.size() > 0 && width[0] == '0' ? '0' : ' ')
+             << std::setw(atoi(width.c_str())) << number;
+    }
+    else if (j == i + 1 && j < pattern.size())
+    {
+      /* one strftime conversion, e.g. %Y or %H */
+      char format[3] = { '%', pattern[j], '\0' };
+      char buf[64];
+      if (strftime(buf, sizeof(buf), format, &local) > 0)
+      {
+        result << buf;
+      }
+    }
+    else
+    {
+      result << pattern.substr(i, j - i + 1);
+    }
+    i = j;
+  }
+  return result.str();
+}
+
+std::string OutputMuxer::DerivedTemplate(const std::string &filename, const std::string &suffix)
+{
+  /* out.mp4 -> out<suffix>.mp4 */
+  size_t dot = filename.find_last_of('.');
+  size_t slash = filename.find_last_of("/\\");
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+  {
+    dot = filename.size();
+  }
+  return filename.substr(0, dot) + suffix + filename.substr(dot);
+}
+
+int OutputMuxer::PrependHeaders(AVPacket *packet, const AVCodecContext *codec)
+{
+  if (!(packet->flags & AV_PKT_FLAG_KEY) || !(codec->flags & AV_CODEC_FLAG_GLOBAL_HEADER) || codec->extradata_size < 4 ||
+    codec->extradata[0] != 0 || codec->extradata[1] != 0 ||
+    (codec->extradata[2] != 1 && (codec->extradata[2] != 0 || codec->extradata[3] != 1)))
+  {
+    return 0;
+  }
+
+  AVPacket with_headers;
+  int ret = av_new_packet(&with_headers, codec->extradata_size + packet->size);
+  if (ret < 0)
+  {
+    return ret;
+  }
+  if ((ret = av_packet_copy_props(&with_headers, packet)) < 0)
+  {
+    av_packet_unref(&with_headers);
+    return ret;
+  }
+  memcpy(with_headers.data, codec->extradata, codec->extradata_size);
+  memcpy(with_headers.data + codec->extradata_size, packet->data, packet->size);
+  av_packet_unref(packet);
+  av_packet_move_ref(packet, &with_headers);
+  return 0;
+}
+
+int OutputMuxer::WriteFileAtomically(const std::string &path, const std::string &data)
+{
+  std::string temp = path + ".tmp";
+  {
+    std::ofstream file(temp.c_str(), std::ios::out | std::ios::trunc | std::ios::binary);
+    if (!file || !file.write(data.data(), data.size()) || !file.flush())
+    {
+      file.close();
+      remove(temp.c_str());
+      return AVERROR(EIO);
+    }
+  }
+  /* rename() does not replace an existing file on Windows */
+#ifdef _WIN32
+  if (!MoveFileExA(temp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING))
+#else
+  if (rename(temp.c_str(), path.c_str()) != 0)
+#endif
+  {
+    remove(temp.c_str());
+    return AVERROR(EIO);
+  }
+  return 0;
+}
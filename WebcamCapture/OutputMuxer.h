@@ -0,0 +1,77 @@
+#pragma once
+
+extern "C"
+{
+  #define __STDC_CONSTANT_MACROS
+  #include <libavformat/avformat.h>
+}
+
+#include <string>
+#include "AsyncWriter.h"
+#include "Noncopyable.h"
+
+struct MuxerOptions
+{
+  MuxerOptions()
+    : low_latency(false)
+    , fragment_sec(0)
+    , writer_stats(NULL)
+  {
+    interrupt.callback = NULL;
+    interrupt.opaque = NULL;
+  }
+
+  bool          low_latency;   // av_write_frame plus flush_packets: no interleaving queue, no buffered output
+  double        fragment_sec;  // MP4/MOV/Matroska: flush a self-contained fragment at the first keyframe after this many seconds, 0 = off
+  std::string   format;        // muxer name, empty uses the layout's
+  AVIOInterruptCB interrupt;   // aborts blocking network I/O
+  WriterOptions writer;        // local files through an AsyncWriter when writer.async
+  WriterStats  *writer_stats;  // not owned, may be NULL
+};
+
+// One output file. Streams are cloned from a layout context whose codec
+// contexts are the opened encoders (or the copied input streams); packets are
+// given in the layout's stream time bases and rescaled here.
+class OutputMuxer : Noncopyable
+{
+public:
+  explicit OutputMuxer(AVFormatContext *layout, const MuxerOptions &options = MuxerOptions());
+  ~OutputMuxer();
+
+  int Open(const std::string &filename);
+  // takes over the packet's reference
+  int WritePacket(AVPacket *packet);
+  // writes the trailer and closes the file
+  int Close();
+
+  bool IsOpen() const { return ctx_ != NULL; }
+  int64_t BytesWritten() const { return bytes_written_; }
+  const std::string &Filename() const { return filename_; }
+
+  // strftime fields of the local time plus %d/%05d for the file number
+  static std::string ExpandTemplate(const std::string &pattern, int number);
+  // inserts suffix before the extension: out.mp4 -> out_%05d.mp4
+  static std::string DerivedTemplate(const std::string &filename, const std::string &suffix);
+  // MP4/MOV family or Matroska/WebM, the muxers fragment_sec applies to
+  static bool CanFragment(const AVOutputFormat *format);
+  // repeats an Annex B encoder's global headers (H.264, HEVC, MPEG-4) in front
+  // of a keyframe like dump_extra does; other packets are left alone
+  static int PrependHeaders(AVPacket *packet, const AVCodecContext *codec);
+  // writes data next to path and renames it over path, so a reader finds the
+  // old contents or the new ones, never half a file
+  static int WriteFileAtomically(const std::string &path, const std::string &data);
+
+private:
+  void Free();
+  int flush_fragment();
+
+private:
+  AVFormatContext *layout_;
+  MuxerOptions options_;
+  AVFormatContext *ctx_;
+  AsyncWriter *writer_;     /* owns ctx_->pb when set */
+  std::string filename_;
+  int64_t bytes_written_;
+  int fragment_stream_;        /* its keyframes start fragments, -1 when not fragmenting */
+  int64_t next_fragment_us_;
+};
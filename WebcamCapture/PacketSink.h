@@ -0,0 +1,19 @@
+#pragma once
+
+extern "C"
+{
+  #define __STDC_CONSTANT_MACROS
+  #include <libavcodec/avcodec.h>
+}
+
+#include "Noncopyable.h"
+
+// Where the mux thread sends the interleaved packets. Timestamps are in the
+// stream time bases of the output layout context.
+class PacketSink : Noncopyable
+{
+public:
+  // takes over the packet's reference
+  virtual int WritePacket(AVPacket *packet) = 0;
+  virtual int Close() = 0;
+};
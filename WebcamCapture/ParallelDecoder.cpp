@@ -0,0 +1,189 @@
+#include "ParallelDecoder.h"
+#include "MediaPool.h"
+
+ParallelDecoder::ParallelDecoder(AVCodecContext *stream_ctx, int threads, MediaPool *pool)
+  : stream_ctx_(stream_ctx)
+  , pool_(pool)
+  , workers_(FFMAX(threads, 1))
+  , stopping_(false)
+  , next_(0)
+  , in_flight_(0)
+{
+  for (size_t i = 0; i < workers_.size(); i++)
+  {
+    Worker &worker = workers_[i];
+    worker.dec_ctx = NULL;
+    worker.thread = NULL;
+    worker.packet = NULL;
+    worker.frame = NULL;
+    worker.pending = false;
+    worker.done = false;
+    worker.got_frame = 0;
+    worker.ret = 0;
+    worker.pts = AV_NOPTS_VALUE;
+  }
+}
+
+ParallelDecoder::~ParallelDecoder()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  work_.notify_all();
+  for (size_t i = 0; i < workers_.size(); i++)
+  {
+    Worker &worker = workers_[i];
+    if (worker.thread)
+    {
+      worker.thread->join();
+      delete worker.thread;
+    }
+    av_packet_free(&worker.packet);
+    av_frame_free(&worker.frame);
+    if (worker.dec_ctx)
+    {
+      avcodec_free_context(&worker.dec_ctx);
+    }
+  }
+}
+
+bool ParallelDecoder::Supports(const AVCodecContext *stream_ctx)
+{
+  const AVCodecDescriptor *desc = avcodec_descriptor_get(stream_ctx->codec_id);
+  return stream_ctx->codec_type == AVMEDIA_TYPE_VIDEO && stream_ctx->codec &&
+    desc && (desc->props & AV_CODEC_PROP_INTRA_ONLY) &&
+    !(stream_ctx->codec->capabilities & (AV_CODEC_CAP_FRAME_THREADS | AV_CODEC_CAP_DELAY));
+}
+
+int ParallelDecoder::Open()
+{
+  const AVCodec *decoder = stream_ctx_->codec;
+  for (size_t i = 0; i < workers_.size(); i++)
+  {
+    Worker &worker = workers_[i];
+    worker.dec_ctx = avcodec_alloc_context3(decoder);
+    worker.packet = av_packet_alloc();
+    worker.frame = av_frame_alloc();
+    if (!worker.dec_ctx || !worker.packet || !worker.frame)
+    {
+      return AVERROR(ENOMEM);
+    }
+    int ret = avcodec_copy_context(worker.dec_ctx, stream_ctx_);
+    if (ret < 0)
+    {
+      return ret;
+    }
+    /* the parallelism is ours, one thread per copy */
+    worker.dec_ctx->thread_count = 1;
+    pool_->AttachDecoder(worker.dec_ctx);
+    if ((ret = avcodec_open2(worker.dec_ctx, decoder, NULL)) < 0)
+    {
+      av_log(NULL, AV_LOG_ERROR, "Cannot open decoder %d of %d\n", (int)i + 1, (int)workers_.size());
+      return ret;
+    }
+  }
+  for (size_t i = 0; i < workers_.size(); i++)
+  {
+    workers_[i].thread = new std::thread(&ParallelDecoder::run, this, &workers_[i]);
+  }
+  return 0;
+}
+
+int ParallelDecoder::Decode(AVFrame *frame, int *got_frame, const AVPacket *packet)
+{
+  *got_frame = 0;
+  if (!packet || !packet->size)
+  {
+    /* the next picture, past the packets that gave none */
+    while (!*got_frame && in_flight_ > 0)
+    {
+      take_oldest(frame, got_frame);
+    }
+    return 0;
+  }
+
+  Worker &worker = workers_[next_ % workers_.size()];
+  int ret = av_packet_ref(worker.packet, packet);
+  if (ret < 0)
+  {
+    return ret;
+  }
+  worker.pts = packet->pts;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    worker.pending = true;
+  }
+  work_.notify_all();
+  next_++;
+  in_flight_++;
+  /* every thread busy before the first picture is taken back, then one out per packet in */
+  if (in_flight_ == workers_.size())
+  {
+    take_oldest(frame, got_frame);
+  }
+  return packet->size;
+}
+
+void ParallelDecoder::take_oldest(AVFrame *frame, int *got_frame)
+{
+  Worker &oldest = workers_[(next_ - in_flight_) % workers_.size()];
+  int ret;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!oldest.done)
+    {
+      done_.wait(lock);
+    }
+    oldest.done = false;
+    ret = oldest.ret;
+    *got_frame = ret >= 0 && oldest.got_frame;
+  }
+  in_flight_--;
+  if (*got_frame)
+  {
+    av_frame_move_ref(frame, oldest.frame);
+    /* what the stream's own decoder would have learned from the picture */
+    stream_ctx_->width = frame->width;
+    stream_ctx_->height = frame->height;
+    stream_ctx_->pix_fmt = (AVPixelFormat)frame->format;
+    return;
+  }
+  av_frame_unref(oldest.frame);
+  if (ret < 0)
+  {
+    /* the packet that failed went in threads - 1 packets ago, the caller is past it */
+    char buf[AV_ERROR_MAX_STRING_SIZE];
+    av_strerror(ret, buf, sizeof(buf));
+    av_log(NULL, AV_LOG_WARNING, "Parallel decoder: the packet at pts %lld failed (%s), its picture is dropped\n",
+      (long long)oldest.pts, buf);
+  }
+}
+
+void ParallelDecoder::run(Worker *worker)
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (1)
+  {
+    while (!stopping_ && !worker->pending)
+    {
+      work_.wait(lock);
+    }
+    if (!worker->pending)
+    {
+      break;
+    }
+    lock.unlock();
+
+    int got_frame = 0;
+    int ret = avcodec_decode_video2(worker->dec_ctx, worker->frame, &got_frame, worker->packet);
+    av_packet_unref(worker->packet);
+
+    lock.lock();
+    worker->pending = false;
+    worker->done = true;
+    worker->got_frame = got_frame;
+    worker->ret = ret;
+    done_.notify_all();
+  }
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+extern "C"
+{
+  #define __STDC_CONSTANT_MACROS
+  #include <libavcodec/avcodec.h>
+}
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Noncopyable.h"
+
+class MediaPool;
+
+// Decodes an intra-only video stream on several threads, for the codecs
+// libavcodec cannot thread itself (MJPEG in this version): packet n goes to
+// the n % threads-th copy of the stream's decoder and the pictures come back
+// in packet order. Like frame threading, the output lags threads - 1 packets
+// behind; a NULL packet drains them at the end of the stream. A packet that
+// fails to decode is logged and loses its picture: by the time its result
+// comes back the caller has handed over later packets.
+class ParallelDecoder : Noncopyable
+{
+public:
+  // stream_ctx is the opened decoder of the stream; it is not used to decode but
+  // follows the size and format of the pictures, as with libavcodec's threads
+  ParallelDecoder(AVCodecContext *stream_ctx, int threads, MediaPool *pool);
+  ~ParallelDecoder();
+
+  // intra-only video whose decoder has no frame threads of its own
+  static bool Supports(const AVCodecContext *stream_ctx);
+
+  // opens a decoder per thread and starts the threads
+  int Open();
+  // avcodec_decode_video2() semantics; a NULL or empty packet returns the next
+  // picture in flight, got_frame stays 0 once there is none
+  int Decode(AVFrame *frame, int *got_frame, const AVPacket *packet);
+
+  int Threads() const { return (int)workers_.size(); }
+
+private:
+  struct Worker
+  {
+    AVCodecContext *dec_ctx;
+    std::thread    *thread;
+    AVPacket       *packet;
+    AVFrame        *frame;
+    bool            pending;   /* packet handed over, under mutex_ */
+    bool            done;      /* frame, got_frame and ret are valid, under mutex_ */
+    int             got_frame;
+    int             ret;
+    int64_t         pts;       /* of the packet, for the log */
+  };
+
+  // waits for the oldest packet in flight; its picture, if any, goes to frame
+  void take_oldest(AVFrame *frame, int *got_frame);
+  void run(Worker *worker);
+
+private:
+  AVCodecContext *stream_ctx_;
+  MediaPool *pool_;
+  std::vector<Worker> workers_;
+  std::mutex mutex_;
+  std::condition_variable work_;
+  std::condition_variable done_;
+  bool stopping_;            /* under mutex_ */
+  uint64_t next_;            /* decoding thread: packets handed out */
+  unsigned int in_flight_;   /* decoding thread: of them not returned yet */
+};
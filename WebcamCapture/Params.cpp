@@ -1,4 +1,6 @@
-#include "params.h"
+#include "Params.h"
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <string>
 
@@ -9,7 +11,76 @@ const char * Params::params_name[PARAMS_MAX+1] =
   "video device ID",
   "video device name",
   "audio device ID",
-  "audio device name"
+  "audio device name",
+  "capture queue size in packets",
+  "capture queue overflow policy: block, drop_oldest or drop_nonkey",
+  "streams to copy without re-encoding: video, audio or all",
+  "video encoder name",
+  "video encoder preset",
+  "video encoder tune",
+  "video constant rate factor",
+  "video bitrate",
+  "video keyframe interval in frames",
+  "video encoder threads",
+  "video encoder thread type: frame or slice",
+  "video encoder pixel format",
+  "other video encoder options as key=value:key=value",
+  "audio encoder name",
+  "audio bitrate",
+  "other audio encoder options as key=value:key=value",
+  "video filter chain, e.g. scale=1280:720,fps=15",
+  "audio filter chain",
+  "filter graph threads, 0 is automatic",
+  "start a new output file every N seconds",
+  "start a new output file after N bytes, K/M/G suffixes allowed",
+  "segment file name, strftime fields and %05d for the number",
+  "keep at most N segment files",
+  "keep at most N bytes of segment files, K/M/G suffixes allowed",
+  "DVR mode: seconds kept in memory before an event",
+  "DVR mode: seconds recorded after an event",
+  "DVR mode: memory cap of the buffer and of the writer queue, K/M/G suffixes allowed",
+  "DVR mode: event file name, strftime fields and %d for the number",
+  "video frame rate policy: cfr or vfr",
+  "move video along with the audio clock: 1 or 0",
+  "read this file or lavfi graph instead of the camera",
+  "input format of -i, e.g. lavfi",
+  "read -i in real time: 1 or 0",
+  "input backend: dshow, v4l2, file, lavfi or spool",
+  "input device/demuxer options as key=value:key=value",
+  "print the formats the devices offer and exit: 1",
+  "write per-stage latency metrics to this file",
+  "metrics export interval in milliseconds",
+  "metrics file format: prometheus or json",
+  "low-latency mode for live monitoring: 1 or 0",
+  "warn when a packet is written more than N ms after capture",
+  "write the output files from a background thread: 1 or 0",
+  "async write block size, e.g. 1M",
+  "async write bytes queued before the muxer waits, e.g. 64M",
+  "reserve disk space this far ahead of the writes, e.g. 256M",
+  "O_DIRECT for async writes, bypassing the page cache: 1 or 0",
+  "more outputs of the same encoding: [f=mpegts]udp://127.0.0.1:1234|copy.mkv",
+  "packets queued per extra output before it drops",
+  "seconds before a failed stream output is reopened, 0 = never",
+  "scaled video renditions as size:bitrate, e.g. 720p:3M,360p:800k",
+  "several cameras at once as video[+audio]:output, e.g. 0+1:cam0.mp4|2:cam2.mp4",
+  "encoder threads shared by the sessions, 0 = one per core",
+  "encode only while something moves: 1 or 0",
+  "luma change of an 8x8 block that counts as motion, 0-255",
+  "percent of the blocks that must change",
+  "frames per second kept of a static scene, e.g. 0.2, 0 = none",
+  "seconds at the full frame rate after the last motion",
+  "areas ignored by the motion detector as x,y,w,h in percent, e.g. 0,0,100,8|75,0,25,40",
+  "steps taken when the host falls behind: bframes,preset,fps,scale, 1 = all in that order",
+  "processing lag in ms that counts as falling behind",
+  "seconds of calm before a step is undone",
+  "still image of the video, .jpg or .png; strftime fields or %d keep every one",
+  "seconds between stills, 0 = only on the 's' command",
+  "width of the stills, 0 = full size",
+  "write the raw packets to spool files of this size, e.g. 2G, and transcode later",
+  "seconds per fragment of a fragmented MP4/MOV/MKV output, readable up to the last one after a crash",
+  "decoder threads, a number or auto; sessions share the cores by default",
+  "decoder thread type: frame or slice",
+  "file of the stream parameters probed per device, later starts skip the probe"
 };
 
 const char * Params::params_key[PARAMS_MAX+1] = 
@@ -19,10 +90,80 @@ const char * Params::params_key[PARAMS_MAX+1] =
   "-v",
   "-video_name",
   "-a",
-  "-audio_name"
+  "-audio_name",
+  "-queue_size",
+  "-queue_policy",
+  "-copy",
+  "-vcodec",
+  "-vpreset",
+  "-vtune",
+  "-vcrf",
+  "-vbitrate",
+  "-vgop",
+  "-vthreads",
+  "-vthread_type",
+  "-vpix_fmt",
+  "-vopts",
+  "-acodec",
+  "-abitrate",
+  "-aopts",
+  "-vf",
+  "-af",
+  "-filter_threads",
+  "-segment_time",
+  "-segment_size",
+  "-segment_template",
+  "-segment_count",
+  "-segment_max_bytes",
+  "-event_pre",
+  "-event_post",
+  "-event_memory",
+  "-event_template",
+  "-vsync",
+  "-drift_correction",
+  "-i",
+  "-input_format",
+  "-re",
+  "-backend",
+  "-input_options",
+  "-list_formats",
+  "-metrics",
+  "-metrics_interval",
+  "-metrics_format",
+  "-low_latency",
+  "-latency_target",
+  "-async_write",
+  "-write_block",
+  "-write_max_pending",
+  "-preallocate",
+  "-direct_io",
+  "-outputs",
+  "-output_queue",
+  "-output_retry",
+  "-renditions",
+  "-sessions",
+  "-workers",
+  "-motion",
+  "-motion_threshold",
+  "-motion_area",
+  "-motion_keepalive",
+  "-motion_hold",
+  "-motion_mask",
+  "-degrade",
+  "-degrade_lag",
+  "-degrade_recover",
+  "-snapshot",
+  "-snapshot_interval",
+  "-snapshot_width",
+  "-spool",
+  "-fragment",
+  "-dthreads",
+  "-dthread_type",
+  "-probe_cache"
 };
 
 const int CONST_CAPTURE_DURATION_SEC = 5;
+const int CONST_QUEUE_SIZE = 512;
 
 Params::Params(int argc, const char ** argv)
   :status_(SUCCEED)
@@ -31,30 +172,47 @@ Params::Params(int argc, const char ** argv)
   {
     for (int params_it = PARAMS_MIN; params_it <= PARAMS_MAX; ++params_it)
     {
-      if (strstr(argv[i], params_key[params_it]) != nullptr && strstr(argv[i]+strlen(params_key[params_it]), "=") != nullptr)
+      //whole key only, so "-v" does not swallow "-video_name"
+      size_t key_length = strlen(params_key[params_it]);
+      if (strncmp(argv[i], params_key[params_it], key_length) == 0 && argv[i][key_length] == '=')
       {
         params_[params_it] = argv[i]+strlen(params_key[params_it])+1;
       }
     }
   }
 
-  //check for required params
-  params_type::const_iterator it = params_.find(FILE_DESTINATION);
+  //check for required params, -sessions names its own devices and files, -list_formats writes no file
+  params_type::const_iterator it = params_.find(SESSIONS);
   if (it == params_.end())
   {
-    status_ = INVALID_PARAM;
-    return;
+    it = params_.find(FILE_DESTINATION);
+    bool listing = params_.find(LIST_FORMATS) != params_.end() && atoi(params_[LIST_FORMATS].c_str()) > 0;
+    if (it == params_.end() && !listing)
+    {
+      status_ = INVALID_PARAM;
+      return;
+    }
+    it = params_.find(VIDEO_DEVICE_ID);
+    if (it == params_.end() && params_.find(INPUT_URL) == params_.end())
+    {
+      status_ = INVALID_PARAM;
+      return;
+    }
   }
-  it = params_.find(VIDEO_DEVICE_ID);
+  it = params_.find(CAPTURE_DURATION_SEC);
   if (it == params_.end())
   {
-    status_ = INVALID_PARAM;
-    return;
+    params_[CAPTURE_DURATION_SEC] = std::to_string(CONST_CAPTURE_DURATION_SEC);
   }
-  it = params_.find(CAPTURE_DURATION_SEC);
+  it = params_.find(QUEUE_SIZE);
   if (it == params_.end())
   {
-    params_[CAPTURE_DURATION_SEC] = std::to_string(CONST_CAPTURE_DURATION_SEC);
+    params_[QUEUE_SIZE] = std::to_string(CONST_QUEUE_SIZE);
+  }
+  it = params_.find(QUEUE_POLICY);
+  if (it == params_.end())
+  {
+    params_[QUEUE_POLICY] = "block";
   }
 }
 
@@ -86,7 +244,7 @@ int Params::Set(int index, const std::string & value)
 void Params::PrintInfo()
 {
   std::cout << "==== Please define params: ====" << std::endl;
-  for (int it = PARAMS_MIN; it != PARAMS_MAX; ++it)
+  for (int it = PARAMS_MIN; it <= PARAMS_MAX; ++it)
   {
     if (!IsInternalParam(it))
     {
@@ -97,7 +255,29 @@ void Params::PrintInfo()
                 "WebcamCapture.exe -f=c:\\output.avi -d=10 -v=0 -a=1\n"
                 "Where d=10 is 10 seconds of capturing\n"
                 "v=0 is the first capture video device in list,\n"
-                "a=1 is the second capture sound device.\n";
+                "a=1 is the second capture sound device.\n"
+                "Use -d=0 -segment_time=600 -segment_count=144 to record\n"
+                "a rolling day of 10 minute files until Ctrl+C.\n"
+                "Use -d=0 -event_pre=30 to keep 30 seconds in memory and\n"
+                "save them when 'e' is entered or Ctrl+Break is pressed.\n"
+                "Use -i=test.avi or -input_format=lavfi -i=testsrc instead of -v\n"
+                "to record without a camera.\n"
+                "Use -backend=v4l2 -v=0 -a=1 on Linux, -list_formats=1 shows\n"
+                "what the chosen devices can capture.\n"
+                "Use -metrics=capture.prom to see where the time goes per stage.\n"
+                "Use -low_latency=1 -latency_target=100 -f=live.ts for monitoring.\n"
+                "Use -async_write=1 -preallocate=256M on slow or shared disks.\n"
+                "Use -outputs=\"[f=mpegts]udp://127.0.0.1:1234\" to also stream what is recorded.\n"
+                "Use -renditions=720p:3M,360p:800k for out_720p.mp4 and out_360p.mp4 as well.\n"
+                "Use -sessions=\"0+1:cam0.mp4|2:cam2.mp4\" -workers=4 instead of -f -v -a\n"
+                "to record several cameras on a shared pool of encoder threads.\n"
+                "Use -motion=1 -motion_keepalive=0.2 to encode a static scene at one frame in 5 seconds.\n"
+                "Use -degrade=1 to drop B-frames, then speed, frame rate and size when the CPU cannot keep up.\n"
+                "Use -snapshot=cam.jpg -snapshot_interval=5 for a dashboard still, 's' takes one now.\n"
+                "Use -spool=2G -f=cam_%03d.spool to keep up on a weak CPU, then -i=cam_000.spool -f=cam.mp4\n"
+                "to transcode it when there is time.\n"
+                "Use -fragment=2 -f=cam.mp4 for a file that survives a killed process.\n"
+                "Use -probe_cache=probe.cache to start in a fraction of a second after the first run.\n";
   std::cout << std::endl;
 }
 
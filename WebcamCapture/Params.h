@@ -22,8 +22,77 @@ public:
     VIDEO_DEVICE_NAME,
     AUDIO_DEVICE_ID,
     AUDIO_DEVICE_NAME,
+    QUEUE_SIZE,
+    QUEUE_POLICY,
+    STREAM_COPY,
+    VIDEO_CODEC,
+    VIDEO_PRESET,
+    VIDEO_TUNE,
+    VIDEO_CRF,
+    VIDEO_BITRATE,
+    VIDEO_GOP,
+    VIDEO_THREADS,
+    VIDEO_THREAD_TYPE,
+    VIDEO_PIX_FMT,
+    VIDEO_CODEC_OPTIONS,
+    AUDIO_CODEC,
+    AUDIO_BITRATE,
+    AUDIO_CODEC_OPTIONS,
+    VIDEO_FILTER,
+    AUDIO_FILTER,
+    FILTER_THREADS,
+    SEGMENT_TIME,
+    SEGMENT_SIZE,
+    SEGMENT_TEMPLATE,
+    SEGMENT_COUNT,
+    SEGMENT_MAX_BYTES,
+    EVENT_PRE,
+    EVENT_POST,
+    EVENT_MEMORY,
+    EVENT_TEMPLATE,
+    VIDEO_SYNC,
+    DRIFT_CORRECTION,
+    INPUT_URL,
+    INPUT_FORMAT,
+    PACE_INPUT,
+    INPUT_BACKEND,
+    INPUT_OPTIONS,
+    LIST_FORMATS,
+    METRICS_FILE,
+    METRICS_INTERVAL,
+    METRICS_FORMAT,
+    LOW_LATENCY,
+    LATENCY_TARGET,
+    ASYNC_WRITE,
+    WRITE_BLOCK,
+    WRITE_MAX_PENDING,
+    PREALLOCATE,
+    DIRECT_IO,
+    OUTPUTS,
+    OUTPUT_QUEUE,
+    OUTPUT_RETRY,
+    RENDITIONS,
+    SESSIONS,
+    WORKERS,
+    MOTION,
+    MOTION_THRESHOLD,
+    MOTION_AREA,
+    MOTION_KEEPALIVE,
+    MOTION_HOLD,
+    MOTION_MASK,
+    DEGRADE,
+    DEGRADE_LAG,
+    DEGRADE_RECOVER,
+    SNAPSHOT,
+    SNAPSHOT_INTERVAL,
+    SNAPSHOT_WIDTH,
+    SPOOL,
+    FRAGMENT,
+    DECODER_THREADS,
+    DECODER_THREAD_TYPE,
+    PROBE_CACHE,
     PARAMS_MIN = FILE_DESTINATION,
-    PARAMS_MAX = AUDIO_DEVICE_NAME
+    PARAMS_MAX = PROBE_CACHE
   };
 
   static const char * params_name[PARAMS_MAX+1];
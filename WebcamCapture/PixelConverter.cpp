@@ -0,0 +1,370 @@
+#include "PixelConverter.h"
+
+extern "C"
+{
+  #include <libavutil/cpu.h>
+  #include <libavutil/imgutils.h>
+}
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define PIXEL_CONVERTER_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__)
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_SSE2
+#define TARGET_AVX2
+#endif
+
+/* One call converts a pair of rows: src0/src1 are the source rows (the same
+ * row for the last line of an odd height), pairs is the number of chroma
+ * samples, i.e. (width + 1) / 2. */
+typedef void (*yuyv_planar_fn)(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1,
+  uint8_t *u, uint8_t *v, int pairs);
+typedef void (*yuyv_nv12_fn)(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1,
+  uint8_t *uv, int pairs);
+typedef void (*split_uv_fn)(const uint8_t *uv, uint8_t *u, uint8_t *v, int pairs);
+
+static void yuyv_to_yuv420p_c(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1,
+  uint8_t *u, uint8_t *v, int pairs)
+{
+  for (int i = 0; i < pairs; i++)
+  {
+    const uint8_t *a = src0 + 4 * i;
+    const uint8_t *b = src1 + 4 * i;
+    y0[2 * i]     = a[0];
+    y0[2 * i + 1] = a[2];
+    y1[2 * i]     = b[0];
+    y1[2 * i + 1] = b[2];
+    u[i] = (uint8_t)((a[1] + b[1] + 1) >> 1);
+    v[i] = (uint8_t)((a[3] + b[3] + 1) >> 1);
+  }
+}
+
+static void yuyv_to_nv12_c(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1,
+  uint8_t *uv, int pairs)
+{
+  for (int i = 0; i < pairs; i++)
+  {
+    const uint8_t *a = src0 + 4 * i;
+    const uint8_t *b = src1 + 4 * i;
+    y0[2 * i]     = a[0];
+    y0[2 * i + 1] = a[2];
+    y1[2 * i]     = b[0];
+    y1[2 * i + 1] = b[2];
+    uv[2 * i]     = (uint8_t)((a[1] + b[1] + 1) >> 1);
+    uv[2 * i + 1] = (uint8_t)((a[3] + b[3] + 1) >> 1);
+  }
+}
+
+static void split_uv_c(const uint8_t *uv, uint8_t *u, uint8_t *v, int pairs)
+{
+  for (int i = 0; i < pairs; i++)
+  {
+    u[i] = uv[2 * i];
+    v[i] = uv[2 * i + 1];
+  }
+}
+
+#ifdef PIXEL_CONVERTER_X86
+
+/* 16 pixels per step: even bytes are luma, odd bytes UVUV */
+TARGET_SSE2 static void yuyv_to_yuv420p_sse2(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1,
+  uint8_t *u, uint8_t *v, int pairs)
+{
+  const __m128i low = _mm_set1_epi16(0x00ff);
+  const __m128i zero = _mm_setzero_si128();
+  int i = 0;
+  for (; i + 8 <= pairs; i += 8)
+  {
+    __m128i a0 = _mm_loadu_si128((const __m128i*)(src0 + 4 * i));
+    __m128i a1 = _mm_loadu_si128((const __m128i*)(src0 + 4 * i + 16));
+    __m128i b0 = _mm_loadu_si128((const __m128i*)(src1 + 4 * i));
+    __m128i b1 = _mm_loadu_si128((const __m128i*)(src1 + 4 * i + 16));
+    _mm_storeu_si128((__m128i*)(y0 + 2 * i), _mm_packus_epi16(_mm_and_si128(a0, low), _mm_and_si128(a1, low)));
+    _mm_storeu_si128((__m128i*)(y1 + 2 * i), _mm_packus_epi16(_mm_and_si128(b0, low), _mm_and_si128(b1, low)));
+    __m128i uv = _mm_avg_epu8(
+      _mm_packus_epi16(_mm_srli_epi16(a0, 8), _mm_srli_epi16(a1, 8)),
+      _mm_packus_epi16(_mm_srli_epi16(b0, 8), _mm_srli_epi16(b1, 8)));
+    _mm_storel_epi64((__m128i*)(u + i), _mm_packus_epi16(_mm_and_si128(uv, low), zero));
+    _mm_storel_epi64((__m128i*)(v + i), _mm_packus_epi16(_mm_srli_epi16(uv, 8), zero));
+  }
+  yuyv_to_yuv420p_c(src0 + 4 * i, src1 + 4 * i, y0 + 2 * i, y1 + 2 * i, u + i, v + i, pairs - i);
+}
+
+TARGET_SSE2 static void yuyv_to_nv12_sse2(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1,
+  uint8_t *uv, int pairs)
+{
+  const __m128i low = _mm_set1_epi16(0x00ff);
+  int i = 0;
+  for (; i + 8 <= pairs; i += 8)
+  {
+    __m128i a0 = _mm_loadu_si128((const __m128i*)(src0 + 4 * i));
+    __m128i a1 = _mm_loadu_si128((const __m128i*)(src0 + 4 * i + 16));
+    __m128i b0 = _mm_loadu_si128((const __m128i*)(src1 + 4 * i));
+    __m128i b1 = _mm_loadu_si128((const __m128i*)(src1 + 4 * i + 16));
+    _mm_storeu_si128((__m128i*)(y0 + 2 * i), _mm_packus_epi16(_mm_and_si128(a0, low), _mm_and_si128(a1, low)));
+    _mm_storeu_si128((__m128i*)(y1 + 2 * i), _mm_packus_epi16(_mm_and_si128(b0, low), _mm_and_si128(b1, low)));
+    _mm_storeu_si128((__m128i*)(uv + 2 * i), _mm_avg_epu8(
+      _mm_packus_epi16(_mm_srli_epi16(a0, 8), _mm_srli_epi16(a1, 8)),
+      _mm_packus_epi16(_mm_srli_epi16(b0, 8), _mm_srli_epi16(b1, 8))));
+  }
+  yuyv_to_nv12_c(src0 + 4 * i, src1 + 4 * i, y0 + 2 * i, y1 + 2 * i, uv + 2 * i, pairs - i);
+}
+
+TARGET_SSE2 static void split_uv_sse2(const uint8_t *uv, uint8_t *u, uint8_t *v, int pairs)
+{
+  const __m128i low = _mm_set1_epi16(0x00ff);
+  int i = 0;
+  for (; i + 16 <= pairs; i += 16)
+  {
+    __m128i a = _mm_loadu_si128((const __m128i*)(uv + 2 * i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(uv + 2 * i + 16));
+    _mm_storeu_si128((__m128i*)(u + i), _mm_packus_epi16(_mm_and_si128(a, low), _mm_and_si128(b, low)));
+    _mm_storeu_si128((__m128i*)(v + i), _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+  }
+  split_uv_c(uv + 2 * i, u + i, v + i, pairs - i);
+}
+
+/* The AVX2 versions do twice the work per step. packus works within 128-bit
+ * lanes, so its result has the middle quadwords swapped; permute 0xD8 puts
+ * them back in order. */
+TARGET_AVX2 static void yuyv_to_yuv420p_avx2(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1,
+  uint8_t *u, uint8_t *v, int pairs)
+{
+  const __m256i low = _mm256_set1_epi16(0x00ff);
+  int i = 0;
+  for (; i + 16 <= pairs; i += 16)
+  {
+    __m256i a0 = _mm256_loadu_si256((const __m256i*)(src0 + 4 * i));
+    __m256i a1 = _mm256_loadu_si256((const __m256i*)(src0 + 4 * i + 32));
+    __m256i b0 = _mm256_loadu_si256((const __m256i*)(src1 + 4 * i));
+    __m256i b1 = _mm256_loadu_si256((const __m256i*)(src1 + 4 * i + 32));
+    _mm256_storeu_si256((__m256i*)(y0 + 2 * i), _mm256_permute4x64_epi64(
+      _mm256_packus_epi16(_mm256_and_si256(a0, low), _mm256_and_si256(a1, low)), 0xD8));
+    _mm256_storeu_si256((__m256i*)(y1 + 2 * i), _mm256_permute4x64_epi64(
+      _mm256_packus_epi16(_mm256_and_si256(b0, low), _mm256_and_si256(b1, low)), 0xD8));
+    __m256i uv = _mm256_permute4x64_epi64(_mm256_avg_epu8(
+      _mm256_packus_epi16(_mm256_srli_epi16(a0, 8), _mm256_srli_epi16(a1, 8)),
+      _mm256_packus_epi16(_mm256_srli_epi16(b0, 8), _mm256_srli_epi16(b1, 8))), 0xD8);
+    /* U in the low half, V in the high half */
+    __m256i planar = _mm256_permute4x64_epi64(
+      _mm256_packus_epi16(_mm256_and_si256(uv, low), _mm256_srli_epi16(uv, 8)), 0xD8);
+    _mm_storeu_si128((__m128i*)(u + i), _mm256_castsi256_si128(planar));
+    _mm_storeu_si128((__m128i*)(v + i), _mm256_extracti128_si256(planar, 1));
+  }
+  _mm256_zeroupper();
+  yuyv_to_yuv420p_c(src0 + 4 * i, src1 + 4 * i, y0 + 2 * i, y1 + 2 * i, u + i, v + i, pairs - i);
+}
+
+TARGET_AVX2 static void yuyv_to_nv12_avx2(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1,
+  uint8_t *uv, int pairs)
+{
+  const __m256i low = _mm256_set1_epi16(0x00ff);
+  int i = 0;
+  for (; i + 16 <= pairs; i += 16)
+  {
+    __m256i a0 = _mm256_loadu_si256((const __m256i*)(src0 + 4 * i));
+    __m256i a1 = _mm256_loadu_si256((const __m256i*)(src0 + 4 * i + 32));
+    __m256i b0 = _mm256_loadu_si256((const __m256i*)(src1 + 4 * i));
+    __m256i b1 = _mm256_loadu_si256((const __m256i*)(src1 + 4 * i + 32));
+    _mm256_storeu_si256((__m256i*)(y0 + 2 * i), _mm256_permute4x64_epi64(
+      _mm256_packus_epi16(_mm256_and_si256(a0, low), _mm256_and_si256(a1, low)), 0xD8));
+    _mm256_storeu_si256((__m256i*)(y1 + 2 * i), _mm256_permute4x64_epi64(
+      _mm256_packus_epi16(_mm256_and_si256(b0, low), _mm256_and_si256(b1, low)), 0xD8));
+    _mm256_storeu_si256((__m256i*)(uv + 2 * i), _mm256_permute4x64_epi64(_mm256_avg_epu8(
+      _mm256_packus_epi16(_mm256_srli_epi16(a0, 8), _mm256_srli_epi16(a1, 8)),
+      _mm256_packus_epi16(_mm256_srli_epi16(b0, 8), _mm256_srli_epi16(b1, 8))), 0xD8));
+  }
+  _mm256_zeroupper();
+  yuyv_to_nv12_c(src0 + 4 * i, src1 + 4 * i, y0 + 2 * i, y1 + 2 * i, uv + 2 * i, pairs - i);
+}
+
+TARGET_AVX2 static void split_uv_avx2(const uint8_t *uv, uint8_t *u, uint8_t *v, int pairs)
+{
+  const __m256i low = _mm256_set1_epi16(0x00ff);
+  int i = 0;
+  for (; i + 32 <= pairs; i += 32)
+  {
+    __m256i a = _mm256_loadu_si256((const __m256i*)(uv + 2 * i));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(uv + 2 * i + 32));
+    _mm256_storeu_si256((__m256i*)(u + i), _mm256_permute4x64_epi64(
+      _mm256_packus_epi16(_mm256_and_si256(a, low), _mm256_and_si256(b, low)), 0xD8));
+    _mm256_storeu_si256((__m256i*)(v + i), _mm256_permute4x64_epi64(
+      _mm256_packus_epi16(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8)), 0xD8));
+  }
+  _mm256_zeroupper();
+  split_uv_c(uv + 2 * i, u + i, v + i, pairs - i);
+}
+
+#endif
+
+struct Kernels
+{
+  yuyv_planar_fn yuyv_planar;
+  yuyv_nv12_fn   yuyv_nv12;
+  split_uv_fn    split_uv;
+};
+
+static const Kernels kernels[] =
+{
+  { yuyv_to_yuv420p_c, yuyv_to_nv12_c, split_uv_c },
+#ifdef PIXEL_CONVERTER_X86
+  { yuyv_to_yuv420p_sse2, yuyv_to_nv12_sse2, split_uv_sse2 },
+  { yuyv_to_yuv420p_avx2, yuyv_to_nv12_avx2, split_uv_avx2 },
+#endif
+};
+
+PixelConverter::PixelConverter(AVPixelFormat src_format, AVPixelFormat dst_format, isa level)
+  : src_format_(src_format)
+  , dst_format_(dst_format)
+  , isa_(FFMIN(level, BestIsa()))
+  , width_(0)
+  , height_(0)
+{
+  for (int i = 0; i < 3; i++)
+  {
+    pools_[i] = NULL;
+    linesize_[i] = 0;
+  }
+}
+
+PixelConverter::~PixelConverter()
+{
+  /* buffers still held by the encoders keep their pool alive */
+  for (int i = 0; i < 3; i++)
+  {
+    av_buffer_pool_uninit(&pools_[i]);
+  }
+}
+
+bool PixelConverter::Supports(AVPixelFormat src_format, AVPixelFormat dst_format)
+{
+  return (src_format == AV_PIX_FMT_YUYV422 && (dst_format == AV_PIX_FMT_YUV420P || dst_format == AV_PIX_FMT_NV12)) ||
+    (src_format == AV_PIX_FMT_NV12 && dst_format == AV_PIX_FMT_YUV420P);
+}
+
+PixelConverter::isa PixelConverter::BestIsa()
+{
+#ifdef PIXEL_CONVERTER_X86
+  int flags = av_get_cpu_flags();
+  if (flags & AV_CPU_FLAG_AVX2)
+  {
+    return AVX2;
+  }
+  if (flags & AV_CPU_FLAG_SSE2)
+  {
+    return SSE2;
+  }
+#endif
+  return C;
+}
+
+const char *PixelConverter::IsaName(isa level)
+{
+  switch (level)
+  {
+  case AVX2: return "avx2";
+  case SSE2: return "sse2";
+  default:   return "c";
+  }
+}
+
+int PixelConverter::alloc_planes(AVFrame *dst, int width, int height)
+{
+  int chroma_height = (height + 1) / 2;
+  int planes = (dst_format_ == AV_PIX_FMT_NV12) ? 2 : 3;
+  if (width != width_ || height != height_)
+  {
+    /* 64-byte aligned rows plus padding past the end, as encoders expect */
+    for (int i = 0; i < 3; i++)
+    {
+      av_buffer_pool_uninit(&pools_[i]);
+      linesize_[i] = 0;
+    }
+    linesize_[0] = FFALIGN(width, 64);
+    linesize_[1] = (planes == 2) ? FFALIGN((width + 1) / 2 * 2, 64) : FFALIGN((width + 1) / 2, 64);
+    linesize_[2] = (planes == 2) ? 0 : linesize_[1];
+    for (int i = 0; i < planes; i++)
+    {
+      pools_[i] = av_buffer_pool_init(linesize_[i] * (i ? chroma_height : height) + 64, av_buffer_alloc);
+      if (!pools_[i])
+      {
+        width_ = height_ = 0;
+        return AVERROR(ENOMEM);
+      }
+    }
+    width_ = width;
+    height_ = height;
+  }
+
+  for (int i = 0; i < planes; i++)
+  {
+    dst->buf[i] = av_buffer_pool_get(pools_[i]);
+    if (!dst->buf[i])
+    {
+      av_frame_unref(dst);
+      return AVERROR(ENOMEM);
+    }
+    dst->data[i] = dst->buf[i]->data;
+    dst->linesize[i] = linesize_[i];
+  }
+  dst->format = dst_format_;
+  dst->width = width;
+  dst->height = height;
+  return 0;
+}
+
+int PixelConverter::Convert(const AVFrame *src, AVFrame *dst)
+{
+  if (src->format != src_format_ || src->width <= 0 || src->height <= 0)
+  {
+    return AVERROR(EINVAL);
+  }
+  int ret = alloc_planes(dst, src->width, src->height);
+  if (ret < 0)
+  {
+    return ret;
+  }
+  if ((ret = av_frame_copy_props(dst, src)) < 0)
+  {
+    av_frame_unref(dst);
+    return ret;
+  }
+
+  const Kernels &k = kernels[isa_];
+  int pairs = (src->width + 1) / 2;
+  if (src_format_ == AV_PIX_FMT_NV12)
+  {
+    av_image_copy_plane(dst->data[0], dst->linesize[0], src->data[0], src->linesize[0], src->width, src->height);
+    for (int y = 0; y < (src->height + 1) / 2; y++)
+    {
+      k.split_uv(src->data[1] + y * src->linesize[1], dst->data[1] + y * dst->linesize[1],
+        dst->data[2] + y * dst->linesize[2], pairs);
+    }
+    return 0;
+  }
+
+  for (int y = 0; y < src->height; y += 2)
+  {
+    /* an odd last row pairs with itself */
+    int next = (y + 1 < src->height) ? y + 1 : y;
+    const uint8_t *src0 = src->data[0] + y * src->linesize[0];
+    const uint8_t *src1 = src->data[0] + next * src->linesize[0];
+    uint8_t *y0 = dst->data[0] + y * dst->linesize[0];
+    uint8_t *y1 = dst->data[0] + next * dst->linesize[0];
+    if (dst_format_ == AV_PIX_FMT_NV12)
+    {
+      k.yuyv_nv12(src0, src1, y0, y1, dst->data[1] + y / 2 * dst->linesize[1], pairs);
+    }
+    else
+    {
+      k.yuyv_planar(src0, src1, y0, y1, dst->data[1] + y / 2 * dst->linesize[1],
+        dst->data[2] + y / 2 * dst->linesize[2], pairs);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+extern "C"
+{
+  #define __STDC_CONSTANT_MACROS
+  #include <libavutil/buffer.h>
+  #include <libavutil/frame.h>
+  #include <libavutil/pixfmt.h>
+}
+
+#include "Noncopyable.h"
+
+// Dedicated same-size conversions for what cameras deliver and encoders
+// want: YUYV422 to YUV420P or NV12, and NV12 to YUV420P. The generic swscale
+// path the buffersink would insert is the costliest per-frame step for these.
+// Vertical chroma is the rounded average of each row pair, like pavgb. The
+// kernels come in SSE2 and AVX2 flavours picked from av_get_cpu_flags(); the
+// C version handles other CPUs and the row tails.
+class PixelConverter : Noncopyable
+{
+public:
+  enum isa
+  {
+    C,
+    SSE2,
+    AVX2
+  };
+
+  // level is capped at what the CPU and the build support
+  PixelConverter(AVPixelFormat src_format, AVPixelFormat dst_format, isa level = AVX2);
+  ~PixelConverter();
+
+  static bool Supports(AVPixelFormat src_format, AVPixelFormat dst_format);
+  static isa BestIsa();
+  static const char *IsaName(isa level);
+
+  AVPixelFormat SourceFormat() const { return src_format_; }
+  isa Isa() const { return isa_; }
+
+  // dst (unreferenced) gets pooled buffers in src's size plus src's properties;
+  // one thread at a time, the buffers may be released anywhere
+  int Convert(const AVFrame *src, AVFrame *dst);
+
+private:
+  int alloc_planes(AVFrame *dst, int width, int height);
+
+private:
+  AVPixelFormat src_format_;
+  AVPixelFormat dst_format_;
+  isa isa_;
+  AVBufferPool *pools_[3];
+  int linesize_[3];
+  int width_;
+  int height_;
+};
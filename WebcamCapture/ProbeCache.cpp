@@ -0,0 +1,330 @@
+#include "ProbeCache.h"
+#include "OutputMuxer.h"
+
+extern "C"
+{
+  #include <libavutil/pixdesc.h>
+}
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+typedef std::map<std::string, std::string> Fields;
+
+static const char *HEADER = "# WebcamCapture probe cache, one input per line";
+
+/* a line per entry and a tab between its parts */
+static std::string clean_key(const std::string &key)
+{
+  std::string clean = key;
+  for (size_t i = 0; i < clean.size(); i++)
+  {
+    if (clean[i] == '\t' || clean[i] == '\n' || clean[i] == '\r')
+    {
+      clean[i] = ' ';
+    }
+  }
+  return clean;
+}
+
+static std::vector<std::string> split(const std::string &text, char separator)
+{
+  std::vector<std::string> parts;
+  size_t start = 0;
+  while (start <= text.size())
+  {
+    size_t end = text.find(separator, start);
+    if (end == std::string::npos)
+    {
+      end = text.size();
+    }
+    parts.push_back(text.substr(start, end - start));
+    start = end + 1;
+  }
+  return parts;
+}
+
+static Fields parse_stream(const std::string &text)
+{
+  Fields fields;
+  std::istringstream tokens(text);
+  std::string token;
+  while (tokens >> token)
+  {
+    size_t equal = token.find('=');
+    if (equal != std::string::npos)
+    {
+      fields[token.substr(0, equal)] = token.substr(equal + 1);
+    }
+  }
+  return fields;
+}
+
+static std::string field(const Fields &fields, const char *name)
+{
+  Fields::const_iterator it = fields.find(name);
+  return it != fields.end() ? it->second : std::string();
+}
+
+static int64_t int_field(const Fields &fields, const char *name)
+{
+  return strtoll(field(fields, name).c_str(), NULL, 10);
+}
+
+static AVRational rational_field(const Fields &fields, const char *name)
+{
+  AVRational value = { 0, 1 };
+  sscanf(field(fields, name).c_str(), "%d/%d", &value.num, &value.den);
+  return value;
+}
+
+static AVCodecID codec_field(const Fields &fields)
+{
+  const AVCodecDescriptor *desc = avcodec_descriptor_get_by_name(field(fields, "codec").c_str());
+  return desc ? desc->id : AV_CODEC_ID_NONE;
+}
+
+static std::string describe_stream(const AVStream *stream)
+{
+  const AVCodecContext *codec = stream->codec;
+  const char *type = av_get_media_type_string(codec->codec_type);
+  std::ostringstream text;
+  text << "type=" << (type ? type : "unknown") << " codec=" << avcodec_get_name(codec->codec_id) <<
+    " tag=" << codec->codec_tag << " bits=" << codec->bits_per_coded_sample;
+  if (codec->codec_type == AVMEDIA_TYPE_VIDEO)
+  {
+    const char *pix_fmt = av_get_pix_fmt_name(codec->pix_fmt);
+    text << " width=" << codec->width << " height=" << codec->height << " pix_fmt=" << (pix_fmt ? pix_fmt : "none") <<
+      " sar=" << codec->sample_aspect_ratio.num << "/" << codec->sample_aspect_ratio.den <<
+      " fps=" << stream->avg_frame_rate.num << "/" << stream->avg_frame_rate.den <<
+      " rfps=" << stream->r_frame_rate.num << "/" << stream->r_frame_rate.den;
+  }
+  else if (codec->codec_type == AVMEDIA_TYPE_AUDIO)
+  {
+    const char *sample_fmt = av_get_sample_fmt_name(codec->sample_fmt);
+    text << " rate=" << codec->sample_rate << " channels=" << codec->channels << " layout=" << codec->channel_layout <<
+      " sample_fmt=" << (sample_fmt ? sample_fmt : "none") << " block_align=" << codec->block_align;
+  }
+  if (codec->extradata_size > 0)
+  {
+    static const char digits[] = "0123456789abcdef";
+    text << " extradata=";
+    for (int i = 0; i < codec->extradata_size; i++)
+    {
+      text << digits[codec->extradata[i] >> 4] << digits[codec->extradata[i] & 15];
+    }
+  }
+  return text.str();
+}
+
+/* what the demuxer already knows at open must agree with the entry */
+static bool matches(const Fields &fields, const AVStream *stream)
+{
+  const AVCodecContext *codec = stream->codec;
+  const char *type = av_get_media_type_string(codec->codec_type);
+  if (field(fields, "type") != (type ? type : "unknown"))
+  {
+    return false;
+  }
+  if (codec->codec_id != AV_CODEC_ID_NONE && codec->codec_id != codec_field(fields))
+  {
+    return false;
+  }
+  if (codec->codec_type == AVMEDIA_TYPE_VIDEO)
+  {
+    return (!codec->width || codec->width == int_field(fields, "width")) &&
+      (!codec->height || codec->height == int_field(fields, "height")) &&
+      (codec->pix_fmt == AV_PIX_FMT_NONE || av_get_pix_fmt(field(fields, "pix_fmt").c_str()) == codec->pix_fmt);
+  }
+  if (codec->codec_type == AVMEDIA_TYPE_AUDIO)
+  {
+    return (!codec->sample_rate || codec->sample_rate == int_field(fields, "rate")) &&
+      (!codec->channels || codec->channels == int_field(fields, "channels"));
+  }
+  return true;
+}
+
+static void fill_stream(const Fields &fields, AVStream *stream)
+{
+  AVCodecContext *codec = stream->codec;
+  if (codec->codec_id == AV_CODEC_ID_NONE)
+  {
+    codec->codec_id = codec_field(fields);
+  }
+  if (!codec->codec_tag)
+  {
+    codec->codec_tag = (unsigned int)int_field(fields, "tag");
+  }
+  if (!codec->bits_per_coded_sample)
+  {
+    codec->bits_per_coded_sample = (int)int_field(fields, "bits");
+  }
+  if (codec->codec_type == AVMEDIA_TYPE_VIDEO)
+  {
+    codec->width = (int)int_field(fields, "width");
+    codec->height = (int)int_field(fields, "height");
+    if (codec->pix_fmt == AV_PIX_FMT_NONE)
+    {
+      codec->pix_fmt = av_get_pix_fmt(field(fields, "pix_fmt").c_str());
+    }
+    AVRational sar = rational_field(fields, "sar");
+    if (!codec->sample_aspect_ratio.num && sar.num > 0 && sar.den > 0)
+    {
+      codec->sample_aspect_ratio = sar;
+    }
+    if (!stream->avg_frame_rate.num)
+    {
+      stream->avg_frame_rate = rational_field(fields, "fps");
+    }
+    if (!stream->r_frame_rate.num)
+    {
+      stream->r_frame_rate = rational_field(fields, "rfps");
+    }
+  }
+  else if (codec->codec_type == AVMEDIA_TYPE_AUDIO)
+  {
+    codec->sample_rate = (int)int_field(fields, "rate");
+    codec->channels = (int)int_field(fields, "channels");
+    if (!codec->channel_layout)
+    {
+      codec->channel_layout = (uint64_t)strtoull(field(fields, "layout").c_str(), NULL, 10);
+    }
+    if (codec->sample_fmt == AV_SAMPLE_FMT_NONE)
+    {
+      codec->sample_fmt = av_get_sample_fmt(field(fields, "sample_fmt").c_str());
+    }
+    if (!codec->block_align)
+    {
+      codec->block_align = (int)int_field(fields, "block_align");
+    }
+  }
+
+  std::string extradata = field(fields, "extradata");
+  if (!codec->extradata && !extradata.empty())
+  {
+    int size = (int)extradata.size() / 2;
+    codec->extradata = (uint8_t*)av_mallocz(size + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (codec->extradata)
+    {
+      for (int i = 0; i < size; i++)
+      {
+        codec->extradata[i] = (uint8_t)strtoul(extradata.substr(i * 2, 2).c_str(), NULL, 16);
+      }
+      codec->extradata_size = size;
+    }
+  }
+}
+
+ProbeCache::ProbeCache(const std::string &path)
+  : path_(path)
+{
+}
+
+int ProbeCache::Load()
+{
+  std::ifstream file(path_.c_str());
+  if (!file)
+  {
+    return 0;
+  }
+  std::string line;
+  while (std::getline(file, line))
+  {
+    if (!line.empty() && line[line.size() - 1] == '\r')
+    {
+      line.erase(line.size() - 1);
+    }
+    size_t tab = line.find('\t');
+    if (line.empty() || line[0] == '#' || tab == std::string::npos)
+    {
+      continue;
+    }
+    entries_[line.substr(0, tab)] = line.substr(tab + 1);
+  }
+  return 0;
+}
+
+bool ProbeCache::Apply(const std::string &key, AVFormatContext *input) const
+{
+  std::map<std::string, std::string>::const_iterator entry = entries_.find(clean_key(key));
+  if (entry == entries_.end())
+  {
+    return false;
+  }
+  std::vector<std::string> streams = split(entry->second, '\t');
+  if (streams.size() != input->nb_streams)
+  {
+    av_log(NULL, AV_LOG_INFO, "Probe cache: the input has %u streams instead of %u, probing\n",
+      input->nb_streams, (unsigned int)streams.size());
+    return false;
+  }
+  std::vector<Fields> fields;
+  for (unsigned int i = 0; i < input->nb_streams; i++)
+  {
+    fields.push_back(parse_stream(streams[i]));
+    if (!matches(fields[i], input->streams[i]))
+    {
+      av_log(NULL, AV_LOG_INFO, "Probe cache: stream #%u is not what it was, probing\n", i);
+      return false;
+    }
+  }
+  for (unsigned int i = 0; i < input->nb_streams; i++)
+  {
+    fill_stream(fields[i], input->streams[i]);
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(57, 33, 100)
+    /* avformat_find_stream_info() of FFmpeg 3.1 and later starts from codecpar, not from stream->codec */
+    if (avcodec_parameters_from_context(input->streams[i]->codecpar, input->streams[i]->codec) < 0)
+    {
+      return false;
+    }
+#endif
+  }
+  return true;
+}
+
+int ProbeCache::Store(const std::string &key, const AVFormatContext *input)
+{
+  std::string streams;
+  for (unsigned int i = 0; i < input->nb_streams; i++)
+  {
+    streams += (i ? "\t" : "") + describe_stream(input->streams[i]);
+  }
+  entries_[clean_key(key)] = streams;
+
+  /* another capture starting now reads the old file or the new one */
+  std::ostringstream file;
+  file << HEADER << "\n";
+  for (std::map<std::string, std::string>::const_iterator it = entries_.begin(); it != entries_.end(); ++it)
+  {
+    file << it->first << "\t" << it->second << "\n";
+  }
+  if (OutputMuxer::WriteFileAtomically(path_, file.str()) < 0)
+  {
+    av_log(NULL, AV_LOG_WARNING, "Cannot write probe cache '%s'\n", path_.c_str());
+    return AVERROR(EIO);
+  }
+  return 0;
+}
+
+bool ProbeCache::Complete(const AVFormatContext *input)
+{
+  for (unsigned int i = 0; i < input->nb_streams; i++)
+  {
+    const AVCodecContext *codec = input->streams[i]->codec;
+    if (codec->codec_type == AVMEDIA_TYPE_VIDEO &&
+      (codec->codec_id == AV_CODEC_ID_NONE || codec->width <= 0 || codec->height <= 0 || codec->pix_fmt == AV_PIX_FMT_NONE))
+    {
+      return false;
+    }
+    if (codec->codec_type == AVMEDIA_TYPE_AUDIO &&
+      (codec->codec_id == AV_CODEC_ID_NONE || codec->sample_rate <= 0 || codec->channels <= 0 ||
+      codec->sample_fmt == AV_SAMPLE_FMT_NONE))
+    {
+      return false;
+    }
+  }
+  return true;
+}
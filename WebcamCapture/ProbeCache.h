@@ -0,0 +1,39 @@
+#pragma once
+
+extern "C"
+{
+  #define __STDC_CONSTANT_MACROS
+  #include <libavformat/avformat.h>
+}
+
+#include <map>
+#include <string>
+#include "Noncopyable.h"
+
+// What avformat_find_stream_info() found for a device, kept in a text file
+// across runs: a line per input, keyed by the backend, the devices and the
+// options they were opened with. On a hit the stream parameters are filled in
+// before probing, so the probe has nothing left to read and decode; a device
+// that reports something else at open is probed as usual and the entry
+// replaced.
+class ProbeCache : Noncopyable
+{
+public:
+  explicit ProbeCache(const std::string &path);
+
+  // a missing file is an empty cache
+  int Load();
+  // fills the missing parameters of the just opened input from the entry for
+  // key; false when there is none or it does not match what the device reports
+  bool Apply(const std::string &key, AVFormatContext *input) const;
+  // replaces the entry for key with the parameters of a probed input and
+  // rewrites the file
+  int Store(const std::string &key, const AVFormatContext *input);
+
+  // every audio and video stream has what the decoders and filters need
+  static bool Complete(const AVFormatContext *input);
+
+private:
+  std::string path_;
+  std::map<std::string, std::string> entries_;
+};
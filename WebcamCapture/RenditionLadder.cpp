@@ -0,0 +1,542 @@
+#include "RenditionLadder.h"
+
+extern "C"
+{
+#include <libavfilter/buffersrc.h>
+#include <libavfilter/buffersink.h>
+#include <libavutil/opt.h>
+}
+
+#include <stdlib.h>
+#include <algorithm>
+#include <sstream>
+
+bool LadderOptions::Parse(const std::string &spec, std::vector<Rendition> *renditions)
+{
+  std::istringstream entries(spec);
+  std::string entry;
+  while (std::getline(entries, entry, ','))
+  {
+    if (entry.empty())
+    {
+      continue;
+    }
+    Rendition rendition;
+    size_t colon = entry.find(':');
+    std::string size = entry.substr(0, colon);
+    if (colon != std::string::npos)
+    {
+      rendition.bitrate = entry.substr(colon + 1);
+    }
+
+    /* 720p or 1280x720 */
+    size_t x = size.find('x');
+    if (x != std::string::npos)
+    {
+      rendition.width = atoi(size.c_str());
+      rendition.height = atoi(size.c_str() + x + 1);
+    }
+    else
+    {
+      rendition.height = atoi(size.c_str());
+    }
+    if (rendition.height <= 0 || (x != std::string::npos && rendition.width <= 0))
+    {
+      return false;
+    }
+    rendition.name = size;
+    renditions->push_back(rendition);
+  }
+  return true;
+}
+
+RenditionLadder::RenditionLadder(const LadderOptions &options, MediaPool *pool)
+  : options_(options)
+  , pool_(pool)
+  , graph_(NULL)
+  , source_(NULL)
+  , input_queue_(NULL)
+  , filter_thread_(NULL)
+  , dropped_(0)
+  , closed_(false)
+{
+}
+
+RenditionLadder::~RenditionLadder()
+{
+  Close();
+  for (size_t i = 0; i < outputs_.size(); i++)
+  {
+    Output *output = outputs_[i];
+    delete output->writer;
+    if (output->frame_queue)
+    {
+      AVFrame *frame = NULL;
+      while (output->frame_queue->TryPop(frame))
+      {
+        pool_->ReleaseFrame(&frame);
+      }
+      delete output->frame_queue;
+    }
+    if (output->enc_ctx)
+    {
+      avcodec_close(output->enc_ctx);
+    }
+    /* frees the encoder context with the stream */
+    avformat_free_context(output->layout);
+    delete output;
+  }
+  if (input_queue_)
+  {
+    AVFrame *frame = NULL;
+    while (input_queue_->TryPop(frame))
+    {
+      pool_->ReleaseFrame(&frame);
+    }
+    delete input_queue_;
+  }
+  avfilter_graph_free(&graph_);
+}
+
+int RenditionLadder::Init(AVCodecContext *dec_ctx, AVPixelFormat pix_fmt, int filter_threads)
+{
+  int ret;
+  AVFilterInOut *outputs = NULL;
+  AVFilterInOut *inputs = NULL;
+
+  graph_ = avfilter_graph_alloc();
+  if (!graph_)
+  {
+    return AVERROR(ENOMEM);
+  }
+  graph_->nb_threads = filter_threads;
+
+  std::ostringstream args;
+  args << "video_size=" << dec_ctx->width << "x" << dec_ctx->height
+       << ":pix_fmt=" << dec_ctx->pix_fmt
+       << ":time_base=1/" << AV_TIME_BASE
+       << ":pixel_aspect=" << dec_ctx->sample_aspect_ratio.num << "/" << FFMAX(dec_ctx->sample_aspect_ratio.den, 1);
+  if ((ret = avfilter_graph_create_filter(&source_, avfilter_get_by_name("buffer"), "in",
+    args.str().c_str(), NULL, graph_)) < 0)
+  {
+    av_log(NULL, AV_LOG_ERROR, "Cannot create the ladder's buffer source\n");
+    return ret;
+  }
+
+  /* largest first: each scaler works from the previous rendition, not from the full picture */
+  std::vector<size_t> order;
+  for (size_t i = 0; i < options_.renditions.size(); i++)
+  {
+    order.push_back(i);
+  }
+  const std::vector<Rendition> &renditions = options_.renditions;
+  std::stable_sort(order.begin(), order.end(), [&renditions](size_t a, size_t b) { return renditions[a].height > renditions[b].height; });
+
+  for (size_t i = 0; i < options_.renditions.size(); i++)
+  {
+    Output *output = new Output();
+    output->rendition = options_.renditions[i];
+    output->sink = NULL;
+    output->layout = NULL;
+    output->enc_ctx = NULL;
+    output->frame_queue = NULL;
+    output->encoder_thread = NULL;
+    output->writer = NULL;
+    output->last_pts = AV_NOPTS_VALUE;
+    output->error = 0;
+    output->frames = 0;
+    output->bytes = 0;
+    outputs_.push_back(output);
+
+    std::ostringstream name;
+    name << "out" << i;
+    if ((ret = avfilter_graph_create_filter(&output->sink, avfilter_get_by_name("buffersink"), name.str().c_str(),
+      NULL, NULL, graph_)) < 0)
+    {
+      av_log(NULL, AV_LOG_ERROR, "Cannot create the buffer sink of rendition %s\n", output->rendition.name.c_str());
+      return ret;
+    }
+    if ((ret = av_opt_set_bin(output->sink, "pix_fmts", (uint8_t*)&pix_fmt, sizeof(pix_fmt), AV_OPT_SEARCH_CHILDREN)) < 0)
+    {
+      return ret;
+    }
+
+    AVFilterInOut *input = avfilter_inout_alloc();
+    if (!input)
+    {
+      avfilter_inout_free(&inputs);
+      return AVERROR(ENOMEM);
+    }
+    input->name = av_strdup(name.str().c_str());
+    input->filter_ctx = output->sink;
+    input->pad_idx = 0;
+    input->next = inputs;
+    inputs = input;
+  }
+
+  /* [in]scale=1920:1080,split[out0][s0];[s0]scale=1280:720,split[out1][s1];[s1]scale=640:360[out2] */
+  std::ostringstream spec;
+  std::string previous = "in";
+  for (size_t k = 0; k < order.size(); k++)
+  {
+    const Rendition &rendition = options_.renditions[order[k]];
+    spec << "[" << previous << "]scale=" << rendition.width << ":" << rendition.height;
+    if (k + 1 < order.size())
+    {
+      spec << ",split[out" << order[k] << "][s" << k << "];";
+      previous = "s" + std::to_string(k);
+    }
+    else
+    {
+      spec << "[out" << order[k] << "]";
+    }
+  }
+
+  outputs = avfilter_inout_alloc();
+  if (!outputs)
+  {
+    avfilter_inout_free(&inputs);
+    return AVERROR(ENOMEM);
+  }
+  outputs->name = av_strdup("in");
+  outputs->filter_ctx = source_;
+  outputs->pad_idx = 0;
+  outputs->next = NULL;
+
+  ret = avfilter_graph_parse_ptr(graph_, spec.str().c_str(), &inputs, &outputs, NULL);
+  avfilter_inout_free(&inputs);
+  avfilter_inout_free(&outputs);
+  if (ret < 0 || (ret = avfilter_graph_config(graph_, NULL)) < 0)
+  {
+    av_log(NULL, AV_LOG_ERROR, "Cannot build the ladder graph '%s'\n", spec.str().c_str());
+    return ret;
+  }
+  av_log(NULL, AV_LOG_VERBOSE, "Ladder graph: %s\n", spec.str().c_str());
+  return 0;
+}
+
+int RenditionLadder::OpenOutputs(AVFormatContext *main_layout, const std::string &filename, const encoder_opener &open_encoder,
+  const SegmentOptions &segment, const MuxerOptions &muxer_options)
+{
+  int ret;
+  for (size_t i = 0; i < outputs_.size(); i++)
+  {
+    Output *output = outputs_[i];
+    std::string suffix = "_" + output->rendition.name;
+    std::string output_filename = OutputMuxer::DerivedTemplate(filename, suffix);
+
+    avformat_alloc_output_context2(&output->layout, main_layout->oformat, NULL, output_filename.c_str());
+    AVStream *video = output->layout ? avformat_new_stream(output->layout, NULL) : NULL;
+    if (!video)
+    {
+      av_log(NULL, AV_LOG_ERROR, "Could not create the output of rendition %s\n", output->rendition.name.c_str());
+      return AVERROR(ENOMEM);
+    }
+
+    /* what the graph produces for this rendition */
+    AVFilterLink *link = output->sink->inputs[0];
+    output->enc_ctx = video->codec;
+    output->enc_ctx->width = link->w;
+    output->enc_ctx->height = link->h;
+    output->enc_ctx->sample_aspect_ratio = link->sample_aspect_ratio;
+    output->enc_ctx->pix_fmt = (AVPixelFormat)link->format;
+    if (output->layout->oformat->flags & AVFMT_GLOBALHEADER)
+    {
+      output->enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+    if ((ret = open_encoder(output->enc_ctx, output->rendition)) < 0)
+    {
+      av_log(NULL, AV_LOG_ERROR, "Cannot open the encoder of rendition %s\n", output->rendition.name.c_str());
+      return ret;
+    }
+    video->time_base = output->enc_ctx->time_base;
+
+    /* the main output's audio, encoded once */
+    output->audio_map.assign(main_layout->nb_streams, -1);
+    for (unsigned int j = 0; j < main_layout->nb_streams; j++)
+    {
+      AVStream *in_stream = main_layout->streams[j];
+      if (in_stream->codec->codec_type != AVMEDIA_TYPE_AUDIO)
+      {
+        continue;
+      }
+      AVStream *audio = avformat_new_stream(output->layout, NULL);
+      if (!audio)
+      {
+        return AVERROR(ENOMEM);
+      }
+      if ((ret = avcodec_copy_context(audio->codec, in_stream->codec)) < 0)
+      {
+        return ret;
+      }
+      audio->codec->codec_tag = 0;
+      audio->time_base = in_stream->time_base;
+      output->audio_map[j] = audio->index;
+    }
+
+    SegmentOptions rendition_segment = segment;
+    if (!rendition_segment.name_template.empty())
+    {
+      rendition_segment.name_template = OutputMuxer::DerivedTemplate(rendition_segment.name_template, suffix);
+    }
+    output->writer = new SegmentWriter(output->layout, output_filename, rendition_segment, muxer_options);
+    if ((ret = output->writer->Open()) < 0)
+    {
+      return ret;
+    }
+    av_log(NULL, AV_LOG_INFO, "Rendition %s: %dx%d to '%s'\n", output->rendition.name.c_str(),
+      output->enc_ctx->width, output->enc_ctx->height, output_filename.c_str());
+  }
+  return 0;
+}
+
+int RenditionLadder::Start()
+{
+  input_queue_ = new SpscQueue<AVFrame*>(FFMAX(options_.queue_size, 2));
+  for (size_t i = 0; i < outputs_.size(); i++)
+  {
+    outputs_[i]->frame_queue = new SpscQueue<AVFrame*>(FFMAX(options_.queue_size, 2));
+    outputs_[i]->encoder_thread = new std::thread(&RenditionLadder::encode_loop, this, outputs_[i]);
+  }
+  filter_thread_ = new std::thread(&RenditionLadder::filter_loop, this);
+  return 0;
+}
+
+void RenditionLadder::SendFrame(const AVFrame *frame)
+{
+  if (!input_queue_ || closed_)
+  {
+    return;
+  }
+  /* the picture is shared, not copied */
+  AVFrame *ref = pool_->AcquireFrame();
+  if (!ref || av_frame_ref(ref, frame) < 0 || !input_queue_->TryPush(ref))
+  {
+    pool_->ReleaseFrame(&ref);
+    ++dropped_;
+  }
+}
+
+void RenditionLadder::SendAudio(const AVPacket *packet)
+{
+  for (size_t i = 0; i < outputs_.size(); i++)
+  {
+    Output *output = outputs_[i];
+    int index = packet->stream_index < (int)output->audio_map.size() ? output->audio_map[packet->stream_index] : -1;
+    if (index < 0 || output->error < 0)
+    {
+      continue;
+    }
+    AVPacket *ref = pool_->AcquirePacket();
+    if (!ref || av_packet_ref(ref, packet) < 0)
+    {
+      pool_->ReleasePacket(&ref);
+      continue;
+    }
+    ref->stream_index = index;
+    int ret = write_packet(output, ref);
+    pool_->ReleasePacket(&ref);
+    if (ret < 0)
+    {
+      av_log(NULL, AV_LOG_ERROR, "Muxing audio into rendition %s failed\n", output->rendition.name.c_str());
+      output->error = ret;
+    }
+  }
+}
+
+int RenditionLadder::Close()
+{
+  if (closed_)
+  {
+    return 0;
+  }
+  closed_ = true;
+  if (filter_thread_)
+  {
+    /* the filter thread flushes the graph and closes the encoders' queues */
+    input_queue_->Close();
+    filter_thread_->join();
+    delete filter_thread_;
+    filter_thread_ = NULL;
+  }
+
+  int ret = 0;
+  for (size_t i = 0; i < outputs_.size(); i++)
+  {
+    Output *output = outputs_[i];
+    if (output->encoder_thread)
+    {
+      output->encoder_thread->join();
+      delete output->encoder_thread;
+      output->encoder_thread = NULL;
+    }
+    if (output->writer)
+    {
+      std::lock_guard<std::mutex> lock(output->writer_mutex);
+      int close_ret = output->writer->Close();
+      if (output->error >= 0 && close_ret < 0)
+      {
+        output->error = close_ret;
+      }
+    }
+    if (ret >= 0 && output->error < 0)
+    {
+      ret = output->error;
+    }
+  }
+  return ret;
+}
+
+void RenditionLadder::PrintStats(int level) const
+{
+  for (size_t i = 0; i < outputs_.size(); i++)
+  {
+    const Output *output = outputs_[i];
+    av_log(NULL, level, "Rendition %s: %llu frames, %llu bytes%s\n", output->rendition.name.c_str(),
+      (unsigned long long)output->frames.load(), (unsigned long long)output->bytes.load(),
+      output->error < 0 ? ", failed" : "");
+  }
+  if (dropped_)
+  {
+    av_log(NULL, level, "Ladder dropped %llu frames\n", (unsigned long long)dropped_.load());
+  }
+}
+
+void RenditionLadder::filter_loop()
+{
+  AVFrame *frame = NULL;
+  int ret = 0;
+  while (input_queue_->Pop(frame))
+  {
+    if (ret < 0)
+    {
+      pool_->ReleaseFrame(&frame);
+      continue;
+    }
+    ret = filter_frame(frame);
+  }
+  if (ret >= 0)
+  {
+    filter_frame(NULL);
+  }
+  for (size_t i = 0; i < outputs_.size(); i++)
+  {
+    outputs_[i]->frame_queue->Close();
+  }
+}
+
+int RenditionLadder::filter_frame(AVFrame *frame)
+{
+  int ret = av_buffersrc_add_frame_flags(source_, frame, 0);
+  pool_->ReleaseFrame(&frame);
+  if (ret < 0)
+  {
+    av_log(NULL, AV_LOG_ERROR, "Error while feeding the ladder graph\n");
+    for (size_t i = 0; i < outputs_.size(); i++)
+    {
+      outputs_[i]->error = ret;
+    }
+    return ret;
+  }
+
+  for (size_t i = 0; i < outputs_.size(); i++)
+  {
+    Output *output = outputs_[i];
+    while (1)
+    {
+      AVFrame *scaled = pool_->AcquireFrame();
+      if (!scaled)
+      {
+        return AVERROR(ENOMEM);
+      }
+      if (av_buffersink_get_frame(output->sink, scaled) < 0)
+      {
+        pool_->ReleaseFrame(&scaled);
+        break;
+      }
+      /* one clock for all renditions; frames that round onto the previous tick are dropped alike */
+      if (scaled->pts != AV_NOPTS_VALUE)
+      {
+        scaled->pts = av_rescale_q(scaled->pts, output->sink->inputs[0]->time_base, output->enc_ctx->time_base);
+      }
+      if (output->last_pts != AV_NOPTS_VALUE && scaled->pts != AV_NOPTS_VALUE && scaled->pts <= output->last_pts)
+      {
+        pool_->ReleaseFrame(&scaled);
+        continue;
+      }
+      output->last_pts = scaled->pts;
+      scaled->pict_type = AV_PICTURE_TYPE_NONE;
+      /* a slow encoder holds up the others, the input queue then drops for all of them */
+      if (!output->frame_queue->Push(scaled))
+      {
+        pool_->ReleaseFrame(&scaled);
+      }
+    }
+  }
+  return 0;
+}
+
+void RenditionLadder::encode_loop(Output *output)
+{
+  AVFrame *frame = NULL;
+  int got_packet = 0;
+  while (output->frame_queue->Pop(frame))
+  {
+    if (output->error < 0)
+    {
+      pool_->ReleaseFrame(&frame);
+      continue;
+    }
+    int ret = encode_frame(output, frame, &got_packet);
+    if (ret < 0)
+    {
+      av_log(NULL, AV_LOG_ERROR, "Encoding failed for rendition %s\n", output->rendition.name.c_str());
+      output->error = ret;
+    }
+  }
+
+  if (output->error >= 0 && (output->enc_ctx->codec->capabilities & AV_CODEC_CAP_DELAY))
+  {
+    do
+    {
+      int ret = encode_frame(output, NULL, &got_packet);
+      if (ret < 0)
+      {
+        output->error = ret;
+        break;
+      }
+    } while (got_packet);
+  }
+}
+
+int RenditionLadder::encode_frame(Output *output, AVFrame *frame, int *got_packet)
+{
+  *got_packet = 0;
+  AVPacket *packet = pool_->AcquirePacket();
+  if (!packet)
+  {
+    pool_->ReleaseFrame(&frame);
+    return AVERROR(ENOMEM);
+  }
+  int ret = avcodec_encode_video2(output->enc_ctx, packet, frame, got_packet);
+  pool_->ReleaseFrame(&frame);
+  if (ret < 0 || !*got_packet)
+  {
+    pool_->ReleasePacket(&packet);
+    return ret;
+  }
+
+  packet->stream_index = 0;
+  av_packet_rescale_ts(packet, output->enc_ctx->time_base, output->layout->streams[0]->time_base);
+  ++output->frames;
+  output->bytes += packet->size;
+  ret = write_packet(output, packet);
+  pool_->ReleasePacket(&packet);
+  return ret;
+}
+
+int RenditionLadder::write_packet(Output *output, AVPacket *packet)
+{
+  std::lock_guard<std::mutex> lock(output->writer_mutex);
+  return output->writer->WritePacket(packet);
+}
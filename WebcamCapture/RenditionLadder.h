@@ -0,0 +1,118 @@
+#pragma once
+
+extern "C"
+{
+  #define __STDC_CONSTANT_MACROS
+  #include <libavcodec/avcodec.h>
+  #include <libavfilter/avfilter.h>
+  #include <libavformat/avformat.h>
+}
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "MediaPool.h"
+#include "Noncopyable.h"
+#include "OutputMuxer.h"
+#include "SegmentWriter.h"
+#include "SpscRing.h"
+
+struct Rendition
+{
+  Rendition()
+    : width(-2)
+    , height(0)
+  {
+  }
+
+  std::string name;     // file name suffix, e.g. 720p
+  int         width;    // -2 keeps the aspect ratio
+  int         height;
+  std::string bitrate;  // "b", also the VBV rate cap; empty keeps the main encoder's rate control
+};
+
+struct LadderOptions
+{
+  LadderOptions()
+    : queue_size(8)
+  {
+  }
+
+  bool Enabled() const { return !renditions.empty(); }
+
+  std::vector<Rendition> renditions;  // written next to the main output as <name>_<rendition>.<ext>
+  int queue_size;                     // decoded frames waiting for the ladder before they are dropped
+
+  // 1080p:5M,720p:3M,640x360:800k
+  static bool Parse(const std::string &spec, std::vector<Rendition> *renditions);
+};
+
+// ABR ladder from one decode: the capture thread hands each decoded video
+// frame over by reference, a filter thread runs it through one graph of
+// cascaded scalers (every rendition is scaled from the next larger one, then
+// split off), and each rendition has an encoder thread and output of its own.
+// The main output's audio packets are shared into every rendition file.
+class RenditionLadder : Noncopyable
+{
+public:
+  // opens enc_ctx for a rendition; size, aspect, pixel format and header flags are already set
+  typedef std::function<int(AVCodecContext *enc_ctx, const Rendition &rendition)> encoder_opener;
+
+  RenditionLadder(const LadderOptions &options, MediaPool *pool);
+  ~RenditionLadder();
+
+  // the graph takes the decoder's frames with pts in microseconds
+  int Init(AVCodecContext *dec_ctx, AVPixelFormat pix_fmt, int filter_threads);
+  // one file per rendition: its video stream followed by the audio streams of main_layout
+  int OpenOutputs(AVFormatContext *main_layout, const std::string &filename, const encoder_opener &open_encoder,
+    const SegmentOptions &segment, const MuxerOptions &muxer_options);
+  int Start();
+  // capture thread: takes a new reference, dropped when the ladder is behind
+  void SendFrame(const AVFrame *frame);
+  // mux thread: an audio packet of main_layout, in its time base, not taken over
+  void SendAudio(const AVPacket *packet);
+  // flushes the graph and the encoders and closes the files; returns the first error
+  int Close();
+
+  size_t QueueDepth() const { return input_queue_ ? input_queue_->Size() : 0; }
+  size_t QueueCapacity() const { return input_queue_ ? input_queue_->Capacity() : 0; }
+  void PrintStats(int level) const;
+
+private:
+  struct Output
+  {
+    Rendition              rendition;
+    AVFilterContext       *sink;
+    AVFormatContext       *layout;         /* the encoder is layout->streams[0]->codec */
+    AVCodecContext        *enc_ctx;
+    std::vector<int>       audio_map;      /* main_layout stream -> layout stream, -1 if none */
+    SpscQueue<AVFrame*>   *frame_queue;
+    std::thread           *encoder_thread;
+    SegmentWriter         *writer;
+    std::mutex             writer_mutex;   /* video from the encoder thread, audio from the mux thread */
+    int64_t                last_pts;       /* filter thread */
+    std::atomic<int>       error;
+    std::atomic<uint64_t>  frames;
+    std::atomic<uint64_t>  bytes;
+  };
+
+  void filter_loop();
+  int filter_frame(AVFrame *frame);
+  void encode_loop(Output *output);
+  int encode_frame(Output *output, AVFrame *frame, int *got_packet);
+  int write_packet(Output *output, AVPacket *packet);
+
+private:
+  LadderOptions options_;
+  MediaPool *pool_;
+  std::vector<Output*> outputs_;
+  AVFilterGraph *graph_;
+  AVFilterContext *source_;
+  SpscQueue<AVFrame*> *input_queue_;
+  std::thread *filter_thread_;
+  std::atomic<uint64_t> dropped_;
+  bool closed_;
+};
@@ -0,0 +1,142 @@
+#include "SegmentWriter.h"
+
+#include <stdio.h>
+
+SegmentWriter::SegmentWriter(AVFormatContext *layout, const std::string &filename, const SegmentOptions &options,
+  const MuxerOptions &muxer_options)
+  : layout_(layout)
+  , filename_(filename)
+  , options_(options)
+  , muxer_(layout, muxer_options)
+  , reference_stream_(-1)
+  , segment_number_(0)
+  , segment_start_us_(AV_NOPTS_VALUE)
+  , closed_size_(0)
+{
+  /* cut on video keyframes, any stream will do for audio-only captures */
+  for (unsigned int i = 0; i < layout_->nb_streams; i++)
+  {
+    if (layout_->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO)
+    {
+      reference_stream_ = i;
+      break;
+    }
+  }
+  if (reference_stream_ < 0 && layout_->nb_streams)
+  {
+    reference_stream_ = 0;
+  }
+
+  if (options_.Enabled() && options_.name_template.empty())
+  {
+    options_.name_template = OutputMuxer::DerivedTemplate(filename_, "_%05d");
+  }
+}
+
+SegmentWriter::~SegmentWriter()
+{
+  Close();
+}
+
+int SegmentWriter::Open()
+{
+  int ret = muxer_.Open(options_.Enabled() ? next_filename() : filename_);
+  if (ret >= 0)
+  {
+    ++segment_number_;
+  }
+  return ret;
+}
+
+int SegmentWriter::WritePacket(AVPacket *packet)
+{
+  int64_t ts = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+  int64_t ts_us = AV_NOPTS_VALUE;
+  if (ts != AV_NOPTS_VALUE)
+  {
+    ts_us = av_rescale_q(ts, layout_->streams[packet->stream_index]->time_base, AV_TIME_BASE_Q);
+  }
+  if (segment_start_us_ == AV_NOPTS_VALUE)
+  {
+    segment_start_us_ = ts_us;
+  }
+
+  if (options_.Enabled() && should_cut(packet, ts_us))
+  {
+    int ret = rotate();
+    if (ret < 0)
+    {
+      av_packet_unref(packet);
+      return ret;
+    }
+    segment_start_us_ = ts_us;
+  }
+
+  if (!muxer_.IsOpen())
+  {
+    av_packet_unref(packet);
+    return AVERROR(EINVAL);
+  }
+  return muxer_.WritePacket(packet);
+}
+
+int SegmentWriter::Close()
+{
+  return muxer_.Close();
+}
+
+bool SegmentWriter::should_cut(const AVPacket *packet, int64_t ts_us) const
+{
+  if (packet->stream_index != reference_stream_ || !(packet->flags & AV_PKT_FLAG_KEY))
+  {
+    return false;
+  }
+  if (options_.duration_sec > 0 && ts_us != AV_NOPTS_VALUE && segment_start_us_ != AV_NOPTS_VALUE &&
+    ts_us - segment_start_us_ >= (int64_t)options_.duration_sec * AV_TIME_BASE)
+  {
+    return true;
+  }
+  return options_.max_size > 0 && muxer_.BytesWritten() >= options_.max_size;
+}
+
+int SegmentWriter::rotate()
+{
+  Segment done;
+  done.filename = muxer_.Filename();
+  done.size = muxer_.BytesWritten();
+
+  /* a broken trailer only loses this segment, keep recording */
+  muxer_.Close();
+  av_log(NULL, AV_LOG_INFO, "Segment '%s' finished, %lld bytes\n", done.filename.c_str(), (long long)done.size);
+  closed_.push_back(done);
+  closed_size_ += done.size;
+
+  int ret = Open();
+  apply_retention();
+  return ret;
+}
+
+std::string SegmentWriter::next_filename() const
+{
+  return OutputMuxer::ExpandTemplate(options_.name_template, segment_number_);
+}
+
+void SegmentWriter::apply_retention()
+{
+  while (!closed_.empty() &&
+    ((options_.max_count > 0 && (int)closed_.size() + 1 > options_.max_count) ||
+     (options_.max_total_size > 0 && closed_size_ + muxer_.BytesWritten() > options_.max_total_size)))
+  {
+    const Segment &oldest = closed_.front();
+    if (remove(oldest.filename.c_str()) != 0)
+    {
+      av_log(NULL, AV_LOG_WARNING, "Cannot delete old segment '%s'\n", oldest.filename.c_str());
+    }
+    else
+    {
+      av_log(NULL, AV_LOG_INFO, "Segment '%s' deleted by retention\n", oldest.filename.c_str());
+    }
+    closed_size_ -= oldest.size;
+    closed_.pop_front();
+  }
+}
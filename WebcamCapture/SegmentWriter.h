@@ -0,0 +1,66 @@
+#pragma once
+
+#include <deque>
+#include <string>
+#include "OutputMuxer.h"
+#include "PacketSink.h"
+
+struct SegmentOptions
+{
+  SegmentOptions()
+    : duration_sec(0)
+    , max_size(0)
+    , max_count(0)
+    , max_total_size(0)
+  {
+  }
+
+  bool Enabled() const { return duration_sec > 0 || max_size > 0; }
+
+  int         duration_sec;     // start a new file after this many seconds, 0 = no limit
+  int64_t     max_size;         // ... or after this many bytes, 0 = no limit
+  std::string name_template;    // strftime fields plus %d/%05d for the segment number
+  int         max_count;        // retention: keep at most this many files, 0 = all
+  int64_t     max_total_size;   // retention: keep at most this many bytes, 0 = all
+};
+
+// Writes the encoded streams into one file, or into a rolling series of files
+// cut on keyframes of the reference stream, deleting the oldest ones to stay
+// within the retention limits. Runs on the mux thread.
+class SegmentWriter : public PacketSink
+{
+public:
+  SegmentWriter(AVFormatContext *layout, const std::string &filename, const SegmentOptions &options,
+    const MuxerOptions &muxer_options = MuxerOptions());
+  ~SegmentWriter();
+
+  int Open();
+  int WritePacket(AVPacket *packet);
+  int Close();
+
+  int Segments() const { return segment_number_; }
+  const std::string &CurrentFilename() const { return muxer_.Filename(); }
+
+private:
+  bool should_cut(const AVPacket *packet, int64_t ts_us) const;
+  int rotate();
+  std::string next_filename() const;
+  void apply_retention();
+
+private:
+  AVFormatContext *layout_;
+  std::string filename_;
+  SegmentOptions options_;
+  OutputMuxer muxer_;
+  int reference_stream_;
+  int segment_number_;
+  int64_t segment_start_us_;
+
+  struct Segment
+  {
+    std::string filename;
+    int64_t size;
+  };
+  std::deque<Segment> closed_;
+  int64_t closed_size_;
+};
@@ -0,0 +1,292 @@
+#include "SnapshotWriter.h"
+#include "LatencyMetrics.h"
+#include "OutputMuxer.h"
+
+extern "C"
+{
+  #include <libswscale/swscale.h>
+}
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#elif defined(__linux__)
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+static bool ends_with(const std::string &text, const char *suffix)
+{
+  size_t length = strlen(suffix);
+  if (text.size() < length)
+  {
+    return false;
+  }
+  for (size_t i = 0; i < length; i++)
+  {
+    if (tolower((unsigned char)text[text.size() - length + i]) != suffix[i])
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+SnapshotWriter::SnapshotWriter(const SnapshotOptions &options)
+  : options_(options)
+  , codec_id_(ends_with(options.path, ".png") ? AV_CODEC_ID_PNG : AV_CODEC_ID_MJPEG)
+  , pix_fmt_(codec_id_ == AV_CODEC_ID_PNG ? AV_PIX_FMT_RGB24 : AV_PIX_FMT_YUVJ420P)
+  , thread_(NULL)
+  , pending_(NULL)
+  , stopping_(false)
+  , busy_(false)
+  , requested_(false)
+  , next_us_(AV_NOPTS_VALUE)
+  , sws_(NULL)
+  , enc_ctx_(NULL)
+  , scaled_(NULL)
+  , number_(0)
+  , written_(0)
+  , skipped_(0)
+  , failed_(0)
+  , last_us_(0)
+{
+}
+
+SnapshotWriter::~SnapshotWriter()
+{
+  if (thread_)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    cond_.notify_one();
+    thread_->join();
+    delete thread_;
+  }
+  av_frame_free(&pending_);
+  av_frame_free(&scaled_);
+  if (enc_ctx_)
+  {
+    avcodec_free_context(&enc_ctx_);
+  }
+  sws_freeContext(sws_);
+}
+
+int SnapshotWriter::Start()
+{
+  if (!avcodec_find_encoder(codec_id_))
+  {
+    av_log(NULL, AV_LOG_ERROR, "No %s encoder for snapshots\n", codec_id_ == AV_CODEC_ID_PNG ? "PNG" : "JPEG");
+    return AVERROR_ENCODER_NOT_FOUND;
+  }
+  scaled_ = av_frame_alloc();
+  if (!scaled_)
+  {
+    return AVERROR(ENOMEM);
+  }
+  thread_ = new std::thread(&SnapshotWriter::run, this);
+  return 0;
+}
+
+void SnapshotWriter::Offer(const AVFrame *frame)
+{
+  int64_t interval_us = (int64_t)(options_.interval_sec * AV_TIME_BASE);
+  bool scheduled = interval_us > 0 && frame->pts != AV_NOPTS_VALUE &&
+    (next_us_ == AV_NOPTS_VALUE || frame->pts >= next_us_);
+  if (!scheduled && !requested_)
+  {
+    return;
+  }
+  if (scheduled)
+  {
+    next_us_ = frame->pts + interval_us;
+  }
+  if (busy_)
+  {
+    /* never wait for the side thread; a request stays pending until it is free */
+    if (scheduled)
+    {
+      skipped_++;
+    }
+    return;
+  }
+
+  AVFrame *ref = av_frame_clone(frame);
+  if (!ref)
+  {
+    failed_++;
+    return;
+  }
+  requested_ = false;
+  busy_ = true;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_ = ref;
+  }
+  cond_.notify_one();
+}
+
+SnapshotWriter::Stats SnapshotWriter::GetStats() const
+{
+  Stats stats;
+  stats.written = written_;
+  stats.skipped = skipped_;
+  stats.failed  = failed_;
+  stats.last_us = last_us_;
+  return stats;
+}
+
+void SnapshotWriter::PrintStats(int level) const
+{
+  Stats stats = GetStats();
+  av_log(NULL, level, "Snapshots: %llu written, %llu skipped while busy, %llu failed, last took %.1f ms\n",
+    (unsigned long long)stats.written, (unsigned long long)stats.skipped, (unsigned long long)stats.failed,
+    stats.last_us / 1000.0);
+}
+
+void SnapshotWriter::run()
+{
+  lower_priority();
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (1)
+  {
+    while (!stopping_ && !pending_)
+    {
+      cond_.wait(lock);
+    }
+    if (!pending_)
+    {
+      break;
+    }
+    AVFrame *frame = pending_;
+    pending_ = NULL;
+    lock.unlock();
+
+    int64_t start = LatencyMetrics::Now();
+    if (write_snapshot(frame) < 0)
+    {
+      failed_++;
+    }
+    else
+    {
+      written_++;
+    }
+    last_us_ = LatencyMetrics::Now() - start;
+    /* the decoder's buffer goes back to its pool before Offer() may take the next one */
+    av_frame_free(&frame);
+    busy_ = false;
+
+    lock.lock();
+  }
+}
+
+int SnapshotWriter::write_snapshot(const AVFrame *frame)
+{
+  int width = (options_.width > 0 && options_.width < frame->width) ? options_.width : frame->width;
+  int height = (int)av_rescale(frame->height, width, frame->width);
+  width = FFMAX(width & ~1, 2);
+  height = FFMAX(height & ~1, 2);
+
+  sws_ = sws_getCachedContext(sws_, frame->width, frame->height, (AVPixelFormat)frame->format,
+    width, height, pix_fmt_, SWS_BILINEAR, NULL, NULL, NULL);
+  if (!sws_)
+  {
+    av_log(NULL, AV_LOG_ERROR, "Cannot scale %dx%d for snapshots\n", frame->width, frame->height);
+    return AVERROR(EINVAL);
+  }
+  int ret;
+  if ((!enc_ctx_ || enc_ctx_->width != width || enc_ctx_->height != height) && (ret = open_encoder(width, height)) < 0)
+  {
+    return ret;
+  }
+
+  av_frame_unref(scaled_);
+  scaled_->format = pix_fmt_;
+  scaled_->width = width;
+  scaled_->height = height;
+  if ((ret = av_frame_get_buffer(scaled_, 32)) < 0)
+  {
+    return ret;
+  }
+  sws_scale(sws_, frame->data, frame->linesize, 0, frame->height, scaled_->data, scaled_->linesize);
+  scaled_->pts = number_;
+  if (codec_id_ == AV_CODEC_ID_MJPEG)
+  {
+    scaled_->quality = enc_ctx_->global_quality;
+  }
+
+  AVPacket packet;
+  av_init_packet(&packet);
+  packet.data = NULL;
+  packet.size = 0;
+  int got_packet = 0;
+  ret = avcodec_encode_video2(enc_ctx_, &packet, scaled_, &got_packet);
+  if (ret < 0 || !got_packet)
+  {
+    av_log(NULL, AV_LOG_WARNING, "Cannot encode snapshot\n");
+    return ret < 0 ? ret : AVERROR(EAGAIN);
+  }
+  ret = write_file(OutputMuxer::ExpandTemplate(options_.path, number_++), &packet);
+  av_packet_unref(&packet);
+  return ret;
+}
+
+int SnapshotWriter::open_encoder(int width, int height)
+{
+  if (enc_ctx_)
+  {
+    avcodec_free_context(&enc_ctx_);
+  }
+  AVCodec *encoder = avcodec_find_encoder(codec_id_);
+  enc_ctx_ = avcodec_alloc_context3(encoder);
+  if (!enc_ctx_)
+  {
+    return AVERROR(ENOMEM);
+  }
+  enc_ctx_->width = width;
+  enc_ctx_->height = height;
+  enc_ctx_->pix_fmt = pix_fmt_;
+  enc_ctx_->time_base.num = 1;
+  enc_ctx_->time_base.den = 25;
+  if (codec_id_ == AV_CODEC_ID_MJPEG)
+  {
+    /* fixed quality, there is no rate to control */
+    enc_ctx_->flags |= AV_CODEC_FLAG_QSCALE;
+    enc_ctx_->global_quality = FF_QP2LAMBDA * av_clip(options_.quality, 2, 31);
+    enc_ctx_->color_range = AVCOL_RANGE_JPEG;
+  }
+  int ret = avcodec_open2(enc_ctx_, encoder, NULL);
+  if (ret < 0)
+  {
+    av_log(NULL, AV_LOG_ERROR, "Cannot open %s encoder for %dx%d snapshots\n", encoder->name, width, height);
+    avcodec_free_context(&enc_ctx_);
+  }
+  return ret;
+}
+
+int SnapshotWriter::write_file(const std::string &filename, const AVPacket *packet)
+{
+  if (OutputMuxer::WriteFileAtomically(filename, std::string((const char*)packet->data, packet->size)) < 0)
+  {
+    av_log(NULL, AV_LOG_WARNING, "Cannot write snapshot '%s'\n", filename.c_str());
+    return AVERROR(EIO);
+  }
+  return 0;
+}
+
+void SnapshotWriter::lower_priority()
+{
+  /* only gets the CPU the capture leaves over */
+#ifdef _WIN32
+  SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL);
+#elif defined(__linux__)
+  setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 10);
+#endif
+}
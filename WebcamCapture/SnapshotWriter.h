@@ -0,0 +1,99 @@
+#pragma once
+
+extern "C"
+{
+  #define __STDC_CONSTANT_MACROS
+  #include <libavcodec/avcodec.h>
+  #include <libavutil/frame.h>
+}
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "Noncopyable.h"
+
+struct SwsContext;
+
+struct SnapshotOptions
+{
+  SnapshotOptions()
+    : interval_sec(5)
+    , width(640)
+    , quality(4)
+  {
+  }
+
+  bool Enabled() const { return !path.empty(); }
+
+  std::string path;      // .jpg or .png; strftime fields or %d (the snapshot number) keep every one
+  double interval_sec;   // media time between snapshots, 0 = only when requested
+  int width;             // scaled down to this width keeping the aspect ratio, 0 = full size
+  int quality;           // JPEG qscale, 2 (best) to 31
+};
+
+// JPEG or PNG stills of the video for dashboards, off the capture path.
+// Offer() runs on the processing thread for every decoded frame and only
+// takes a reference (av_frame_clone, the picture is shared) when a snapshot is
+// due and the side thread is idle: a slow disk or a big picture costs skipped
+// snapshots, never capture time. The side thread runs at low priority, scales
+// with swscale, encodes and writes aside before renaming, so readers never see
+// half an image.
+class SnapshotWriter : Noncopyable
+{
+public:
+  struct Stats
+  {
+    uint64_t written;
+    uint64_t skipped;   // due while the side thread was still busy
+    uint64_t failed;
+    int64_t  last_us;   // scale, encode and write time of the last one
+  };
+
+  explicit SnapshotWriter(const SnapshotOptions &options);
+  // waits for the snapshot in progress
+  ~SnapshotWriter();
+
+  // finds the image encoder and starts the side thread
+  int Start();
+
+  // processing thread; frame pts in microseconds
+  void Offer(const AVFrame *frame);
+  // any thread: the next offered frame is taken even if the interval has not passed
+  void Request() { requested_ = true; }
+
+  Stats GetStats() const;
+  void PrintStats(int level) const;
+
+private:
+  void run();
+  int write_snapshot(const AVFrame *frame);
+  int open_encoder(int width, int height);
+  int write_file(const std::string &filename, const AVPacket *packet);
+  static void lower_priority();
+
+private:
+  SnapshotOptions options_;
+  AVCodecID codec_id_;
+  AVPixelFormat pix_fmt_;
+  std::thread *thread_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  AVFrame *pending_;                /* handed over under mutex_ */
+  bool stopping_;                   /* under mutex_ */
+  std::atomic<bool> busy_;          /* from Offer() until the side thread is done with it */
+  std::atomic<bool> requested_;
+  int64_t next_us_;                 /* processing thread */
+
+  /* side thread */
+  SwsContext *sws_;
+  AVCodecContext *enc_ctx_;
+  AVFrame *scaled_;
+  int number_;
+
+  std::atomic<uint64_t> written_;
+  std::atomic<uint64_t> skipped_;
+  std::atomic<uint64_t> failed_;
+  std::atomic<int64_t> last_us_;
+};
@@ -0,0 +1,505 @@
+#include "SpoolFile.h"
+#include "OutputMuxer.h"
+
+extern "C"
+{
+  #include <libavutil/time.h>
+}
+
+#include <atomic>
+#include <string.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* how much of the data area is mapped at a time */
+static const size_t DATA_WINDOW = 16 << 20;
+/* index entries reserved per byte of data, an entry per 2 KB on average */
+static const int64_t BYTES_PER_ENTRY = 2048;
+static const char MAGIC[8] = "WCSPOOL";
+
+MappedFile::MappedFile()
+  : writable_(false)
+  , size_(0)
+#ifdef _WIN32
+  , file_(INVALID_HANDLE_VALUE)
+  , mapping_(NULL)
+#else
+  , fd_(-1)
+#endif
+{
+}
+
+MappedFile::~MappedFile()
+{
+  Close();
+}
+
+int MappedFile::Open(const std::string &filename, int64_t size)
+{
+  writable_ = size > 0;
+#ifdef _WIN32
+  file_ = CreateFileA(filename.c_str(), writable_ ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ, FILE_SHARE_READ, NULL,
+    writable_ ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file_ == INVALID_HANDLE_VALUE)
+  {
+    return AVERROR(EIO);
+  }
+  LARGE_INTEGER length;
+  if (writable_)
+  {
+    /* allocates the clusters now, the capture never waits for the filesystem to grow the file */
+    length.QuadPart = size;
+    if (!SetFilePointerEx(file_, length, NULL, FILE_BEGIN) || !SetEndOfFile(file_))
+    {
+      Close();
+      return AVERROR(ENOSPC);
+    }
+  }
+  else if (!GetFileSizeEx(file_, &length))
+  {
+    Close();
+    return AVERROR(EIO);
+  }
+  size_ = length.QuadPart;
+  mapping_ = CreateFileMappingA(file_, NULL, writable_ ? PAGE_READWRITE : PAGE_READONLY, 0, 0, NULL);
+  if (!mapping_)
+  {
+    Close();
+    return AVERROR(ENOMEM);
+  }
+#else
+  fd_ = open(filename.c_str(), writable_ ? O_RDWR | O_CREAT | O_TRUNC : O_RDONLY, 0644);
+  if (fd_ < 0)
+  {
+    return AVERROR(errno);
+  }
+  if (writable_)
+  {
+    int ret = ENOSYS;
+#if defined(__linux__)
+    /* real blocks, a full disk must not turn into SIGBUS on a mapped write */
+    ret = posix_fallocate(fd_, 0, size);
+#endif
+    if (ret != 0 && (ret == ENOSPC || ftruncate(fd_, size) != 0))
+    {
+      Close();
+      return AVERROR(ENOSPC);
+    }
+    size_ = size;
+  }
+  else
+  {
+    struct stat info;
+    if (fstat(fd_, &info) != 0)
+    {
+      Close();
+      return AVERROR(errno);
+    }
+    size_ = info.st_size;
+  }
+#endif
+  return 0;
+}
+
+void MappedFile::Close()
+{
+#ifdef _WIN32
+  if (mapping_)
+  {
+    CloseHandle(mapping_);
+    mapping_ = NULL;
+  }
+  if (file_ != INVALID_HANDLE_VALUE)
+  {
+    CloseHandle(file_);
+    file_ = INVALID_HANDLE_VALUE;
+  }
+#else
+  if (fd_ >= 0)
+  {
+    close(fd_);
+    fd_ = -1;
+  }
+#endif
+}
+
+int MappedFile::Map(int64_t offset, size_t length, MappedView *view)
+{
+  if (offset < 0 || offset + (int64_t)length > size_)
+  {
+    return AVERROR(EINVAL);
+  }
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  int64_t granularity = info.dwAllocationGranularity;
+#else
+  int64_t granularity = sysconf(_SC_PAGESIZE);
+#endif
+  int64_t aligned = offset - offset % granularity;
+  size_t map_length = length + (size_t)(offset - aligned);
+#ifdef _WIN32
+  void *base = MapViewOfFile(mapping_, writable_ ? FILE_MAP_WRITE : FILE_MAP_READ, (DWORD)(aligned >> 32),
+    (DWORD)aligned, map_length);
+  if (!base)
+  {
+    return AVERROR(ENOMEM);
+  }
+#else
+  void *base = mmap(NULL, map_length, writable_ ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd_, aligned);
+  if (base == MAP_FAILED)
+  {
+    return AVERROR(errno);
+  }
+#endif
+  view->base = base;
+  view->data = (uint8_t*)base + (offset - aligned);
+  view->offset = offset;
+  view->length = length;
+  return 0;
+}
+
+void MappedFile::Unmap(MappedView *view)
+{
+  if (!view->base)
+  {
+    return;
+  }
+#ifdef _WIN32
+  UnmapViewOfFile(view->base);
+#else
+  munmap(view->base, view->length + (view->data - (uint8_t*)view->base));
+#endif
+  *view = MappedView();
+}
+
+int MappedFile::Truncate(int64_t size)
+{
+#ifdef _WIN32
+  /* a file with a mapping object cannot shrink */
+  if (mapping_)
+  {
+    CloseHandle(mapping_);
+    mapping_ = NULL;
+  }
+  LARGE_INTEGER length;
+  length.QuadPart = size;
+  if (!SetFilePointerEx(file_, length, NULL, FILE_BEGIN) || !SetEndOfFile(file_))
+  {
+    return AVERROR(EIO);
+  }
+#else
+  if (ftruncate(fd_, size) != 0)
+  {
+    return AVERROR(errno);
+  }
+#endif
+  size_ = size;
+  return 0;
+}
+
+SpoolWriter::SpoolWriter(const std::string &filename, const SpoolOptions &options)
+  : pattern_(filename)
+  , options_(options)
+  , input_(NULL)
+  , files_(0)
+  , header_(NULL)
+  , index_(NULL)
+  , packets_(0)
+  , bytes_(0)
+  , start_time_(0)
+{
+}
+
+SpoolWriter::~SpoolWriter()
+{
+  Close();
+}
+
+int SpoolWriter::Open(const AVFormatContext *input)
+{
+  if (input->nb_streams > (unsigned int)spool::MAX_STREAMS)
+  {
+    av_log(NULL, AV_LOG_ERROR, "A spool file holds at most %d streams\n", spool::MAX_STREAMS);
+    return AVERROR(EINVAL);
+  }
+  input_ = input;
+  start_time_ = av_gettime();
+  return open_file();
+}
+
+int SpoolWriter::Write(const AVPacket *packet, int64_t arrival_us)
+{
+  if (!header_)
+  {
+    return AVERROR(EINVAL);
+  }
+  if (header_->entries >= header_->index_capacity || header_->data_end + packet->size > header_->data_capacity)
+  {
+    if (pattern_.find('%') == std::string::npos || packet->size > header_->data_capacity)
+    {
+      av_log(NULL, AV_LOG_ERROR, "Spool file '%s' is full\n", filename_.c_str());
+      return AVERROR(ENOSPC);
+    }
+    int ret = close_file();
+    if (ret < 0 || (ret = open_file()) < 0)
+    {
+      return ret;
+    }
+    av_log(NULL, AV_LOG_INFO, "Spool file full, continuing in '%s'\n", filename_.c_str());
+  }
+
+  int ret = map_data(header_->data_end, packet->size);
+  if (ret < 0)
+  {
+    av_log(NULL, AV_LOG_ERROR, "Cannot map spool file '%s'\n", filename_.c_str());
+    return ret;
+  }
+  memcpy(data_view_.data + (header_->data_offset + header_->data_end - data_view_.offset), packet->data, packet->size);
+
+  spool::Entry &entry = index_[header_->entries];
+  entry.offset = header_->data_end;
+  entry.pts = packet->pts;
+  entry.dts = packet->dts;
+  entry.arrival_us = arrival_us;
+  entry.size = packet->size;
+  entry.stream_index = (uint16_t)packet->stream_index;
+  entry.flags = (uint16_t)packet->flags;
+  /* the counts last: whatever they cover is complete */
+  std::atomic_thread_fence(std::memory_order_release);
+  header_->data_end += packet->size;
+  header_->entries++;
+
+  packets_++;
+  bytes_ += packet->size;
+  return 0;
+}
+
+int SpoolWriter::Close()
+{
+  return header_ ? close_file() : 0;
+}
+
+void SpoolWriter::PrintStats(int level) const
+{
+  av_log(NULL, level, "Spool: %llu packets, %lld bytes in %d file(s)\n", (unsigned long long)packets_, (long long)bytes_, files_);
+}
+
+int SpoolWriter::open_file()
+{
+  filename_ = OutputMuxer::ExpandTemplate(pattern_, files_);
+  int64_t index_capacity = FFMAX(options_.size / BYTES_PER_ENTRY, 1024);
+  int64_t data_offset = spool::HEADER_SIZE + FFALIGN(index_capacity * (int64_t)sizeof(spool::Entry), spool::HEADER_SIZE);
+  if (options_.size <= data_offset)
+  {
+    av_log(NULL, AV_LOG_ERROR, "Spool size %lld is too small\n", (long long)options_.size);
+    return AVERROR(EINVAL);
+  }
+
+  int ret = file_.Open(filename_, options_.size);
+  if (ret < 0)
+  {
+    av_log(NULL, AV_LOG_ERROR, "Cannot create spool file '%s' of %lld bytes\n", filename_.c_str(), (long long)options_.size);
+    return ret;
+  }
+  files_++;
+  if ((ret = file_.Map(0, (size_t)spool::HEADER_SIZE, &header_view_)) < 0 ||
+    (ret = file_.Map(spool::HEADER_SIZE, (size_t)(index_capacity * sizeof(spool::Entry)), &index_view_)) < 0)
+  {
+    av_log(NULL, AV_LOG_ERROR, "Cannot map spool file '%s'\n", filename_.c_str());
+    file_.Unmap(&header_view_);
+    file_.Close();
+    return ret;
+  }
+  header_ = (spool::Header*)header_view_.data;
+  index_ = (spool::Entry*)index_view_.data;
+
+  memset(header_, 0, sizeof(*header_));
+  memcpy(header_->magic, MAGIC, sizeof(header_->magic));
+  header_->version = spool::VERSION;
+  header_->index_offset = spool::HEADER_SIZE;
+  header_->index_capacity = index_capacity;
+  header_->data_offset = data_offset;
+  header_->data_capacity = options_.size - data_offset;
+  header_->start_time = start_time_;
+
+  /* codec parameters for the reader, extradata behind the header */
+  int64_t extradata_offset = FFALIGN((int64_t)sizeof(spool::Header), 16);
+  for (unsigned int i = 0; i < input_->nb_streams; i++)
+  {
+    const AVStream *stream = input_->streams[i];
+    const AVCodecContext *codec = stream->codec;
+    spool::StreamInfo &info = header_->streams[i];
+    info.codec_type = codec->codec_type;
+    info.codec_id = codec->codec_id;
+    info.codec_tag = codec->codec_tag;
+    info.bits_per_coded_sample = codec->bits_per_coded_sample;
+    info.width = codec->width;
+    info.height = codec->height;
+    info.pix_fmt = codec->pix_fmt;
+    info.sample_aspect_num = codec->sample_aspect_ratio.num;
+    info.sample_aspect_den = codec->sample_aspect_ratio.den;
+    info.sample_rate = codec->sample_rate;
+    info.channels = codec->channels;
+    info.channel_layout = codec->channel_layout;
+    info.sample_fmt = codec->sample_fmt;
+    info.block_align = codec->block_align;
+    info.bit_rate = codec->bit_rate;
+    info.time_base_num = stream->time_base.num;
+    info.time_base_den = stream->time_base.den;
+    info.frame_rate_num = stream->avg_frame_rate.num ? stream->avg_frame_rate.num : stream->r_frame_rate.num;
+    info.frame_rate_den = stream->avg_frame_rate.num ? stream->avg_frame_rate.den : stream->r_frame_rate.den;
+    if (codec->extradata_size > 0 && extradata_offset + codec->extradata_size <= spool::HEADER_SIZE)
+    {
+      memcpy((uint8_t*)header_ + extradata_offset, codec->extradata, codec->extradata_size);
+      info.extradata_offset = extradata_offset;
+      info.extradata_size = codec->extradata_size;
+      extradata_offset = FFALIGN(extradata_offset + codec->extradata_size, 16);
+    }
+  }
+  header_->nb_streams = input_->nb_streams;
+  return 0;
+}
+
+int SpoolWriter::close_file()
+{
+  header_->closed = 1;
+  int64_t end = header_->data_offset + header_->data_end;
+  file_.Unmap(&data_view_);
+  file_.Unmap(&index_view_);
+  file_.Unmap(&header_view_);
+  header_ = NULL;
+  index_ = NULL;
+
+  /* give back the preallocation that was not needed */
+  int ret = file_.Truncate(end);
+  if (ret < 0)
+  {
+    av_log(NULL, AV_LOG_WARNING, "Cannot trim spool file '%s'\n", filename_.c_str());
+  }
+  file_.Close();
+  return 0;
+}
+
+int SpoolWriter::map_data(int64_t offset, size_t size)
+{
+  int64_t file_offset = header_->data_offset + offset;
+  if (data_view_.data && file_offset >= data_view_.offset &&
+    file_offset + (int64_t)size <= data_view_.offset + (int64_t)data_view_.length)
+  {
+    return 0;
+  }
+  file_.Unmap(&data_view_);
+  size_t length = (size_t)FFMIN((int64_t)FFMAX(DATA_WINDOW, size), file_.Size() - file_offset);
+  return file_.Map(file_offset, length, &data_view_);
+}
+
+SpoolReader::SpoolReader()
+  : header_(NULL)
+  , index_(NULL)
+  , entries_(0)
+  , next_(0)
+{
+}
+
+SpoolReader::~SpoolReader()
+{
+  file_.Unmap(&data_view_);
+  file_.Unmap(&index_view_);
+  file_.Unmap(&header_view_);
+}
+
+int SpoolReader::Open(const std::string &filename)
+{
+  int ret = file_.Open(filename, 0);
+  if (ret < 0)
+  {
+    return ret;
+  }
+  if (file_.Size() < spool::HEADER_SIZE || (ret = file_.Map(0, (size_t)spool::HEADER_SIZE, &header_view_)) < 0)
+  {
+    return ret < 0 ? ret : AVERROR_INVALIDDATA;
+  }
+  header_ = (const spool::Header*)header_view_.data;
+  if (memcmp(header_->magic, MAGIC, sizeof(MAGIC)) != 0 || header_->version != spool::VERSION ||
+    header_->nb_streams > (uint32_t)spool::MAX_STREAMS || header_->index_capacity < 0 || header_->entries < 0 ||
+    header_->index_offset + header_->index_capacity * (int64_t)sizeof(spool::Entry) > header_->data_offset)
+  {
+    av_log(NULL, AV_LOG_ERROR, "'%s' is not a spool file\n", filename.c_str());
+    return AVERROR_INVALIDDATA;
+  }
+  if (!header_->closed)
+  {
+    av_log(NULL, AV_LOG_WARNING, "Spool file '%s' was not closed, reading the %lld packets it committed\n",
+      filename.c_str(), (long long)header_->entries);
+  }
+
+  entries_ = FFMIN(header_->entries, header_->index_capacity);
+  if (entries_ > 0 &&
+    (ret = file_.Map(header_->index_offset, (size_t)(entries_ * sizeof(spool::Entry)), &index_view_)) < 0)
+  {
+    return ret;
+  }
+  index_ = (const spool::Entry*)index_view_.data;
+  return 0;
+}
+
+const uint8_t *SpoolReader::Extradata(int stream_index) const
+{
+  const spool::StreamInfo &info = header_->streams[stream_index];
+  if (info.extradata_size <= 0 || info.extradata_offset < (int64_t)sizeof(spool::Header) ||
+    info.extradata_offset + info.extradata_size > spool::HEADER_SIZE)
+  {
+    return NULL;
+  }
+  return (const uint8_t*)header_ + info.extradata_offset;
+}
+
+int SpoolReader::Read(AVPacket *packet)
+{
+  if (next_ >= entries_)
+  {
+    return AVERROR_EOF;
+  }
+  const spool::Entry &entry = index_[next_++];
+  int64_t file_offset = header_->data_offset + entry.offset;
+  if (entry.size < 0 || entry.offset < 0 || entry.offset + entry.size > header_->data_end ||
+    file_offset + entry.size > file_.Size() || entry.stream_index >= header_->nb_streams)
+  {
+    return AVERROR_INVALIDDATA;
+  }
+  if (!data_view_.data || file_offset < data_view_.offset ||
+    file_offset + entry.size > data_view_.offset + (int64_t)data_view_.length)
+  {
+    file_.Unmap(&data_view_);
+    size_t length = (size_t)FFMIN((int64_t)FFMAX(DATA_WINDOW, (size_t)entry.size), file_.Size() - file_offset);
+    int ret = file_.Map(file_offset, length, &data_view_);
+    if (ret < 0)
+    {
+      return ret;
+    }
+  }
+
+  int ret = av_new_packet(packet, entry.size);
+  if (ret < 0)
+  {
+    return ret;
+  }
+  memcpy(packet->data, data_view_.data + (file_offset - data_view_.offset), entry.size);
+  packet->pts = entry.pts;
+  packet->dts = entry.dts;
+  packet->stream_index = entry.stream_index;
+  packet->flags = entry.flags;
+  /* not a byte position: the capture clock time the packet arrived at */
+  packet->pos = entry.arrival_us;
+  return 0;
+}
@@ -0,0 +1,199 @@
+#pragma once
+
+extern "C"
+{
+  #define __STDC_CONSTANT_MACROS
+  #include <libavformat/avformat.h>
+}
+
+#include <string>
+#include "Noncopyable.h"
+
+struct SpoolOptions
+{
+  SpoolOptions()
+    : size(0)
+  {
+  }
+
+  bool Enabled() const { return size > 0; }
+
+  int64_t size;  // preallocated bytes per spool file; a full file goes on in the next one if the name has %d
+};
+
+// A raw capture file: the demuxer's packets as they came, for transcoding
+// later. Layout: a 64 KB header with the stream parameters, a fixed index of
+// 40-byte entries (timestamps, stream, flags, arrival time) and the packet
+// data. The file is preallocated and written through memory maps; the header
+// counts are updated after each entry, so a spool cut short by a crash of the
+// process is readable up to the last complete packet.
+namespace spool
+{
+  static const int     MAX_STREAMS = 8;
+  static const int64_t HEADER_SIZE = 65536;
+  static const uint32_t VERSION    = 1;
+
+  struct StreamInfo
+  {
+    int32_t codec_type;
+    int32_t codec_id;
+    uint32_t codec_tag;
+    int32_t bits_per_coded_sample;
+    int32_t width;
+    int32_t height;
+    int32_t pix_fmt;
+    int32_t sample_aspect_num;
+    int32_t sample_aspect_den;
+    int32_t sample_rate;
+    int32_t channels;
+    int32_t sample_fmt;
+    int32_t block_align;
+    int32_t time_base_num;
+    int32_t time_base_den;
+    int32_t frame_rate_num;
+    int32_t frame_rate_den;
+    int32_t extradata_size;
+    uint64_t channel_layout;
+    int64_t bit_rate;
+    int64_t extradata_offset;  // in the header block
+  };
+
+  struct Header
+  {
+    char     magic[8];         // "WCSPOOL"
+    uint32_t version;
+    uint32_t nb_streams;
+    int64_t  index_offset;
+    int64_t  index_capacity;   // entries
+    int64_t  data_offset;
+    int64_t  data_capacity;
+    int64_t  start_time;       // av_gettime() when the capture started
+    int64_t  data_end;         // committed bytes of data
+    int64_t  entries;          // committed entries, updated last
+    int32_t  closed;           // 0 if the capture did not end cleanly
+    int32_t  reserved;
+    StreamInfo streams[MAX_STREAMS];
+  };
+
+  struct Entry
+  {
+    int64_t  offset;           // in the data area
+    int64_t  pts;              // the demuxer's, in the stream time base
+    int64_t  dts;
+    int64_t  arrival_us;       // on the capture clock
+    int32_t  size;
+    uint16_t stream_index;
+    uint16_t flags;            // AV_PKT_FLAG_*
+  };
+}
+
+// one region of a MappedFile
+struct MappedView
+{
+  MappedView()
+    : data(NULL)
+    , base(NULL)
+    , offset(0)
+    , length(0)
+  {
+  }
+
+  uint8_t *data;     // the requested offset
+  void    *base;     // the mapping, aligned down
+  int64_t  offset;
+  size_t   length;   // from data on
+};
+
+// A preallocated (or existing) file accessed through memory maps of any
+// offset and length.
+class MappedFile : Noncopyable
+{
+public:
+  MappedFile();
+  ~MappedFile();
+
+  // size > 0 creates the file with that many bytes allocated, 0 opens an existing one read-only
+  int Open(const std::string &filename, int64_t size);
+  void Close();
+  int64_t Size() const { return size_; }
+
+  int Map(int64_t offset, size_t length, MappedView *view);
+  void Unmap(MappedView *view);
+  // shrinks the file, all views must be unmapped
+  int Truncate(int64_t size);
+
+private:
+  bool writable_;
+  int64_t size_;
+#ifdef _WIN32
+  void *file_;
+  void *mapping_;
+#else
+  int fd_;
+#endif
+};
+
+// Appends packets to a spool file from the capture thread.
+class SpoolWriter : Noncopyable
+{
+public:
+  // filename may hold %d (the file number) and strftime fields
+  SpoolWriter(const std::string &filename, const SpoolOptions &options);
+  ~SpoolWriter();
+
+  // takes the stream parameters of the opened input
+  int Open(const AVFormatContext *input);
+  // the packet is copied; AVERROR(ENOSPC) once the file is full and cannot roll over
+  int Write(const AVPacket *packet, int64_t arrival_us);
+  // trims the unused preallocation and marks the file complete
+  int Close();
+
+  uint64_t Packets() const { return packets_; }
+  int64_t Bytes() const { return bytes_; }
+  void PrintStats(int level) const;
+
+private:
+  int open_file();
+  int close_file();
+  int map_data(int64_t offset, size_t size);
+
+private:
+  std::string pattern_;
+  SpoolOptions options_;
+  const AVFormatContext *input_;
+  std::string filename_;
+  int files_;
+  MappedFile file_;
+  MappedView header_view_;
+  MappedView index_view_;
+  MappedView data_view_;
+  spool::Header *header_;
+  spool::Entry *index_;
+  uint64_t packets_;
+  int64_t bytes_;
+  int64_t start_time_;
+};
+
+// Reads a spool file back in packet order.
+class SpoolReader : Noncopyable
+{
+public:
+  SpoolReader();
+  ~SpoolReader();
+
+  int Open(const std::string &filename);
+  const spool::Header &Header() const { return *header_; }
+  const uint8_t *Extradata(int stream_index) const;
+  // AVERROR_EOF after the last committed packet; pkt->pos carries the arrival time
+  int Read(AVPacket *packet);
+
+private:
+  MappedFile file_;
+  MappedView header_view_;
+  MappedView index_view_;
+  MappedView data_view_;
+  const spool::Header *header_;
+  const spool::Entry *index_;
+  int64_t entries_;
+  int64_t next_;
+};
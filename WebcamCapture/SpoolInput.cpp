@@ -0,0 +1,135 @@
+#include "SpoolInput.h"
+#include "SpoolFile.h"
+
+#include <string.h>
+#include <mutex>
+
+static SpoolReader *spool_reader(AVFormatContext *s)
+{
+  return *(SpoolReader**)s->priv_data;
+}
+
+static int spool_read_close(AVFormatContext *s)
+{
+  delete spool_reader(s);
+  *(SpoolReader**)s->priv_data = NULL;
+  return 0;
+}
+
+static int spool_read_header(AVFormatContext *s)
+{
+  SpoolReader *reader = new SpoolReader();
+  *(SpoolReader**)s->priv_data = reader;
+  int ret = reader->Open(s->filename);
+  for (uint32_t i = 0; ret >= 0 && i < reader->Header().nb_streams; i++)
+  {
+    const spool::StreamInfo &info = reader->Header().streams[i];
+    AVStream *stream = avformat_new_stream(s, NULL);
+    if (!stream)
+    {
+      ret = AVERROR(ENOMEM);
+      break;
+    }
+    AVCodecContext *codec = stream->codec;
+    codec->codec_type = (AVMediaType)info.codec_type;
+    codec->codec_id = (AVCodecID)info.codec_id;
+    codec->codec_tag = info.codec_tag;
+    codec->bits_per_coded_sample = info.bits_per_coded_sample;
+    codec->width = info.width;
+    codec->height = info.height;
+    codec->pix_fmt = (AVPixelFormat)info.pix_fmt;
+    codec->sample_aspect_ratio.num = info.sample_aspect_num;
+    codec->sample_aspect_ratio.den = info.sample_aspect_den;
+    codec->sample_rate = info.sample_rate;
+    codec->channels = info.channels;
+    codec->channel_layout = info.channel_layout;
+    codec->sample_fmt = (AVSampleFormat)info.sample_fmt;
+    codec->block_align = info.block_align;
+    codec->bit_rate = info.bit_rate;
+    const uint8_t *extradata = reader->Extradata(i);
+    if (extradata)
+    {
+      codec->extradata = (uint8_t*)av_mallocz(info.extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
+      if (!codec->extradata)
+      {
+        ret = AVERROR(ENOMEM);
+        break;
+      }
+      memcpy(codec->extradata, extradata, info.extradata_size);
+      codec->extradata_size = info.extradata_size;
+    }
+    stream->time_base.num = info.time_base_num;
+    stream->time_base.den = info.time_base_den;
+    /* the device's timestamps, e.g. dshow's 100 ns units, run past 33 bits within minutes */
+    stream->pts_wrap_bits = 64;
+    stream->sample_aspect_ratio = codec->sample_aspect_ratio;
+    stream->avg_frame_rate.num = info.frame_rate_num;
+    stream->avg_frame_rate.den = info.frame_rate_den;
+    stream->r_frame_rate = stream->avg_frame_rate;
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(57, 33, 100)
+    /* from FFmpeg 3.1 on codecpar is what libavformat keeps, it overwrites stream->codec after read_header */
+    if ((ret = avcodec_parameters_from_context(stream->codecpar, codec)) < 0)
+    {
+      break;
+    }
+#endif
+  }
+  if (ret < 0)
+  {
+    /* read_close is not called when the header fails */
+    spool_read_close(s);
+    return ret;
+  }
+  s->start_time_realtime = reader->Header().start_time;
+  return 0;
+}
+
+static int spool_read_packet(AVFormatContext *s, AVPacket *packet)
+{
+  return spool_reader(s)->Read(packet);
+}
+
+static void init_spool_format(AVInputFormat *format)
+{
+  format->name = "wcspool";
+  format->long_name = "WebcamCapture raw packet spool";
+  format->flags = AVFMT_NOFILE;
+  format->extensions = "spool";
+  /* below the public part of AVInputFormat: these follow the FFmpeg 3.0
+   * layout and must be checked whenever the FFmpeg headers change */
+  format->priv_data_size = sizeof(SpoolReader*);
+  format->read_header = spool_read_header;
+  format->read_packet = spool_read_packet;
+  format->read_close = spool_read_close;
+}
+
+/* not registered with libavformat, the backend hands it to avformat_open_input();
+ * filled once, sessions open their spool files concurrently */
+static AVInputFormat *spool_format()
+{
+  static AVInputFormat format;
+  static std::once_flag once;
+  std::call_once(once, init_spool_format, &format);
+  return &format;
+}
+
+InputCapabilities SpoolInput::Capabilities() const
+{
+  InputCapabilities caps;
+  caps.recorded = true;
+  caps.video = true;
+  caps.audio = true;
+  return caps;
+}
+
+int SpoolInput::BuildInput(const InputRequest &request, AVInputFormat **format, std::string *url, AVDictionary **options)
+{
+  if (request.url.empty())
+  {
+    av_log(NULL, AV_LOG_ERROR, "No spool file given\n");
+    return AVERROR(EINVAL);
+  }
+  *url = request.url;
+  *format = spool_format();
+  return 0;
+}
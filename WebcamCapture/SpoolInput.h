@@ -0,0 +1,15 @@
+#pragma once
+
+#include "InputBackend.h"
+
+// Spool files written by -spool, read back for the deferred transcode. A
+// small demuxer of its own turns the index into packets, which keep the
+// arrival times they were captured with. Not live: the reader runs as fast
+// as the pipeline takes the packets.
+class SpoolInput : public InputBackend
+{
+public:
+  const char *Name() const { return "spool"; }
+  InputCapabilities Capabilities() const;
+  int BuildInput(const InputRequest &request, AVInputFormat **format, std::string *url, AVDictionary **options);
+};
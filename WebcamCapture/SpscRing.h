@@ -0,0 +1,215 @@
+#pragma once
+
+#include "Noncopyable.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Bounded lock-free ring of pointers for one producer and one consumer thread.
+// The read index is advanced with compare-and-swap, so the producer may also
+// call TryPop() to evict the oldest element when the ring is full.
+template <typename T>
+class SpscRing : Noncopyable
+{
+public:
+  explicit SpscRing(size_t capacity)
+    : mask_(RoundUp(capacity) - 1)
+    , slots_(RoundUp(capacity))
+    , head_(0)
+    , tail_(0)
+  {
+    for (size_t i = 0; i < slots_.size(); ++i)
+    {
+      slots_[i].store(T(), std::memory_order_relaxed);
+    }
+  }
+
+  // producer only
+  bool TryPush(T value)
+  {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) > mask_)
+    {
+      return false;
+    }
+    slots_[tail & mask_].store(value, std::memory_order_relaxed);
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // consumer, or producer evicting the oldest element
+  bool TryPop(T &value)
+  {
+    size_t head = head_.load(std::memory_order_acquire);
+    while (head != tail_.load(std::memory_order_acquire))
+    {
+      value = slots_[head & mask_].load(std::memory_order_relaxed);
+      if (head_.compare_exchange_weak(head, head + 1, std::memory_order_acq_rel))
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  size_t Size() const
+  {
+    size_t head = head_.load(std::memory_order_acquire);
+    return tail_.load(std::memory_order_acquire) - head;
+  }
+
+  size_t Capacity() const { return mask_ + 1; }
+  bool Empty() const { return Size() == 0; }
+  bool Full() const { return Size() > mask_; }
+
+private:
+  static size_t RoundUp(size_t value)
+  {
+    size_t result = 2;
+    while (result < value)
+    {
+      result <<= 1;
+    }
+    return result;
+  }
+
+private:
+  const size_t mask_;
+  std::vector<std::atomic<T> > slots_;
+  std::atomic<size_t> head_;
+  std::atomic<size_t> tail_;
+};
+
+// SpscRing with blocking Push()/Pop() for the pipeline threads. The data path
+// stays lock-free; the mutex is only taken to park a thread that found the ring
+// full or empty, and the wait is bounded so a missed wakeup costs one timeout.
+template <typename T>
+class SpscQueue : Noncopyable
+{
+public:
+  explicit SpscQueue(size_t capacity)
+    : ring_(capacity)
+    , closed_(false)
+    , waiters_(0)
+  {
+  }
+
+  bool TryPush(T value)
+  {
+    if (!ring_.TryPush(value))
+    {
+      return false;
+    }
+    Wake();
+    return true;
+  }
+
+  bool TryPop(T &value)
+  {
+    if (!ring_.TryPop(value))
+    {
+      return false;
+    }
+    Wake();
+    return true;
+  }
+
+  // Waits for free space; returns false if the queue was closed meanwhile.
+  bool Push(T value)
+  {
+    for (int spin = 0; !TryPush(value); ++spin)
+    {
+      if (closed_.load(std::memory_order_acquire))
+      {
+        return false;
+      }
+      Park(spin, true);
+    }
+    return true;
+  }
+
+  // Waits for an element; returns false once the queue is closed and drained.
+  bool Pop(T &value)
+  {
+    for (int spin = 0; !TryPop(value); ++spin)
+    {
+      if (closed_.load(std::memory_order_acquire) && ring_.Empty())
+      {
+        return false;
+      }
+      Park(spin, false);
+    }
+    return true;
+  }
+
+  // Pop() that gives up after the timeout.
+  bool PopFor(T &value, std::chrono::milliseconds timeout)
+  {
+    if (TryPop(value))
+    {
+      return true;
+    }
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      waiters_.fetch_add(1, std::memory_order_acq_rel);
+      if (!closed_.load(std::memory_order_acquire) && ring_.Empty())
+      {
+        cond_.wait_for(lock, timeout);
+      }
+      waiters_.fetch_sub(1, std::memory_order_acq_rel);
+    }
+    return TryPop(value);
+  }
+
+  void Close()
+  {
+    closed_.store(true, std::memory_order_release);
+    std::lock_guard<std::mutex> lock(mutex_);
+    cond_.notify_all();
+  }
+
+  bool Closed() const { return closed_.load(std::memory_order_acquire); }
+  // closed and nothing left; everything pushed before Close() is visible here
+  bool Drained() const { return Closed() && ring_.Empty(); }
+  size_t Size() const { return ring_.Size(); }
+  size_t Capacity() const { return ring_.Capacity(); }
+  bool Empty() const { return ring_.Empty(); }
+  bool Full() const { return ring_.Full(); }
+
+private:
+  void Wake()
+  {
+    if (waiters_.load(std::memory_order_acquire))
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      cond_.notify_all();
+    }
+  }
+
+  void Park(int spin, bool for_space)
+  {
+    if (spin < 64)
+    {
+      std::this_thread::yield();
+      return;
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    waiters_.fetch_add(1, std::memory_order_acq_rel);
+    if (!closed_.load(std::memory_order_acquire) && (for_space ? ring_.Full() : ring_.Empty()))
+    {
+      cond_.wait_for(lock, std::chrono::milliseconds(10));
+    }
+    waiters_.fetch_sub(1, std::memory_order_acq_rel);
+  }
+
+private:
+  SpscRing<T> ring_;
+  std::atomic<bool> closed_;
+  std::atomic<int> waiters_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+};
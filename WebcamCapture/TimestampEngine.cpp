@@ -0,0 +1,311 @@
+#include "TimestampEngine.h"
+
+#include <math.h>
+
+/* device timestamps further than this from the prediction start a new mapping */
+static const int64_t kDiscontinuityUs = AV_TIME_BASE;
+/* audio gaps longer than this are left as gaps instead of being counted through */
+static const int64_t kAudioResyncUs = AV_TIME_BASE / 5;
+
+static int64_t round_to_int64(double value)
+{
+  return (int64_t)floor(value + 0.5);
+}
+
+TimestampEngine::StreamClock::StreamClock()
+  : offset_us(0)
+  , first_offset_us(0)
+  , first_arrival_us(AV_NOPTS_VALUE)
+  , last_device_us(AV_NOPTS_VALUE)
+  , last_arrival_us(AV_NOPTS_VALUE)
+  , last_out_us(AV_NOPTS_VALUE)
+  , last_error_us(0)
+  , interval_us(0)
+  , jitter_us(0)
+  , sample_rate(0)
+  , audio_anchor(0)
+  , audio_anchor_us(AV_NOPTS_VALUE)
+  , audio_samples(0)
+  , next_slot(AV_NOPTS_VALUE)
+  , last_pts(AV_NOPTS_VALUE)
+{
+}
+
+TimestampEngine::TimestampEngine(unsigned int nb_streams, const TimestampOptions &options)
+  : options_(options)
+  , clocks_(nb_streams)
+  , master_audio_(-1)
+  , av_drift_us_(0)
+{
+  StreamStats empty = { 0, 0, 0, 0, 0, 0, 0 };
+  stats_.av_drift_ms = 0;
+  stats_.audio_resyncs = 0;
+  stats_.streams.assign(nb_streams, empty);
+}
+
+int64_t TimestampEngine::Recover(unsigned int stream_index, int64_t device_us, int64_t arrival_us)
+{
+  StreamClock &clock = clocks_[stream_index];
+  bool reset = false;
+  int64_t error = 0;
+
+  if (!options_.live && device_us != AV_NOPTS_VALUE)
+  {
+    /* nothing to recover, the source's own timestamps are exact */
+    arrival_us = device_us;
+  }
+
+  if (clock.last_arrival_us != AV_NOPTS_VALUE)
+  {
+    double spacing = (double)(arrival_us - clock.last_arrival_us);
+    clock.interval_us = clock.interval_us > 0 ? clock.interval_us + (spacing - clock.interval_us) / 16 : spacing;
+  }
+  if (device_us == AV_NOPTS_VALUE)
+  {
+    /* no device time: extrapolate with the mean spacing and let the arrivals pull it in */
+    device_us = (clock.last_device_us == AV_NOPTS_VALUE) ? arrival_us :
+      clock.last_device_us + round_to_int64(clock.interval_us);
+  }
+
+  if (clock.last_device_us == AV_NOPTS_VALUE)
+  {
+    clock.offset_us = arrival_us - device_us;
+    clock.first_offset_us = clock.offset_us;
+    clock.first_arrival_us = arrival_us;
+  }
+  else
+  {
+    /* how late this packet is against the current mapping */
+    error = arrival_us - (device_us + clock.offset_us);
+    if (error > kDiscontinuityUs || error < -kDiscontinuityUs)
+    {
+      clock.offset_us = arrival_us - device_us;
+      clock.first_offset_us = clock.offset_us;
+      clock.first_arrival_us = arrival_us;
+      error = 0;
+      reset = true;
+    }
+    else if (error < 0)
+    {
+      /* follow the lower envelope of the delay quickly, it is the least jittered */
+      clock.offset_us += error / 4;
+    }
+    else
+    {
+      /* and drift upwards slowly, enough to track a device clock running slow */
+      clock.offset_us += error / 512;
+    }
+  }
+
+  double transit_change = (double)(error > clock.last_error_us ? error - clock.last_error_us : clock.last_error_us - error);
+  clock.jitter_us += (transit_change - clock.jitter_us) / 16;
+  clock.last_error_us = error;
+  clock.last_device_us = device_us;
+  clock.last_arrival_us = arrival_us;
+
+  int64_t out_us = device_us + clock.offset_us;
+  if (clock.last_out_us != AV_NOPTS_VALUE && out_us <= clock.last_out_us)
+  {
+    out_us = clock.last_out_us + 1;
+  }
+  clock.last_out_us = out_us;
+
+  std::lock_guard<std::mutex> lock(stats_mutex_);
+  StreamStats &stats = stats_.streams[stream_index];
+  ++stats.packets;
+  stats.jitter_ms = clock.jitter_us / 1000;
+  if (stats.jitter_ms > stats.max_jitter_ms)
+  {
+    stats.max_jitter_ms = stats.jitter_ms;
+  }
+  if (arrival_us - clock.first_arrival_us > AV_TIME_BASE)
+  {
+    stats.clock_drift_ppm = (double)(clock.offset_us - clock.first_offset_us) * 1e6 / (arrival_us - clock.first_arrival_us);
+  }
+  if (reset)
+  {
+    ++stats.resets;
+  }
+  return out_us;
+}
+
+int64_t TimestampEngine::ToCapture(unsigned int stream_index, int64_t device_us) const
+{
+  if (device_us == AV_NOPTS_VALUE)
+  {
+    return AV_NOPTS_VALUE;
+  }
+  return device_us + clocks_[stream_index].offset_us;
+}
+
+int64_t TimestampEngine::AudioFrame(unsigned int stream_index, int64_t frame_us, int nb_samples, int sample_rate)
+{
+  StreamClock &clock = clocks_[stream_index];
+  AVRational sample_tb = { 1, sample_rate };
+  bool resync = false;
+
+  if (master_audio_ < 0)
+  {
+    master_audio_ = stream_index;
+  }
+  if (clock.audio_anchor_us == AV_NOPTS_VALUE || clock.sample_rate != sample_rate)
+  {
+    if (frame_us == AV_NOPTS_VALUE)
+    {
+      frame_us = 0;
+    }
+    clock.sample_rate = sample_rate;
+    clock.audio_anchor_us = frame_us;
+    clock.audio_anchor = av_rescale_q(frame_us, AV_TIME_BASE_Q, sample_tb);
+    clock.audio_samples = 0;
+  }
+
+  int64_t counted_us = clock.audio_anchor_us + av_rescale(clock.audio_samples, AV_TIME_BASE, sample_rate);
+  if (frame_us != AV_NOPTS_VALUE)
+  {
+    int64_t drift = counted_us - frame_us;
+    if (drift < -kAudioResyncUs)
+    {
+      /* the device dropped audio: leave the hole, keep the drift measured so far */
+      int64_t lead = round_to_int64(av_drift_us_);
+      clock.audio_anchor_us = frame_us + lead;
+      clock.audio_anchor = av_rescale_q(clock.audio_anchor_us, AV_TIME_BASE_Q, sample_tb);
+      clock.audio_samples = 0;
+      counted_us = clock.audio_anchor_us;
+      drift = lead;
+      resync = true;
+    }
+    if ((int)stream_index == master_audio_)
+    {
+      av_drift_us_ += (drift - av_drift_us_) / 32;
+    }
+  }
+
+  int64_t pts = clock.audio_anchor + clock.audio_samples;
+  clock.audio_samples += nb_samples;
+
+  std::lock_guard<std::mutex> lock(stats_mutex_);
+  stats_.av_drift_ms = av_drift_us_ / 1000;
+  if (resync)
+  {
+    ++stats_.audio_resyncs;
+  }
+  return pts;
+}
+
+int64_t TimestampEngine::VideoFrame(unsigned int stream_index, int64_t frame_us)
+{
+  if (frame_us == AV_NOPTS_VALUE || !options_.drift_correction || master_audio_ < 0)
+  {
+    return frame_us;
+  }
+  return frame_us + round_to_int64(av_drift_us_);
+}
+
+int TimestampEngine::ConformVideo(unsigned int stream_index, int64_t frame_us, AVRational time_base, int64_t *pts)
+{
+  StreamClock &clock = clocks_[stream_index];
+  int copies = 1;
+
+  if (options_.sync == TimestampOptions::VFR)
+  {
+    int64_t vfr_pts = (frame_us == AV_NOPTS_VALUE) ? clock.last_pts + 1 : av_rescale_q(frame_us, AV_TIME_BASE_Q, time_base);
+    if (clock.last_pts != AV_NOPTS_VALUE && vfr_pts <= clock.last_pts)
+    {
+      /* same timestamp as the previous frame in this time base */
+      copies = 0;
+    }
+    else
+    {
+      clock.last_pts = vfr_pts;
+      *pts = vfr_pts;
+    }
+  }
+  else
+  {
+    /* position of the frame in frame slots of the encoder time base */
+    double position = (frame_us == AV_NOPTS_VALUE) ? (double)clock.next_slot :
+      (double)frame_us * time_base.den / ((double)time_base.num * AV_TIME_BASE);
+    if (clock.next_slot == AV_NOPTS_VALUE)
+    {
+      clock.next_slot = round_to_int64(position);
+    }
+    double delta = position - clock.next_slot;
+    if (delta < -0.6)
+    {
+      /* its slot is taken already */
+      copies = 0;
+    }
+    else if (delta > 1.1)
+    {
+      /* the camera missed slots, repeat this picture to fill them */
+      copies = (int)round_to_int64(delta) + 1;
+      if (copies - 1 > options_.max_duplicates)
+      {
+        clock.next_slot = round_to_int64(position);
+        copies = 1;
+      }
+    }
+    if (copies > 0)
+    {
+      *pts = clock.next_slot;
+      clock.next_slot += copies;
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(stats_mutex_);
+  StreamStats &stats = stats_.streams[stream_index];
+  if (copies == 0)
+  {
+    ++stats.dropped;
+  }
+  else
+  {
+    stats.duplicated += copies - 1;
+  }
+  return copies;
+}
+
+TimestampEngine::Stats TimestampEngine::GetStats() const
+{
+  std::lock_guard<std::mutex> lock(stats_mutex_);
+  return stats_;
+}
+
+void TimestampEngine::PrintStats(int level) const
+{
+  Stats stats = GetStats();
+  for (size_t i = 0; i < stats.streams.size(); i++)
+  {
+    const StreamStats &stream = stats.streams[i];
+    if (!stream.packets)
+    {
+      continue;
+    }
+    av_log(NULL, level, "Stream #%u clock: jitter %.2f ms (max %.2f), drift %+.1f ppm, %llu resets, %llu duplicated, %llu dropped\n",
+      (unsigned)i, stream.jitter_ms, stream.max_jitter_ms, stream.clock_drift_ppm,
+      (unsigned long long)stream.resets, (unsigned long long)stream.duplicated, (unsigned long long)stream.dropped);
+  }
+  if (master_audio_ >= 0)
+  {
+    av_log(NULL, level, "A/V drift %+.1f ms, %llu audio resyncs\n",
+      stats.av_drift_ms, (unsigned long long)stats.audio_resyncs);
+  }
+}
+
+bool TimestampEngine::ParseSync(const std::string &name, TimestampOptions::video_sync *sync)
+{
+  if (name == "cfr")
+  {
+    *sync = TimestampOptions::CFR;
+  }
+  else if (name == "vfr")
+  {
+    *sync = TimestampOptions::VFR;
+  }
+  else
+  {
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+extern "C"
+{
+  #define __STDC_CONSTANT_MACROS
+  #include <libavutil/avutil.h>
+  #include <libavutil/mathematics.h>
+}
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "Noncopyable.h"
+
+struct TimestampOptions
+{
+  enum video_sync
+  {
+    CFR,  // fill every frame slot of the encoder time base, dropping or duplicating frames
+    VFR   // keep the recovered capture times, drop only frames that would repeat a timestamp
+  };
+
+  TimestampOptions()
+    : sync(CFR)
+    , drift_correction(true)
+    , max_duplicates(30)
+    , live(true)
+  {
+  }
+
+  video_sync sync;
+  bool       drift_correction;  // move video along with the audio device clock
+  int        max_duplicates;    // CFR: longer holes stay holes instead of frozen pictures
+  bool       live;              // arrival times follow the source; off for files read faster than real time
+};
+
+// Turns device timestamps and arrival times into one smooth, monotonic
+// capture clock shared by all streams, in microseconds since capture start.
+// Audio is the master clock: its timestamps count samples, and video follows
+// the measured audio/system clock drift before it is conformed to CFR or VFR.
+//
+// Recover()/ToCapture() run on the reader thread, the frame calls on the
+// processing thread; statistics can be read from any thread.
+class TimestampEngine : Noncopyable
+{
+public:
+  struct StreamStats
+  {
+    uint64_t packets;
+    double   jitter_ms;        // smoothed interarrival jitter, RFC 3550 style
+    double   max_jitter_ms;
+    double   clock_drift_ppm;  // device clock against the system clock
+    uint64_t resets;           // device timestamp discontinuities
+    uint64_t duplicated;       // CFR fills
+    uint64_t dropped;          // frames that had no slot of their own
+  };
+  struct Stats
+  {
+    double   av_drift_ms;      // audio sample clock minus system clock
+    uint64_t audio_resyncs;    // gaps left where the audio device skipped
+    std::vector<StreamStats> streams;
+  };
+
+  TimestampEngine(unsigned int nb_streams, const TimestampOptions &options);
+
+  // capture time of a packet; device_us may be AV_NOPTS_VALUE
+  int64_t Recover(unsigned int stream_index, int64_t device_us, int64_t arrival_us);
+  // another timestamp of the same packet (pts next to dts), with the offset Recover() just used
+  int64_t ToCapture(unsigned int stream_index, int64_t device_us) const;
+
+  // decoded audio: pts in 1/sample_rate, continuous unless the device skipped
+  int64_t AudioFrame(unsigned int stream_index, int64_t frame_us, int nb_samples, int sample_rate);
+  // decoded video: capture time corrected for the audio clock drift
+  int64_t VideoFrame(unsigned int stream_index, int64_t frame_us);
+  // encoder input: how many copies to encode, 0 drops the frame; the first copy goes at *pts in time_base
+  int ConformVideo(unsigned int stream_index, int64_t frame_us, AVRational time_base, int64_t *pts);
+
+  Stats GetStats() const;
+  void PrintStats(int level) const;
+
+  static bool ParseSync(const std::string &name, TimestampOptions::video_sync *sync);
+
+private:
+  struct StreamClock
+  {
+    StreamClock();
+
+    /* reader thread */
+    int64_t offset_us;         // device time to capture time
+    int64_t first_offset_us;
+    int64_t first_arrival_us;
+    int64_t last_device_us;
+    int64_t last_arrival_us;
+    int64_t last_out_us;
+    int64_t last_error_us;
+    double  interval_us;       // mean packet spacing, stands in for missing device times
+    double  jitter_us;
+
+    /* processing thread */
+    int     sample_rate;
+    int64_t audio_anchor;      // pts of the first sample counted since the last resync
+    int64_t audio_anchor_us;
+    int64_t audio_samples;
+    int64_t next_slot;         // CFR
+    int64_t last_pts;          // VFR
+  };
+
+private:
+  TimestampOptions options_;
+  std::vector<StreamClock> clocks_;
+  std::atomic<int> master_audio_;  // the first audio stream
+  double av_drift_us_;
+
+  mutable std::mutex stats_mutex_;
+  Stats stats_;
+};
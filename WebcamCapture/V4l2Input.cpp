@@ -0,0 +1,85 @@
+#include "V4l2Input.h"
+
+extern "C"
+{
+  #define __STDC_CONSTANT_MACROS
+  #include <libavutil/avstring.h>
+}
+
+InputCapabilities V4l2Input::Capabilities() const
+{
+  InputCapabilities caps;
+  caps.live = true;
+  caps.enumerable = true;
+  caps.video = true;
+  caps.audio = true;
+  return caps;
+}
+
+std::vector<InputDevice> V4l2Input::ListDevices()
+{
+  std::vector<InputDevice> devices;
+  list_sources("video4linux2", false, &devices);
+  list_sources("alsa", true, &devices);
+  return devices;
+}
+
+int V4l2Input::BuildInput(const InputRequest &request, AVInputFormat **format, std::string *url, AVDictionary **options)
+{
+  if (request.video_device.empty() && request.audio_device.empty())
+  {
+    av_log(NULL, AV_LOG_ERROR, "No v4l2 or alsa device given\n");
+    return AVERROR(EINVAL);
+  }
+  if (request.audio_device.empty())
+  {
+    *url = request.video_device;
+    return find_format("video4linux2", format);
+  }
+  if (request.video_device.empty())
+  {
+    *url = request.audio_device;
+    return find_format("alsa", format);
+  }
+
+  if (!request.options.empty())
+  {
+    av_log(NULL, AV_LOG_WARNING, "Input options go to lavfi when v4l2 and alsa are captured together\n");
+  }
+  *url = "movie=filename=" + escape_source(request.video_device) + ":format_name=video4linux2[out0];"
+         "amovie=filename=" + escape_source(request.audio_device) + ":format_name=alsa[out1]";
+  return find_format("lavfi", format);
+}
+
+int V4l2Input::PrintCapabilities(const InputRequest &request)
+{
+  int ret = 0;
+  if (!request.video_device.empty())
+  {
+    ret = print_device_options("video4linux2", request.video_device, "list_formats", "all");
+  }
+  if (ret >= 0 && !request.audio_device.empty())
+  {
+    /* alsa has no listing option, what it opens with is all there is */
+    InputRequest audio_only;
+    audio_only.audio_device = request.audio_device;
+    ret = InputBackend::PrintCapabilities(audio_only);
+  }
+  return ret;
+}
+
+std::string V4l2Input::escape_source(const std::string &value)
+{
+  /* hw:0,0 needs escaping twice: once for the option parser, once for the graph parser */
+  std::string result;
+  char *option = NULL;
+  char *graph = NULL;
+  if (av_escape(&option, value.c_str(), ":", AV_ESCAPE_MODE_BACKSLASH, 0) >= 0 &&
+    av_escape(&graph, option, ",;[]", AV_ESCAPE_MODE_BACKSLASH, 0) >= 0)
+  {
+    result = graph;
+  }
+  av_free(option);
+  av_free(graph);
+  return result;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "InputBackend.h"
+
+// Video4Linux2 cameras with ALSA microphones. They are separate demuxers,
+// so a capture with both runs them as movie/amovie sources of one lavfi
+// graph; device options then go to lavfi and cannot reach v4l2 or alsa.
+class V4l2Input : public InputBackend
+{
+public:
+  const char *Name() const { return "v4l2"; }
+  InputCapabilities Capabilities() const;
+  std::vector<InputDevice> ListDevices();
+  int BuildInput(const InputRequest &request, AVInputFormat **format, std::string *url, AVDictionary **options);
+  int PrintCapabilities(const InputRequest &request);
+
+private:
+  // escapes a movie source option value, then the graph description around it
+  static std::string escape_source(const std::string &value);
+};
@@ -1,40 +1,103 @@
 #include "WebcamCapture.h"
+#include "ProbeCache.h"
 
 extern "C"
 {
-#include <libavfilter\buffersrc.h>
-#include <libavfilter\buffersink.h>
-#include <libavutil\time.h>
+#include <libavfilter/buffersrc.h>
+#include <libavfilter/buffersink.h>
+#include <libavutil/cpu.h>
+#include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/time.h>
 }
+#include <stdlib.h>
 #include <chrono>
+#include <thread>
 #include <vector>
 #include <sstream>
 
-WebcamCapture::WebcamCapture(uint32_t duration_sec, const std::string &output_filename, const std::string &camera_name, const std::string &mic_name)
+WebcamCapture::WebcamCapture(uint32_t duration_sec, const std::string &output_filename, const std::string &camera_name, const std::string &mic_name,
+  const CaptureOptions &options)
   : status_(SUCCESS)
   , packet_in_(NULL)
-  , packet_out_(NULL)
   , frame_(NULL)
   , ifmt_ctx_(NULL)
-  , input_format_(NULL)
+  , input_backend_(NULL)
   , ofmt_ctx_(NULL)
+  , output_(NULL)
+  , event_recorder_(NULL)
+  , fanout_(NULL)
+  , ladder_(NULL)
+  , ladder_stream_(-1)
+  , filter_ctx_(NULL)
+  , stream_ctx_(NULL)
   , filtered_frame_(NULL)
+  , media_pool_(new MediaPool())
+  , capture_queue_(new CaptureQueue(options.queue_size, options.queue_policy, media_pool_))
+  , timestamps_(NULL)
+  , metrics_(NULL)
+  , motion_gate_(NULL)
+  , motion_stream_(-1)
+  , snapshots_(NULL)
+  , snapshot_stream_(-1)
+  , spool_(NULL)
+  , degrade_(NULL)
+  , degrade_stream_(-1)
+  , degrade_width_(0)
+  , degrade_height_(0)
+  , degrade_graph_(false)
+  , degrade_scale_steps_(0)
+  , decimation_(1)
+  , decimate_slot_(0)
+  , adapted_encoder_(NULL)
+  , adapted_no_bframes_(false)
+  , adapted_fast_preset_(false)
+  , adapted_skip_(0)
+  , adapted_last_dts_(AV_NOPTS_VALUE)
+  , capture_start_us_(0)
+  , output_video_frames_(0)
+  , output_audio_frames_(0)
+  , output_bytes_(0)
+  , output_start_us_(AV_NOPTS_VALUE)
+  , output_duration_us_(0)
+  , late_packets_(0)
+  , late_warning_us_(0)
+  , stop_reading_(false)
+  , mux_thread_(NULL)
+  , pipeline_error_(0)
+  , pool_client_(-1)
+  , encoder_scheduled_(NULL)
+  , running_encoders_(0)
   , camera_name_(camera_name)
   , mic_name_(mic_name)
   , output_filename_(output_filename)
   , packet_pts_(0)
   , duration_sec_(duration_sec)
+  , options_(options)
 {
   av_register_all();
   avfilter_register_all();
   avdevice_register_all();
 
-  if ((open_input_file() < 0) ||
+  int64_t start_us = LatencyMetrics::Now();
+  if (options_.spool.Enabled())
+  {
+    if ((open_input_file() < 0) ||
+      (open_spool() < 0))
+    {
+      status_ = INVALID;
+    }
+  }
+  else if ((open_input_file() < 0) ||
     (open_output_file() < 0) ||
     (init_filters() < 0))
   {
     status_ = INVALID;
   }
+  if (status_ == SUCCESS)
+  {
+    av_log(NULL, AV_LOG_INFO, "Ready to capture in %.1f ms\n", (LatencyMetrics::Now() - start_us) / 1000.0);
+  }
 }
 
 WebcamCapture::~WebcamCapture()
@@ -42,23 +105,21 @@ WebcamCapture::~WebcamCapture()
   if (ofmt_ctx_ && status_ == SUCCESS)
   {
     flush_filters();
-    av_write_trailer(ofmt_ctx_);
   }
+  /* finalizes the last segment even if capture failed half-way */
+  delete output_;
+  delete ladder_;
   if (packet_in_)
   {
-    av_packet_unref(packet_in_);
-  }
-  if (packet_out_)
-  {
-    av_packet_unref(packet_in_);
+    media_pool_->ReleasePacket(&packet_in_);
   }
   if (frame_)
   {
-    av_frame_free(&frame_);
+    media_pool_->ReleaseFrame(&frame_);
   }
   if (filtered_frame_)
   {
-    av_frame_free(&filtered_frame_);
+    media_pool_->ReleaseFrame(&filtered_frame_);
   }
   if (ifmt_ctx_)
   {
@@ -73,25 +134,47 @@ WebcamCapture::~WebcamCapture()
       {
         avfilter_graph_free(&filter_ctx_[i].filter_graph);
       }
+      if (stream_ctx_)
+      {
+        delete stream_ctx_[i].converter;
+        delete stream_ctx_[i].parallel;
+      }
     }
     avformat_close_input(&ifmt_ctx_);
   }
-  av_free(filter_ctx_);
-  av_free(stream_ctx_);
-  if (ofmt_ctx_ && !(ofmt_ctx_->oformat->flags & AVFMT_NOFILE))
+  delete capture_queue_;
+  delete timestamps_;
+  delete metrics_;
+  delete motion_gate_;
+  /* holds decoded pictures from the pool */
+  delete snapshots_;
+  delete spool_;
+  delete degrade_;
+  if (adapted_encoder_)
   {
-    avio_closep(&ofmt_ctx_->pb);
+    avcodec_free_context(&adapted_encoder_);
   }
+  delete input_backend_;
+  av_free(filter_ctx_);
+  av_free(stream_ctx_);
+  delete[] encoder_scheduled_;
   if (ofmt_ctx_)
   {
     avformat_free_context(ofmt_ctx_);
   }
+  delete media_pool_;
 }
 
 int WebcamCapture::flush_filters()
 {
   int ret = 0;
-  /* flush filters and encoders */
+  if (!mux_thread_)
+  {
+    /* pipeline threads never started or already flushed */
+    return 0;
+  }
+
+  /* flush filters, the encoder threads flush the encoders once their queues run dry */
   for (int i = 0; i < ifmt_ctx_->nb_streams; i++)
   {
     /* flush filter */
@@ -105,14 +188,12 @@ int WebcamCapture::flush_filters()
       av_log(NULL, AV_LOG_ERROR, "Flushing filter failed\n");
       break;
     }
+  }
 
-    /* flush encoder */
-    ret = flush_encoder(i);
-    if (ret < 0)
-    {
-      av_log(NULL, AV_LOG_ERROR, "Flushing encoder failed\n");
-      break;
-    }
+  int workers_ret = stop_workers();
+  if (ret >= 0)
+  {
+    ret = workers_ret;
   }
 
   if (ret < 0)
@@ -128,35 +209,37 @@ int WebcamCapture::open_input_file()
 {
   int ret = 0;
 
-  AVDictionary *av_option = 0;
-  av_dict_set(&av_option, "rtbufsize", "1000000000", NULL);
-  input_format_ = av_find_input_format("dshow");
-  ifmt_ctx_ = avformat_alloc_context();
+  InputRequest request;
+  request.video_device = camera_name_;
+  request.audio_device = mic_name_;
+  request.url = options_.input_url;
+  request.format = options_.input_format;
+  request.options = options_.input_options;
 
-  std::string device_name = "video=";
-  device_name.append(camera_name_);
-  if (!mic_name_.empty())
+  input_backend_ = InputBackend::Create(options_.input_backend);
+  if (!input_backend_)
   {
-    device_name.append(":audio=");
-    device_name.append(mic_name_);
+    av_log(NULL, AV_LOG_ERROR, "Unknown input backend '%s'\n", options_.input_backend.c_str());
+    return AVERROR(EINVAL);
   }
-  //test incoming file:
-  //device_name = "d:\\WORK\\1.avi"; input_format = NULL;
-  if ((ret = avformat_open_input(&ifmt_ctx_, device_name.c_str(), input_format_, &av_option)) < 0)
+  int64_t open_start = LatencyMetrics::Now();
+  if ((ret = input_backend_->Open(request, &ifmt_ctx_)) < 0)
   {
-    av_dict_free(&av_option);
-    char buf[AV_ERROR_MAX_STRING_SIZE];
-    av_strerror(ret, buf, sizeof(buf));
-    av_log(NULL, AV_LOG_ERROR, "Cannot open input source '%s' with error '%s'\n", device_name.c_str(), buf);
     return ret;
   }
-  av_dict_free(&av_option);
+  if (options_.low_latency)
+  {
+    /* packets read while probing would reach the pipeline late, drop them */
+    ifmt_ctx_->flags |= AVFMT_FLAG_NOBUFFER;
+  }
 
-  if ((ret = avformat_find_stream_info(ifmt_ctx_, NULL)) < 0)
+  int64_t probe_start = LatencyMetrics::Now();
+  if ((ret = probe_input()) < 0)
   {
     av_log(NULL, AV_LOG_ERROR, "Cannot find stream information\n");
     return ret;
   }
+  int64_t decoders_start = LatencyMetrics::Now();
 
   stream_ctx_ = (StreamContext*)av_mallocz_array(ifmt_ctx_->nb_streams, sizeof(*stream_ctx_));
   if (!stream_ctx_)
@@ -167,14 +250,27 @@ int WebcamCapture::open_input_file()
   for (int i = 0; i < ifmt_ctx_->nb_streams; i++)
   {
     AVStream *stream = ifmt_ctx_->streams[i];
+    AVCodecContext *codec_ctx = stream->codec;
+    stream_ctx_[i].stream_copy =
+      (codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO && options_.copy_video) ||
+      (codec_ctx->codec_type == AVMEDIA_TYPE_AUDIO && options_.copy_audio);
+    if (stream_ctx_[i].stream_copy)
+    {
+      /* packets go straight to the muxer, no decoder needed */
+      if (codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO)
+      {
+        codec_ctx->framerate = av_guess_frame_rate(ifmt_ctx_, stream, NULL);
+      }
+      stream_ctx_[i].dec_ctx = codec_ctx;
+      continue;
+    }
+
     AVCodec *dec = avcodec_find_decoder(stream->codec->codec_id);
-    AVCodecContext *codec_ctx;
     if (!dec)
     {
       av_log(NULL, AV_LOG_ERROR, "Failed to find decoder for stream #%u\n", i);
       return AVERROR_DECODER_NOT_FOUND;
     }
-    codec_ctx = stream->codec;
     if (!codec_ctx)
     {
       av_log(NULL, AV_LOG_ERROR, "Failed to allocate the decoder context for stream #%u\n", i);
@@ -194,18 +290,171 @@ int WebcamCapture::open_input_file()
       {
         codec_ctx->framerate = av_guess_frame_rate(ifmt_ctx_, stream, NULL);
       }
+      /* decoded pictures come from the pool's AVBufferPools */
+      media_pool_->AttachDecoder(codec_ctx);
+      if (options_.low_latency)
+      {
+        codec_ctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+      }
       /* Open decoder */
-      ret = avcodec_open2(codec_ctx, dec, NULL);
+      AVDictionary *dec_opts = NULL;
+      build_decoder_options(&dec_opts);
+      ret = avcodec_open2(codec_ctx, dec, &dec_opts);
+      av_dict_free(&dec_opts);
       if (ret < 0)
       {
         av_log(NULL, AV_LOG_ERROR, "Failed to open decoder for stream #%u\n", i);
         return 0;
       }
+      if ((ret = open_parallel_decoder(i)) < 0)
+      {
+        return ret;
+      }
     }
     stream_ctx_[i].dec_ctx = codec_ctx;
   }
+  av_log(NULL, AV_LOG_INFO, "Input opened in %.1f ms, probed in %.1f ms, decoders in %.1f ms\n",
+    (probe_start - open_start) / 1000.0, (decoders_start - probe_start) / 1000.0,
+    (LatencyMetrics::Now() - decoders_start) / 1000.0);
+
+  av_dump_format(ifmt_ctx_, 0, ifmt_ctx_->filename, 0);
+  /* arrival times only mean something when the source runs in real time, or did when it was spooled */
+  InputCapabilities caps = input_backend_->Capabilities();
+  options_.timestamps.live = caps.live || caps.recorded || options_.pace_input;
+  timestamps_ = new TimestampEngine(ifmt_ctx_->nb_streams, options_.timestamps);
+  /* low-latency mode reports the capture-to-write latency even without a metrics file */
+  if (options_.metrics.Enabled() || options_.low_latency)
+  {
+    metrics_ = new LatencyMetrics(ifmt_ctx_->nb_streams, options_.metrics);
+    for (unsigned int i = 0; i < ifmt_ctx_->nb_streams; i++)
+    {
+      metrics_->SetStreamType(i, ifmt_ctx_->streams[i]->codec->codec_type);
+    }
+  }
+  /* the first video stream; a remuxed one never reaches the gate */
+  for (unsigned int i = 0; i < ifmt_ctx_->nb_streams && options_.motion.Enabled() && !motion_gate_; i++)
+  {
+    if (ifmt_ctx_->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO)
+    {
+      motion_stream_ = i;
+      motion_gate_ = new MotionGate(options_.motion);
+    }
+  }
+  /* stills need decoded pictures as well */
+  for (unsigned int i = 0; i < ifmt_ctx_->nb_streams && options_.snapshot.Enabled() && !snapshots_; i++)
+  {
+    if (ifmt_ctx_->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO && !stream_ctx_[i].stream_copy)
+    {
+      snapshot_stream_ = i;
+      snapshots_ = new SnapshotWriter(options_.snapshot);
+      if ((ret = snapshots_->Start()) < 0)
+      {
+        return ret;
+      }
+    }
+  }
+  if (options_.snapshot.Enabled() && !snapshots_)
+  {
+    av_log(NULL, AV_LOG_WARNING, "Snapshots need a decoded video stream, ignoring them\n");
+  }
+  return 0;
+}
+
+int WebcamCapture::open_spool()
+{
+  spool_ = new SpoolWriter(output_filename_, options_.spool);
+  return spool_->Open(ifmt_ctx_);
+}
+
+int WebcamCapture::probe_input()
+{
+  if (options_.probe_cache.empty() || !input_backend_->Capabilities().live)
+  {
+    /* files and synthetic sources differ from one run to the next */
+    return avformat_find_stream_info(ifmt_ctx_, NULL);
+  }
+
+  /* a device is known by its backend, names and the options it was opened with */
+  std::string key = std::string(input_backend_->Name()) + "|" + camera_name_ + "|" + mic_name_ + "|" +
+    options_.input_url + "|" + options_.input_format + "|" + options_.input_options;
+  ProbeCache cache(options_.probe_cache);
+  cache.Load();
+  bool cached = cache.Apply(key, ifmt_ctx_);
+  int64_t probesize = ifmt_ctx_->probesize;
+  int64_t analyze_duration = ifmt_ctx_->max_analyze_duration;
+  if (cached)
+  {
+    /* nothing left to find: stop at the first packet */
+    ifmt_ctx_->probesize = 32;
+    ifmt_ctx_->max_analyze_duration = 1;
+  }
+  int ret = avformat_find_stream_info(ifmt_ctx_, NULL);
+  ifmt_ctx_->probesize = probesize;
+  ifmt_ctx_->max_analyze_duration = analyze_duration;
+  if (ret >= 0 && cached && !ProbeCache::Complete(ifmt_ctx_))
+  {
+    av_log(NULL, AV_LOG_WARNING, "The cached stream parameters are not enough, probing\n");
+    cached = false;
+    ret = avformat_find_stream_info(ifmt_ctx_, NULL);
+  }
+  if (ret < 0)
+  {
+    return ret;
+  }
+  av_log(NULL, AV_LOG_INFO, "Stream parameters %s\n", cached ? "from the probe cache" : "probed");
+  if (!cached && ProbeCache::Complete(ifmt_ctx_))
+  {
+    /* a failed write only costs the next start its speed */
+    cache.Store(key, ifmt_ctx_);
+  }
+  return ret;
+}
+
+void WebcamCapture::build_decoder_options(AVDictionary **dict) const
+{
+  const DecoderOptions &dec_options = options_.decoder;
+  av_dict_set(dict, "threads", dec_options.threads.empty() ? "auto" : dec_options.threads.c_str(), 0);
+  if (!dec_options.thread_type.empty())
+  {
+    av_dict_set(dict, "thread_type", dec_options.thread_type.c_str(), 0);
+  }
+  else if (options_.low_latency)
+  {
+    /* frame threads hold back a picture per thread */
+    av_dict_set(dict, "thread_type", "slice", 0);
+  }
+}
+
+int WebcamCapture::open_parallel_decoder(unsigned int stream_index)
+{
+  AVCodecContext *dec_ctx = stream_ctx_[stream_index].dec_ctx;
+  const DecoderOptions &dec_options = options_.decoder;
+  bool frames = dec_options.thread_type.empty() ? !options_.low_latency : dec_options.thread_type == "frame";
+  if (!frames || !ParallelDecoder::Supports(dec_ctx))
+  {
+    return 0;
+  }
+  /* the same count libavcodec would have used */
+  int threads = atoi(dec_options.threads.c_str());
+  if (threads <= 0)
+  {
+    threads = FFMIN(av_cpu_count() + 1, 16);
+  }
+  if (threads <= 1)
+  {
+    return 0;
+  }
 
-  av_dump_format(ifmt_ctx_, 0, device_name.c_str(), 0);
+  ParallelDecoder *parallel = new ParallelDecoder(dec_ctx, threads, media_pool_);
+  int ret = parallel->Open();
+  if (ret < 0)
+  {
+    av_log(NULL, AV_LOG_WARNING, "Cannot decode stream #%u on %d threads, using one\n", stream_index, threads);
+    delete parallel;
+    return 0;
+  }
+  av_log(NULL, AV_LOG_INFO, "Decoding stream #%u (%s) on %d threads\n", stream_index, dec_ctx->codec->name, threads);
+  stream_ctx_[stream_index].parallel = parallel;
   return 0;
 }
 
@@ -224,6 +473,12 @@ int WebcamCapture::open_output_file()
     av_log(NULL, AV_LOG_ERROR, "Could not create output context\n");
     return AVERROR_UNKNOWN;
   }
+
+  filter_ctx_ = (FilteringContext*)av_mallocz_array(ifmt_ctx_->nb_streams, sizeof(*filter_ctx_));
+  if (!filter_ctx_)
+  {
+    return AVERROR(ENOMEM);
+  }
                                       
   for (i = 0; i < ifmt_ctx_->nb_streams; i++)
   {
@@ -235,11 +490,19 @@ int WebcamCapture::open_output_file()
 
     dec_ctx = stream_ctx_[i].dec_ctx;
 
-    if (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO
+    if (stream_ctx_[i].stream_copy)
+    {
+      if ((ret = copy_stream_parameters(i, out_stream)) < 0)
+      {
+        return ret;
+      }
+    }
+    else if (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO
       || dec_ctx->codec_type == AVMEDIA_TYPE_AUDIO)
     {
-      /* in this example, we choose transcoding to same codec */
-      encoder = avcodec_find_encoder(dec_ctx->codec_id);
+      const EncoderOptions &enc_options = (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) ?
+        options_.video_encoder : options_.audio_encoder;
+      encoder = find_encoder(dec_ctx, enc_options);
       if (!encoder) {
         av_log(NULL, AV_LOG_FATAL, "Necessary encoder not found\n");
         return AVERROR_INVALIDDATA;
@@ -258,8 +521,17 @@ int WebcamCapture::open_output_file()
         enc_ctx->height = dec_ctx->height;
         enc_ctx->width = dec_ctx->width;
         enc_ctx->sample_aspect_ratio = dec_ctx->sample_aspect_ratio;
-        /* take first format from list of supported formats */
-        if (encoder->pix_fmts)
+        /* take the requested format or the first from list of supported formats */
+        if (!enc_options.pix_fmt.empty())
+        {
+          enc_ctx->pix_fmt = av_get_pix_fmt(enc_options.pix_fmt.c_str());
+          if (enc_ctx->pix_fmt == AV_PIX_FMT_NONE)
+          {
+            av_log(NULL, AV_LOG_ERROR, "Unknown pixel format '%s'\n", enc_options.pix_fmt.c_str());
+            return AVERROR(EINVAL);
+          }
+        }
+        else if (encoder->pix_fmts)
         {
           enc_ctx->pix_fmt = encoder->pix_fmts[0];
         }
@@ -292,20 +564,45 @@ int WebcamCapture::open_output_file()
         enc_ctx->time_base.den = enc_ctx->sample_rate;
       }
 
-      /* Third parameter can be used to pass settings to encoder */
-      ret = avcodec_open2(enc_ctx, encoder, NULL);
+      /* the graph decides the final picture size and rate, so it comes first */
+      stream_ctx_[i].enc_ctx = enc_ctx;
+      if ((ret = setup_filter(i, encoder, enc_ctx)) < 0)
+      {
+        return ret;
+      }
+      if (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO && options_.timestamps.sync == TimestampOptions::VFR)
+      {
+        /* real capture times need a finer clock than the nominal frame rate */
+        enc_ctx->framerate = av_inv_q(enc_ctx->time_base);
+        enc_ctx->time_base.num = 1;
+        enc_ctx->time_base.den = 1000;
+      }
+
+      /* some formats want stream headers to be separate, must be known before opening */
+      if (global_header())
+      {
+        enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+      }
+
+      AVDictionary *enc_dict = NULL;
+      if ((ret = build_encoder_options(encoder, enc_options, &enc_dict)) < 0)
+      {
+        av_dict_free(&enc_dict);
+        return ret;
+      }
+      ret = avcodec_open2(enc_ctx, encoder, &enc_dict);
       if (ret < 0) {
+        av_dict_free(&enc_dict);
         av_log(NULL, AV_LOG_ERROR, "Cannot open video encoder for stream #%u\n", i);
         return ret;
       }
-      //         if ((ret = avcodec_parameters_from_context(out_stream->codec, enc_ctx)) < 0) {
-      //           av_log(NULL, AV_LOG_ERROR, "Failed to copy encoder parameters to output stream #%u\n", i);
-      //           return ret;
-      //         }
-      if (ofmt_ctx_->oformat->flags & AVFMT_GLOBALHEADER)
+      AVDictionaryEntry *unused = NULL;
+      while ((unused = av_dict_get(enc_dict, "", unused, AV_DICT_IGNORE_SUFFIX)) != NULL)
       {
-        enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+        av_log(NULL, AV_LOG_WARNING, "Encoder %s ignored option %s=%s\n", encoder->name, unused->key, unused->value);
       }
+      av_dict_free(&enc_dict);
+      av_log(NULL, AV_LOG_INFO, "Stream #%u is encoded with %s\n", i, encoder->name);
       out_stream->time_base = enc_ctx->time_base;
       stream_ctx_[i].enc_ctx = enc_ctx;
     } else if (dec_ctx->codec_type == AVMEDIA_TYPE_UNKNOWN) {
@@ -314,36 +611,249 @@ int WebcamCapture::open_output_file()
       return AVERROR_INVALIDDATA;
     } else {
       /* if this stream must be remuxed */
-      //       ret = avcodec_parameters_copy(out_stream->codecpar, in_stream->codecpar);
-      //       if (ret < 0) {
-      //         av_log(NULL, AV_LOG_ERROR, "Copying parameters for stream #%u failed\n", i);
-      //         return ret;
-      //       }
+      if ((ret = copy_stream_parameters(i, out_stream)) < 0)
+      {
+        return ret;
+      }
     }
   }
   av_dump_format(ofmt_ctx_, 0, output_filename_.c_str(), 1);
 
-  if (!(ofmt_ctx_->oformat->flags & AVFMT_NOFILE)) {
-    ret = avio_open(&ofmt_ctx_->pb, output_filename_.c_str(), AVIO_FLAG_WRITE);
-    if (ret < 0) {
-      av_log(NULL, AV_LOG_ERROR, "Could not open output file '%s'", output_filename_.c_str());
-      return ret;
+  /* ofmt_ctx_ only describes the streams, the files are opened by the writer */
+  MuxerOptions muxer_options;
+  muxer_options.low_latency = options_.low_latency;
+  muxer_options.writer = options_.writer;
+  muxer_options.writer_stats = &writer_stats_;
+  muxer_options.fragment_sec = options_.fragment_sec;
+  if (options_.fragment_sec > 0 && !OutputMuxer::CanFragment(ofmt_ctx_->oformat))
+  {
+    av_log(NULL, AV_LOG_WARNING, "Fragments need an MP4, MOV or Matroska output, '%s' is written as usual\n",
+      ofmt_ctx_->oformat->name);
+  }
+  if (options_.event.Enabled())
+  {
+    if (options_.segment.Enabled())
+    {
+      av_log(NULL, AV_LOG_WARNING, "Segment options are ignored in DVR mode\n");
+    }
+    event_recorder_ = new EventRecorder(ofmt_ctx_, output_filename_, options_.event, muxer_options);
+    output_ = event_recorder_;
+    ret = event_recorder_->Start();
+  }
+  else
+  {
+    SegmentWriter *writer = new SegmentWriter(ofmt_ctx_, output_filename_, options_.segment, muxer_options);
+    output_ = writer;
+    ret = writer->Open();
+  }
+  if (ret >= 0 && options_.ladder.Enabled())
+  {
+    ret = open_ladder(muxer_options);
+  }
+  if (ret >= 0 && options_.fanout.Enabled())
+  {
+    /* the same packets to more containers, the main output stays on the mux thread */
+    fanout_ = new FanoutSink(ofmt_ctx_, output_, options_.fanout, muxer_options);
+    output_ = fanout_;
+    ret = fanout_->Start();
+  }
+  return ret;
+}
+
+int WebcamCapture::open_ladder(const MuxerOptions &muxer_options)
+{
+  for (unsigned int i = 0; i < ifmt_ctx_->nb_streams && ladder_stream_ < 0; i++)
+  {
+    if (stream_ctx_[i].enc_ctx && stream_ctx_[i].enc_ctx->codec_type == AVMEDIA_TYPE_VIDEO)
+    {
+      ladder_stream_ = i;
     }
   }
+  if (ladder_stream_ < 0)
+  {
+    av_log(NULL, AV_LOG_ERROR, "Renditions need a decoded video stream, not a copied one\n");
+    return AVERROR(EINVAL);
+  }
 
-  /* init muxer, write output file header */
-  ret = avformat_write_header(ofmt_ctx_, NULL);
-  if (ret < 0) {
-    av_log(NULL, AV_LOG_ERROR, "Error occurred when opening output file\n");
+  ladder_ = new RenditionLadder(options_.ladder, media_pool_);
+  int ret = ladder_->Init(stream_ctx_[ladder_stream_].dec_ctx, stream_ctx_[ladder_stream_].enc_ctx->pix_fmt,
+    options_.filter_threads);
+  if (ret < 0)
+  {
     return ret;
   }
+  unsigned int stream_index = ladder_stream_;
+  return ladder_->OpenOutputs(ofmt_ctx_, output_filename_,
+    [this, stream_index](AVCodecContext *enc_ctx, const Rendition &rendition) { return open_rendition_encoder(stream_index, enc_ctx, rendition); },
+    options_.segment, muxer_options);
+}
+
+int WebcamCapture::open_rendition_encoder(unsigned int stream_index, AVCodecContext *enc_ctx, const Rendition &rendition)
+{
+  const AVCodecContext *main_ctx = stream_ctx_[stream_index].enc_ctx;
+  /* the main video encoder, with its options */
+  AVCodec *encoder = main_ctx->codec ? avcodec_find_encoder_by_name(main_ctx->codec->name) : NULL;
+  if (!encoder)
+  {
+    return AVERROR_ENCODER_NOT_FOUND;
+  }
+  enc_ctx->time_base = main_ctx->time_base;
+  enc_ctx->framerate = main_ctx->framerate;
+
+  EncoderOptions enc_options = options_.video_encoder;
+  if (!rendition.bitrate.empty())
+  {
+    enc_options.bitrate = rendition.bitrate;
+    enc_options.crf.clear();
+  }
+  AVDictionary *enc_dict = NULL;
+  int ret = build_encoder_options(encoder, enc_options, &enc_dict);
+  if (ret >= 0 && !rendition.bitrate.empty())
+  {
+    /* capped, so every rendition stays inside its slot of the ladder */
+    av_dict_set(&enc_dict, "crf", NULL, 0);
+    av_dict_set(&enc_dict, "maxrate", rendition.bitrate.c_str(), AV_DICT_DONT_OVERWRITE);
+    av_dict_set(&enc_dict, "bufsize", rendition.bitrate.c_str(), AV_DICT_DONT_OVERWRITE);
+  }
+  /* the renditions get the same frames, without scene cuts their keyframes line up */
+  av_dict_set(&enc_dict, "sc_threshold", "0", AV_DICT_DONT_OVERWRITE);
+  if (ret >= 0)
+  {
+    ret = avcodec_open2(enc_ctx, encoder, &enc_dict);
+  }
+  AVDictionaryEntry *unused = NULL;
+  while (ret >= 0 && (unused = av_dict_get(enc_dict, "", unused, AV_DICT_IGNORE_SUFFIX)) != NULL)
+  {
+    av_log(NULL, AV_LOG_WARNING, "Encoder %s ignored option %s=%s\n", encoder->name, unused->key, unused->value);
+  }
+  av_dict_free(&enc_dict);
+  return ret;
+}
+
+bool WebcamCapture::global_header() const
+{
+  /* encoded once for every output: extra outputs without global headers get them in band */
+  return (ofmt_ctx_->oformat->flags & AVFMT_GLOBALHEADER) || FanoutSink::NeedsGlobalHeader(options_.fanout);
+}
+
+AVCodec *WebcamCapture::find_encoder(AVCodecContext *dec_ctx, const EncoderOptions &enc_options)
+{
+  if (!enc_options.codec.empty())
+  {
+    AVCodec *encoder = avcodec_find_encoder_by_name(enc_options.codec.c_str());
+    if (!encoder || encoder->type != dec_ctx->codec_type)
+    {
+      av_log(NULL, AV_LOG_ERROR, "Encoder '%s' not found\n", enc_options.codec.c_str());
+      return NULL;
+    }
+    return encoder;
+  }
+
+  /* fast lossy codecs first, raw camera formats would produce gigabytes per minute */
+  static const char *video_encoders[] = { "libx264", "mpeg4", NULL };
+  static const char *audio_encoders[] = { "aac", "libmp3lame", NULL };
+  const char **names = (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) ? video_encoders : audio_encoders;
+  for (int i = 0; names[i]; i++)
+  {
+    AVCodec *encoder = avcodec_find_encoder_by_name(names[i]);
+    if (encoder)
+    {
+      return encoder;
+    }
+  }
+  /* fall back to transcoding to same codec */
+  return avcodec_find_encoder(dec_ctx->codec_id);
+}
+
+int WebcamCapture::build_encoder_options(AVCodec *encoder, const EncoderOptions &enc_options, AVDictionary **dict)
+{
+  int ret = 0;
+  if (!enc_options.extra.empty())
+  {
+    ret = av_dict_parse_string(dict, enc_options.extra.c_str(), "=", ":", 0);
+    if (ret < 0)
+    {
+      av_log(NULL, AV_LOG_ERROR, "Cannot parse encoder options '%s'\n", enc_options.extra.c_str());
+      return ret;
+    }
+  }
+  /* named options win over the same key in the free-form string */
+  if (!enc_options.preset.empty())      av_dict_set(dict, "preset", enc_options.preset.c_str(), 0);
+  if (!enc_options.tune.empty())        av_dict_set(dict, "tune", enc_options.tune.c_str(), 0);
+  if (!enc_options.crf.empty())         av_dict_set(dict, "crf", enc_options.crf.c_str(), 0);
+  if (!enc_options.bitrate.empty())     av_dict_set(dict, "b", enc_options.bitrate.c_str(), 0);
+  if (!enc_options.gop.empty())         av_dict_set(dict, "g", enc_options.gop.c_str(), 0);
+  if (!enc_options.threads.empty())     av_dict_set(dict, "threads", enc_options.threads.c_str(), 0);
+  if (!enc_options.thread_type.empty()) av_dict_set(dict, "thread_type", enc_options.thread_type.c_str(), 0);
+
+  if (options_.low_latency && encoder->type == AVMEDIA_TYPE_VIDEO)
+  {
+    /* zero delay: no B-frames, no lookahead, slices instead of frame threads */
+    av_dict_set(dict, "bf", "0", AV_DICT_DONT_OVERWRITE);
+    av_dict_set(dict, "thread_type", "slice", AV_DICT_DONT_OVERWRITE);
+    if (!strcmp(encoder->name, "libx264") || !strcmp(encoder->name, "libx265"))
+    {
+      av_dict_set(dict, "tune", "zerolatency", AV_DICT_DONT_OVERWRITE);
+    }
+    else if (!strcmp(encoder->name, "libvpx") || !strcmp(encoder->name, "libvpx-vp9"))
+    {
+      av_dict_set(dict, "deadline", "realtime", AV_DICT_DONT_OVERWRITE);
+      av_dict_set(dict, "lag-in-frames", "0", AV_DICT_DONT_OVERWRITE);
+    }
+  }
+  else if (options_.low_latency && !strcmp(encoder->name, "libopus"))
+  {
+    av_dict_set(dict, "application", "lowdelay", AV_DICT_DONT_OVERWRITE);
+  }
+
+  /* defaults, only where the user said nothing */
+  bool rate_given = av_dict_get(*dict, "b", NULL, 0) || av_dict_get(*dict, "crf", NULL, 0) ||
+    av_dict_get(*dict, "qscale", NULL, 0);
+  if (encoder->type == AVMEDIA_TYPE_VIDEO)
+  {
+    /* on the shared pool the sessions are the parallelism, encoder threads would oversubscribe it */
+    av_dict_set(dict, "threads", options_.worker_pool ? "1" : "auto", AV_DICT_DONT_OVERWRITE);
+    if (!strcmp(encoder->name, "libx264"))
+    {
+      av_dict_set(dict, "preset", "veryfast", AV_DICT_DONT_OVERWRITE);
+      if (!rate_given)
+      {
+        av_dict_set(dict, "crf", "23", 0);
+      }
+    }
+    else if (!rate_given && encoder->id != AV_CODEC_ID_RAWVIDEO)
+    {
+      av_dict_set(dict, "b", "4M", 0);
+    }
+  }
+  else if (encoder->type == AVMEDIA_TYPE_AUDIO && !rate_given)
+  {
+    av_dict_set(dict, "b", "128k", 0);
+  }
+  return 0;
+}
 
+int WebcamCapture::copy_stream_parameters(unsigned int stream_index, AVStream *out_stream)
+{
+  AVStream *in_stream = ifmt_ctx_->streams[stream_index];
+  int ret = avcodec_copy_context(out_stream->codec, in_stream->codec);
+  if (ret < 0)
+  {
+    av_log(NULL, AV_LOG_ERROR, "Copying parameters for stream #%u failed\n", stream_index);
+    return ret;
+  }
+  /* the input's fourcc may not be valid in the output container */
+  out_stream->codec->codec_tag = 0;
+  if (global_header())
+  {
+    out_stream->codec->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+  }
+  out_stream->time_base = in_stream->time_base;
   return 0;
 }
 
 int WebcamCapture::init_filter(FilteringContext* fctx, AVCodecContext *dec_ctx, AVCodecContext *enc_ctx, const char *filter_spec)
 {
-  char args[512];
   int ret = 0;
   AVFilter *buffersrc = NULL;
   AVFilter *buffersink = NULL;
@@ -358,6 +868,8 @@ int WebcamCapture::init_filter(FilteringContext* fctx, AVCodecContext *dec_ctx,
     ret = AVERROR(ENOMEM);
     goto end;
   }
+  /* heavy scaling runs on slice threads, 0 lets libavfilter pick */
+  filter_graph->nb_threads = options_.filter_threads;
 
   if (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO)
   {
@@ -370,15 +882,14 @@ int WebcamCapture::init_filter(FilteringContext* fctx, AVCodecContext *dec_ctx,
       goto end;
     }
 
-    sprintf_s(args, sizeof(args),
-      "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
-      dec_ctx->width, dec_ctx->height, dec_ctx->pix_fmt,
-      dec_ctx->time_base.num, dec_ctx->time_base.den,
-      dec_ctx->sample_aspect_ratio.num,
-      dec_ctx->sample_aspect_ratio.den);
+    std::ostringstream args;
+    args << "video_size=" << dec_ctx->width << "x" << dec_ctx->height
+         << ":pix_fmt=" << dec_ctx->pix_fmt
+         << ":time_base=1/" << AV_TIME_BASE
+         << ":pixel_aspect=" << dec_ctx->sample_aspect_ratio.num << "/" << dec_ctx->sample_aspect_ratio.den;
 
     ret = avfilter_graph_create_filter(&buffersrc_ctx, buffersrc, "in",
-      args, NULL, filter_graph);
+      args.str().c_str(), NULL, filter_graph);
     if (ret < 0)
     {
       av_log(NULL, AV_LOG_ERROR, "Cannot create buffer source\n");
@@ -417,13 +928,13 @@ int WebcamCapture::init_filter(FilteringContext* fctx, AVCodecContext *dec_ctx,
     {
       dec_ctx->channel_layout = av_get_default_channel_layout(dec_ctx->channels);
     }
-    sprintf_s(args, sizeof(args),
-      "time_base=%d/%d:sample_rate=%d:sample_fmt=%s:channel_layout=0x%""I64x",
-      dec_ctx->time_base.num, dec_ctx->time_base.den, dec_ctx->sample_rate,
-      av_get_sample_fmt_name(dec_ctx->sample_fmt),
-      dec_ctx->channel_layout);
+    std::ostringstream args;
+    args << "time_base=1/" << dec_ctx->sample_rate
+         << ":sample_rate=" << dec_ctx->sample_rate
+         << ":sample_fmt=" << av_get_sample_fmt_name(dec_ctx->sample_fmt)
+         << ":channel_layout=0x" << std::hex << dec_ctx->channel_layout;
     ret = avfilter_graph_create_filter(&buffersrc_ctx, buffersrc, "in",
-      args, NULL, filter_graph);
+      args.str().c_str(), NULL, filter_graph);
     if (ret < 0)
     {
       av_log(NULL, AV_LOG_ERROR, "Cannot create audio buffer source\n");
@@ -503,69 +1014,938 @@ int WebcamCapture::init_filter(FilteringContext* fctx, AVCodecContext *dec_ctx,
   fctx->buffersrc_ctx = buffersrc_ctx;
   fctx->buffersink_ctx = buffersink_ctx;
   fctx->filter_graph = filter_graph;
+  filter_graph = NULL;
 
 end:
+  avfilter_graph_free(&filter_graph);
   avfilter_inout_free(&inputs);
   avfilter_inout_free(&outputs);
 
   return ret;
 }
 
-int WebcamCapture::init_filters()
+const char *WebcamCapture::filter_spec(unsigned int stream_index) const
 {
-  const char *filter_spec;
-  unsigned int i;
-  int ret;
-  filter_ctx_ = (FilteringContext*)av_malloc_array(ifmt_ctx_->nb_streams, sizeof(*filter_ctx_));
-  if (!filter_ctx_)
+  AVMediaType type = stream_ctx_[stream_index].dec_ctx->codec_type;
+  const std::string &user_spec = (type == AVMEDIA_TYPE_VIDEO) ? options_.video_filter : options_.audio_filter;
+  if (!user_spec.empty())
   {
-    return AVERROR(ENOMEM);
+    return user_spec.c_str();
   }
+  /* passthrough (dummy) filter, the sink still converts to the encoder's format */
+  return (type == AVMEDIA_TYPE_VIDEO) ? "null" : "anull";
+}
 
-  for (i = 0; i < ifmt_ctx_->nb_streams; i++) {
-    filter_ctx_[i].buffersrc_ctx  = NULL;
-    filter_ctx_[i].buffersink_ctx = NULL;
-    filter_ctx_[i].filter_graph   = NULL;
-    if (!(ifmt_ctx_->streams[i]->codec->codec_type == AVMEDIA_TYPE_AUDIO
-      || ifmt_ctx_->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO))
+int WebcamCapture::setup_filter(unsigned int stream_index, AVCodec *encoder, AVCodecContext *enc_ctx)
+{
+  AVCodecContext *dec_ctx = stream_ctx_[stream_index].dec_ctx;
+  FilteringContext *fctx = &filter_ctx_[stream_index];
+  const std::string &user_spec = (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) ? options_.video_filter : options_.audio_filter;
+  int ret;
+
+  /* nothing to do for the graph: decoded frames go straight to the encoder */
+  if (user_spec.empty())
+  {
+    if (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO && dec_ctx->pix_fmt == enc_ctx->pix_fmt)
     {
-      continue;
+      return 0;
     }
-
-    if (ifmt_ctx_->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO)
+    if (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO && PixelConverter::Supports(dec_ctx->pix_fmt, enc_ctx->pix_fmt))
     {
-      filter_spec = "null"; /* passthrough (dummy) filter for video */
+      /* a dedicated kernel instead of the generic swscale conversion the sink would insert */
+      PixelConverter *converter = new PixelConverter(dec_ctx->pix_fmt, enc_ctx->pix_fmt);
+      stream_ctx_[stream_index].converter = converter;
+      av_log(NULL, AV_LOG_INFO, "Stream #%u: %s to %s with the %s kernel\n", stream_index,
+        av_get_pix_fmt_name(dec_ctx->pix_fmt), av_get_pix_fmt_name(enc_ctx->pix_fmt), PixelConverter::IsaName(converter->Isa()));
+      return 0;
     }
-    else
+    if (dec_ctx->codec_type == AVMEDIA_TYPE_AUDIO &&
+      (encoder->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE) &&
+      dec_ctx->sample_fmt == enc_ctx->sample_fmt &&
+      dec_ctx->sample_rate == enc_ctx->sample_rate &&
+      (dec_ctx->channel_layout ? dec_ctx->channel_layout : (uint64_t)av_get_default_channel_layout(dec_ctx->channels)) == enc_ctx->channel_layout)
     {
-      filter_spec = "anull"; /* passthrough (dummy) filter for audio */
+      return 0;
     }
-    ret = init_filter(&filter_ctx_[i], /*ifmt_ctx_->streams[i]->codec*/ stream_ctx_[i].dec_ctx,
-      /*ofmt_ctx_->streams[i]->codec*/stream_ctx_[i].enc_ctx, filter_spec);
-    if (ret)
+  }
+
+  if ((ret = init_filter(fctx, dec_ctx, enc_ctx, filter_spec(stream_index))) < 0)
+  {
+    av_log(NULL, AV_LOG_ERROR, "Cannot build filter graph '%s' for stream #%u\n", filter_spec(stream_index), stream_index);
+    return ret;
+  }
+
+  /* a user chain may scale or change the rate, the encoder takes whatever comes out */
+  if (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO)
+  {
+    AVFilterLink *link = fctx->buffersink_ctx->inputs[0];
+    enc_ctx->width  = link->w;
+    enc_ctx->height = link->h;
+    enc_ctx->sample_aspect_ratio = link->sample_aspect_ratio;
+    if (link->frame_rate.num > 0 && link->frame_rate.den > 0)
     {
-      return ret;
+      enc_ctx->time_base = av_inv_q(link->frame_rate);
     }
   }
   return 0;
 }
 
-int WebcamCapture::Work()
+int WebcamCapture::init_filters()
 {
-  int ret = 0;
-  int frame_decoded = 0;
-  packet_in_ = new AVPacket;
-  av_init_packet(packet_in_);
+  /* graphs are built together with the encoders, this finishes what needs an open encoder */
+  for (unsigned int i = 0; i < ifmt_ctx_->nb_streams; i++)
+  {
+    AVCodecContext *enc_ctx = stream_ctx_[i].enc_ctx;
+    if (!enc_ctx)
+    {
+      continue;
+    }
+    if (!filter_ctx_[i].filter_graph)
+    {
+      av_log(NULL, AV_LOG_INFO, "Stream #%u bypasses the filter graph\n", i);
+      continue;
+    }
+    /* encoders like aac take exactly frame_size samples per frame */
+    if (enc_ctx->codec_type == AVMEDIA_TYPE_AUDIO && enc_ctx->frame_size &&
+      !(enc_ctx->codec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE))
+    {
+      av_buffersink_set_frame_size(filter_ctx_[i].buffersink_ctx, enc_ctx->frame_size);
+    }
+  }
+  return setup_degradation();
+}
+
+int WebcamCapture::setup_degradation()
+{
+  if (!options_.degrade.Enabled())
+  {
+    return 0;
+  }
+  if (!input_backend_->Capabilities().live && !options_.pace_input)
+  {
+    /* a file or spool read as fast as possible always looks overloaded */
+    av_log(NULL, AV_LOG_WARNING, "Degradation needs a live or paced input, ignoring it\n");
+    return 0;
+  }
+  for (unsigned int i = 0; i < ifmt_ctx_->nb_streams && degrade_stream_ < 0; i++)
+  {
+    if (stream_ctx_[i].enc_ctx && stream_ctx_[i].enc_ctx->codec_type == AVMEDIA_TYPE_VIDEO)
+    {
+      degrade_stream_ = i;
+    }
+  }
+  if (degrade_stream_ < 0)
+  {
+    av_log(NULL, AV_LOG_WARNING, "Degradation needs an encoded video stream, ignoring it\n");
+    return 0;
+  }
+
+  /* only the steps that change something for this encoder */
+  AVCodecContext *enc_ctx = stream_ctx_[degrade_stream_].enc_ctx;
+  DegradeOptions options = options_.degrade;
+  options.steps.clear();
+  std::string names;
+  for (size_t i = 0; i < options_.degrade.steps.size(); i++)
+  {
+    DegradeOptions::step step = options_.degrade.steps[i];
+    if ((step == DegradeOptions::BFRAMES && enc_ctx->has_b_frames <= 0) ||
+      (step == DegradeOptions::PRESET && !av_opt_find(enc_ctx->priv_data, "preset", NULL, 0, 0)))
+    {
+      av_log(NULL, AV_LOG_INFO, "Stream #%d: %s encoder has nothing to gain from the %s step\n", degrade_stream_,
+        enc_ctx->codec->name, DegradeOptions::StepName(step));
+      continue;
+    }
+    options.steps.push_back(step);
+    names += (names.empty() ? "" : ",") + std::string(DegradeOptions::StepName(step));
+  }
+  if (!options.Enabled())
+  {
+    return 0;
+  }
+
+  degrade_ = new DegradationController(options);
+  degrade_width_ = enc_ctx->width;
+  degrade_height_ = enc_ctx->height;
+  degrade_graph_ = filter_ctx_[degrade_stream_].filter_graph != NULL;
+  adapted_no_bframes_ = false;
+  adapted_fast_preset_ = false;
+  av_log(NULL, AV_LOG_INFO, "Stream #%d degrades under load: %s\n", degrade_stream_, names.c_str());
+  return 0;
+}
+
+int WebcamCapture::update_degradation()
+{
+  DegradationController::Sample sample;
+  sample.lag_us = LatencyMetrics::Now() - capture_start_us_ - frame_->pts;
+  CaptureQueue::Stats capture = capture_queue_->GetStats();
+  SpscQueue<AVFrame*> *frames = stream_ctx_[degrade_stream_].frame_queue;
+  sample.queue_fill = FFMAX(capture.capacity ? (double)capture.depth / capture.capacity : 0.0,
+    (double)frames->Size() / frames->Capacity());
+  if (!degrade_->Update(frame_->pts, sample))
+  {
+    return 0;
+  }
+
+  /* the encoder thread picks up the B-frame and preset changes by itself */
+  DegradationController::Profile profile = degrade_->GetProfile();
+  decimation_ = profile.fps_divisor;
+  if (profile.scale_steps != degrade_scale_steps_)
+  {
+    return rescale_video(profile.scale_steps);
+  }
+  return 0;
+}
+
+int WebcamCapture::rescale_video(int scale_steps)
+{
+  unsigned int stream_index = degrade_stream_;
+  FilteringContext *fctx = &filter_ctx_[stream_index];
+  int width = degrade_width_;
+  int height = degrade_height_;
+  for (int i = 0; i < scale_steps; i++)
+  {
+    width = FFMAX(width * 2 / 3 & ~1, 2);
+    height = FFMAX(height * 2 / 3 & ~1, 2);
+  }
+
+  /* frames still inside the old graph are lost, a scale step is rare enough */
+  if (fctx->filter_graph)
+  {
+    avfilter_graph_free(&fctx->filter_graph);
+    fctx->buffersrc_ctx = NULL;
+    fctx->buffersink_ctx = NULL;
+  }
+  degrade_scale_steps_ = scale_steps;
+  if (!scale_steps && !degrade_graph_)
+  {
+    /* back to the direct path */
+    return 0;
+  }
+
+  std::string spec = filter_spec(stream_index);
+  if (scale_steps)
+  {
+    spec += ",scale=" + std::to_string(width) + ":" + std::to_string(height);
+  }
+  int ret = init_filter(fctx, stream_ctx_[stream_index].dec_ctx, stream_ctx_[stream_index].enc_ctx, spec.c_str());
+  if (ret < 0)
+  {
+    av_log(NULL, AV_LOG_ERROR, "Cannot build filter graph '%s' for stream #%u\n", spec.c_str(), stream_index);
+  }
+  return ret;
+}
+
+bool WebcamCapture::decimate(unsigned int stream_index)
+{
+  /* counts output slots, so CFR copies of one frame are thinned out as well */
+  return (int)stream_index == degrade_stream_ && decimation_ > 1 && decimate_slot_++ % decimation_ != 0;
+}
+
+AVCodecContext *WebcamCapture::encoder_context(unsigned int stream_index) const
+{
+  return (adapted_encoder_ && (int)stream_index == degrade_stream_) ? adapted_encoder_ : stream_ctx_[stream_index].enc_ctx;
+}
+
+/* two notches faster, an unknown name gets the fastest */
+static const char *faster_preset(const char *preset)
+{
+  static const char *presets[] = { "ultrafast", "superfast", "veryfast", "faster", "fast", "medium", "slow", "slower", "veryslow", "placebo" };
+  for (int i = 2; preset && i < (int)(sizeof(presets) / sizeof(presets[0])); i++)
+  {
+    if (!strcmp(preset, presets[i]))
+    {
+      return presets[i - 2];
+    }
+  }
+  return presets[0];
+}
+
+int WebcamCapture::adapt_encoder(const AVFrame *frame)
+{
+  unsigned int stream_index = degrade_stream_;
+  DegradationController::Profile profile = degrade_->GetProfile();
+  AVCodecContext *current = encoder_context(stream_index);
+  if (profile.no_bframes == adapted_no_bframes_ && profile.fast_preset == adapted_fast_preset_ &&
+    frame->width == current->width && frame->height == current->height)
+  {
+    if (adapted_skip_ > 0)
+    {
+      adapted_skip_--;
+      return 1;
+    }
+    return 0;
+  }
+
+  /* the muxer keeps the first encoder's stream parameters: drain it and open
+   * a second context instead of reopening the one the outputs were set up from */
+  int ret = flush_encoder(stream_index);
+  if (ret < 0)
+  {
+    return ret;
+  }
+  const AVCodecContext *layout = stream_ctx_[stream_index].enc_ctx;
+  AVCodec *encoder = (AVCodec*)layout->codec;
+  AVCodecContext *enc_ctx = avcodec_alloc_context3(encoder);
+  if (!enc_ctx)
+  {
+    return AVERROR(ENOMEM);
+  }
+  enc_ctx->width = frame->width;
+  enc_ctx->height = frame->height;
+  enc_ctx->pix_fmt = layout->pix_fmt;
+  enc_ctx->sample_aspect_ratio = layout->sample_aspect_ratio;
+  enc_ctx->time_base = layout->time_base;
+  enc_ctx->framerate = layout->framerate;
+  enc_ctx->flags = layout->flags;
+
+  AVDictionary *enc_dict = NULL;
+  ret = build_encoder_options(encoder, options_.video_encoder, &enc_dict);
+  if (profile.no_bframes)
+  {
+    av_dict_set(&enc_dict, "bf", "0", 0);
+  }
+  if (profile.fast_preset)
+  {
+    AVDictionaryEntry *preset = av_dict_get(enc_dict, "preset", NULL, 0);
+    av_dict_set(&enc_dict, "preset", faster_preset(preset ? preset->value : NULL), 0);
+  }
+  if (ret >= 0)
+  {
+    ret = avcodec_open2(enc_ctx, encoder, &enc_dict);
+  }
+  av_dict_free(&enc_dict);
+  if (ret < 0)
+  {
+    av_log(NULL, AV_LOG_ERROR, "Cannot reopen video encoder for stream #%u\n", stream_index);
+    avcodec_free_context(&enc_ctx);
+    return ret;
+  }
+
+  if (adapted_encoder_)
+  {
+    avcodec_free_context(&adapted_encoder_);
+  }
+  adapted_encoder_ = enc_ctx;
+  adapted_no_bframes_ = profile.no_bframes;
+  adapted_fast_preset_ = profile.fast_preset;
+  av_log(NULL, AV_LOG_INFO, "Stream #%u encoder reopened at %dx%d%s%s\n", stream_index, enc_ctx->width, enc_ctx->height,
+    profile.no_bframes ? ", without B-frames" : "", profile.fast_preset ? ", faster preset" : "");
+
+  /* with B-frames the first dts lies has_b_frames frames before the first pts,
+   * dropping as many frames keeps it after the packets already written */
+  adapted_skip_ = enc_ctx->has_b_frames;
+  if (adapted_skip_ > 0)
+  {
+    adapted_skip_--;
+    return 1;
+  }
+  return 0;
+}
+
+int WebcamCapture::fix_adapted_packet(AVPacket *packet)
+{
+  if (adapted_encoder_)
+  {
+    /* the new parameter sets, the outputs were opened with the first encoder's */
+    int ret = OutputMuxer::PrependHeaders(packet, adapted_encoder_);
+    if (ret < 0)
+    {
+      return ret;
+    }
+  }
+  if (packet->dts == AV_NOPTS_VALUE)
+  {
+    return 0;
+  }
+  /* the muxer needs increasing dts across the encoder switch */
+  if (adapted_last_dts_ != AV_NOPTS_VALUE && packet->dts <= adapted_last_dts_)
+  {
+    packet->dts = adapted_last_dts_ + 1;
+    if (packet->pts != AV_NOPTS_VALUE && packet->pts < packet->dts)
+    {
+      packet->pts = packet->dts;
+    }
+  }
+  adapted_last_dts_ = packet->dts;
+  return 0;
+}
+
+bool WebcamCapture::frame_matches_encoder(const AVFrame *frame, unsigned int stream_index) const
+{
+  const AVCodecContext *enc_ctx = stream_ctx_[stream_index].enc_ctx;
+  if (enc_ctx->codec_type == AVMEDIA_TYPE_VIDEO)
+  {
+    return frame->format == enc_ctx->pix_fmt && frame->width == enc_ctx->width && frame->height == enc_ctx->height;
+  }
+  uint64_t layout = frame->channel_layout ? frame->channel_layout : (uint64_t)av_get_default_channel_layout(frame->channels);
+  return frame->format == enc_ctx->sample_fmt && frame->sample_rate == enc_ctx->sample_rate &&
+    layout == enc_ctx->channel_layout;
+}
+
+int WebcamCapture::convert_frame(unsigned int stream_index)
+{
+  PixelConverter *converter = stream_ctx_[stream_index].converter;
+  if (!converter || frame_->format != converter->SourceFormat())
+  {
+    /* a format change mid-stream is left to the filter graph */
+    return 0;
+  }
+
+  int64_t convert_start = metrics_ ? LatencyMetrics::Now() : 0;
+  AVFrame *converted = media_pool_->AcquireFrame();
+  if (!converted)
+  {
+    return AVERROR(ENOMEM);
+  }
+  int ret = converter->Convert(frame_, converted);
+  if (ret < 0)
+  {
+    av_log(NULL, AV_LOG_ERROR, "Cannot convert frame of stream #%u\n", stream_index);
+    media_pool_->ReleaseFrame(&converted);
+    return ret;
+  }
+  media_pool_->ReleaseFrame(&frame_);
+  frame_ = converted;
+  if (metrics_)
+  {
+    metrics_->Record(LatencyMetrics::FILTER, stream_index, LatencyMetrics::Now() - convert_start);
+  }
+  return 0;
+}
+
+int WebcamCapture::queue_frame(AVFrame *frame, unsigned int stream_index, AVRational time_base)
+{
+  StreamContext &stream = stream_ctx_[stream_index];
+  int copies = 1;
+  int64_t pts = AV_NOPTS_VALUE;
+
+  if (stream.enc_ctx->codec_type == AVMEDIA_TYPE_VIDEO)
+  {
+    int64_t frame_us = (frame->pts != AV_NOPTS_VALUE) ? av_rescale_q(frame->pts, time_base, AV_TIME_BASE_Q) : AV_NOPTS_VALUE;
+    copies = timestamps_->ConformVideo(stream_index, frame_us, stream.enc_ctx->time_base, &pts);
+  }
+  else if (frame->pts != AV_NOPTS_VALUE)
+  {
+    pts = av_rescale_q(frame->pts, time_base, stream.enc_ctx->time_base);
+  }
+  if (copies == 0)
+  {
+    media_pool_->ReleaseFrame(&frame);
+    return 0;
+  }
+
+  frame->pict_type = AV_PICTURE_TYPE_NONE;
+  for (int i = 1; i < copies; i++)
+  {
+    /* CFR fill, the copy shares the picture buffers */
+    if (decimate(stream_index))
+    {
+      pts++;
+      continue;
+    }
+    AVFrame *copy = media_pool_->AcquireFrame();
+    if (!copy || av_frame_ref(copy, frame) < 0)
+    {
+      media_pool_->ReleaseFrame(&copy);
+      break;
+    }
+    copy->pts = pts++;
+    if (!stream.frame_queue->Push(copy))
+    {
+      media_pool_->ReleaseFrame(&copy);
+      media_pool_->ReleaseFrame(&frame);
+      return AVERROR_EXIT;
+    }
+    if (options_.worker_pool)
+    {
+      schedule_encoder(stream_index);
+    }
+  }
+  frame->pts = pts;
+  if (decimate(stream_index))
+  {
+    media_pool_->ReleaseFrame(&frame);
+    return 0;
+  }
+
+  /* the encoder thread owns the frame from here on */
+  if (!stream.frame_queue->Push(frame))
+  {
+    media_pool_->ReleaseFrame(&frame);
+    return AVERROR_EXIT;
+  }
+  if (options_.worker_pool)
+  {
+    schedule_encoder(stream_index);
+  }
+  return 0;
+}
+
+int WebcamCapture::start_workers()
+{
+  pipeline_error_ = 0;
+  if (options_.worker_pool)
+  {
+    if (pool_client_ < 0)
+    {
+      pool_client_ = options_.worker_pool->AddClient(output_filename_);
+    }
+    delete[] encoder_scheduled_;
+    encoder_scheduled_ = new std::atomic<bool>[ifmt_ctx_->nb_streams];
+    running_encoders_ = 0;
+  }
+  for (unsigned int i = 0; i < ifmt_ctx_->nb_streams; i++)
+  {
+    stream_ctx_[i].packet_queue = new SpscQueue<AVPacket*>(options_.packet_queue_size);
+    if (encoder_scheduled_)
+    {
+      encoder_scheduled_[i] = false;
+    }
+    if (stream_ctx_[i].enc_ctx)
+    {
+      stream_ctx_[i].frame_queue = new SpscQueue<AVFrame*>(options_.frame_queue_size);
+      if (options_.worker_pool)
+      {
+        /* batches are queued on the pool as frames arrive */
+        stream_ctx_[i].encoder_error = 0;
+        running_encoders_++;
+      }
+      else
+      {
+        stream_ctx_[i].encoder_thread = new std::thread(&WebcamCapture::encode_stream, this, i);
+      }
+    }
+  }
+  mux_thread_ = new std::thread(&WebcamCapture::mux_packets, this);
+  if (ladder_)
+  {
+    ladder_->Start();
+  }
+  return 0;
+}
+
+int WebcamCapture::stop_workers()
+{
+  /* end of input: encoder threads flush and close their packet queues,
+   * remuxed streams have no encoder so their queues are closed here */
+  for (unsigned int i = 0; i < ifmt_ctx_->nb_streams; i++)
+  {
+    if (stream_ctx_[i].frame_queue)
+    {
+      stream_ctx_[i].frame_queue->Close();
+    }
+    else if (stream_ctx_[i].packet_queue)
+    {
+      stream_ctx_[i].packet_queue->Close();
+    }
+  }
+  if (options_.worker_pool)
+  {
+    /* the last batch of every stream sees the closed queue and flushes */
+    for (unsigned int i = 0; i < ifmt_ctx_->nb_streams; i++)
+    {
+      if (stream_ctx_[i].frame_queue)
+      {
+        schedule_encoder(i);
+      }
+    }
+    std::unique_lock<std::mutex> lock(encoders_mutex_);
+    while (running_encoders_)
+    {
+      encoders_done_.wait(lock);
+    }
+  }
+  for (unsigned int i = 0; i < ifmt_ctx_->nb_streams; i++)
+  {
+    if (stream_ctx_[i].encoder_thread)
+    {
+      stream_ctx_[i].encoder_thread->join();
+      delete stream_ctx_[i].encoder_thread;
+      stream_ctx_[i].encoder_thread = NULL;
+    }
+  }
+  mux_thread_->join();
+  delete mux_thread_;
+  mux_thread_ = NULL;
+
+  for (unsigned int i = 0; i < ifmt_ctx_->nb_streams; i++)
+  {
+    AVFrame *frame = NULL;
+    AVPacket *packet = NULL;
+    if (stream_ctx_[i].frame_queue)
+    {
+      while (stream_ctx_[i].frame_queue->TryPop(frame))
+      {
+        media_pool_->ReleaseFrame(&frame);
+      }
+      delete stream_ctx_[i].frame_queue;
+      stream_ctx_[i].frame_queue = NULL;
+    }
+    if (stream_ctx_[i].packet_queue)
+    {
+      while (stream_ctx_[i].packet_queue->TryPop(packet))
+      {
+        media_pool_->ReleasePacket(&packet);
+      }
+      delete stream_ctx_[i].packet_queue;
+      stream_ctx_[i].packet_queue = NULL;
+    }
+  }
+  return pipeline_error_;
+}
+
+void WebcamCapture::encode_stream(unsigned int stream_index)
+{
+  StreamContext &stream = stream_ctx_[stream_index];
+  AVFrame *frame = NULL;
+  int ret = 0;
+
+  while (stream.frame_queue->Pop(frame))
+  {
+    encode_queued_frame(frame, stream_index, &ret);
+  }
+  finish_encoder(stream_index, ret);
+}
+
+void WebcamCapture::encode_queued_frame(AVFrame *frame, unsigned int stream_index, int *ret)
+{
+  if (*ret < 0)
+  {
+    /* keep draining so the capture thread never blocks on a dead encoder */
+    media_pool_->ReleaseFrame(&frame);
+    return;
+  }
+  if (degrade_ && (int)stream_index == degrade_stream_ && (*ret = adapt_encoder(frame)) != 0)
+  {
+    /* dropped after a reopen, or the reopen failed */
+    media_pool_->ReleaseFrame(&frame);
+    *ret = FFMIN(*ret, 0);
+  }
+  else
+  {
+    *ret = encode_write_frame(frame, stream_index, NULL);
+  }
+  if (*ret < 0)
+  {
+    av_log(NULL, AV_LOG_ERROR, "Encoding failed for stream #%u\n", stream_index);
+    pipeline_error_ = *ret;
+  }
+}
+
+void WebcamCapture::finish_encoder(unsigned int stream_index, int ret)
+{
+  if (ret >= 0)
+  {
+    ret = flush_encoder(stream_index);
+    if (ret < 0)
+    {
+      av_log(NULL, AV_LOG_ERROR, "Flushing encoder failed\n");
+      pipeline_error_ = ret;
+    }
+  }
+  stream_ctx_[stream_index].packet_queue->Close();
+
+  if (options_.worker_pool)
+  {
+    std::lock_guard<std::mutex> lock(encoders_mutex_);
+    running_encoders_--;
+    encoders_done_.notify_all();
+  }
+}
+
+void WebcamCapture::schedule_encoder(unsigned int stream_index)
+{
+  /* at most one batch per stream, so its frames are encoded in order */
+  if (!encoder_scheduled_[stream_index].exchange(true))
+  {
+    options_.worker_pool->Submit(pool_client_, [this, stream_index]() { encode_batch(stream_index); });
+  }
+}
+
+void WebcamCapture::encode_batch(unsigned int stream_index)
+{
+  /* a few frames per turn, then the pool moves on to the other captures */
+  static const int batch_frames = 4;
+  StreamContext &stream = stream_ctx_[stream_index];
+  AVFrame *frame = NULL;
+
+  for (int i = 0; i < batch_frames && stream.frame_queue->TryPop(frame); i++)
+  {
+    encode_queued_frame(frame, stream_index, &stream.encoder_error);
+  }
+  if (stream.frame_queue->Drained())
+  {
+    /* stays scheduled for good, nothing may run after the flush */
+    finish_encoder(stream_index, stream.encoder_error);
+    return;
+  }
+  encoder_scheduled_[stream_index] = false;
+  /* frames pushed (or Close() called) while the flag was still set scheduled nothing */
+  if (!stream.frame_queue->Empty() || stream.frame_queue->Closed())
+  {
+    schedule_encoder(stream_index);
+  }
+}
+
+static int64_t mux_timestamp(const AVPacket *packet)
+{
+  return packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+}
+
+void WebcamCapture::mux_packets()
+{
+  unsigned int nb_streams = ofmt_ctx_->nb_streams;
+  std::vector<AVPacket*> pending(nb_streams, (AVPacket*)NULL);
+  std::vector<bool> finished(nb_streams, false);
+  int ret = 0;
+
+  while (1)
+  {
+    int next = -1;
+    int waiting = -1;
+    bool backlog = false;
+
+    for (unsigned int i = 0; i < nb_streams; i++)
+    {
+      if (finished[i])
+      {
+        continue;
+      }
+      SpscQueue<AVPacket*> *queue = stream_ctx_[i].packet_queue;
+      if (!pending[i] && !queue->TryPop(pending[i]))
+      {
+        if (queue->Drained())
+        {
+          finished[i] = true;
+        }
+        else
+        {
+          waiting = i;
+        }
+        continue;
+      }
+      /* this stream's encoder is about to block on us */
+      if (queue->Full())
+      {
+        backlog = true;
+      }
+      if (next < 0 || av_compare_ts(mux_timestamp(pending[i]), ofmt_ctx_->streams[i]->time_base,
+        mux_timestamp(pending[next]), ofmt_ctx_->streams[next]->time_base) < 0)
+      {
+        next = i;
+      }
+    }
+
+    if (next < 0 && waiting < 0)
+    {
+      break;
+    }
+    if (waiting >= 0 && !backlog && (next < 0 || !options_.low_latency))
+    {
+      /* every live stream must offer a packet before the smallest DTS is known;
+       * low-latency mode writes whatever is ready instead of waiting for the others */
+      stream_ctx_[waiting].packet_queue->PopFor(pending[waiting], std::chrono::milliseconds(10));
+      continue;
+    }
+
+    AVPacket *packet = pending[next];
+    pending[next] = NULL;
+    if (ret >= 0)
+    {
+      count_output(packet);
+      av_log(NULL, AV_LOG_DEBUG, "Muxing frame\n");
+      int64_t arrival = packet->pos;
+      int size = packet->size;
+      int64_t mux_start = 0;
+      if (metrics_)
+      {
+        packet->pos = -1;
+        mux_start = LatencyMetrics::Now();
+      }
+      if (ladder_)
+      {
+        /* before the main output rescales it */
+        ladder_->SendAudio(packet);
+      }
+      ret = output_->WritePacket(packet);
+      if (ret < 0)
+      {
+        av_log(NULL, AV_LOG_ERROR, "Muxing failed for stream #%d\n", next);
+        pipeline_error_ = ret;
+      }
+      else if (metrics_)
+      {
+        int64_t now = LatencyMetrics::Now();
+        metrics_->Record(LatencyMetrics::MUX, next, now - mux_start, size);
+        if (arrival > 0)
+        {
+          metrics_->Record(LatencyMetrics::END_TO_END, next, now - arrival);
+          if (options_.low_latency)
+          {
+            report_latency(next, now - arrival);
+          }
+        }
+      }
+    }
+    media_pool_->ReleasePacket(&packet);
+  }
+}
+
+void WebcamCapture::count_output(const AVPacket *packet)
+{
+  AVStream *stream = ofmt_ctx_->streams[packet->stream_index];
+  if (stream->codec->codec_type == AVMEDIA_TYPE_VIDEO)
+  {
+    ++output_video_frames_;
+  }
+  else if (stream->codec->codec_type == AVMEDIA_TYPE_AUDIO)
+  {
+    ++output_audio_frames_;
+  }
+  output_bytes_ += packet->size;
+
+  int64_t end = (packet->dts != AV_NOPTS_VALUE) ? packet->dts : packet->pts;
+  if (end != AV_NOPTS_VALUE)
+  {
+    int64_t end_us = av_rescale_q(end + packet->duration, stream->time_base, AV_TIME_BASE_Q);
+    if (output_start_us_ == AV_NOPTS_VALUE)
+    {
+      output_start_us_ = end_us;
+    }
+    if (end_us - output_start_us_ > output_duration_us_)
+    {
+      output_duration_us_ = end_us - output_start_us_;
+    }
+  }
+}
 
-  av_log(NULL, AV_LOG_INFO, "Start capture the frames!\n");
+void WebcamCapture::sample_queues(LatencyMetrics *metrics)
+{
+  CaptureQueue::Stats capture = capture_queue_->GetStats();
+  metrics->SetQueueDepth("capture", capture.depth, capture.capacity);
+  for (unsigned int i = 0; i < ifmt_ctx_->nb_streams; i++)
+  {
+    std::string suffix = "_" + std::to_string(i);
+    if (stream_ctx_[i].frame_queue)
+    {
+      metrics->SetQueueDepth("frames" + suffix, stream_ctx_[i].frame_queue->Size(), stream_ctx_[i].frame_queue->Capacity());
+    }
+    if (stream_ctx_[i].packet_queue)
+    {
+      metrics->SetQueueDepth("packets" + suffix, stream_ctx_[i].packet_queue->Size(), stream_ctx_[i].packet_queue->Capacity());
+    }
+  }
+  if (fanout_)
+  {
+    for (size_t i = 0; i < fanout_->Outputs(); i++)
+    {
+      metrics->SetQueueDepth("output_" + std::to_string(i + 1), fanout_->QueueDepth(i), fanout_->QueueCapacity(i));
+    }
+  }
+  if (ladder_)
+  {
+    metrics->SetQueueDepth("ladder", ladder_->QueueDepth(), ladder_->QueueCapacity());
+  }
+  if (motion_gate_)
+  {
+    MotionGate::Stats motion = motion_gate_->GetStats();
+    metrics->SetGauge("motion_level", motion.level);
+    metrics->SetGauge("motion_frames_skipped", (double)motion.skipped);
+    metrics->SetGauge("motion_frames_encoded", (double)motion.passed);
+    metrics->SetGauge("motion_cpu_saved_seconds", motion.saved_us / 1000000.0);
+  }
+  if (degrade_)
+  {
+    DegradationController::Stats degrade = degrade_->GetStats();
+    metrics->SetGauge("degrade_level", degrade.level);
+    metrics->SetGauge("degrade_steps_down", (double)degrade.degrades);
+    metrics->SetGauge("degrade_steps_up", (double)degrade.recoveries);
+    metrics->SetGauge("degrade_lag_seconds", degrade.lag_ms / 1000.0);
+    metrics->SetGauge("degrade_encode_load", degrade.encode_load);
+  }
+  if (snapshots_)
+  {
+    SnapshotWriter::Stats snapshot = snapshots_->GetStats();
+    metrics->SetGauge("snapshots_written", (double)snapshot.written);
+    metrics->SetGauge("snapshots_skipped", (double)snapshot.skipped);
+    metrics->SetGauge("snapshot_seconds", snapshot.last_us / 1000000.0);
+  }
+  sample_writer(metrics);
+}
+
+void WebcamCapture::sample_writer(LatencyMetrics *metrics)
+{
+  if (options_.writer.async)
+  {
+    metrics->SetGauge("writer_pending_bytes", (double)writer_stats_.pending_bytes.load());
+    metrics->SetGauge("writer_written_bytes", (double)writer_stats_.written_bytes.load());
+    metrics->SetGauge("writer_stalls", (double)writer_stats_.stalls.load());
+    metrics->SetGauge("writer_stall_seconds", writer_stats_.stall_us.load() / 1000000.0);
+    metrics->SetGauge("writer_block_p99_seconds", writer_stats_.write_latency.Percentile(0.99) / 1000000.0);
+    metrics->SetGauge("writer_errors", (double)writer_stats_.errors.load());
+  }
+}
+
+void WebcamCapture::report_latency(unsigned int stream_index, int64_t latency_us)
+{
+  av_log(NULL, AV_LOG_VERBOSE, "Stream #%u packet written %.1f ms after capture\n", stream_index, latency_us / 1000.0);
+  if (options_.latency_target_ms <= 0 || latency_us <= (int64_t)options_.latency_target_ms * 1000)
+  {
+    return;
+  }
+  ++late_packets_;
+  /* one warning a second is enough to notice */
+  int64_t now = LatencyMetrics::Now();
+  if (now - late_warning_us_ >= AV_TIME_BASE)
+  {
+    av_log(NULL, AV_LOG_WARNING, "Stream #%u packet written %.1f ms after capture, target is %d ms\n",
+      stream_index, latency_us / 1000.0, options_.latency_target_ms);
+    late_warning_us_ = now;
+  }
+}
+
+void WebcamCapture::print_latency_report() const
+{
+  for (unsigned int i = 0; i < ifmt_ctx_->nb_streams; i++)
+  {
+    const LatencyHistogram &latency = metrics_->Histogram(LatencyMetrics::END_TO_END, i);
+    if (!latency.Count())
+    {
+      continue;
+    }
+    av_log(NULL, AV_LOG_INFO, "Capture-to-write latency of stream #%u: p50 %.1f ms, p99 %.1f ms, max %.1f ms\n",
+      i, latency.Percentile(0.5) / 1000.0, latency.Percentile(0.99) / 1000.0, latency.Max() / 1000.0);
+  }
+  if (options_.latency_target_ms > 0)
+  {
+    av_log(NULL, AV_LOG_INFO, "%llu packets missed the %d ms latency target\n",
+      (unsigned long long)late_packets_, options_.latency_target_ms);
+  }
+}
 
+WebcamCapture::OutputStats WebcamCapture::GetOutputStats() const
+{
+  OutputStats stats;
+  stats.video_frames = output_video_frames_;
+  stats.audio_frames = output_audio_frames_;
+  stats.bytes        = output_bytes_;
+  stats.duration_us  = output_duration_us_;
+  return stats;
+}
+
+void WebcamCapture::read_packets()
+{
   auto now = std::chrono::steady_clock::now();
   auto start = now;
+  capture_start_us_ = LatencyMetrics::Now();
   auto until = now + std::chrono::seconds(duration_sec_);
-
-  int cnt_in = 0;
   auto one_second = now + std::chrono::seconds(1);
-  while (now < until)
+  int64_t first_packet_us = AV_NOPTS_VALUE;
+  /* a spool's packets bring the arrival times of the original capture */
+  bool recorded = input_backend_->Capabilities().recorded;
+
+  /* duration 0 records until Stop() */
+  while ((duration_sec_ == 0 || now < until) && !stop_reading_)
   {
     now = std::chrono::steady_clock::now();
 
@@ -573,66 +1953,181 @@ int WebcamCapture::Work()
     if (now > one_second)
     {
       av_log(NULL, AV_LOG_INFO, ".");
+      capture_queue_->PrintStats(AV_LOG_VERBOSE);
+      media_pool_->PrintStats(AV_LOG_VERBOSE);
+      timestamps_->PrintStats(AV_LOG_VERBOSE);
       one_second = now + std::chrono::seconds(1);
     }
 
-    if ((ret = av_read_frame(ifmt_ctx_, packet_in_)) < 0)
+    AVPacket *packet = media_pool_->AcquirePacket();
+    if (!packet)
+    {
+      break;
+    }
+    int64_t read_start = metrics_ ? LatencyMetrics::Now() : 0;
+    if (av_read_frame(ifmt_ctx_, packet) < 0)
+    {
+      media_pool_->ReleasePacket(&packet);
+      break;
+    }
+    if (metrics_)
+    {
+      metrics_->Record(LatencyMetrics::READ, packet->stream_index, LatencyMetrics::Now() - read_start, packet->size);
+    }
+    if (options_.pace_input && packet->dts != AV_NOPTS_VALUE)
+    {
+      /* files and synthetic sources come as fast as they are read, hold them to their own clock */
+      int64_t packet_us = av_rescale_q(packet->dts, ifmt_ctx_->streams[packet->stream_index]->time_base, AV_TIME_BASE_Q);
+      if (first_packet_us == AV_NOPTS_VALUE)
+      {
+        first_packet_us = packet_us;
+      }
+      std::this_thread::sleep_until(start + std::chrono::microseconds(packet_us - first_packet_us));
+    }
+
+    /* stamp the arrival time here, queueing delay must not leak into it */
+    now = std::chrono::steady_clock::now();
+    int64_t arrival_us = recorded ? packet->pos : std::chrono::duration_cast<std::chrono::microseconds>(now - start).count();
+    if (spool_)
+    {
+      /* as the device gave it, the transcode recovers the timestamps later */
+      int ret = spool_->Write(packet, arrival_us);
+      media_pool_->ReleasePacket(&packet);
+      if (ret < 0)
+      {
+        pipeline_error_ = ret;
+        break;
+      }
+      continue;
+    }
+    stamp_packet(packet, arrival_us);
+    if (metrics_)
+    {
+      /* the demuxer's byte position is not needed downstream, carry the arrival time instead */
+      packet->pos = LatencyMetrics::Now();
+    }
+
+    capture_queue_->Push(packet);
+  }
+  capture_queue_->Close();
+}
+
+void WebcamCapture::stamp_packet(AVPacket *packet, int64_t arrival_us)
+{
+  unsigned int stream_index = packet->stream_index;
+  AVRational time_base = ifmt_ctx_->streams[stream_index]->time_base;
+  int64_t device_ts = (packet->dts != AV_NOPTS_VALUE) ? packet->dts : packet->pts;
+  int64_t device_us = (device_ts != AV_NOPTS_VALUE) ? av_rescale_q(device_ts, time_base, AV_TIME_BASE_Q) : AV_NOPTS_VALUE;
+
+  /* device clock to capture clock; copied streams keep their pts - dts reorder delay */
+  int64_t dts_us = timestamps_->Recover(stream_index, device_us, arrival_us);
+  int64_t pts_us = dts_us;
+  if (packet->pts != AV_NOPTS_VALUE && packet->dts != AV_NOPTS_VALUE)
+  {
+    pts_us = FFMAX(timestamps_->ToCapture(stream_index, av_rescale_q(packet->pts, time_base, AV_TIME_BASE_Q)), dts_us);
+  }
+  packet->dts = av_rescale_q(dts_us, AV_TIME_BASE_Q, time_base);
+  packet->pts = av_rescale_q(pts_us, AV_TIME_BASE_Q, time_base);
+}
+
+/* decoded frames carry microseconds (video) or sample counts (audio) up to the encoder */
+static AVRational frame_time_base(AVMediaType type, const AVFrame *frame)
+{
+  if (type == AVMEDIA_TYPE_VIDEO)
+  {
+    return AV_TIME_BASE_Q;
+  }
+  AVRational sample_tb = { 1, frame->sample_rate };
+  return sample_tb;
+}
+
+void WebcamCapture::stamp_frame(AVFrame *frame, unsigned int stream_index)
+{
+  AVRational time_base = ifmt_ctx_->streams[stream_index]->time_base;
+  int64_t frame_us = (frame->pts != AV_NOPTS_VALUE) ? av_rescale_q(frame->pts, time_base, AV_TIME_BASE_Q) : AV_NOPTS_VALUE;
+
+  if (stream_ctx_[stream_index].dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO)
+  {
+    frame->pts = timestamps_->VideoFrame(stream_index, frame_us);
+  }
+  else
+  {
+    frame->pts = timestamps_->AudioFrame(stream_index, frame_us, frame->nb_samples, frame->sample_rate);
+  }
+}
+
+int WebcamCapture::Work()
+{
+  int ret = 0;
+  int frame_decoded = 0;
+
+  av_log(NULL, AV_LOG_INFO, "Start capture the frames!\n");
+
+  if (spool_)
+  {
+    return spool_work();
+  }
+  if ((ret = start_workers()) < 0)
+  {
+    status_ = INVALID;
+    return ret;
+  }
+  if (metrics_)
+  {
+    metrics_->Start([this](LatencyMetrics *metrics) { sample_queues(metrics); });
+  }
+  std::thread reader(&WebcamCapture::read_packets, this);
+
+  while ((packet_in_ = capture_queue_->Pop()) != NULL)
+  {
+    if (pipeline_error_ < 0)
     {
+      ret = pipeline_error_;
       break;
     }
     int stream_index = packet_in_->stream_index;
+    if (metrics_ && packet_in_->pos > 0)
+    {
+      metrics_->Record(LatencyMetrics::QUEUE, stream_index, LatencyMetrics::Now() - packet_in_->pos);
+    }
 
-    AVMediaType type = ifmt_ctx_->streams[stream_index]->codec->codec_type;
     av_log(NULL, AV_LOG_DEBUG, "Demuxer gave frame of stream_index %u\n",
       stream_index);
 
-    if (filter_ctx_[stream_index].filter_graph)
+    if (stream_ctx_[stream_index].enc_ctx)
     {
       av_log(NULL, AV_LOG_DEBUG, "Going to reencode & filter the frame\n");
-      frame_ = av_frame_alloc();
+      frame_ = media_pool_->AcquireFrame();
       if (!frame_)
       {
         ret = AVERROR(ENOMEM);
         break;
       }
 
-
-
-      packet_in_->dts = packet_in_->pts = cnt_in;
-
-      auto delta = (now - start).count();
-      packet_in_->dts = packet_in_->pts = delta;
-      av_packet_rescale_ts(packet_in_,
-      ifmt_ctx_->streams[stream_index]->time_base,
-      ifmt_ctx_->streams[stream_index]->codec->time_base);
-
-      if (type == AVMEDIA_TYPE_VIDEO)
+      int64_t decode_start = metrics_ ? LatencyMetrics::Now() : 0;
+      ret = decode_packet(stream_index, packet_in_, &frame_decoded);
+      if (metrics_ && ret >= 0)
       {
-        ++cnt_in;
+        metrics_->Record(LatencyMetrics::DECODE, stream_index, LatencyMetrics::Now() - decode_start, packet_in_->size);
       }
-      dec_func_ptr dec_func = (type == AVMEDIA_TYPE_VIDEO) ? avcodec_decode_video2 : avcodec_decode_audio4;
-      ret = dec_func(stream_ctx_[stream_index].dec_ctx, frame_, &frame_decoded, packet_in_);
 
       if (ret < 0)
       {
-        av_frame_free(&frame_);
+        media_pool_->ReleaseFrame(&frame_);
         av_log(NULL, AV_LOG_ERROR, "Decoding failed\n");
         break;
       }
 
       if (frame_decoded)
       {
-        frame_->pts = av_frame_get_best_effort_timestamp(frame_);
-        ret = filter_encode_write_frame(frame_, stream_index);
-        av_frame_free(&frame_);
-        if (ret < 0)
+        if ((ret = process_decoded_frame(stream_index)) < 0)
         {
           break;
         }
       }
       else
       {
-        av_frame_free(&frame_);
+        media_pool_->ReleaseFrame(&frame_);
       }
     }
     else
@@ -641,18 +2136,117 @@ int WebcamCapture::Work()
       av_packet_rescale_ts(packet_in_,
         ifmt_ctx_->streams[stream_index]->time_base,
         ofmt_ctx_->streams[stream_index]->time_base);
+      if (!metrics_)
+      {
+        /* with metrics pos still holds the arrival time, the mux thread clears it */
+        packet_in_->pos = -1;
+      }
 
-      ret = av_interleaved_write_frame(ofmt_ctx_, packet_in_);
-      if (ret < 0)
+      if (stream_ctx_[stream_index].packet_queue->Push(packet_in_))
       {
-        break;
+        packet_in_ = NULL;
       }
     }
-    av_packet_unref(packet_in_);
+    media_pool_->ReleasePacket(&packet_in_);
+  }
+  media_pool_->ReleasePacket(&packet_in_);
+
+  /* on a processing error the reader may still be waiting for queue space */
+  stop_reading_ = true;
+  capture_queue_->Close();
+  reader.join();
+  if (ret >= 0)
+  {
+    /* what threaded decoders still hold belongs to the recording */
+    ret = flush_decoders();
   }
   av_log(NULL, AV_LOG_INFO, "\nStop!\n");
+  capture_queue_->PrintStats(AV_LOG_INFO);
+  timestamps_->PrintStats(AV_LOG_INFO);
+  if (motion_gate_)
+  {
+    motion_gate_->PrintStats(AV_LOG_INFO);
+  }
+  if (degrade_)
+  {
+    degrade_->PrintStats(AV_LOG_INFO);
+  }
+  if (snapshots_)
+  {
+    snapshots_->PrintStats(AV_LOG_INFO);
+  }
+  if (metrics_)
+  {
+    /* the sampler must be gone before the workers free their queues */
+    metrics_->Stop();
+  }
+
+  /* the first error is the capture's */
+  int flush_ret = flush_filters();
+  if (ret >= 0)
+  {
+    ret = flush_ret;
+  }
+  /* finalize the output here, a failed (background) write is an error of the capture */
+  int close_ret = output_->Close();
+  if (ret >= 0)
+  {
+    ret = close_ret;
+  }
+  if (ladder_)
+  {
+    /* after the mux thread, which fed it the audio */
+    close_ret = ladder_->Close();
+    if (ret >= 0)
+    {
+      ret = close_ret;
+    }
+  }
+  media_pool_->PrintStats(AV_LOG_INFO);
+  if (metrics_)
+  {
+    sample_writer(metrics_);
+    metrics_->Export();
+    metrics_->PrintStats(options_.metrics.Enabled() ? AV_LOG_INFO : AV_LOG_VERBOSE);
+  }
+  if (options_.low_latency)
+  {
+    print_latency_report();
+  }
+  if (options_.writer.async)
+  {
+    writer_stats_.PrintStats(AV_LOG_INFO);
+  }
+  if (fanout_)
+  {
+    fanout_->PrintStats(AV_LOG_INFO);
+  }
+  if (ladder_)
+  {
+    ladder_->PrintStats(AV_LOG_INFO);
+  }
+
+  if (ret < 0)
+  {
+    av_log(NULL, AV_LOG_ERROR, "Error occurred: %d\n", ret);
+  }
+  status_ = (ret < 0) ? INVALID : SUCCESS;
+  return ret;
+}
 
-  ret = flush_filters();
+int WebcamCapture::spool_work()
+{
+  /* nothing to decode or encode: the reader writes straight to the spool on this thread */
+  read_packets();
+  int ret = pipeline_error_;
+  int close_ret = spool_->Close();
+  if (ret >= 0)
+  {
+    ret = close_ret;
+  }
+  av_log(NULL, AV_LOG_INFO, "\nStop!\n");
+  spool_->PrintStats(AV_LOG_INFO);
+  media_pool_->PrintStats(AV_LOG_INFO);
 
   if (ret < 0)
   {
@@ -662,7 +2256,115 @@ int WebcamCapture::Work()
   return ret;
 }
 
-int cnt_out = 0;
+int WebcamCapture::decode_packet(unsigned int stream_index, const AVPacket *packet, int *frame_decoded)
+{
+  if (stream_ctx_[stream_index].parallel)
+  {
+    return stream_ctx_[stream_index].parallel->Decode(frame_, frame_decoded, packet);
+  }
+  AVCodecContext *dec_ctx = stream_ctx_[stream_index].dec_ctx;
+  dec_func_ptr dec_func = (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) ? avcodec_decode_video2 : avcodec_decode_audio4;
+  return dec_func(dec_ctx, frame_, frame_decoded, packet);
+}
+
+/* takes frame_ over: filtered and encoded, queued, or dropped */
+int WebcamCapture::process_decoded_frame(unsigned int stream_index)
+{
+  int ret;
+  AVMediaType type = stream_ctx_[stream_index].dec_ctx->codec_type;
+  frame_->pts = av_frame_get_best_effort_timestamp(frame_);
+  stamp_frame(frame_, stream_index);
+  if (snapshots_ && (int)stream_index == snapshot_stream_)
+  {
+    /* before the motion gate, a dashboard wants stills of a static scene too */
+    snapshots_->Offer(frame_);
+  }
+  if (motion_gate_ && (int)stream_index == motion_stream_ && !motion_gate_->Pass(frame_))
+  {
+    /* static scene: neither filtered nor encoded */
+    media_pool_->ReleaseFrame(&frame_);
+    return 0;
+  }
+  if (degrade_ && (int)stream_index == degrade_stream_ && (ret = update_degradation()) < 0)
+  {
+    media_pool_->ReleaseFrame(&frame_);
+    return ret;
+  }
+  if (ladder_ && (int)stream_index == ladder_stream_)
+  {
+    ladder_->SendFrame(frame_);
+  }
+  if (!filter_ctx_[stream_index].filter_graph && (ret = convert_frame(stream_index)) < 0)
+  {
+    media_pool_->ReleaseFrame(&frame_);
+    return ret;
+  }
+  if (!filter_ctx_[stream_index].filter_graph && !frame_matches_encoder(frame_, stream_index))
+  {
+    /* the device changed format mid-stream, convert from now on */
+    av_log(NULL, AV_LOG_WARNING, "Stream #%u changed format, inserting filter graph\n", stream_index);
+    ret = init_filter(&filter_ctx_[stream_index], stream_ctx_[stream_index].dec_ctx,
+      stream_ctx_[stream_index].enc_ctx, filter_spec(stream_index));
+    if (ret < 0)
+    {
+      media_pool_->ReleaseFrame(&frame_);
+      return ret;
+    }
+  }
+  if (filter_ctx_[stream_index].filter_graph)
+  {
+    ret = filter_encode_write_frame(frame_, stream_index);
+    media_pool_->ReleaseFrame(&frame_);
+  }
+  else
+  {
+    ret = queue_frame(frame_, stream_index, frame_time_base(type, frame_));
+    frame_ = NULL;
+  }
+  return ret;
+}
+
+int WebcamCapture::flush_decoders()
+{
+  /* frame threads and the parallel decoder still hold the last pictures */
+  AVPacket packet;
+  av_init_packet(&packet);
+  packet.data = NULL;
+  packet.size = 0;
+  for (unsigned int i = 0; i < ifmt_ctx_->nb_streams; i++)
+  {
+    if (!stream_ctx_[i].enc_ctx || stream_ctx_[i].stream_copy)
+    {
+      continue;
+    }
+    int frame_decoded = 1;
+    while (frame_decoded)
+    {
+      frame_ = media_pool_->AcquireFrame();
+      if (!frame_)
+      {
+        return AVERROR(ENOMEM);
+      }
+      int ret = decode_packet(i, &packet, &frame_decoded);
+      if (ret < 0)
+      {
+        media_pool_->ReleaseFrame(&frame_);
+        av_log(NULL, AV_LOG_ERROR, "Draining the decoder of stream #%u failed\n", i);
+        return ret;
+      }
+      if (!frame_decoded)
+      {
+        media_pool_->ReleaseFrame(&frame_);
+      }
+      else if ((ret = process_decoded_frame(i)) < 0)
+      {
+        return ret;
+      }
+    }
+  }
+  return 0;
+}
+
 int WebcamCapture::encode_write_frame(AVFrame *filtered_frame, unsigned int stream_index, int *frame_decoded)
 {
   int ret = 0;
@@ -677,53 +2379,85 @@ int WebcamCapture::encode_write_frame(AVFrame *filtered_frame, unsigned int stre
 
   av_log(NULL, AV_LOG_DEBUG, "Encoding frame\n");
   /* encode filtered frame */
-  packet_out_ = new AVPacket;
-  av_init_packet(packet_out_);
-  packet_out_->data = NULL;
-  packet_out_->size = 0;
-  ret = enc_func(stream_ctx_[stream_index].enc_ctx, packet_out_, filtered_frame, frame_decoded);
-
-  packet_out_->pts = filtered_frame->pkt_pts;
-  packet_out_->dts = filtered_frame->pkt_dts;
-  av_frame_free(&filtered_frame);
-  if (ret < 0)
+  AVPacket *packet_out = media_pool_->AcquirePacket();
+  if (!packet_out)
+  {
+    media_pool_->ReleaseFrame(&filtered_frame);
+    return AVERROR(ENOMEM);
+  }
+  int64_t encode_start = 0;
+  bool gated = motion_gate_ && (int)stream_index == motion_stream_;
+  bool degradable = degrade_ && (int)stream_index == degrade_stream_;
+  if (metrics_ && filtered_frame)
+  {
+    metrics_->TagEncoderInput(stream_index, filtered_frame->pts, av_frame_get_pkt_pos(filtered_frame));
+  }
+  if ((metrics_ || gated || degradable) && filtered_frame)
+  {
+    encode_start = LatencyMetrics::Now();
+  }
+  ret = enc_func(encoder_context(stream_index), packet_out, filtered_frame, frame_decoded);
+  if (metrics_ && filtered_frame && ret >= 0)
+  {
+    metrics_->Record(LatencyMetrics::ENCODE, stream_index, LatencyMetrics::Now() - encode_start,
+      *frame_decoded ? packet_out->size : 0);
+  }
+  if (gated && filtered_frame && ret >= 0)
+  {
+    /* what a skipped frame would have cost, for the CPU saved estimate */
+    motion_gate_->AddEncodeTime(LatencyMetrics::Now() - encode_start);
+  }
+  if (degradable && filtered_frame && ret >= 0)
+  {
+    degrade_->AddEncodeTime(LatencyMetrics::Now() - encode_start);
+  }
+
+  media_pool_->ReleaseFrame(&filtered_frame);
+  if (ret < 0 || !(*frame_decoded))
   {
+    media_pool_->ReleasePacket(&packet_out);
     return ret;
   }
-  if (!(*frame_decoded))
+  if (metrics_)
   {
-    return 0;
+    /* the arrival time of the frame this packet came from, for the end-to-end latency */
+    packet_out->pos = metrics_->TakeEncoderTag(stream_index, packet_out->pts);
+  }
+
+  if (degradable && (ret = fix_adapted_packet(packet_out)) < 0)
+  {
+    media_pool_->ReleasePacket(&packet_out);
+    return ret;
   }
 
   /* prepare packet for muxing */
-  packet_out_->stream_index = stream_index;
-  av_packet_rescale_ts(packet_out_,
+  packet_out->stream_index = stream_index;
+  av_packet_rescale_ts(packet_out,
                        ofmt_ctx_->streams[stream_index]->codec->time_base,
                        ofmt_ctx_->streams[stream_index]->time_base);
 
-  //av_log(NULL, AV_LOG_INFO, "%3.0d) out_packet[%d] %lld, %lld\n", cnt_out, stream_index, out_packet.pts, out_packet.dts);
-  
-  av_log(NULL, AV_LOG_DEBUG, "Muxing frame\n");
-  if (type == AVMEDIA_TYPE_VIDEO)
+  /* hand the encoded frame to the mux thread */
+  if (!stream_ctx_[stream_index].packet_queue->Push(packet_out))
   {
-    ++cnt_out;
+    media_pool_->ReleasePacket(&packet_out);
   }
-
-  /* mux encoded frame */
-  ret = av_interleaved_write_frame(ofmt_ctx_, packet_out_);
-
-  av_packet_unref(packet_out_);
-  return ret;
+  return 0;
 }
 
 int WebcamCapture::filter_encode_write_frame(AVFrame *frame, unsigned int stream_index)
 {
   int ret;
+  int64_t filter_us = 0;
+  int64_t filter_start = metrics_ ? LatencyMetrics::Now() : 0;
 
   av_log(NULL, AV_LOG_DEBUG, "Pushing decoded frame to filters\n");
   /* push the decoded frame into the filtergraph */
   ret = av_buffersrc_add_frame_flags(filter_ctx_[stream_index].buffersrc_ctx,
     frame, 0);
+  if (metrics_)
+  {
+    filter_us += LatencyMetrics::Now() - filter_start;
+  }
   if (ret < 0)
   {
     av_log(NULL, AV_LOG_ERROR, "Error while feeding the filtergraph\n");
@@ -733,15 +2467,21 @@ int WebcamCapture::filter_encode_write_frame(AVFrame *frame, unsigned int stream
   /* pull filtered frames from the filtergraph */
   while (1)
   {
-    filtered_frame_ = av_frame_alloc();
+    filtered_frame_ = media_pool_->AcquireFrame();
     if (!filtered_frame_)
     {
       ret = AVERROR(ENOMEM);
       break;
     }
     av_log(NULL, AV_LOG_DEBUG, "Pulling filtered frame from filters\n");
+    filter_start = metrics_ ? LatencyMetrics::Now() : 0;
     ret = av_buffersink_get_frame(filter_ctx_[stream_index].buffersink_ctx,
       filtered_frame_);
+    if (metrics_)
+    {
+      /* the encoder queue may block below, that is not filtering time */
+      filter_us += LatencyMetrics::Now() - filter_start;
+    }
     if (ret < 0)
     {
       /* if no more frames for output - returns AVERROR(EAGAIN)
@@ -752,18 +2492,24 @@ int WebcamCapture::filter_encode_write_frame(AVFrame *frame, unsigned int stream
       {
         ret = 0;
       }
-      av_frame_free(&filtered_frame_);
+      media_pool_->ReleaseFrame(&filtered_frame_);
       break;
     }
 
-    filtered_frame_->pict_type = AV_PICTURE_TYPE_NONE;
-    ret = encode_write_frame(filtered_frame_, stream_index, NULL);
+    AVFrame *filtered_frame = filtered_frame_;
+    filtered_frame_ = NULL;
+    ret = queue_frame(filtered_frame, stream_index,
+      filter_ctx_[stream_index].buffersink_ctx->inputs[0]->time_base);
     if (ret < 0)
     {
       break;
     }
   }
 
+  if (metrics_ && frame)
+  {
+    metrics_->Record(LatencyMetrics::FILTER, stream_index, filter_us);
+  }
   return ret;
 }
 
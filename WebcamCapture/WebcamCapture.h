@@ -3,22 +3,50 @@
 extern "C"
 {
   #define __STDC_CONSTANT_MACROS
-  #include <libavdevice\avdevice.h>
-  #include <libavfilter\avfilter.h>
+  #include <libavdevice/avdevice.h>
+  #include <libavfilter/avfilter.h>
 }
 
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
 #include <string>
-#include <xutility>
+#include <thread>
+#include <utility>
+#include "CaptureOptions.h"
+#include "CaptureQueue.h"
+#include "DegradationController.h"
+#include "EventRecorder.h"
+#include "FanoutSink.h"
+#include "InputBackend.h"
+#include "LatencyMetrics.h"
+#include "MediaPool.h"
+#include "MotionGate.h"
 #include "Noncopyable.h"
+#include "PacketSink.h"
+#include "ParallelDecoder.h"
+#include "PixelConverter.h"
+#include "RenditionLadder.h"
+#include "SnapshotWriter.h"
+#include "SpoolFile.h"
+#include "SpscRing.h"
+#include "TimestampEngine.h"
 
 
 class WebcamCapture : Noncopyable
 {
 public:
-  WebcamCapture(uint32_t duration_sec, const std::string &output_filename, const std::string &camera_name, const std::string &mic_name = std::string());
+  WebcamCapture(uint32_t duration_sec, const std::string &output_filename, const std::string &camera_name, const std::string &mic_name = std::string(),
+    const CaptureOptions &options = CaptureOptions());
   ~WebcamCapture();
 
   int Work();
+  // ends the capture early; safe to call from another thread or a signal handler
+  void Stop() { stop_reading_ = true; }
+  // DVR mode: save the buffered seconds and the following ones; same thread rules as Stop()
+  void TriggerEvent() { if (event_recorder_) event_recorder_->Trigger(); }
+  // -snapshot: write one from the next video frame; same thread rules as Stop()
+  void TakeSnapshot() { if (snapshots_) snapshots_->Request(); }
 
   enum status
   {
@@ -26,6 +54,16 @@ public:
     INVALID
   };
   status Status() const { return status_; };
+  CaptureQueue::Stats QueueStats() const { return capture_queue_->GetStats(); }
+
+  struct OutputStats
+  {
+    uint64_t video_frames;   // muxed packets per stream type
+    uint64_t audio_frames;
+    uint64_t bytes;          // payload handed to the muxer, without container overhead
+    int64_t  duration_us;    // media time covered by the output
+  };
+  OutputStats GetOutputStats() const;
  
  private:
    typedef struct FilteringContext
@@ -39,6 +77,13 @@ public:
    {
      AVCodecContext *dec_ctx;
      AVCodecContext *enc_ctx;
+     SpscQueue<AVFrame*>  *frame_queue;    /* filtered frames waiting for the encoder thread */
+     SpscQueue<AVPacket*> *packet_queue;   /* encoded or remuxed packets waiting for the mux thread */
+     std::thread          *encoder_thread;  /* NULL when the encoder runs on the worker pool */
+     int                   encoder_error;   /* pool mode: the last result of the stream's encoder */
+     int                   stream_copy;     /* remux the device's packets without decoding */
+     PixelConverter       *converter;       /* decoder to encoder pixel format without a graph, or NULL */
+     ParallelDecoder      *parallel;        /* decodes instead of dec_ctx, or NULL */
    } StreamContext;
  
    typedef int (*dec_func_ptr)(AVCodecContext *, AVFrame *, int *, const AVPacket *);
@@ -46,24 +91,109 @@ public:
  
    int flush_filters();
    int open_input_file();
+   int probe_input();
+   void build_decoder_options(AVDictionary **dict) const;
+   int open_parallel_decoder(unsigned int stream_index);
+   int open_spool();
+   int spool_work();
    int open_output_file();
+   bool global_header() const;
+   int open_ladder(const MuxerOptions &muxer_options);
+   int open_rendition_encoder(unsigned int stream_index, AVCodecContext *enc_ctx, const Rendition &rendition);
+   AVCodec *find_encoder(AVCodecContext *dec_ctx, const EncoderOptions &enc_options);
+   int build_encoder_options(AVCodec *encoder, const EncoderOptions &enc_options, AVDictionary **dict);
+   int copy_stream_parameters(unsigned int stream_index, AVStream *out_stream);
    int init_filter(FilteringContext* fctx, AVCodecContext *dec_ctx,
      AVCodecContext *enc_ctx, const char *filter_spec);
    int init_filters();
+   const char *filter_spec(unsigned int stream_index) const;
+   int setup_filter(unsigned int stream_index, AVCodec *encoder, AVCodecContext *enc_ctx);
+   int setup_degradation();
+   int update_degradation();
+   int rescale_video(int scale_steps);
+   bool decimate(unsigned int stream_index);
+   AVCodecContext *encoder_context(unsigned int stream_index) const;
+   int adapt_encoder(const AVFrame *frame);
+   int fix_adapted_packet(AVPacket *packet);
+   bool frame_matches_encoder(const AVFrame *frame, unsigned int stream_index) const;
+   int convert_frame(unsigned int stream_index);
+   int queue_frame(AVFrame *frame, unsigned int stream_index, AVRational time_base);
    int encode_write_frame(AVFrame *filtered_frame, unsigned int stream_index, int *frame_decoded);
    int filter_encode_write_frame(AVFrame *frame, unsigned int stream_index);
    int flush_encoder(unsigned int stream_index);
+   int decode_packet(unsigned int stream_index, const AVPacket *packet, int *frame_decoded);
+   int process_decoded_frame(unsigned int stream_index);
+   int flush_decoders();
+   void read_packets();
+   void stamp_packet(AVPacket *packet, int64_t arrival_us);
+   void stamp_frame(AVFrame *frame, unsigned int stream_index);
+   int start_workers();
+   int stop_workers();
+   void encode_stream(unsigned int stream_index);
+   void encode_queued_frame(AVFrame *frame, unsigned int stream_index, int *ret);
+   void finish_encoder(unsigned int stream_index, int ret);
+   void schedule_encoder(unsigned int stream_index);
+   void encode_batch(unsigned int stream_index);
+   void mux_packets();
+   void count_output(const AVPacket *packet);
+   void sample_queues(LatencyMetrics *metrics);
+   void sample_writer(LatencyMetrics *metrics);
+   void report_latency(unsigned int stream_index, int64_t latency_us);
+   void print_latency_report() const;
  
  private:
    AVPacket         *packet_in_;
-   AVPacket         *packet_out_;
    AVFrame          *frame_;
    AVFormatContext  *ifmt_ctx_;
-   AVInputFormat    *input_format_;
+   InputBackend     *input_backend_;
    AVFormatContext  *ofmt_ctx_;
+   PacketSink       *output_;
+   EventRecorder    *event_recorder_;   /* output_ in DVR mode, NULL otherwise */
+   FanoutSink       *fanout_;           /* output_ with -outputs, owns the main sink */
+   RenditionLadder  *ladder_;           /* NULL without -renditions */
+   int               ladder_stream_;    /* the video stream it scales */
    FilteringContext *filter_ctx_;
    StreamContext    *stream_ctx_;
    AVFrame          *filtered_frame_;
+   MediaPool        *media_pool_;
+   CaptureQueue     *capture_queue_;
+   TimestampEngine  *timestamps_;
+   LatencyMetrics   *metrics_;          /* NULL unless -metrics is given */
+   MotionGate       *motion_gate_;      /* NULL without -motion */
+   int               motion_stream_;    /* the video stream it gates */
+   SnapshotWriter   *snapshots_;        /* NULL without -snapshot */
+   int               snapshot_stream_;  /* the video stream it takes stills of */
+   SpoolWriter      *spool_;            /* spool mode: replaces the whole decode and encode pipeline */
+   DegradationController *degrade_;     /* NULL without -degrade */
+   int               degrade_stream_;   /* the video stream it degrades */
+   int               degrade_width_;    /* its encoder's size at level 0 */
+   int               degrade_height_;
+   bool              degrade_graph_;    /* it needs a filter graph at level 0 */
+   int               degrade_scale_steps_;  /* processing thread: scale of the current graph */
+   int               decimation_;       /* processing thread: keep one frame of this many */
+   uint64_t          decimate_slot_;
+   AVCodecContext   *adapted_encoder_;  /* encoder thread: replaces enc_ctx once reopened */
+   bool              adapted_no_bframes_;
+   bool              adapted_fast_preset_;
+   int               adapted_skip_;     /* frames to drop after a reopen with B-frames */
+   int64_t           adapted_last_dts_;
+   int64_t           capture_start_us_; /* LatencyMetrics::Now() at the capture clock's zero */
+   WriterStats       writer_stats_;     /* every file of the capture, -async_write */
+   std::atomic<uint64_t> output_video_frames_;
+   std::atomic<uint64_t> output_audio_frames_;
+   std::atomic<uint64_t> output_bytes_;
+   int64_t               output_start_us_;     /* mux thread */
+   std::atomic<int64_t>  output_duration_us_;
+   uint64_t              late_packets_;        /* mux thread, low-latency mode */
+   int64_t               late_warning_us_;     /* mux thread */
+   std::atomic<bool> stop_reading_;
+   std::thread      *mux_thread_;
+   std::atomic<int>  pipeline_error_;
+   int               pool_client_;       /* this capture's turn in options_.worker_pool */
+   std::atomic<bool> *encoder_scheduled_; /* per stream: a batch is queued or running on the pool */
+   std::mutex        encoders_mutex_;
+   std::condition_variable encoders_done_;
+   unsigned int      running_encoders_;  /* pool mode: streams not flushed yet */
  
    status status_;
  
@@ -72,5 +202,6 @@ public:
    std::string output_filename_;
    uint32_t packet_pts_;
    uint32_t duration_sec_;
+   CaptureOptions options_;
 };
 
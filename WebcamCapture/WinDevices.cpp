@@ -10,6 +10,7 @@
 WinDevices::WinDevices()
   : pMoniker(nullptr)
   , device_id_(0)
+  , first_audio_id_(0)
 {
   FindDevice();
 }
@@ -59,6 +60,7 @@ void WinDevices::FindDevice()
       DisplayDeviceInformation(pEnum);
       pEnum->Release();
     }
+    first_audio_id_ = device_id_;
     hr = EnumerateDevices(CLSID_AudioInputDeviceCategory, &pEnum);
     if (SUCCEEDED(hr))
     {
@@ -13,6 +13,9 @@ public:
   ~WinDevices();
 
   const std::string & DeviceName(int index) const;
+  int Count() const { return device_id_; }
+  // video devices come first, this is the index of the first audio one
+  int FirstAudioDevice() const { return first_audio_id_; }
 
   void Print();
 
@@ -27,4 +30,5 @@ private:
   IMoniker *pMoniker;
   device_list_type device_list_;
   int device_id_;
+  int first_audio_id_;
 };
\ No newline at end of file
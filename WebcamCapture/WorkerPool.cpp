@@ -0,0 +1,123 @@
+#include "WorkerPool.h"
+#include "LatencyMetrics.h"
+
+WorkerPool::WorkerPool(unsigned int threads)
+  : stopping_(false)
+{
+  if (!threads)
+  {
+    threads = FFMAX(std::thread::hardware_concurrency(), 1u);
+  }
+  for (unsigned int i = 0; i < threads; i++)
+  {
+    threads_.push_back(new std::thread(&WorkerPool::worker_loop, this));
+  }
+}
+
+WorkerPool::~WorkerPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  cond_.notify_all();
+  for (size_t i = 0; i < threads_.size(); i++)
+  {
+    threads_[i]->join();
+    delete threads_[i];
+  }
+  for (size_t i = 0; i < clients_.size(); i++)
+  {
+    delete clients_[i];
+  }
+}
+
+int WorkerPool::AddClient(const std::string &name)
+{
+  Client *client = new Client();
+  client->name = name;
+  client->ready = false;
+  client->completed = 0;
+  client->busy_us = 0;
+  client->wait_us = 0;
+  client->max_wait_us = 0;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  clients_.push_back(client);
+  return (int)clients_.size() - 1;
+}
+
+void WorkerPool::Submit(int client_id, const task_type &task)
+{
+  Queued queued;
+  queued.task = task;
+  queued.submitted_us = LatencyMetrics::Now();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Client *client = clients_[client_id];
+    client->tasks.push_back(queued);
+    if (!client->ready)
+    {
+      client->ready = true;
+      ready_.push_back(client_id);
+    }
+  }
+  cond_.notify_one();
+}
+
+void WorkerPool::PrintStats(int level) const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  av_log(NULL, level, "Worker pool: %u threads\n", (unsigned int)threads_.size());
+  for (size_t i = 0; i < clients_.size(); i++)
+  {
+    const Client *client = clients_[i];
+    av_log(NULL, level, "  %s: %llu tasks, busy %.1f s, wait avg %.2f ms, max %.2f ms\n", client->name.c_str(),
+      (unsigned long long)client->completed, client->busy_us / 1000000.0,
+      client->completed ? client->wait_us / 1000.0 / client->completed : 0.0, client->max_wait_us / 1000.0);
+  }
+}
+
+void WorkerPool::worker_loop()
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (1)
+  {
+    while (!stopping_ && ready_.empty())
+    {
+      cond_.wait(lock);
+    }
+    if (ready_.empty())
+    {
+      break;
+    }
+
+    /* one task of the client in front, then it goes to the back of the line */
+    int client_id = ready_.front();
+    ready_.pop_front();
+    Client *client = clients_[client_id];
+    Queued queued = client->tasks.front();
+    client->tasks.pop_front();
+    if (client->tasks.empty())
+    {
+      client->ready = false;
+    }
+    else
+    {
+      ready_.push_back(client_id);
+      cond_.notify_one();
+    }
+    lock.unlock();
+
+    int64_t start = LatencyMetrics::Now();
+    queued.task();
+    int64_t end = LatencyMetrics::Now();
+
+    lock.lock();
+    int64_t wait = start - queued.submitted_us;
+    client->completed++;
+    client->busy_us += end - start;
+    client->wait_us += wait;
+    client->max_wait_us = FFMAX(client->max_wait_us, wait);
+  }
+}
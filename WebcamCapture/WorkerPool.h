@@ -0,0 +1,66 @@
+#pragma once
+
+extern "C"
+{
+  #define __STDC_CONSTANT_MACROS
+  #include <libavutil/avutil.h>
+}
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Noncopyable.h"
+
+// A fixed number of threads shared by the capture sessions of one process.
+// Every session is a client with a task queue of its own, and the workers
+// serve the clients with pending tasks round-robin, one task per turn, so a
+// busy camera gets its turn like every other one but cannot starve them.
+// Tasks should be short (a few frames); a task may block briefly on a full
+// queue downstream, never on another task of the pool.
+class WorkerPool : Noncopyable
+{
+public:
+  typedef std::function<void()> task_type;
+
+  // threads = 0 takes the number of cores
+  explicit WorkerPool(unsigned int threads);
+  ~WorkerPool();
+
+  // safe from any thread
+  int AddClient(const std::string &name);
+  void Submit(int client, const task_type &task);
+
+  unsigned int Threads() const { return (unsigned int)threads_.size(); }
+  void PrintStats(int level) const;
+
+private:
+  struct Queued
+  {
+    task_type task;
+    int64_t   submitted_us;
+  };
+  struct Client
+  {
+    std::string        name;
+    std::deque<Queued> tasks;
+    bool               ready;     /* in ready_ */
+    uint64_t           completed;
+    int64_t            busy_us;   /* time the workers spent on its tasks */
+    int64_t            wait_us;   /* time its tasks spent queued */
+    int64_t            max_wait_us;
+  };
+
+  void worker_loop();
+
+private:
+  mutable std::mutex mutex_;
+  std::condition_variable cond_;
+  std::vector<Client*> clients_;
+  std::deque<int> ready_;         /* clients with pending tasks, served front to back */
+  bool stopping_;
+  std::vector<std::thread*> threads_;
+};
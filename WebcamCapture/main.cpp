@@ -1,14 +1,255 @@
+#include "InputBackend.h"
+#include "OptionsFromParams.h"
 #include "Params.h"
 #include "WebcamCapture.h"
-#include "WinDevices.h"
+#include "WorkerPool.h"
+#include <atomic>
+#include <csignal>
+#include <cstdlib>
 #include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* filled before the handlers are installed, cleared after the captures end; the
+ * stdin thread holds captures_mutex while it uses them, the signal handlers cannot
+ * lock and only rely on captures_alive, which goes false before they are reset */
+static std::vector<WebcamCapture*> running_captures;
+static std::mutex captures_mutex;
+static std::atomic<bool> captures_alive(false);
+
+static void StopAll()
+{
+  if (!captures_alive)
+  {
+    return;
+  }
+  for (size_t i = 0; i < running_captures.size(); i++)
+  {
+    running_captures[i]->Stop();
+  }
+}
+
+static void TriggerAll()
+{
+  if (!captures_alive)
+  {
+    return;
+  }
+  for (size_t i = 0; i < running_captures.size(); i++)
+  {
+    running_captures[i]->TriggerEvent();
+  }
+}
+
+static void SnapshotAll()
+{
+  if (!captures_alive)
+  {
+    return;
+  }
+  for (size_t i = 0; i < running_captures.size(); i++)
+  {
+    running_captures[i]->TakeSnapshot();
+  }
+}
+
+static void OnInterrupt(int)
+{
+  StopAll();
+}
+
+static void OnTrigger(int signal_number)
+{
+  TriggerAll();
+  /* some runtimes reset the handler after each signal */
+  if (captures_alive)
+  {
+    signal(signal_number, OnTrigger);
+  }
+}
+
+// console commands: "e" saves an event in DVR mode, "s" takes a snapshot, "q" stops
+static void ReadCommands()
+{
+  std::string line;
+  while (std::getline(std::cin, line))
+  {
+    std::lock_guard<std::mutex> lock(captures_mutex);
+    if (line == "e")
+    {
+      TriggerAll();
+    }
+    else if (line == "s")
+    {
+      SnapshotAll();
+    }
+    else if (line == "q")
+    {
+      StopAll();
+      break;
+    }
+  }
+}
+
+static void InstallHandlers(const std::vector<WebcamCapture*> &captures, const CaptureOptions &options)
+{
+  {
+    std::lock_guard<std::mutex> lock(captures_mutex);
+    running_captures = captures;
+    captures_alive = true;
+  }
+  /* Ctrl+C ends an unlimited or segmented recording cleanly */
+  signal(SIGINT, OnInterrupt);
+  if (options.event.Enabled())
+  {
+#ifdef SIGBREAK
+    signal(SIGBREAK, OnTrigger);
+#else
+    signal(SIGUSR1, OnTrigger);
+#endif
+  }
+  if (options.event.Enabled() || options.snapshot.Enabled())
+  {
+    std::thread(ReadCommands).detach();
+  }
+}
+
+/* before the captures are deleted: the handlers stop using them, the stdin thread lets go */
+static void RemoveHandlers()
+{
+  captures_alive = false;
+  signal(SIGINT, SIG_DFL);
+#ifdef SIGBREAK
+  signal(SIGBREAK, SIG_IGN);
+#else
+  signal(SIGUSR1, SIG_IGN);
+#endif
+  std::lock_guard<std::mutex> lock(captures_mutex);
+  running_captures.clear();
+}
+
+/* -sessions takes device indexes like -v and -a, anything else is a device name */
+static std::string SessionDevice(InputBackend *backend, const std::string &device)
+{
+  if (device.empty() || device.find_first_not_of("0123456789") != std::string::npos)
+  {
+    return device;
+  }
+  return backend->DeviceName(atoi(device.c_str()));
+}
+
+static int RunSessions(Params &params, const CaptureOptions &options, InputBackend *backend)
+{
+  std::vector<SessionSpec> specs;
+  if (!ParseSessions(params.GetString(Params::SESSIONS), &specs) || specs.empty())
+  {
+    std::cout << "Cannot parse sessions '" << params.GetString(Params::SESSIONS) << "'" << std::endl;
+    return -1;
+  }
+
+  WorkerPool pool(FFMAX(params.GetInt(Params::WORKERS), 0));
+  std::vector<WebcamCapture*> sessions;
+  for (size_t i = 0; i < specs.size(); i++)
+  {
+    CaptureOptions session_options = options;
+    session_options.worker_pool = &pool;
+    std::string video;
+    std::string audio;
+    if (backend->Capabilities().enumerable)
+    {
+      video = SessionDevice(backend, specs[i].video);
+      audio = SessionDevice(backend, specs[i].audio);
+    }
+    else
+    {
+      session_options.input_url = specs[i].video;
+    }
+    if (options.input_backend == "dshow" && options.input_options.find("rtbufsize") == std::string::npos)
+    {
+      /* the single capture's 1 GB real-time buffer, shared out */
+      std::string rtbufsize = "rtbufsize=" + std::to_string(FFMAX(1000000000 / (int)specs.size(), 100000000));
+      session_options.input_options += (session_options.input_options.empty() ? "" : ":") + rtbufsize;
+    }
+    if (options.decoder.threads.empty())
+    {
+      /* every session decoding on all cores would only add contention */
+      session_options.decoder.threads = std::to_string(FFMAX((int)std::thread::hardware_concurrency() / (int)specs.size(), 1));
+    }
+    /* the per-capture files the sessions would otherwise share */
+    std::string suffix = "_" + std::to_string(i);
+    if (!session_options.segment.name_template.empty())
+    {
+      session_options.segment.name_template = OutputMuxer::DerivedTemplate(session_options.segment.name_template, suffix);
+    }
+    if (!session_options.event.name_template.empty())
+    {
+      session_options.event.name_template = OutputMuxer::DerivedTemplate(session_options.event.name_template, suffix);
+    }
+    if (session_options.metrics.Enabled())
+    {
+      session_options.metrics.path = OutputMuxer::DerivedTemplate(session_options.metrics.path, suffix);
+    }
+    if (session_options.snapshot.Enabled())
+    {
+      session_options.snapshot.path = OutputMuxer::DerivedTemplate(session_options.snapshot.path, suffix);
+    }
+
+    WebcamCapture *capture = new WebcamCapture(params.GetInt(Params::CAPTURE_DURATION_SEC), specs[i].output, video, audio,
+      session_options);
+    if (capture->Status() != WebcamCapture::SUCCESS)
+    {
+      /* one camera that fails to open does not keep the others from recording */
+      std::cout << "Session " << i << " (" << specs[i].output << ") cannot start" << std::endl;
+      delete capture;
+      continue;
+    }
+    sessions.push_back(capture);
+  }
+  if (sessions.empty())
+  {
+    return -1;
+  }
+
+  InstallHandlers(sessions, options);
+  std::vector<int> results(sessions.size(), 0);
+  std::vector<std::thread*> threads;
+  for (size_t i = 0; i < sessions.size(); i++)
+  {
+    threads.push_back(new std::thread([&sessions, &results, i]() { results[i] = sessions[i]->Work(); }));
+  }
+  for (size_t i = 0; i < threads.size(); i++)
+  {
+    threads[i]->join();
+    delete threads[i];
+  }
+  RemoveHandlers();
+
+  pool.PrintStats(AV_LOG_INFO);
+  int failed = 0;
+  for (size_t i = 0; i < sessions.size(); i++)
+  {
+    WebcamCapture::OutputStats output = sessions[i]->GetOutputStats();
+    CaptureQueue::Stats queue = sessions[i]->QueueStats();
+    std::cout << "Session " << i << ": " << output.video_frames << " video and " << output.audio_frames << " audio packets, "
+      << output.bytes / 1024 << " KB, " << output.duration_us / 1000 << " ms, " << queue.dropped << " packets dropped"
+      << (results[i] < 0 ? ", failed" : "") << std::endl;
+    failed += results[i] < 0;
+    /* finalizes the files before the pool goes away */
+    delete sessions[i];
+  }
+  return failed ? -1 : 0;
+}
 
 int main(int argc, const char ** argv)
 {
+#ifdef _WIN32
   system("@echo off");
   system("@chcp 65001");
   std::cout << std::endl;
   setlocale(LC_ALL, "ru-RU"); 
+#endif
   Params params(argc, argv);
 
   if (params.GetStatus() == Params::INVALID_PARAM)
@@ -18,22 +259,55 @@ int main(int argc, const char ** argv)
 
   params.PrintParams();
 
-  WinDevices devices;
-  devices.Print();
+  CaptureOptions options = MakeOptions(params);
+  InputBackend *backend = InputBackend::Create(options.input_backend);
+  if (!backend)
+  {
+    std::cout << "Unknown input backend '" << options.input_backend << "'" << std::endl;
+    return -1;
+  }
+  backend->PrintDevices();
 
   if (params.GetStatus() == Params::INVALID_PARAM)
   {
+    delete backend;
     return -1;
   }
 
-  params.Set(Params::VIDEO_DEVICE_NAME, devices.DeviceName(params.GetInt(Params::VIDEO_DEVICE_ID)));
-  params.Set(Params::AUDIO_DEVICE_NAME, devices.DeviceName(params.GetInt(Params::AUDIO_DEVICE_ID)));
+  if (!params.GetString(Params::SESSIONS).empty())
+  {
+    int ret = RunSessions(params, options, backend);
+    delete backend;
+    return ret;
+  }
+
+  if (backend->Capabilities().enumerable)
+  {
+    params.Set(Params::VIDEO_DEVICE_NAME, backend->DeviceName(params.GetInt(Params::VIDEO_DEVICE_ID)));
+    params.Set(Params::AUDIO_DEVICE_NAME, backend->DeviceName(params.GetInt(Params::AUDIO_DEVICE_ID)));
+  }
+
+  if (params.GetInt(Params::LIST_FORMATS) > 0)
+  {
+    InputRequest request;
+    request.video_device = params.GetString(Params::VIDEO_DEVICE_NAME);
+    request.audio_device = params.GetString(Params::AUDIO_DEVICE_NAME);
+    request.url = options.input_url;
+    request.format = options.input_format;
+    request.options = options.input_options;
+    int ret = backend->PrintCapabilities(request);
+    delete backend;
+    return ret < 0 ? -1 : 0;
+  }
+  delete backend;
 
-  WebcamCapture webcam(params.GetInt(Params::CAPTURE_DURATION_SEC), params.GetString(Params::FILE_DESTINATION), params.GetString(Params::VIDEO_DEVICE_NAME), params.GetString(Params::AUDIO_DEVICE_NAME));
+  WebcamCapture webcam(params.GetInt(Params::CAPTURE_DURATION_SEC), params.GetString(Params::FILE_DESTINATION), params.GetString(Params::VIDEO_DEVICE_NAME), params.GetString(Params::AUDIO_DEVICE_NAME), options);
 
   if (webcam.Status() == 0)
   {
+    InstallHandlers(std::vector<WebcamCapture*>(1, &webcam), options);
     webcam.Work();
+    RemoveHandlers();
   }
    return 0;
 }